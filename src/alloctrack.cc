@@ -0,0 +1,111 @@
+#include <malloc.h>
+
+#include <atomic>
+#include <cstdlib>
+#include <new>
+
+#include "alloctrack.h"
+
+#ifdef ALLOC_TRACKING
+static std::atomic<uint64_t> allocations{0};
+static std::atomic<uint64_t> allocated{0};
+
+static void *tracked_alloc(size_t size) {
+  void *p = malloc(size == 0 ? 1 : size);
+  if (p != nullptr) {
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    allocated.fetch_add(malloc_usable_size(p), std::memory_order_relaxed);
+  }
+  return p;
+}
+
+void *operator new(size_t size) {
+  void *p = tracked_alloc(size);
+  if (p == nullptr) {
+    throw std::bad_alloc();
+  }
+  return p;
+}
+void *operator new[](size_t size) { return operator new(size); }
+void *operator new(size_t size, const std::nothrow_t &) noexcept { return tracked_alloc(size); }
+void *operator new[](size_t size, const std::nothrow_t &) noexcept { return tracked_alloc(size); }
+void operator delete(void *p) noexcept { free(p); }
+void operator delete[](void *p) noexcept { free(p); }
+void operator delete(void *p, size_t) noexcept { free(p); }
+void operator delete[](void *p, size_t) noexcept { free(p); }
+void operator delete(void *p, const std::nothrow_t &) noexcept { free(p); }
+void operator delete[](void *p, const std::nothrow_t &) noexcept { free(p); }
+
+bool AllocTracker::enabled() { return true; }
+
+AllocStats AllocTracker::snapshot() {
+  AllocStats stats;
+  stats.allocations = allocations.load(std::memory_order_relaxed);
+  stats.bytes = allocated.load(std::memory_order_relaxed);
+  return stats;
+}
+#else
+bool AllocTracker::enabled() { return false; }
+AllocStats AllocTracker::snapshot() { return AllocStats(); }
+#endif
+
+uint64_t AllocTracker::heapInUse() {
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 33))
+  struct mallinfo2 info = mallinfo2();
+  return info.uordblks + info.hblkhd;
+#else
+  struct mallinfo info = mallinfo();
+  return static_cast<unsigned int>(info.uordblks) + static_cast<unsigned int>(info.hblkhd);
+#endif
+}
+
+void AllocPhases::start(const std::string &phase) {
+  stop();
+  current_ = phase;
+  started_ = AllocTracker::snapshot();
+}
+
+void AllocPhases::stop() {
+  if (current_.empty()) {
+    return;
+  }
+  AllocStats now = AllocTracker::snapshot();
+  AllocStats delta;
+  delta.allocations = now.allocations - started_.allocations;
+  delta.bytes = now.bytes - started_.bytes;
+  phases_.emplace_back(current_, delta);
+  current_.clear();
+}
+
+std::string AllocPhases::str() const {
+  std::string out;
+  for (const auto &p : phases_) {
+    if (!out.empty()) {
+      out += " ";
+    }
+    out += p.first + "=" + std::to_string(p.second.allocations) + "/" + std::to_string(p.second.bytes) + "B";
+  }
+  return out;
+}
+
+uint64_t HeapTrend::growth() const {
+  auto first = static_cast<size_t>(static_cast<double>(samples_.size()) * warmup_);
+  size_t n = samples_.size() - first;
+  if (n < 2) {
+    return 0;
+  }
+  double mean_x = static_cast<double>(n - 1) / 2;
+  double mean_y = 0;
+  for (size_t i = first; i < samples_.size(); i++) {
+    mean_y += static_cast<double>(samples_[i]) / static_cast<double>(n);
+  }
+  double cov = 0;
+  double var = 0;
+  for (size_t i = 0; i < n; i++) {
+    double dx = static_cast<double>(i) - mean_x;
+    cov += dx * (static_cast<double>(samples_[first + i]) - mean_y);
+    var += dx * dx;
+  }
+  double slope = cov / var;
+  return slope <= 0 ? 0 : static_cast<uint64_t>(slope * static_cast<double>(n - 1));
+}
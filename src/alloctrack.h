@@ -0,0 +1,55 @@
+#ifndef AKTUALIZR_LITE_ALLOCTRACK
+#define AKTUALIZR_LITE_ALLOCTRACK
+
+#include <string>
+#include <utility>
+#include <vector>
+
+// Counts C++ heap allocations when built with ALLOC_TRACKING, which replaces
+// the global operator new and delete. Otherwise only the heap size reported
+// by malloc is available.
+struct AllocStats {
+  uint64_t allocations{0};
+  uint64_t bytes{0};  // allocated, regardless of whether they've been freed
+};
+
+class AllocTracker {
+ public:
+  static bool enabled();
+  static AllocStats snapshot();
+  // Bytes malloc has handed out and not had back, from any allocator
+  static uint64_t heapInUse();
+};
+
+// Allocations per phase of a loop, used like PhaseTimer
+class AllocPhases {
+ public:
+  void start(const std::string &phase);
+  void stop();
+  void clear() { phases_.clear(); }
+  std::string str() const;
+
+ private:
+  std::string current_;
+  AllocStats started_;
+  std::vector<std::pair<std::string, AllocStats>> phases_;
+};
+
+// Samples the heap once per loop and tells whether it keeps growing after
+// the first `warmup` fraction of samples, when caches have filled up.
+class HeapTrend {
+ public:
+  explicit HeapTrend(double warmup = 0.2) : warmup_(warmup) {}
+
+  void add(uint64_t heap) { samples_.push_back(heap); }
+  size_t samples() const { return samples_.size(); }
+  // The heap growth across the steady state samples according to a least
+  // squares fit, so that single spikes don't count. 0 if it shrank.
+  uint64_t growth() const;
+
+ private:
+  double warmup_;
+  std::vector<uint64_t> samples_;
+};
+
+#endif  // AKTUALIZR_LITE_ALLOCTRACK
@@ -0,0 +1,60 @@
+#include <gtest/gtest.h>
+
+#include <memory>
+
+#include "alloctrack.h"
+
+// Built with ALLOC_TRACKING
+TEST(alloctrack, counts) {
+  ASSERT_TRUE(AllocTracker::enabled());
+  AllocPhases phases;
+  phases.start("none");
+  phases.start("some");
+  std::vector<std::unique_ptr<int>> ints;
+  for (int i = 0; i < 10; i++) {
+    ints.emplace_back(new int(i));
+  }
+  phases.stop();
+  ASSERT_EQ(0, phases.str().find("none=0/0B some="));
+
+  AllocStats before = AllocTracker::snapshot();
+  std::unique_ptr<char[]> buf(new char[1000]);
+  AllocStats after = AllocTracker::snapshot();
+  ASSERT_EQ(1, after.allocations - before.allocations);
+  ASSERT_GE(after.bytes - before.bytes, 1000);
+}
+
+TEST(alloctrack, heap_in_use) {
+  uint64_t before = AllocTracker::heapInUse();
+  std::unique_ptr<char[]> buf(new char[1024 * 1024]);
+  ASSERT_GE(AllocTracker::heapInUse(), before + 1024 * 1024);
+}
+
+TEST(alloctrack, trend) {
+  HeapTrend flat;
+  ASSERT_EQ(0, flat.growth());
+  for (uint64_t i = 0; i < 1000; i++) {
+    // Noise and the odd spike
+    flat.add(1000000 + (i * 7919) % 4096 + (i == 800 ? 100000 : 0));
+  }
+  ASSERT_LT(flat.growth(), 1024);
+
+  HeapTrend warmup;
+  for (uint64_t i = 0; i < 1000; i++) {
+    warmup.add(1000000 + std::min<uint64_t>(i, 150) * 1000);
+  }
+  ASSERT_EQ(0, warmup.growth());
+
+  HeapTrend leak;
+  for (uint64_t i = 0; i < 1000; i++) {
+    leak.add(1000000 + i * 100 + (i * 7919) % 4096);
+  }
+  ASSERT_NEAR(80000, leak.growth(), 4096);
+}
+
+#ifndef __NO_MAIN__
+int main(int argc, char **argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
+#endif
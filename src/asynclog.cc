@@ -0,0 +1,254 @@
+#include <algorithm>
+#include <stdexcept>
+
+#include "asynclog.h"
+#include "utilities/utils.h"
+
+// Lines that stopped repeating are forgotten once there are this many
+static const size_t kMaxRepeats = 1024;
+
+LogRing::LogRing(size_t capacity) {
+  size_t size = 2;
+  while (size < capacity) {
+    size <<= 1;
+  }
+  mask_ = size - 1;
+  cells_.reset(new Cell[size]);
+  for (size_t i = 0; i < size; i++) {
+    cells_[i].seq.store(i, std::memory_order_relaxed);
+  }
+}
+
+// Each cell's sequence number says whether it's ready to be written to for
+// the current lap of the ring or holds a line ready to be read.
+bool LogRing::push(std::string &&line) {
+  size_t pos = head_.load(std::memory_order_relaxed);
+  Cell *cell;
+  while (true) {
+    cell = &cells_[pos & mask_];
+    size_t seq = cell->seq.load(std::memory_order_acquire);
+    auto diff = static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos);
+    if (diff == 0) {
+      if (head_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+        break;
+      }
+    } else if (diff < 0) {
+      return false;  // full
+    } else {
+      pos = head_.load(std::memory_order_relaxed);
+    }
+  }
+  cell->line = std::move(line);
+  cell->seq.store(pos + 1, std::memory_order_release);
+  return true;
+}
+
+bool LogRing::pop(std::string &line) {
+  size_t pos = tail_.load(std::memory_order_relaxed);
+  Cell *cell;
+  while (true) {
+    cell = &cells_[pos & mask_];
+    size_t seq = cell->seq.load(std::memory_order_acquire);
+    auto diff = static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos + 1);
+    if (diff == 0) {
+      if (tail_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+        break;
+      }
+    } else if (diff < 0) {
+      return false;  // empty
+    } else {
+      pos = tail_.load(std::memory_order_relaxed);
+    }
+  }
+  line = std::move(cell->line);
+  cell->seq.store(pos + mask_ + 1, std::memory_order_release);
+  return true;
+}
+
+AsyncLogConfig::AsyncLogConfig(const std::map<std::string, std::string> &extra) {
+  auto it = extra.find("async_logging");
+  if (it != extra.end()) {
+    if (it->second != "0" && it->second != "1") {
+      throw std::invalid_argument("Invalid async_logging: " + it->second);
+    }
+    enabled = it->second == "1";
+  }
+  it = extra.find("log_buffer_lines");
+  if (it != extra.end()) {
+    buffer_lines = std::stoul(it->second);
+    if (buffer_lines == 0) {
+      throw std::invalid_argument("Invalid log_buffer_lines: " + it->second);
+    }
+  }
+  it = extra.find("log_repeat_window");
+  if (it != extra.end()) {
+    repeat_window = std::chrono::seconds(std::stoul(it->second));
+  }
+}
+
+AsyncLogWriter::AsyncLogWriter(std::ostream &out, size_t capacity, std::chrono::seconds repeat_window)
+    : out_(out), ring_(capacity), repeat_window_(repeat_window) {
+  thread_ = std::thread(&AsyncLogWriter::run, this);
+}
+
+AsyncLogWriter::~AsyncLogWriter() {
+  stop_ = true;
+  cv_.notify_one();
+  thread_.join();
+}
+
+void AsyncLogWriter::write(std::string line) {
+  if (!ring_.push(std::move(line))) {
+    dropped_++;
+    dropped_total_++;
+    return;
+  }
+  queued_++;
+  // Pairs with the fence in run() so that either the writer sees this line
+  // before going to sleep or we see that it's asleep
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  if (sleeping_.exchange(false)) {
+    cv_.notify_one();
+  }
+}
+
+void AsyncLogWriter::flush() {
+  uint64_t target = queued_;
+  if (sleeping_.exchange(false)) {
+    cv_.notify_one();
+  }
+  while (processed_ < target || dropped_ != 0) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+}
+
+void AsyncLogWriter::emit(std::string &line, Clock::time_point now) {
+  if (repeat_window_.count() > 0) {
+    auto it = repeats_.find(line);
+    if (it != repeats_.end()) {
+      if (now - it->second.last < repeat_window_) {
+        it->second.suppressed++;
+        suppressed_total_++;
+        return;
+      }
+      if (it->second.suppressed > 0) {
+        out_ << line << " (" << it->second.suppressed << " repeats suppressed)\n";
+        written_++;
+        it->second = Repeat{now, 0};
+        return;
+      }
+      it->second.last = now;
+    } else {
+      if (repeats_.size() >= kMaxRepeats) {
+        for (auto r = repeats_.begin(); r != repeats_.end();) {
+          r = now - r->second.last >= repeat_window_ ? repeats_.erase(r) : std::next(r);
+        }
+      }
+      repeats_.emplace(line, Repeat{now, 0});
+    }
+  }
+  out_ << line << "\n";
+  written_++;
+}
+
+void AsyncLogWriter::run() {
+  std::string line;
+  while (true) {
+    bool busy = false;
+    auto now = Clock::now();
+    while (ring_.pop(line)) {
+      emit(line, now);
+      processed_++;
+      busy = true;
+    }
+    uint64_t dropped = dropped_;
+    if (dropped > 0) {
+      out_ << "[" << dropped << " log lines dropped]\n";
+      // Only cleared once reported so flush() waits for it
+      dropped_ -= dropped;
+      busy = true;
+    }
+    if (busy) {
+      out_.flush();
+      continue;
+    }
+    if (stop_) {
+      return;
+    }
+
+    sleeping_ = true;
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (ring_.pop(line)) {
+      sleeping_ = false;
+      emit(line, Clock::now());
+      processed_++;
+      continue;
+    }
+    std::unique_lock<std::mutex> guard(lock_);
+    // The timeout only matters if a wake up is lost to the race between the
+    // check above and waiting here
+    cv_.wait_for(guard, std::chrono::seconds(1), [this] { return !sleeping_ || stop_; });
+    sleeping_ = false;
+  }
+}
+
+// Hands each complete line written to the stream to the writer. Sinks
+// serialize their own writes, the lock is for anything else writing there.
+class AsyncLog::LineBuffer : public std::streambuf {
+ public:
+  explicit LineBuffer(std::shared_ptr<AsyncLogWriter> writer) : writer_(std::move(writer)) {}
+  ~LineBuffer() override {
+    if (!line_.empty()) {
+      writer_->write(std::move(line_));
+    }
+  }
+  LineBuffer(const LineBuffer &) = delete;
+  LineBuffer &operator=(const LineBuffer &) = delete;
+
+ protected:
+  int_type overflow(int_type c) override {
+    if (traits_type::eq_int_type(c, traits_type::eof())) {
+      return traits_type::not_eof(c);
+    }
+    char ch = traits_type::to_char_type(c);
+    xsputn(&ch, 1);
+    return c;
+  }
+
+  std::streamsize xsputn(const char *s, std::streamsize n) override {
+    std::lock_guard<std::mutex> guard(lock_);
+    const char *end = s + n;
+    while (s < end) {
+      const char *nl = std::find(s, end, '\n');
+      line_.append(s, nl);
+      if (nl == end) {
+        break;
+      }
+      writer_->write(std::move(line_));
+      line_.clear();
+      s = nl + 1;
+    }
+    return n;
+  }
+
+ private:
+  std::shared_ptr<AsyncLogWriter> writer_;
+  std::mutex lock_;
+  std::string line_;
+};
+
+AsyncLog::AsyncLog(std::ostream &out, const AsyncLogConfig &config)
+    : out_(out),
+      old_(out.rdbuf()),
+      real_(old_),
+      writer_(std::make_shared<AsyncLogWriter>(real_, config.buffer_lines, config.repeat_window)),
+      buffer_(std_::make_unique<LineBuffer>(writer_)) {
+  out_.flush();
+  out_.rdbuf(buffer_.get());
+}
+
+AsyncLog::~AsyncLog() {
+  out_.rdbuf(old_);
+  buffer_.reset();
+  writer_->flush();
+}
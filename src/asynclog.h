@@ -0,0 +1,121 @@
+#ifndef AKTUALIZR_LITE_ASYNCLOG
+#define AKTUALIZR_LITE_ASYNCLOG
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <streambuf>
+#include <string>
+#include <thread>
+#include <unordered_map>
+
+// A bounded multi-producer queue of log lines that never blocks or locks on
+// the producer side. A push to a full ring fails rather than waiting.
+class LogRing {
+ public:
+  explicit LogRing(size_t capacity);  // rounded up to a power of two
+  LogRing(const LogRing &) = delete;
+  LogRing &operator=(const LogRing &) = delete;
+
+  bool push(std::string &&line);
+  bool pop(std::string &line);
+
+ private:
+  struct Cell {
+    std::atomic<size_t> seq;
+    std::string line;
+  };
+  std::unique_ptr<Cell[]> cells_;
+  size_t mask_;
+  std::atomic<size_t> head_{0};
+  std::atomic<size_t> tail_{0};
+};
+
+// Configured via [pacman] async_logging (0 or 1), log_buffer_lines (default
+// 1024) and log_repeat_window (seconds during which a line identical to one
+// already written is suppressed, 0 disables).
+struct AsyncLogConfig {
+  AsyncLogConfig() = default;
+  explicit AsyncLogConfig(const std::map<std::string, std::string> &extra);
+
+  bool enabled{false};
+  size_t buffer_lines{1024};
+  std::chrono::seconds repeat_window{0};
+};
+
+// Drains a LogRing to an ostream from a background thread so that slow
+// consoles or flash don't hold up the code doing the logging. Lines lost to
+// a full ring and repeats suppressed are counted and reported in the output.
+class AsyncLogWriter {
+ public:
+  using Clock = std::chrono::steady_clock;
+
+  AsyncLogWriter(std::ostream &out, size_t capacity, std::chrono::seconds repeat_window);
+  ~AsyncLogWriter();
+  AsyncLogWriter(const AsyncLogWriter &) = delete;
+  AsyncLogWriter &operator=(const AsyncLogWriter &) = delete;
+
+  void write(std::string line);
+  // Blocks until everything queued so far has been written
+  void flush();
+
+  uint64_t written() const { return written_; }
+  uint64_t dropped() const { return dropped_total_; }
+  uint64_t suppressed() const { return suppressed_total_; }
+
+ private:
+  struct Repeat {
+    Clock::time_point last;
+    uint64_t suppressed;
+  };
+
+  void run();
+  void emit(std::string &line, Clock::time_point now);
+
+  std::ostream &out_;
+  LogRing ring_;
+  std::chrono::seconds repeat_window_;
+  std::unordered_map<std::string, Repeat> repeats_;
+
+  std::atomic<uint64_t> queued_{0};
+  std::atomic<uint64_t> processed_{0};
+  std::atomic<uint64_t> written_{0};
+  std::atomic<uint64_t> dropped_{0};
+  std::atomic<uint64_t> dropped_total_{0};
+  std::atomic<uint64_t> suppressed_total_{0};
+
+  std::atomic_bool stop_{false};
+  std::atomic_bool sleeping_{false};
+  std::mutex lock_;
+  std::condition_variable cv_;
+  std::thread thread_;
+};
+
+// Routes what's written to `out`, eg std::cout where logger_init()'s sink
+// writes, through an AsyncLogWriter for as long as it exists. The sinks and
+// their formatting are left as they are, only the stream's buffer is swapped
+// and it gets its own back on destruction, by which time nothing else may
+// be writing to the stream.
+class AsyncLog {
+ public:
+  AsyncLog(std::ostream &out, const AsyncLogConfig &config);
+  ~AsyncLog();
+  AsyncLog(const AsyncLog &) = delete;
+  AsyncLog &operator=(const AsyncLog &) = delete;
+
+  AsyncLogWriter &writer() { return *writer_; }
+
+ private:
+  class LineBuffer;
+  std::ostream &out_;
+  std::streambuf *old_;
+  std::ostream real_;
+  std::shared_ptr<AsyncLogWriter> writer_;
+  std::unique_ptr<LineBuffer> buffer_;
+};
+
+#endif  // AKTUALIZR_LITE_ASYNCLOG
@@ -0,0 +1,111 @@
+#include <gtest/gtest.h>
+
+#include <sstream>
+#include <thread>
+#include <vector>
+
+#include <boost/core/null_deleter.hpp>
+#include <boost/log/core.hpp>
+#include <boost/log/expressions.hpp>
+#include <boost/log/sinks/sync_frontend.hpp>
+#include <boost/log/sinks/text_ostream_backend.hpp>
+
+#include "asynclog.h"
+#include "logging/logging.h"
+
+TEST(asynclog, ring) {
+  LogRing ring(3);  // rounded up to 4
+  std::string line;
+  ASSERT_FALSE(ring.pop(line));
+  for (int i = 0; i < 4; i++) {
+    ASSERT_TRUE(ring.push(std::to_string(i)));
+  }
+  ASSERT_FALSE(ring.push("full"));
+  ASSERT_TRUE(ring.pop(line));
+  ASSERT_EQ("0", line);
+  ASSERT_TRUE(ring.push("4"));
+  for (int i = 1; i < 5; i++) {
+    ASSERT_TRUE(ring.pop(line));
+    ASSERT_EQ(std::to_string(i), line);
+  }
+  ASSERT_FALSE(ring.pop(line));
+}
+
+TEST(asynclog, producers) {
+  std::ostringstream out;
+  const int kThreads = 4;
+  const int kLines = 5000;
+  AsyncLogWriter writer(out, 64, std::chrono::seconds(0));
+  std::vector<std::thread> threads;
+  for (int t = 0; t < kThreads; t++) {
+    threads.emplace_back([&writer, t]() {
+      for (int i = 0; i < kLines; i++) {
+        writer.write(std::to_string(t) + ":" + std::to_string(i));
+      }
+    });
+  }
+  for (auto &t : threads) {
+    t.join();
+  }
+  writer.flush();
+  // Every line was either written or counted as dropped
+  ASSERT_EQ(kThreads * kLines, writer.written() + writer.dropped());
+  if (writer.dropped() > 0) {
+    ASSERT_NE(std::string::npos, out.str().find("log lines dropped]"));
+  }
+}
+
+TEST(asynclog, repeats) {
+  std::ostringstream out;
+  AsyncLogWriter writer(out, 16, std::chrono::seconds(3600));
+  for (int i = 0; i < 5; i++) {
+    writer.write("Refreshing Targets metadata");
+  }
+  writer.write("Something else");
+  writer.flush();
+  ASSERT_EQ("Refreshing Targets metadata\nSomething else\n", out.str());
+  ASSERT_EQ(2, writer.written());
+  ASSERT_EQ(4, writer.suppressed());
+}
+
+TEST(asynclog, config) {
+  AsyncLogConfig config({{"async_logging", "1"}, {"log_buffer_lines", "64"}, {"log_repeat_window", "600"}});
+  ASSERT_TRUE(config.enabled);
+  ASSERT_EQ(64, config.buffer_lines);
+  ASSERT_EQ(600, config.repeat_window.count());
+  ASSERT_FALSE(AsyncLogConfig(std::map<std::string, std::string>{}).enabled);
+  ASSERT_THROW(AsyncLogConfig(std::map<std::string, std::string>{{"async_logging", "yes"}}), std::invalid_argument);
+  ASSERT_THROW(AsyncLogConfig(std::map<std::string, std::string>{{"log_buffer_lines", "0"}}), std::invalid_argument);
+}
+
+TEST(asynclog, boost_log) {
+  std::ostringstream out;
+  // A sink formatting like logger_init()'s, but writing to `out`
+  auto backend = boost::make_shared<boost::log::sinks::text_ostream_backend>();
+  backend->add_stream(boost::shared_ptr<std::ostream>(&out, boost::null_deleter()));
+  backend->auto_flush(true);
+  auto sink = boost::make_shared<boost::log::sinks::synchronous_sink<boost::log::sinks::text_ostream_backend>>(backend);
+  sink->set_formatter(boost::log::expressions::stream << boost::log::trivial::severity << ": "
+                                                      << boost::log::expressions::smessage);
+  boost::log::core::get()->add_sink(sink);
+
+  AsyncLogConfig config;
+  config.enabled = true;
+  {
+    AsyncLog log(out, config);
+    LOG_INFO << "via the ring";
+    log.writer().flush();
+    ASSERT_EQ("info: via the ring\n", out.str());
+  }
+  // The sink is left in place, writing straight to the stream again
+  LOG_ERROR << "afterwards";
+  ASSERT_EQ("info: via the ring\nerror: afterwards\n", out.str());
+  boost::log::core::get()->remove_sink(sink);
+}
+
+#ifndef __NO_MAIN__
+int main(int argc, char **argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
+#endif
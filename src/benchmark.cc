@@ -0,0 +1,334 @@
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <random>
+#include <thread>
+#include <vector>
+
+#include <boost/core/null_deleter.hpp>
+#include <boost/log/core.hpp>
+#include <boost/log/expressions.hpp>
+#include <boost/log/sinks/sync_frontend.hpp>
+#include <boost/log/sinks/text_ostream_backend.hpp>
+#include <boost/program_options.hpp>
+
+#include "asynclog.h"
+#include "config/config.h"
+#include "crypto/crypto.h"
+#include "litestorage.h"
+#include "logging/logging.h"
+#include "package_manager/ostreemanager.h"
+#include "storage/invstorage.h"
+#include "utilities/utils.h"
+#include "verify.h"
+
+namespace bpo = boost::program_options;
+
+// Micro benchmarks for aktualizr-lite's building blocks. These aren't run by
+// ctest as their numbers only mean something on the target hardware.
+
+using Clock = std::chrono::steady_clock;
+
+static double elapsed_us(Clock::time_point start, uint64_t iterations = 1) {
+  auto us = std::chrono::duration_cast<std::chrono::microseconds>(Clock::now() - start).count();
+  return static_cast<double>(us) / static_cast<double>(iterations);
+}
+
+static uint64_t dir_size(const boost::filesystem::path &dir) {
+  uint64_t size = 0;
+  for (auto &entry : boost::make_iterator_range(boost::filesystem::recursive_directory_iterator(dir), {})) {
+    if (boost::filesystem::is_regular_file(entry)) {
+      size += boost::filesystem::file_size(entry);
+    }
+  }
+  return size;
+}
+
+static void report(const std::string &backend, const std::string &what, double value, const std::string &unit) {
+  std::cout << std::left << std::setw(8) << backend << std::setw(24) << what << std::right << std::setw(12)
+            << std::fixed << std::setprecision(1) << value << " " << unit << "\n";
+}
+
+static Uptane::Target bench_target(uint64_t i) {
+  Json::Value json;
+  json["hashes"]["sha256"] = std::string(62, '0') + std::to_string(10 + i % 90);
+  json["custom"]["targetFormat"] = "OSTREE";
+  json["custom"]["version"] = std::to_string(i);
+  json["custom"]["hardwareIds"][0] = "bench";
+  json["length"] = 0;
+  return Uptane::Target("bench-" + std::to_string(i), json);
+}
+
+// A targets.json of `count` targets, standing in for the image repo's
+static std::string bench_metadata(uint64_t count) {
+  Json::Value json;
+  json["signed"]["_type"] = "Targets";
+  json["signed"]["expires"] = "2030-01-01T00:00:00Z";
+  json["signed"]["version"] = 1;
+  for (uint64_t i = 0; i < count; i++) {
+    Uptane::Target t = bench_target(i);
+    json["signed"]["targets"][t.filename()] = t.toDebugJson();
+  }
+  return Utils::jsonToCanonicalStr(json);
+}
+
+// Times the same INvStorage calls aktualizr-lite makes against a backend:
+// opening it, recording an installed target and reading the current one back,
+// storing and loading the targets metadata, and opening it again.
+static void storage_bench(const std::string &backend, const std::function<std::shared_ptr<INvStorage>()> &open,
+                          const boost::filesystem::path &dir, uint64_t iterations, const std::string &metadata) {
+  auto start = Clock::now();
+  auto storage = open();
+  report(backend, "create", elapsed_us(start), "us");
+  storage->storeEcuSerials({{Uptane::EcuSerial("bench"), Uptane::HardwareIdentifier("bench")}});
+
+  start = Clock::now();
+  for (uint64_t i = 0; i < iterations; i++) {
+    storage->savePrimaryInstalledVersion(bench_target(i), InstalledVersionUpdateMode::kCurrent);
+  }
+  report(backend, "write installed", elapsed_us(start, iterations), "us/op");
+  start = Clock::now();
+  for (uint64_t i = 0; i < iterations; i++) {
+    boost::optional<Uptane::Target> current;
+    storage->loadPrimaryInstalledVersions(&current, nullptr);
+  }
+  report(backend, "read installed", elapsed_us(start, iterations), "us/op");
+
+  start = Clock::now();
+  for (uint64_t i = 0; i < iterations; i++) {
+    storage->storeNonRoot(metadata, Uptane::RepositoryType::Image(), Uptane::Role::Targets());
+  }
+  report(backend, "write targets.json", elapsed_us(start, iterations), "us/op");
+  start = Clock::now();
+  for (uint64_t i = 0; i < iterations; i++) {
+    std::string raw;
+    storage->loadNonRoot(&raw, Uptane::RepositoryType::Image(), Uptane::Role::Targets());
+  }
+  report(backend, "read targets.json", elapsed_us(start, iterations), "us/op");
+
+  storage.reset();
+  start = Clock::now();
+  storage = open();
+  boost::optional<Uptane::Target> current;
+  storage->loadPrimaryInstalledVersions(&current, nullptr);
+  report(backend, "reopen and read", elapsed_us(start), "us");
+  report(backend, "disk", static_cast<double>(dir_size(dir)) / 1024, "KiB");
+}
+
+// Compares LiteStorage against the SQL storage it can replace
+static int store_bench(const bpo::variables_map &vm) {
+  auto iterations = vm["iterations"].as<uint64_t>();
+  std::string metadata = bench_metadata(vm["targets"].as<uint64_t>());
+  std::cout << "targets.json is " << metadata.size() / 1024 << " KiB\n";
+
+  TemporaryDirectory sql_dir;
+  StorageConfig sql_config;
+  sql_config.path = sql_dir.Path();
+  storage_bench("sql", [&sql_config]() { return INvStorage::newStorage(sql_config); }, sql_dir.Path(), iterations,
+                metadata);
+
+  TemporaryDirectory log_dir;
+  StorageConfig log_config;
+  log_config.path = log_dir.Path();
+  storage_bench("log", [&log_config]() { return std::make_shared<LiteStorage>(log_config); }, log_dir.Path(),
+                iterations, metadata);
+  return 0;
+}
+
+// Discards output, but takes a while for every line like a serial console
+class SlowConsole : public std::streambuf {
+ public:
+  explicit SlowConsole(std::chrono::microseconds delay) : delay_(delay) {}
+
+ protected:
+  int_type overflow(int_type c) override {
+    if (c == '\n') {
+      std::this_thread::sleep_for(delay_);
+    }
+    return traits_type::not_eof(c);
+  }
+
+ private:
+  std::chrono::microseconds delay_;
+};
+
+// Times a loop that logs like the daemon does on every poll, once with a
+// synchronous sink as set up by logger_init() and once with AsyncLog
+static void log_loop(const std::string &backend, uint64_t iterations, uint64_t lines) {
+  std::vector<double> latency;
+  for (uint64_t i = 0; i < iterations; i++) {
+    auto start = Clock::now();
+    LOG_INFO << "Refreshing Targets metadata";
+    for (uint64_t l = 0; l < lines; l++) {
+      LOG_INFO << "bench-" << l << "\tsha256:" << std::string(64, '0');
+    }
+    latency.push_back(elapsed_us(start));
+  }
+  std::sort(latency.begin(), latency.end());
+  report(backend, "loop p50", latency[latency.size() / 2], "us");
+  report(backend, "loop p99", latency[latency.size() * 99 / 100], "us");
+  report(backend, "loop max", latency.back(), "us");
+}
+
+static int log_bench(const bpo::variables_map &vm) {
+  auto iterations = vm["iterations"].as<uint64_t>();
+  auto lines = vm["lines"].as<uint64_t>();
+  SlowConsole console(std::chrono::microseconds(vm["write-delay-us"].as<uint64_t>()));
+  std::ostream out(&console);
+  logger_set_threshold(boost::log::trivial::info);
+
+  auto core = boost::log::core::get();
+  core->remove_all_sinks();
+  auto backend = boost::make_shared<boost::log::sinks::text_ostream_backend>();
+  backend->add_stream(boost::shared_ptr<std::ostream>(&out, boost::null_deleter()));
+  backend->auto_flush(true);
+  auto sink = boost::make_shared<boost::log::sinks::synchronous_sink<boost::log::sinks::text_ostream_backend>>(backend);
+  sink->set_formatter(boost::log::expressions::stream << boost::log::expressions::smessage);
+  core->add_sink(sink);
+  log_loop("sync", iterations, lines);
+
+  // The same sink, with the console written from the ring's thread
+  AsyncLogConfig config;
+  config.enabled = true;
+  config.buffer_lines = vm["log-buffer-lines"].as<uint64_t>();
+  uint64_t dropped;
+  {
+    AsyncLog log(out, config);
+    log_loop("async", iterations, lines);
+    log.writer().flush();
+    dropped = log.writer().dropped();
+  }
+  core->remove_sink(sink);
+  report("async", "dropped", static_cast<double>(dropped), "lines");
+  return 0;
+}
+
+// Checks the same content on one thread and on a pool of them. Random files
+// stand in for app bundles, with --sysroot the booted commit is checked too.
+static int verify_bench(const bpo::variables_map &vm) {
+  size_t threads = vm["threads"].as<uint64_t>();
+  if (threads == 0) {
+    threads = std::max(1U, std::thread::hardware_concurrency());
+  }
+  auto files = vm["files"].as<uint64_t>();
+  uint64_t file_size = vm["file-mib"].as<uint64_t>() * 1024 * 1024;
+
+  TemporaryDirectory dir;
+  std::vector<std::string> digests;
+  std::mt19937_64 rng(42);
+  for (uint64_t f = 0; f < files; f++) {
+    std::string data(file_size, '\0');
+    for (size_t i = 0; i + sizeof(uint64_t) <= data.size(); i += sizeof(uint64_t)) {
+      uint64_t r = rng();
+      memcpy(&data[i], &r, sizeof(r));
+    }
+    MultiPartSHA256Hasher hasher;
+    hasher.update(reinterpret_cast<const unsigned char *>(data.data()), data.size());
+    digests.push_back(hasher.getHexDigest());
+    Utils::writeFile(dir / std::to_string(f), data);
+  }
+
+  boost::filesystem::path sysroot;
+  std::string commit;
+  if (vm.count("sysroot") > 0) {
+    sysroot = vm["sysroot"].as<boost::filesystem::path>();
+    GObjectUniquePtr<OstreeSysroot> sysroot_smart = OstreeManager::LoadSysroot(sysroot);
+    OstreeDeployment *deployment = ostree_sysroot_get_booted_deployment(sysroot_smart.get());
+    if (deployment == nullptr) {
+      throw std::runtime_error("No booted deployment in " + sysroot.string());
+    }
+    commit = ostree_deployment_get_csum(deployment);
+  }
+
+  for (size_t n : {static_cast<size_t>(1), threads}) {
+    VerifyConfig config;
+    config.threads = n;
+    ContentVerifier verifier(sysroot, config);
+    if (!commit.empty()) {
+      verifier.addCommit(commit);
+    }
+    for (uint64_t f = 0; f < files; f++) {
+      verifier.addFile(std::to_string(f), dir / std::to_string(f), digests[f], file_size);
+    }
+    // Both runs read the files from the page cache as they've just been written
+    auto start = Clock::now();
+    VerifyResult res = verifier.run();
+    double us = elapsed_us(start);
+    if (!res.ok()) {
+      throw std::runtime_error("Verification failed for " + res.failed.front());
+    }
+    std::string backend = std::to_string(n) + "-thr";
+    report(backend, "time", us / 1000, "ms");
+    report(backend, "checked", static_cast<double>(res.checked), "items");
+    report(backend, "files", static_cast<double>(res.bytes) / (1024 * 1024) / (us / 1e6), "MiB/s");
+  }
+  return 0;
+}
+
+struct Benchmark {
+  const char *name;
+  int (*main)(const bpo::variables_map &);
+};
+static Benchmark benchmarks[] = {
+    {"store", store_bench},
+    {"log", log_bench},
+    {"verify", verify_bench},
+};
+
+int main(int argc, char *argv[]) {
+  logger_init(isatty(1) == 1);
+  logger_set_threshold(boost::log::trivial::warning);
+
+  std::string names;
+  for (const auto &b : benchmarks) {
+    names += names.empty() ? b.name : std::string(", ") + b.name;
+  }
+  bpo::options_description description("aktualizr-lite benchmarks");
+  // clang-format off
+  description.add_options()
+      ("help,h", "print usage")
+      ("iterations,n", bpo::value<uint64_t>()->default_value(1000), "number of operations to time")
+      ("targets", bpo::value<uint64_t>()->default_value(500), "store: targets in the metadata stored")
+      ("lines", bpo::value<uint64_t>()->default_value(10), "log: lines logged per loop")
+      ("write-delay-us", bpo::value<uint64_t>()->default_value(200), "log: time the console takes per line")
+      ("log-buffer-lines", bpo::value<uint64_t>()->default_value(1024), "log: async ring size")
+      ("threads", bpo::value<uint64_t>()->default_value(0), "verify: size of the pool, 0 for one per core")
+      ("files", bpo::value<uint64_t>()->default_value(8), "verify: number of files standing in for app bundles")
+      ("file-mib", bpo::value<uint64_t>()->default_value(64), "verify: size of each file")
+      ("sysroot", bpo::value<boost::filesystem::path>(), "verify: also check the booted commit of this OSTree sysroot")
+      ("benchmark", bpo::value<std::string>(), ("Benchmark to run: " + names).c_str());
+  // clang-format on
+  bpo::positional_options_description pos;
+  pos.add("benchmark", 1);
+
+  bpo::variables_map vm;
+  try {
+    bpo::store(bpo::command_line_parser(argc, argv).options(description).positional(pos).run(), vm);
+    bpo::notify(vm);
+  } catch (const bpo::error &ex) {
+    std::cerr << ex.what() << "\n" << description;
+    return EXIT_FAILURE;
+  }
+  if (vm.count("help") != 0 || vm.count("benchmark") == 0) {
+    std::cout << description;
+    return EXIT_SUCCESS;
+  }
+
+  for (const auto &b : benchmarks) {
+    if (vm["benchmark"].as<std::string>() == b.name) {
+      try {
+        return b.main(vm);
+      } catch (const std::exception &ex) {
+        LOG_ERROR << ex.what();
+        return EXIT_FAILURE;
+      }
+    }
+  }
+  std::cerr << "Unknown benchmark: " << vm["benchmark"].as<std::string>() << "\n";
+  return EXIT_FAILURE;
+}
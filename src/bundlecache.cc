@@ -0,0 +1,237 @@
+#include <algorithm>
+#include <sstream>
+#include <stdexcept>
+
+#include <boost/algorithm/hex.hpp>
+#include <boost/algorithm/string.hpp>
+
+#include "bundlecache.h"
+#include "crypto/crypto.h"
+#include "logging/logging.h"
+#include "utilities/utils.h"
+
+// Bundles are compose files and the like, so a copy is read into memory
+// before it's written out. Anything bigger is left to be downloaded.
+static const uint64_t kMaxBundleSize = 64 * 1024 * 1024;
+
+BundleCacheConfig::BundleCacheConfig(const std::map<std::string, std::string> &extra) {
+  auto it = extra.find("app_bundle_cache");
+  if (it != extra.end()) {
+    if (it->second != "0" && it->second != "1") {
+      throw std::invalid_argument("Invalid app_bundle_cache: " + it->second);
+    }
+    enabled = it->second == "1";
+  }
+}
+
+Json::Value BundleCacheStats::json() const {
+  Json::Value res;
+  res["hits"] = static_cast<Json::UInt64>(hits);
+  res["misses"] = static_cast<Json::UInt64>(misses);
+  res["hit_rate"] = static_cast<Json::UInt64>(hitRate());
+  res["bytes_saved"] = static_cast<Json::UInt64>(bytes_saved);
+  res["bundles"] = static_cast<Json::UInt64>(bundles);
+  res["bytes"] = static_cast<Json::UInt64>(bytes);
+  return res;
+}
+
+std::string BundleCacheStats::str() const {
+  std::ostringstream out;
+  out << "hit rate " << hitRate() << "% (" << hits << " hits, " << misses << " misses), " << bytes_saved
+      << " bytes saved, " << bundles << " bundles of " << bytes << " bytes cached";
+  return out.str();
+}
+
+static std::string sha256_of(const Uptane::Target &t) { return boost::algorithm::to_lower_copy(t.sha256Hash()); }
+
+BundleCache::BundleCache(boost::filesystem::path dir, std::shared_ptr<INvStorage> storage)
+    : dir_(std::move(dir)), storage_(std::move(storage)) {
+  boost::filesystem::create_directories(dir_);
+  load();
+}
+
+std::vector<Uptane::Target> BundleCache::bundles(const Uptane::Target &target, const std::vector<Uptane::Target> &all,
+                                                 const std::vector<std::string> &apps) {
+  std::vector<Uptane::Target> res;
+  auto target_apps = target.custom_data()["docker_apps"];
+  for (const auto &app : apps) {
+    if (!target_apps.isMember(app)) {
+      continue;
+    }
+    std::string filename = target_apps[app]["filename"].asString();
+    auto it = std::find_if(all.begin(), all.end(),
+                           [&filename](const Uptane::Target &t) { return t.filename() == filename; });
+    if (it != all.end()) {
+      res.push_back(*it);
+    }
+  }
+  return res;
+}
+
+boost::filesystem::path BundleCache::path(const std::string &sha256) const { return dir_ / sha256; }
+
+// Checks the cached copy on the way, libaktualizr won't once it's stored
+bool BundleCache::copyToStorage(const Uptane::Target &bundle) {
+  std::string sha256 = sha256_of(bundle);
+  if (bundle.length() > kMaxBundleSize) {
+    return false;
+  }
+  std::string data;
+  if (boost::filesystem::exists(path(sha256))) {
+    data = Utils::readFile(path(sha256));
+  }
+  std::string actual = boost::algorithm::to_lower_copy(boost::algorithm::hex(Crypto::sha256digest(data)));
+  if (data.size() != bundle.length() || actual != sha256) {
+    LOG_WARNING << "Dropping damaged app bundle " << sha256 << " from the cache";
+    boost::filesystem::remove(path(sha256));
+    entries_.erase(sha256);
+    return false;
+  }
+
+  // The cached file may be a link to the one this replaces, which is fine as
+  // its content is already in memory and the same as what's written
+  auto out = storage_->allocateTargetFile(bundle);
+  if (out->wfeed(reinterpret_cast<const uint8_t *>(data.data()), data.size()) != data.size()) {
+    LOG_WARNING << "Unable to store app bundle " << bundle.filename();
+    out->wabort();
+    return false;
+  }
+  out->wcommit();
+  return true;
+}
+
+uint64_t BundleCache::prime(const std::string &target, const std::vector<Uptane::Target> &bundles) {
+  std::lock_guard<std::mutex> guard(lock_);
+  uint64_t saved = 0;
+  for (const auto &bundle : bundles) {
+    auto stored = storage_->checkTargetFile(bundle);
+    if (stored && stored->first >= bundle.length()) {
+      // Nothing to fetch either way
+      continue;
+    }
+    std::string sha256 = sha256_of(bundle);
+    if (entries_.count(sha256) > 0 && copyToStorage(bundle)) {
+      entries_[sha256].refs.insert(target);
+      stats_.hits++;
+      stats_.bytes_saved += bundle.length();
+      saved += bundle.length();
+      LOG_INFO << "Using cached app bundle for " << bundle.filename();
+    } else {
+      stats_.misses++;
+    }
+  }
+  save();
+  return saved;
+}
+
+void BundleCache::add(const std::string &target, const std::vector<Uptane::Target> &bundles) {
+  std::lock_guard<std::mutex> guard(lock_);
+  for (const auto &bundle : bundles) {
+    auto stored = storage_->checkTargetFile(bundle);
+    if (!stored || stored->first < bundle.length()) {
+      continue;
+    }
+    std::string sha256 = sha256_of(bundle);
+    if (!boost::filesystem::exists(path(sha256))) {
+      // A link costs no space or flash writes, a copy where links can't be made
+      boost::system::error_code ec;
+      boost::filesystem::create_hard_link(stored->second, path(sha256), ec);
+      if (ec) {
+        boost::filesystem::copy_file(stored->second, path(sha256), ec);
+      }
+      if (ec) {
+        LOG_WARNING << "Unable to cache app bundle " << bundle.filename() << ": " << ec.message();
+        continue;
+      }
+    }
+    Entry &entry = entries_[sha256];
+    entry.length = bundle.length();
+    entry.refs.insert(target);
+  }
+  save();
+}
+
+uint64_t BundleCache::retain(const std::set<std::string> &targets) {
+  std::lock_guard<std::mutex> guard(lock_);
+  uint64_t freed = 0;
+  for (auto it = entries_.begin(); it != entries_.end();) {
+    auto &refs = it->second.refs;
+    for (auto ref = refs.begin(); ref != refs.end();) {
+      ref = targets.count(*ref) > 0 ? std::next(ref) : refs.erase(ref);
+    }
+    if (refs.empty()) {
+      boost::filesystem::remove(path(it->first));
+      freed += it->second.length;
+      it = entries_.erase(it);
+    } else {
+      ++it;
+    }
+  }
+  save();
+  return freed;
+}
+
+bool BundleCache::contains(const std::string &sha256) const {
+  std::lock_guard<std::mutex> guard(lock_);
+  return entries_.count(boost::algorithm::to_lower_copy(sha256)) > 0;
+}
+
+BundleCacheStats BundleCache::stats() const {
+  std::lock_guard<std::mutex> guard(lock_);
+  BundleCacheStats res = stats_;
+  res.bundles = entries_.size();
+  for (const auto &e : entries_) {
+    res.bytes += e.second.length;
+  }
+  return res;
+}
+
+void BundleCache::load() {
+  auto index = dir_ / "index.json";
+  if (boost::filesystem::exists(index)) {
+    Json::Value json = Utils::parseJSONFile(index);
+    for (auto it = json["bundles"].begin(); it != json["bundles"].end(); ++it) {
+      Entry entry;
+      entry.length = (*it)["length"].asUInt64();
+      for (const auto &ref : (*it)["refs"]) {
+        entry.refs.insert(ref.asString());
+      }
+      entries_[it.key().asString()] = entry;
+    }
+    stats_.hits = json["hits"].asUInt64();
+    stats_.misses = json["misses"].asUInt64();
+    stats_.bytes_saved = json["bytes_saved"].asUInt64();
+  }
+
+  // Whatever an interrupted update left out of step with the index
+  for (auto it = entries_.begin(); it != entries_.end();) {
+    it = boost::filesystem::exists(path(it->first)) ? std::next(it) : entries_.erase(it);
+  }
+  for (auto &entry : boost::make_iterator_range(boost::filesystem::directory_iterator(dir_), {})) {
+    std::string name = entry.path().filename().string();
+    if (name != "index.json" && entries_.count(name) == 0) {
+      boost::filesystem::remove(entry.path());
+    }
+  }
+}
+
+void BundleCache::save() const {
+  Json::Value json;
+  json["bundles"] = Json::objectValue;
+  for (const auto &e : entries_) {
+    Json::Value &entry = json["bundles"][e.first];
+    entry["length"] = static_cast<Json::UInt64>(e.second.length);
+    entry["refs"] = Json::arrayValue;
+    for (const auto &ref : e.second.refs) {
+      entry["refs"].append(ref);
+    }
+  }
+  json["hits"] = static_cast<Json::UInt64>(stats_.hits);
+  json["misses"] = static_cast<Json::UInt64>(stats_.misses);
+  json["bytes_saved"] = static_cast<Json::UInt64>(stats_.bytes_saved);
+
+  // Replaced in one go so a power cut leaves the old or the new index
+  auto tmp = dir_ / "index.json.tmp";
+  Utils::writeFile(tmp, Utils::jsonToCanonicalStr(json));
+  boost::filesystem::rename(tmp, dir_ / "index.json");
+}
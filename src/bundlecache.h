@@ -0,0 +1,87 @@
+#ifndef AKTUALIZR_LITE_BUNDLECACHE
+#define AKTUALIZR_LITE_BUNDLECACHE
+
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <vector>
+
+#include <json/json.h>
+#include <boost/filesystem.hpp>
+
+#include "storage/invstorage.h"
+#include "uptane/tuf.h"
+
+// Keeps docker app bundles by digest across targets. Configured via [pacman]
+// app_bundle_cache (0 or 1, default 0).
+struct BundleCacheConfig {
+  BundleCacheConfig() = default;
+  explicit BundleCacheConfig(const std::map<std::string, std::string> &extra);
+
+  bool enabled{false};
+};
+
+struct BundleCacheStats {
+  uint64_t hits{0};
+  uint64_t misses{0};
+  uint64_t bytes_saved{0};
+  uint64_t bundles{0};
+  uint64_t bytes{0};
+
+  // Percent of the bundles looked up that came from the cache
+  uint64_t hitRate() const { return hits + misses > 0 ? hits * 100 / (hits + misses) : 0; }
+  Json::Value json() const;
+  std::string str() const;
+};
+
+// App bundles are target files named after the app and the build, so an app
+// that didn't change between two targets still has a new filename and
+// libaktualizr fetches it again. The cache keeps each bundle under its
+// sha256, hard linked to libaktualizr's copy where it can be, and copies it
+// into libaktualizr's storage under the new name before a download, which
+// then finds it already there.
+//
+// Each bundle counts the targets referring to it. Entries no target refers to
+// any more are dropped by retain(), which is given the current and rollback
+// targets once an update is installed.
+class BundleCache {
+ public:
+  BundleCache(boost::filesystem::path dir, std::shared_ptr<INvStorage> storage);
+
+  // The bundle targets among `all` of the configured `apps` in `target`
+  static std::vector<Uptane::Target> bundles(const Uptane::Target &target, const std::vector<Uptane::Target> &all,
+                                             const std::vector<std::string> &apps);
+
+  // Stores the cached bundles for `target` that libaktualizr doesn't have yet,
+  // returning the bytes that won't have to be downloaded
+  uint64_t prime(const std::string &target, const std::vector<Uptane::Target> &bundles);
+  // Caches what libaktualizr downloaded for `target`
+  void add(const std::string &target, const std::vector<Uptane::Target> &bundles);
+  // Drops the references of targets not in `targets`, and the bundles left
+  // without any. Returns the bytes freed.
+  uint64_t retain(const std::set<std::string> &targets);
+
+  bool contains(const std::string &sha256) const;
+  BundleCacheStats stats() const;
+
+ private:
+  struct Entry {
+    uint64_t length{0};
+    std::set<std::string> refs;
+  };
+
+  boost::filesystem::path path(const std::string &sha256) const;
+  bool copyToStorage(const Uptane::Target &bundle);
+  void load();
+  void save() const;
+
+  boost::filesystem::path dir_;
+  std::shared_ptr<INvStorage> storage_;
+  mutable std::mutex lock_;
+  std::map<std::string, Entry> entries_;
+  BundleCacheStats stats_;
+};
+
+#endif  // AKTUALIZR_LITE_BUNDLECACHE
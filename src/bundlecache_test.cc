@@ -0,0 +1,136 @@
+#include <gtest/gtest.h>
+
+#include <boost/algorithm/hex.hpp>
+#include <boost/algorithm/string.hpp>
+
+#include "bundlecache.h"
+#include "crypto/crypto.h"
+#include "utilities/utils.h"
+
+static Uptane::Target bundle(const std::string &name, const std::string &content) {
+  Json::Value json;
+  json["hashes"]["sha256"] = boost::algorithm::to_lower_copy(boost::algorithm::hex(Crypto::sha256digest(content)));
+  json["length"] = static_cast<Json::UInt64>(content.size());
+  return Uptane::Target(name, json);
+}
+
+static Uptane::Target target(const std::string &name, const std::vector<Uptane::Target> &bundles) {
+  Json::Value json;
+  json["hashes"]["sha256"] = std::string(64, '1');
+  json["length"] = 0;
+  json["custom"]["targetFormat"] = "OSTREE";
+  for (const auto &b : bundles) {
+    json["custom"]["docker_apps"][b.filename().substr(0, b.filename().find('-'))]["filename"] = b.filename();
+  }
+  return Uptane::Target(name, json);
+}
+
+// What libaktualizr does when it fetches a bundle
+static void download(INvStorage &storage, const Uptane::Target &bundle, const std::string &content) {
+  auto out = storage.allocateTargetFile(bundle);
+  out->wfeed(reinterpret_cast<const uint8_t *>(content.data()), content.size());
+  out->wcommit();
+}
+
+static std::string stored(INvStorage &storage, const Uptane::Target &bundle) {
+  auto res = storage.checkTargetFile(bundle);
+  return res ? Utils::readFile(res->second) : "";
+}
+
+TEST(bundlecache, config) {
+  ASSERT_FALSE(BundleCacheConfig(std::map<std::string, std::string>{}).enabled);
+  ASSERT_TRUE(BundleCacheConfig(std::map<std::string, std::string>{{"app_bundle_cache", "1"}}).enabled);
+  ASSERT_THROW(BundleCacheConfig(std::map<std::string, std::string>{{"app_bundle_cache", "yes"}}),
+               std::invalid_argument);
+}
+
+TEST(bundlecache, bundles) {
+  auto app1 = bundle("app1-1.dockerapp", "app1");
+  auto app2 = bundle("app2-1.dockerapp", "app2");
+  auto t = target("lmp-1", {app1, app2, bundle("app3-1.dockerapp", "not a target")});
+  std::vector<Uptane::Target> all{t, app1, app2};
+
+  auto res = BundleCache::bundles(t, all, {"app2", "app3", "app4"});
+  ASSERT_EQ(1, res.size());
+  ASSERT_EQ("app2-1.dockerapp", res[0].filename());
+  ASSERT_TRUE(BundleCache::bundles(t, all, {}).empty());
+}
+
+TEST(bundlecache, reuse) {
+  TemporaryDirectory dir;
+  StorageConfig config;
+  config.path = dir.Path();
+  auto storage = INvStorage::newStorage(config);
+
+  std::string shared(10000, 's');
+  std::vector<Uptane::Target> first{bundle("app1-1.dockerapp", shared), bundle("app2-1.dockerapp", "version 1")};
+  std::vector<Uptane::Target> second{bundle("app1-2.dockerapp", shared), bundle("app2-2.dockerapp", "version 2")};
+  {
+    BundleCache cache(dir / "app-bundles", storage);
+    ASSERT_EQ(0, cache.prime("lmp-1", first));
+    download(*storage, first[0], shared);
+    download(*storage, first[1], "version 1");
+    cache.add("lmp-1", first);
+    ASSERT_TRUE(cache.contains(first[0].sha256Hash()));
+
+    // app1 didn't change, so it's stored under its new name without a download
+    ASSERT_EQ(shared.size(), cache.prime("lmp-2", second));
+    ASSERT_EQ(shared, stored(*storage, second[0]));
+    ASSERT_EQ("", stored(*storage, second[1]));
+    download(*storage, second[1], "version 2");
+    cache.add("lmp-2", second);
+
+    auto stats = cache.stats();
+    ASSERT_EQ(1, stats.hits);
+    ASSERT_EQ(3, stats.misses);
+    ASSERT_EQ(25, stats.hitRate());
+    ASSERT_EQ(shared.size(), stats.bytes_saved);
+    ASSERT_EQ(3, stats.bundles);
+  }
+
+  // Counts survive a restart, and bundles only lmp-1 used go once it's no
+  // longer the current or rollback target
+  BundleCache cache(dir / "app-bundles", storage);
+  ASSERT_EQ(shared.size(), cache.stats().bytes_saved);
+  ASSERT_EQ(0, cache.retain({"lmp-1", "lmp-2"}));
+  ASSERT_EQ(9, cache.retain({"lmp-2", "lmp-3"}));
+  ASSERT_TRUE(cache.contains(second[0].sha256Hash()));
+  ASSERT_FALSE(cache.contains(first[1].sha256Hash()));
+  ASSERT_TRUE(cache.contains(second[1].sha256Hash()));
+  ASSERT_EQ(2, cache.stats().bundles);
+  ASSERT_EQ(shared, stored(*storage, second[0]));
+
+  ASSERT_EQ(shared.size() + 9, cache.retain({}));
+  ASSERT_EQ(0, cache.stats().bundles);
+  ASSERT_EQ(1, std::distance(boost::filesystem::directory_iterator(dir / "app-bundles"), {}));
+}
+
+TEST(bundlecache, damaged) {
+  TemporaryDirectory dir;
+  StorageConfig config;
+  config.path = dir.Path();
+  auto storage = INvStorage::newStorage(config);
+
+  auto first = bundle("app1-1.dockerapp", "content");
+  auto second = bundle("app1-2.dockerapp", "content");
+  BundleCache cache(dir / "app-bundles", storage);
+  download(*storage, first, "content");
+  cache.add("lmp-1", {first});
+
+  // Left for the download to fetch rather than stored as is
+  auto cached = dir / "app-bundles" / first.sha256Hash();
+  boost::filesystem::remove(cached);
+  Utils::writeFile(cached, std::string("CONTENT"));
+  ASSERT_EQ(0, cache.prime("lmp-2", {second}));
+  ASSERT_FALSE(storage->checkTargetFile(second));
+  ASSERT_FALSE(cache.contains(first.sha256Hash()));
+  ASSERT_FALSE(boost::filesystem::exists(cached));
+  ASSERT_EQ(1, cache.stats().misses);
+}
+
+#ifndef __NO_MAIN__
+int main(int argc, char **argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
+#endif
@@ -0,0 +1,260 @@
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <cstring>
+#include <stdexcept>
+
+#include "control.h"
+#include "logging/logging.h"
+#include "utilities/utils.h"
+
+// Requests are small, anything bigger is a misbehaving client
+static const size_t kMaxRequestSize = 64 * 1024;
+// Replies and events not yet taken by a client, which is dropped beyond this
+static const size_t kMaxBacklog = 1024 * 1024;
+
+ControlServer::ControlServer(boost::filesystem::path path, Handler handler)
+    : path_(std::move(path)), handler_(std::move(handler)) {
+  struct sockaddr_un addr {};
+  if (path_.native().size() >= sizeof(addr.sun_path)) {
+    throw std::runtime_error("Control socket path too long: " + path_.string());
+  }
+  addr.sun_family = AF_UNIX;
+  strncpy(addr.sun_path, path_.c_str(), sizeof(addr.sun_path) - 1);
+
+  sock_ = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (sock_ < 0) {
+    throw std::runtime_error(std::string("Unable to create control socket: ") + strerror(errno));
+  }
+  // Left behind by a daemon that didn't exit cleanly. Anything else there isn't ours to remove.
+  struct stat st {};
+  if (lstat(path_.c_str(), &st) == 0) {
+    if (!S_ISSOCK(st.st_mode)) {
+      close(sock_);
+      throw std::runtime_error("Control socket path exists and isn't a socket: " + path_.string());
+    }
+    unlink(path_.c_str());
+  }
+  // Only root may drive updates. The socket is created with these permissions
+  // rather than changed after, when anyone could have connected already.
+  // Created before the daemon's workers start, so nothing else is creating
+  // files under the changed umask.
+  mode_t old_mask = umask(0177);
+  int rc = bind(sock_, reinterpret_cast<struct sockaddr *>(&addr), sizeof(addr));
+  umask(old_mask);
+  if (rc != 0 || listen(sock_, 8) != 0) {
+    std::string err = strerror(errno);
+    close(sock_);
+    throw std::runtime_error("Unable to listen on " + path_.string() + ": " + err);
+  }
+
+  if (pipe2(wake_, O_CLOEXEC | O_NONBLOCK) != 0) {
+    close(sock_);
+    throw std::runtime_error(std::string("Unable to create control pipe: ") + strerror(errno));
+  }
+  LOG_INFO << "Control socket listening on " << path_;
+  thread_ = std::thread(&ControlServer::run, this);
+}
+
+ControlServer::~ControlServer() {
+  char c = 'q';
+  if (write(wake_[1], &c, 1) != 1) {
+    LOG_ERROR << "Unable to stop control socket thread";
+  }
+  thread_.join();
+  for (auto &client : clients_) {
+    close(client.fd);
+  }
+  close(wake_[0]);
+  close(wake_[1]);
+  close(sock_);
+  unlink(path_.c_str());
+}
+
+// Writes what it can of the client's backlog without blocking. Only called
+// by the server's thread, and the socket I/O is made without `lock_` held.
+void ControlServer::flush(Client &client) {
+  std::string pending;
+  {
+    std::lock_guard<std::mutex> guard(lock_);
+    if (client.dead) {
+      return;
+    }
+    pending.swap(client.out);
+  }
+  size_t sent = 0;
+  bool failed = false;
+  while (sent < pending.size()) {
+    ssize_t rc = ::send(client.fd, pending.data() + sent, pending.size() - sent, MSG_NOSIGNAL | MSG_DONTWAIT);
+    if (rc < 0 && errno == EINTR) {
+      continue;
+    }
+    if (rc < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      break;
+    }
+    if (rc <= 0) {
+      failed = true;
+      break;
+    }
+    sent += static_cast<size_t>(rc);
+  }
+  std::lock_guard<std::mutex> guard(lock_);
+  if (failed) {
+    client.dead = true;
+    return;
+  }
+  // Anything published meanwhile goes after what's left of this
+  client.out.insert(0, pending, sent, std::string::npos);
+}
+
+// Must be called with `lock_` held
+void ControlServer::queue(Client &client, const Json::Value &msg) {
+  if (client.dead) {
+    return;
+  }
+  client.out += Utils::jsonToStr(msg) + "\n";
+  // A client that doesn't keep up is dropped rather than left to grow this
+  if (client.out.size() > kMaxBacklog) {
+    client.dead = true;
+  }
+}
+
+void ControlServer::wake() {
+  char c = 'w';
+  if (write(wake_[1], &c, 1) != 1) {
+    LOG_DEBUG << "Control socket thread already has a wake up pending";
+  }
+}
+
+void ControlServer::publish(const Json::Value &event) {
+  {
+    std::lock_guard<std::mutex> guard(lock_);
+    for (auto &client : clients_) {
+      if (client.streaming) {
+        queue(client, event);
+      }
+    }
+  }
+  wake();
+}
+
+Json::Value ControlServer::handle(Client &client, const std::string &line) {
+  Json::Value res;
+  try {
+    Json::Value req = Utils::parseJSON(line);
+    if (!req.isObject() || !req["cmd"].isString()) {
+      res["error"] = "Invalid request";
+    } else if (req["cmd"].asString() == "progress") {
+      Json::Value status;
+      status["cmd"] = "status";
+      res = handler_(status);
+      std::lock_guard<std::mutex> guard(lock_);
+      client.streaming = true;
+    } else {
+      res = handler_(req);
+    }
+  } catch (const std::exception &ex) {
+    res = Json::Value();
+    res["error"] = ex.what();
+  }
+  return res;
+}
+
+// Only this thread adds or removes clients, so it can use them without
+// `lock_`, which guards what publish() touches: `out`, `streaming` and `dead`.
+void ControlServer::run() {
+  while (true) {
+    std::vector<struct pollfd> fds;
+    {
+      std::lock_guard<std::mutex> guard(lock_);
+      for (auto it = clients_.begin(); it != clients_.end();) {
+        if (it->dead) {
+          close(it->fd);
+          it = clients_.erase(it);
+        } else {
+          ++it;
+        }
+      }
+      fds.push_back({wake_[0], POLLIN, 0});
+      fds.push_back({sock_, POLLIN, 0});
+      for (const auto &client : clients_) {
+        fds.push_back({client.fd, static_cast<short>(client.out.empty() ? POLLIN : POLLIN | POLLOUT), 0});
+      }
+    }
+
+    if (poll(fds.data(), fds.size(), -1) < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      LOG_ERROR << "Control socket poll failed: " << strerror(errno);
+      return;
+    }
+
+    if ((fds[0].revents & POLLIN) != 0) {
+      char c;
+      while (read(wake_[0], &c, 1) == 1) {
+        if (c == 'q') {
+          return;
+        }
+      }
+    }
+
+    if ((fds[1].revents & POLLIN) != 0) {
+      int fd = accept4(sock_, nullptr, nullptr, SOCK_CLOEXEC);
+      if (fd >= 0) {
+        std::lock_guard<std::mutex> guard(lock_);
+        clients_.push_back({fd, "", "", false, false});
+      }
+    }
+    // Clients accepted above aren't part of this poll round. Indexes line up
+    // with fds[2:] since clients are only ever removed at the top of the loop.
+    for (size_t i = 2; i < fds.size(); i++) {
+      Client &client = clients_[i - 2];
+      if ((fds[i].revents & (POLLIN | POLLHUP | POLLERR)) == 0) {
+        continue;
+      }
+      char buf[4096];
+      ssize_t n = recv(client.fd, buf, sizeof(buf), MSG_DONTWAIT);
+      if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+        continue;
+      }
+      if (n <= 0) {
+        std::lock_guard<std::mutex> guard(lock_);
+        client.dead = true;
+        continue;
+      }
+      client.buf.append(buf, static_cast<size_t>(n));
+      size_t pos;
+      while ((pos = client.buf.find('\n')) != std::string::npos) {
+        std::string line = client.buf.substr(0, pos);
+        if (!line.empty() && line.back() == '\r') {
+          line.pop_back();
+        }
+        client.buf.erase(0, pos + 1);
+        Json::Value res = handle(client, line);
+        std::lock_guard<std::mutex> guard(lock_);
+        queue(client, res);
+      }
+      if (client.buf.size() > kMaxRequestSize) {
+        std::lock_guard<std::mutex> guard(lock_);
+        client.dead = true;
+      }
+    }
+
+    // Every client with a backlog, whether or not it was in this poll round
+    for (auto &client : clients_) {
+      bool pending;
+      {
+        std::lock_guard<std::mutex> guard(lock_);
+        pending = !client.out.empty();
+      }
+      if (pending) {
+        flush(client);
+      }
+    }
+  }
+}
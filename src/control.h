@@ -0,0 +1,65 @@
+#ifndef AKTUALIZR_LITE_CONTROL
+#define AKTUALIZR_LITE_CONTROL
+
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <boost/filesystem.hpp>
+#include <json/json.h>
+
+// A local unix socket API served by a running daemon. Clients send one JSON
+// request per line and receive one JSON response per line:
+//   {"cmd": "status"}                  current target, what the daemon is doing and
+//                                      the latency of its workers' jobs, and the
+//                                      app bundle cache's hit rate when enabled
+//   {"cmd": "list"}                    targets available to this device
+//   {"cmd": "check"}                   poll for updates now
+//   {"cmd": "update", "target": NAME}  update to the named target
+//   {"cmd": "cancel"}                  stop the download or verification under way,
+//                                      what was fetched is kept for the next attempt
+//   {"cmd": "progress"}                stream status events until disconnect
+// Requests other than "progress" are answered by the Handler, which must only
+// use the daemon's in-memory state as it runs on the server's thread. Replies
+// and events are queued and written without blocking, so a client that
+// doesn't read can't hold up the server or publish(); it's dropped once its
+// backlog grows too big.
+class ControlServer {
+ public:
+  using Handler = std::function<Json::Value(const Json::Value &request)>;
+
+  ControlServer(boost::filesystem::path path, Handler handler);
+  ~ControlServer();
+  ControlServer(const ControlServer &) = delete;
+  ControlServer &operator=(const ControlServer &) = delete;
+
+  // Send an event to every client streaming progress
+  void publish(const Json::Value &event);
+
+ private:
+  struct Client {
+    int fd;
+    std::string buf;  // received, up to the next full request
+    std::string out;  // to be sent
+    bool streaming;
+    bool dead;
+  };
+
+  void run();
+  Json::Value handle(Client &client, const std::string &line);
+  void queue(Client &client, const Json::Value &msg);
+  void flush(Client &client);
+  void wake();
+
+  boost::filesystem::path path_;
+  Handler handler_;
+  int sock_{-1};
+  int wake_[2]{-1, -1};
+  std::mutex lock_;
+  std::vector<Client> clients_;
+  std::thread thread_;
+};
+
+#endif  // AKTUALIZR_LITE_CONTROL
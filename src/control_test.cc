@@ -0,0 +1,162 @@
+#include <gtest/gtest.h>
+
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <chrono>
+
+#include "control.h"
+#include "utilities/utils.h"
+
+class Connection {
+ public:
+  explicit Connection(const boost::filesystem::path &path) {
+    fd_ = socket(AF_UNIX, SOCK_STREAM, 0);
+    struct sockaddr_un addr {};
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+    EXPECT_EQ(0, connect(fd_, reinterpret_cast<struct sockaddr *>(&addr), sizeof(addr)));
+  }
+  ~Connection() { close(fd_); }
+
+  Json::Value request(const std::string &req) {
+    std::string data = req + "\n";
+    EXPECT_EQ(static_cast<ssize_t>(data.size()), write(fd_, data.c_str(), data.size()));
+    return read();
+  }
+
+  // Fails once the server has dropped the connection
+  bool send(const std::string &req) {
+    std::string data = req + "\n";
+    return ::send(fd_, data.c_str(), data.size(), MSG_NOSIGNAL) == static_cast<ssize_t>(data.size());
+  }
+
+  Json::Value read() {
+    std::string line;
+    char c;
+    while (::read(fd_, &c, 1) == 1 && c != '\n') {
+      line += c;
+    }
+    return Utils::parseJSON(line);
+  }
+
+ private:
+  int fd_;
+};
+
+TEST(control, requests) {
+  TemporaryDirectory tmp_dir;
+  auto path = tmp_dir / "control.sock";
+  ControlServer server(path, [](const Json::Value &req) {
+    Json::Value res;
+    if (req["cmd"].asString() == "boom") {
+      throw std::runtime_error("boom");
+    }
+    res["echo"] = req["cmd"];
+    return res;
+  });
+
+  Connection conn(path);
+  ASSERT_EQ("status", conn.request("{\"cmd\": \"status\"}")["echo"].asString());
+  ASSERT_EQ("list", conn.request("{\"cmd\": \"list\"}")["echo"].asString());
+  ASSERT_TRUE(conn.request("not json").isMember("error"));
+  ASSERT_TRUE(conn.request("{\"foo\": 1}").isMember("error"));
+  ASSERT_EQ("boom", conn.request("{\"cmd\": \"boom\"}")["error"].asString());
+
+  // Clients are served concurrently
+  Connection conn2(path);
+  ASSERT_EQ("check", conn2.request("{\"cmd\": \"check\"}")["echo"].asString());
+  ASSERT_EQ("status", conn.request("{\"cmd\": \"status\"}")["echo"].asString());
+}
+
+TEST(control, progress) {
+  TemporaryDirectory tmp_dir;
+  auto path = tmp_dir / "control.sock";
+  ControlServer server(path, [](const Json::Value &req) {
+    Json::Value res;
+    res["echo"] = req["cmd"];
+    return res;
+  });
+
+  Connection streaming(path);
+  Connection other(path);
+  // Streaming starts with the current status
+  ASSERT_EQ("status", streaming.request("{\"cmd\": \"progress\"}")["echo"].asString());
+  ASSERT_EQ("status", other.request("{\"cmd\": \"status\"}")["echo"].asString());
+
+  Json::Value event;
+  event["state"] = "downloading";
+  event["progress"] = 42;
+  server.publish(event);
+  Json::Value received = streaming.read();
+  ASSERT_EQ("downloading", received["state"].asString());
+  ASSERT_EQ(42, received["progress"].asInt());
+}
+
+// A client that stops reading can't hold up the server or the daemon publishing events
+TEST(control, slow_client) {
+  TemporaryDirectory tmp_dir;
+  auto path = tmp_dir / "control.sock";
+  ControlServer server(path, [](const Json::Value &req) {
+    Json::Value res;
+    res["echo"] = req["cmd"];
+    res["padding"] = std::string(1024, 'x');
+    return res;
+  });
+
+  Connection stuck(path);
+  stuck.request("{\"cmd\": \"progress\"}");
+  // Far more replies than the socket buffers, until it's dropped
+  int sent = 0;
+  while (sent < 2000 && stuck.send("{\"cmd\": \"status\"}")) {
+    sent++;
+  }
+  Json::Value event;
+  event["state"] = "downloading";
+  event["padding"] = std::string(1024, 'x');
+  auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < 2000; i++) {
+    server.publish(event);
+  }
+  ASSERT_LT(std::chrono::steady_clock::now() - start, std::chrono::seconds(5));
+
+  Connection other(path);
+  ASSERT_EQ("status", other.request("{\"cmd\": \"status\"}")["echo"].asString());
+}
+
+TEST(control, socket_path) {
+  TemporaryDirectory tmp_dir;
+  auto path = tmp_dir / "control.sock";
+  auto handler = [](const Json::Value &req) { return req; };
+
+  Utils::writeFile(path, std::string("not a socket"));
+  ASSERT_THROW(ControlServer(path, handler), std::runtime_error);
+  ASSERT_EQ("not a socket", Utils::readFile(path));
+  boost::filesystem::remove(path);
+
+  {
+    // Left behind by a daemon that didn't exit cleanly
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    struct sockaddr_un addr {};
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+    ASSERT_EQ(0, bind(fd, reinterpret_cast<struct sockaddr *>(&addr), sizeof(addr)));
+    close(fd);
+  }
+  ControlServer server(path, handler);
+  struct stat st {};
+  ASSERT_EQ(0, stat(path.c_str(), &st));
+  ASSERT_TRUE(S_ISSOCK(st.st_mode));
+  ASSERT_EQ(0600, st.st_mode & 0777);
+  Connection conn(path);
+  ASSERT_EQ("status", conn.request("{\"cmd\": \"status\"}")["cmd"].asString());
+}
+
+#ifndef __NO_MAIN__
+int main(int argc, char **argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
+#endif
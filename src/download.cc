@@ -0,0 +1,164 @@
+#include <time.h>
+
+#include <algorithm>
+#include <stdexcept>
+
+#include <boost/algorithm/string.hpp>
+
+#include "download.h"
+#include "logging/logging.h"
+
+static int parse_time_of_day(const std::string &val) {
+  std::vector<std::string> parts;
+  boost::split(parts, val, boost::is_any_of(":"));
+  if (parts.size() != 2) {
+    throw std::invalid_argument("Invalid time of day: " + val);
+  }
+  int hours = std::stoi(parts[0]);
+  int mins = std::stoi(parts[1]);
+  if (hours < 0 || hours > 24 || mins < 0 || mins > 59 || (hours == 24 && mins != 0)) {
+    throw std::invalid_argument("Invalid time of day: " + val);
+  }
+  return hours * 60 + mins;
+}
+
+uint64_t parse_size(const std::string &size) {
+  std::string val = boost::trim_copy(size);
+  if (val.empty()) {
+    throw std::invalid_argument("Empty size");
+  }
+  uint64_t multiplier = 1;
+  switch (::toupper(val.back())) {
+    case 'K':
+      multiplier = 1024;
+      break;
+    case 'M':
+      multiplier = 1024 * 1024;
+      break;
+    case 'G':
+      multiplier = 1024 * 1024 * 1024;
+      break;
+    default:
+      break;
+  }
+  if (multiplier != 1) {
+    val.pop_back();
+  }
+  size_t pos = 0;
+  uint64_t num = std::stoull(val, &pos);
+  if (pos != val.size()) {
+    throw std::invalid_argument("Invalid size: " + size);
+  }
+  return num * multiplier;
+}
+
+RateSchedule::RateSchedule(const std::string &spec) {
+  std::vector<std::string> entries;
+  boost::split(entries, spec, boost::is_any_of(","), boost::token_compress_on);
+  for (auto &entry : entries) {
+    boost::trim(entry);
+    if (entry.empty()) {
+      continue;
+    }
+    auto eq = entry.find('=');
+    if (eq == std::string::npos) {
+      default_rate_ = parse_size(entry);
+      continue;
+    }
+    std::string range = entry.substr(0, eq);
+    auto dash = range.find('-');
+    if (dash == std::string::npos) {
+      throw std::invalid_argument("Invalid download rate window: " + entry);
+    }
+    Window w{};
+    w.start = parse_time_of_day(boost::trim_copy(range.substr(0, dash)));
+    w.end = parse_time_of_day(boost::trim_copy(range.substr(dash + 1)));
+    w.rate = parse_size(entry.substr(eq + 1));
+    windows_.push_back(w);
+  }
+}
+
+uint64_t RateSchedule::rateAt(int minute_of_day) const {
+  for (const auto &w : windows_) {
+    if (w.start <= w.end) {
+      if (minute_of_day >= w.start && minute_of_day < w.end) {
+        return w.rate;
+      }
+    } else if (minute_of_day >= w.start || minute_of_day < w.end) {
+      // window wraps around midnight, eg 22:00-06:00
+      return w.rate;
+    }
+  }
+  return default_rate_;
+}
+
+uint64_t RateSchedule::rateNow() const {
+  time_t now = time(nullptr);
+  struct tm tm {};
+  localtime_r(&now, &tm);
+  return rateAt(tm.tm_hour * 60 + tm.tm_min);
+}
+
+TokenBucket::TokenBucket(uint64_t rate, std::chrono::steady_clock::time_point now)
+    : rate_(rate), tokens_(static_cast<double>(rate)), last_(now) {}
+
+void TokenBucket::setRate(uint64_t rate) {
+  rate_ = rate;
+  // Don't let a burst allowance from a faster window carry over
+  if (tokens_ > static_cast<double>(rate_)) {
+    tokens_ = static_cast<double>(rate_);
+  }
+}
+
+bool TokenBucket::consume(uint64_t bytes, std::chrono::steady_clock::time_point now) {
+  if (rate_ == 0) {
+    return true;  // unlimited
+  }
+  std::chrono::duration<double> elapsed = now - last_;
+  last_ = now;
+  // The bucket holds at most one second worth of data
+  tokens_ = std::min(static_cast<double>(rate_), tokens_ + elapsed.count() * static_cast<double>(rate_));
+  tokens_ -= static_cast<double>(bytes);
+  return tokens_ >= 0;
+}
+
+void DownloadMeter::progress(unsigned int percent) {
+  uint64_t bytes = expected_ * std::min(percent, 100U) / 100;
+  // A retried pull reports from the start again, what it fetched before still counts
+  uint64_t prev = received_;
+  while (bytes > prev && !received_.compare_exchange_weak(prev, bytes)) {
+  }
+}
+
+DownloadThrottle::DownloadThrottle(const RateSchedule &schedule, std::function<uint64_t()> received,
+                                   api::FlowControlToken &token)
+    : schedule_(schedule), received_(std::move(received)), token_(token) {
+  thread_ = std::thread(&DownloadThrottle::run, this);
+}
+
+DownloadThrottle::~DownloadThrottle() {
+  stop_ = true;
+  thread_.join();
+  token_.setPause(false);
+}
+
+void DownloadThrottle::run() {
+  auto now = std::chrono::steady_clock::now();
+  TokenBucket bucket(schedule_.rateNow(), now);
+  uint64_t last = received_();
+  bool paused = false;
+
+  while (!stop_) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    now = std::chrono::steady_clock::now();
+    uint64_t total = received_();
+    bucket.setRate(schedule_.rateNow());
+    bool ok = bucket.consume(total >= last ? total - last : 0, now);
+    last = total;
+    if (ok == paused) {
+      paused = !ok;
+      LOG_DEBUG << (paused ? "Pausing" : "Resuming") << " download to honor bandwidth limit";
+      token_.setPause(paused);
+    }
+  }
+}
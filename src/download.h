@@ -0,0 +1,96 @@
+#ifndef AKTUALIZR_LITE_DOWNLOAD
+#define AKTUALIZR_LITE_DOWNLOAD
+
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "utilities/apiqueue.h"
+
+// Parses a byte count with an optional K/M/G suffix, eg "256K".
+uint64_t parse_size(const std::string &size);
+
+// A download bandwidth limit that can vary by time of day. The spec is a
+// comma separated list of "HH:MM-HH:MM=RATE" windows and an optional plain
+// "RATE" used outside of them, eg: "08:00-18:00=256K,2M". RATE is in bytes
+// per second with an optional K/M/G suffix. A rate of 0 means unlimited.
+class RateSchedule {
+ public:
+  RateSchedule() = default;
+  explicit RateSchedule(const std::string &spec);
+
+  uint64_t rateAt(int minute_of_day) const;
+  uint64_t rateNow() const;
+  bool empty() const { return default_rate_ == 0 && windows_.empty(); }
+
+ private:
+  struct Window {
+    int start;  // minutes since midnight
+    int end;
+    uint64_t rate;
+  };
+  uint64_t default_rate_{0};
+  std::vector<Window> windows_;
+};
+
+class TokenBucket {
+ public:
+  TokenBucket(uint64_t rate, std::chrono::steady_clock::time_point now);
+
+  void setRate(uint64_t rate);
+  // Take `bytes` out of the bucket. Returns false while the bucket is in debt
+  // and the consumer should hold off.
+  bool consume(uint64_t bytes, std::chrono::steady_clock::time_point now);
+
+ private:
+  uint64_t rate_;
+  double tokens_;
+  std::chrono::steady_clock::time_point last_;
+};
+
+// The bytes a download has received so far, worked out from libaktualizr's
+// progress reports. Those only give the whole percent of the target fetched,
+// OSTree counting objects rather than bytes, so it's that share of the bytes
+// the download was expected to take. The count moves in steps of 1% of the
+// expected size, and as objects differ in size a step can stand for more or
+// fewer bytes than actually arrived.
+class DownloadMeter {
+ public:
+  explicit DownloadMeter(uint64_t expected) : expected_(expected) {}
+
+  void progress(unsigned int percent);
+  uint64_t received() const { return received_; }
+
+ private:
+  uint64_t expected_;
+  std::atomic<uint64_t> received_{0};
+};
+
+// Enforces a RateSchedule on an in-flight download by pausing its flow
+// control token whenever the bytes it has received exceed the budget.
+// `received` gives the download's running total and is called from the
+// throttle's own thread. The rate holds only as well as that total: fed by a
+// DownloadMeter it's an average over the download, with the link used at
+// full speed until a step is counted and the download then paused to pay it
+// off, so bursts are up to a step plus a second's worth of the rate.
+class DownloadThrottle {
+ public:
+  DownloadThrottle(const RateSchedule &schedule, std::function<uint64_t()> received, api::FlowControlToken &token);
+  ~DownloadThrottle();
+  DownloadThrottle(const DownloadThrottle &) = delete;
+  DownloadThrottle &operator=(const DownloadThrottle &) = delete;
+
+ private:
+  void run();
+
+  const RateSchedule &schedule_;
+  std::function<uint64_t()> received_;
+  api::FlowControlToken &token_;
+  std::atomic_bool stop_{false};
+  std::thread thread_;
+};
+
+#endif  // AKTUALIZR_LITE_DOWNLOAD
@@ -0,0 +1,103 @@
+#include <gtest/gtest.h>
+
+#include <atomic>
+#include <thread>
+
+#include "download.h"
+
+TEST(download, parse_size) {
+  ASSERT_EQ(0, parse_size("0"));
+  ASSERT_EQ(100, parse_size("100"));
+  ASSERT_EQ(256 * 1024, parse_size("256K"));
+  ASSERT_EQ(2 * 1024 * 1024, parse_size(" 2m "));
+  ASSERT_THROW(parse_size("12X"), std::invalid_argument);
+  ASSERT_THROW(parse_size(""), std::invalid_argument);
+}
+
+TEST(download, schedule) {
+  ASSERT_TRUE(RateSchedule().empty());
+  ASSERT_TRUE(RateSchedule("0").empty());
+
+  RateSchedule flat("1M");
+  ASSERT_FALSE(flat.empty());
+  ASSERT_EQ(1024 * 1024, flat.rateAt(0));
+  ASSERT_EQ(1024 * 1024, flat.rateAt(23 * 60 + 59));
+
+  // Business hours are throttled, unlimited otherwise
+  RateSchedule office("08:00-18:00=256K");
+  ASSERT_EQ(0, office.rateAt(7 * 60 + 59));
+  ASSERT_EQ(256 * 1024, office.rateAt(8 * 60));
+  ASSERT_EQ(256 * 1024, office.rateAt(17 * 60 + 59));
+  ASSERT_EQ(0, office.rateAt(18 * 60));
+
+  // Windows can wrap midnight and fall back to a default rate
+  RateSchedule night("22:00-06:00=4M, 512K");
+  ASSERT_EQ(4 * 1024 * 1024, night.rateAt(23 * 60));
+  ASSERT_EQ(4 * 1024 * 1024, night.rateAt(5 * 60));
+  ASSERT_EQ(512 * 1024, night.rateAt(12 * 60));
+
+  ASSERT_THROW(RateSchedule("08:00=1M"), std::invalid_argument);
+  ASSERT_THROW(RateSchedule("8-18=1M"), std::invalid_argument);
+  ASSERT_THROW(RateSchedule("08:00-25:00=1M"), std::invalid_argument);
+}
+
+TEST(download, token_bucket) {
+  auto now = std::chrono::steady_clock::now();
+  TokenBucket bucket(1000, now);
+
+  // A full second worth of data can burst through
+  ASSERT_TRUE(bucket.consume(1000, now));
+  // Anything more puts us in debt until enough time has passed
+  ASSERT_FALSE(bucket.consume(500, now));
+  ASSERT_FALSE(bucket.consume(0, now + std::chrono::milliseconds(250)));
+  ASSERT_TRUE(bucket.consume(0, now + std::chrono::milliseconds(500)));
+
+  // Idle time doesn't accumulate more than the burst size
+  now += std::chrono::seconds(60);
+  ASSERT_TRUE(bucket.consume(1000, now));
+  ASSERT_FALSE(bucket.consume(1, now));
+
+  // Unlimited
+  bucket.setRate(0);
+  ASSERT_TRUE(bucket.consume(1 << 30, now));
+}
+
+TEST(download, meter) {
+  DownloadMeter meter(1000);
+  ASSERT_EQ(0, meter.received());
+  meter.progress(25);
+  ASSERT_EQ(250, meter.received());
+  // A retry starting over doesn't take back what was fetched
+  meter.progress(10);
+  ASSERT_EQ(250, meter.received());
+  meter.progress(150);
+  ASSERT_EQ(1000, meter.received());
+}
+
+// Only what the download itself received counts against the limit
+TEST(download, throttle) {
+  RateSchedule schedule("1K");
+  api::FlowControlToken token;
+  std::atomic<uint64_t> received{0};
+  {
+    DownloadThrottle throttle(schedule, [&received] { return received.load(); }, token);
+    std::this_thread::sleep_for(std::chrono::milliseconds(300));
+    ASSERT_TRUE(token.canContinue(false));
+
+    received = 10 * 1024;
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(2);
+    while (token.canContinue(false) && std::chrono::steady_clock::now() < deadline) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    ASSERT_FALSE(token.canContinue(false));
+  }
+  // Never left paused
+  ASSERT_TRUE(token.canContinue(false));
+}
+
+#ifndef __NO_MAIN__
+int main(int argc, char **argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
+#endif
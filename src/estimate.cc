@@ -0,0 +1,285 @@
+#include <algorithm>
+#include <cstdio>
+#include <fstream>
+#include <limits>
+#include <sstream>
+
+#include <boost/algorithm/string.hpp>
+
+#include "bundlecache.h"
+#include "crypto/keymanager.h"
+#include "download.h"
+#include "estimate.h"
+#include "logging/logging.h"
+#include "package_manager/ostreemanager.h"
+
+// The remote OstreeManager::pull() sets up and pulls from
+static const char kRemote[] = "aktualizr-remote";
+
+#ifdef BUILD_DOCKERAPP
+#include "package_manager/dockerappmanager.h"
+std::vector<std::string> configured_apps(const PackageConfig &pacman) {
+  if (pacman.type != PACKAGE_MANAGER_OSTREEDOCKERAPP) {
+    return {};
+  }
+  return DockerAppManagerConfig(pacman).docker_apps;
+}
+#else /* ! BUILD_DOCKERAPP */
+std::vector<std::string> configured_apps(const PackageConfig &pacman) {
+  (void)pacman;
+  return {};
+}
+#endif
+
+struct VariantDeleter {
+  void operator()(GVariant *v) const { g_variant_unref(v); }
+};
+using VariantPtr = std::unique_ptr<GVariant, VariantDeleter>;
+
+static std::string human_size(uint64_t bytes) {
+  const char *units[] = {"B", "KiB", "MiB", "GiB"};
+  auto val = static_cast<double>(bytes);
+  size_t unit = 0;
+  while (val >= 1024 && unit < 3) {
+    val /= 1024;
+    unit++;
+  }
+  char buf[32];
+  snprintf(buf, sizeof(buf), unit == 0 ? "%.0f %s" : "%.1f %s", val, units[unit]);
+  return buf;
+}
+
+std::string UpdateEstimate::str() const {
+  if (!known) {
+    return "unknown";
+  }
+  std::stringstream ss;
+  ss << human_size(total()) << " (" << ostree_objects << " OSTree objects, " << apps << " app bundles)";
+  return ss.str();
+}
+
+static bool read_varuint64(const unsigned char *&data, size_t &len, uint64_t &out) {
+  out = 0;
+  for (unsigned int shift = 0; len > 0 && shift < 64; shift += 7) {
+    unsigned char b = *data++;
+    len--;
+    out |= static_cast<uint64_t>(b & 0x7f) << shift;
+    if ((b & 0x80) == 0) {
+      return true;
+    }
+  }
+  return false;
+}
+
+bool parse_ostree_size(const unsigned char *data, size_t len, OstreeObjectSize &out) {
+  static const size_t kDigestLen = 32;
+  static const char hex[] = "0123456789abcdef";
+  if (len < kDigestLen) {
+    return false;
+  }
+  out.checksum.clear();
+  for (size_t i = 0; i < kDigestLen; i++) {
+    out.checksum += hex[data[i] >> 4];
+    out.checksum += hex[data[i] & 0xf];
+  }
+  data += kDigestLen;
+  len -= kDigestLen;
+  if (!read_varuint64(data, len, out.archived) || !read_varuint64(data, len, out.unpacked)) {
+    return false;
+  }
+  out.type = OSTREE_OBJECT_TYPE_FILE;
+  if (len > 0) {
+    out.type = *data;
+    len--;
+  }
+  return len == 0 && out.type >= OSTREE_OBJECT_TYPE_FILE && out.type <= OSTREE_OBJECT_TYPE_COMMIT;
+}
+
+UpdateEstimator::UpdateEstimator(const Config &config, std::shared_ptr<INvStorage> storage,
+                                 const BundleCache *bundles)
+    : config_(config), storage_(std::move(storage)), bundles_(bundles) {}
+
+static bool fetch_commit(OstreeRepo *repo, const std::string &commit, const Config &config,
+                         const std::shared_ptr<INvStorage> &storage) {
+  KeyManager keys(storage, config.keymanagerConfig());
+  keys.loadKeys();
+  if (!OstreeManager::addRemote(repo, config.pacman.ostree_server, keys)) {
+    LOG_WARNING << "Unable to add OSTree remote for " << config.pacman.ostree_server;
+    return false;
+  }
+
+  GVariantBuilder builder;
+  g_variant_builder_init(&builder, G_VARIANT_TYPE("a{sv}"));
+  const char *const refs[] = {commit.c_str()};
+  g_variant_builder_add(&builder, "{s@v}", "refs", g_variant_new_variant(g_variant_new_strv(refs, 1)));
+  g_variant_builder_add(&builder, "{s@v}", "flags",
+                        g_variant_new_variant(g_variant_new_int32(OSTREE_REPO_PULL_FLAGS_COMMIT_ONLY)));
+  VariantPtr options(g_variant_ref_sink(g_variant_builder_end(&builder)));
+
+  GError *error = nullptr;
+  if (!ostree_repo_pull_with_options(repo, kRemote, options.get(), nullptr, nullptr, &error)) {
+    LOG_WARNING << "Unable to fetch OSTree commit " << commit << ": " << error->message;
+    g_error_free(error);
+    return false;
+  }
+  return true;
+}
+
+// Returns false if the size of what's missing can't be told
+bool UpdateEstimator::estimateOstree(const std::string &commit, UpdateEstimate &res) {
+  GObjectUniquePtr<OstreeSysroot> sysroot = OstreeManager::LoadSysroot(config_.pacman.sysroot);
+  OstreeRepo *raw_repo = nullptr;
+  GError *error = nullptr;
+  if (!ostree_sysroot_get_repo(sysroot.get(), &raw_repo, nullptr, &error)) {
+    LOG_WARNING << "Unable to open OSTree repo: " << error->message;
+    g_error_free(error);
+    return false;
+  }
+  GObjectUniquePtr<OstreeRepo> repo(raw_repo);
+
+  gboolean have_commit = 0;
+  if (!ostree_repo_has_object(repo.get(), OSTREE_OBJECT_TYPE_COMMIT, commit.c_str(), &have_commit, nullptr,
+                              &error)) {
+    LOG_WARNING << "Unable to look up OSTree commit " << commit << ": " << error->message;
+    g_error_free(error);
+    return false;
+  }
+  if (have_commit == 0 && !fetch_commit(repo.get(), commit, config_, storage_)) {
+    return false;
+  }
+
+  GVariant *raw_commit = nullptr;
+  OstreeRepoCommitState state = OSTREE_REPO_COMMIT_STATE_NORMAL;
+  if (!ostree_repo_load_commit(repo.get(), commit.c_str(), &raw_commit, &state, &error)) {
+    LOG_WARNING << "Unable to load OSTree commit " << commit << ": " << error->message;
+    g_error_free(error);
+    return false;
+  }
+  VariantPtr commit_v(raw_commit);
+  if ((state & OSTREE_REPO_COMMIT_STATE_PARTIAL) == 0) {
+    return true;  // fully pulled already
+  }
+
+  VariantPtr metadata(g_variant_get_child_value(commit_v.get(), 0));
+  VariantPtr sizes(g_variant_lookup_value(metadata.get(), "ostree.sizes", G_VARIANT_TYPE("aay")));
+  if (sizes == nullptr) {
+    LOG_DEBUG << "OSTree commit " << commit << " has no ostree.sizes metadata";
+    return false;
+  }
+  size_t n = g_variant_n_children(sizes.get());
+  for (size_t i = 0; i < n; i++) {
+    VariantPtr entry(g_variant_get_child_value(sizes.get(), i));
+    size_t len = 0;
+    const guint8 *data = g_variant_get_fixed_array(entry.get(), &len, 1);
+    OstreeObjectSize obj;
+    if (!parse_ostree_size(data, len, obj)) {
+      LOG_WARNING << "Invalid ostree.sizes metadata in commit " << commit;
+      return false;
+    }
+    gboolean present = 0;
+    if (!ostree_repo_has_object(repo.get(), static_cast<OstreeObjectType>(obj.type), obj.checksum.c_str(), &present,
+                                nullptr, &error)) {
+      LOG_WARNING << "Unable to look up OSTree object " << obj.checksum << ": " << error->message;
+      g_error_free(error);
+      return false;
+    }
+    if (present == 0) {
+      res.ostree_bytes += obj.archived;
+      res.ostree_objects++;
+    }
+  }
+  return true;
+}
+
+// Bundles are fetched like any other target file, partially fetched ones are resumed and cached ones copied
+void UpdateEstimator::estimateApps(const Uptane::Target &target, const std::vector<Uptane::Target> &all_targets,
+                                   UpdateEstimate &res) {
+  auto apps = target.custom_data()["docker_apps"];
+  for (const auto &app : configured_apps(config_.pacman)) {
+    if (!apps.isMember(app)) {
+      continue;
+    }
+    std::string filename = apps[app]["filename"].asString();
+    auto it = std::find_if(all_targets.begin(), all_targets.end(),
+                           [&filename](const Uptane::Target &t) { return t.filename() == filename; });
+    if (it == all_targets.end()) {
+      LOG_WARNING << "Docker app " << app << " refers to unknown target " << filename;
+      res.known = false;
+      continue;
+    }
+    uint64_t have = 0;
+    auto stored = storage_->checkTargetFile(*it);
+    if (stored) {
+      have = stored->first;
+    }
+    if (bundles_ != nullptr && bundles_->contains(it->sha256Hash())) {
+      have = it->length();
+    }
+    if (have < it->length()) {
+      res.app_bytes += it->length() - have;
+      res.apps++;
+    }
+  }
+}
+
+UpdateEstimate UpdateEstimator::estimate(const Uptane::Target &target, const std::vector<Uptane::Target> &all_targets) {
+  UpdateEstimate res;
+  try {
+    res.known = estimateOstree(target.sha256Hash(), res);
+  } catch (const std::exception &ex) {
+    LOG_WARNING << "Unable to estimate OSTree download for " << target.filename() << ": " << ex.what();
+  }
+  estimateApps(target, all_targets, res);
+  return res;
+}
+
+MeteredPolicy::MeteredPolicy(const std::map<std::string, std::string> &extra) {
+  auto it = extra.find("metered_interfaces");
+  if (it != extra.end()) {
+    std::string val = boost::trim_copy(it->second);
+    if (!val.empty()) {
+      boost::split(interfaces, val, boost::is_any_of(", "), boost::token_compress_on);
+    }
+  }
+  it = extra.find("metered_update_limit");
+  if (it != extra.end()) {
+    limit = parse_size(it->second);
+  }
+}
+
+bool MeteredPolicy::metered(const std::string &iface) const {
+  return !iface.empty() && std::find(interfaces.begin(), interfaces.end(), iface) != interfaces.end();
+}
+
+bool MeteredPolicy::allows(const UpdateEstimate &estimate, const std::string &iface) const {
+  if (!metered(iface)) {
+    return true;
+  }
+  return estimate.known && estimate.total() <= limit;
+}
+
+std::string MeteredPolicy::defaultInterface(const boost::filesystem::path &routes) {
+  std::ifstream in(routes.string());
+  std::string line;
+  std::getline(in, line);  // header
+  std::string best;
+  uint64_t best_metric = std::numeric_limits<uint64_t>::max();
+  while (std::getline(in, line)) {
+    // Iface Destination Gateway Flags RefCnt Use Metric Mask ...
+    std::istringstream fields(line);
+    std::string iface, dest, gateway, flags, refcnt, use, metric, mask;
+    if (!(fields >> iface >> dest >> gateway >> flags >> refcnt >> use >> metric >> mask)) {
+      continue;
+    }
+    // RTF_UP
+    if (dest != "00000000" || mask != "00000000" || (std::stoul(flags, nullptr, 16) & 0x1) == 0) {
+      continue;
+    }
+    uint64_t m = std::stoull(metric);
+    if (m < best_metric) {
+      best_metric = m;
+      best = iface;
+    }
+  }
+  return best;
+}
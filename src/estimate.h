@@ -0,0 +1,86 @@
+#ifndef AKTUALIZR_LITE_ESTIMATE
+#define AKTUALIZR_LITE_ESTIMATE
+
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <boost/filesystem.hpp>
+
+#include "config/config.h"
+#include "storage/invstorage.h"
+#include "uptane/tuf.h"
+
+class BundleCache;
+
+// The docker apps aktualizr-lite fetches along with a target, if they're in it
+std::vector<std::string> configured_apps(const PackageConfig &pacman);
+
+// What an update to a target would transfer given what's already on the
+// device. Only the app bundles are counted for docker apps, not the container
+// images Docker pulls for them when they're started.
+struct UpdateEstimate {
+  // False when the OSTree commit carries no object sizes or couldn't be fetched
+  bool known{false};
+  uint64_t ostree_bytes{0};
+  uint64_t ostree_objects{0};
+  uint64_t app_bytes{0};
+  uint64_t apps{0};
+
+  uint64_t total() const { return ostree_bytes + app_bytes; }
+  std::string str() const;
+};
+
+// One entry of the "ostree.sizes" commit metadata written by
+// `ostree commit --generate-sizes`: the object's checksum followed by its
+// archived and unpacked sizes as varints, and its type in newer versions.
+struct OstreeObjectSize {
+  std::string checksum;  // hex
+  int type{0};           // OstreeObjectType, files when the entry doesn't say
+  uint64_t archived{0};
+  uint64_t unpacked{0};
+};
+bool parse_ostree_size(const unsigned char *data, size_t len, OstreeObjectSize &out);
+
+// Works out which OSTree objects and app bundles of a target are missing
+// locally. The target's commit object is fetched on its own if needed, which
+// is all it takes to learn the size of every object in the tree. Bundles in
+// `bundles`, if given, won't be downloaded either.
+class UpdateEstimator {
+ public:
+  UpdateEstimator(const Config &config, std::shared_ptr<INvStorage> storage, const BundleCache *bundles = nullptr);
+
+  UpdateEstimate estimate(const Uptane::Target &target, const std::vector<Uptane::Target> &all_targets);
+
+ private:
+  bool estimateOstree(const std::string &commit, UpdateEstimate &res);
+  void estimateApps(const Uptane::Target &target, const std::vector<Uptane::Target> &all_targets,
+                    UpdateEstimate &res);
+
+  const Config &config_;
+  std::shared_ptr<INvStorage> storage_;
+  const BundleCache *bundles_;
+};
+
+// Holds back large updates while the device is on a metered connection.
+// Configured via [pacman] metered_interfaces (eg "wwan0,ppp0") and
+// metered_update_limit (bytes with an optional K/M/G suffix, default 0). An
+// update is deferred when the default route goes through one of the
+// interfaces and it needs more than the limit, or its size isn't known.
+struct MeteredPolicy {
+  MeteredPolicy() = default;
+  explicit MeteredPolicy(const std::map<std::string, std::string> &extra);
+
+  bool enabled() const { return !interfaces.empty(); }
+  bool metered(const std::string &iface) const;
+  bool allows(const UpdateEstimate &estimate, const std::string &iface) const;
+
+  // The interface of the IPv4 default route with the lowest metric, "" if none
+  static std::string defaultInterface(const boost::filesystem::path &routes = "/proc/net/route");
+
+  std::vector<std::string> interfaces;
+  uint64_t limit{0};
+};
+
+#endif  // AKTUALIZR_LITE_ESTIMATE
@@ -0,0 +1,113 @@
+#include <gtest/gtest.h>
+
+#include <ostree.h>
+
+#include "estimate.h"
+#include "utilities/utils.h"
+
+static std::vector<unsigned char> size_entry(uint64_t archived, uint64_t unpacked, int type = -1) {
+  std::vector<unsigned char> entry;
+  for (unsigned char i = 0; i < 32; i++) {
+    entry.push_back(i);
+  }
+  for (uint64_t v : {archived, unpacked}) {
+    do {
+      unsigned char b = v & 0x7f;
+      v >>= 7;
+      entry.push_back(v != 0 ? (b | 0x80) : b);
+    } while (v != 0);
+  }
+  if (type >= 0) {
+    entry.push_back(static_cast<unsigned char>(type));
+  }
+  return entry;
+}
+
+TEST(estimate, parse_ostree_size) {
+  OstreeObjectSize obj;
+  // As written by older versions of ostree, files only
+  auto entry = size_entry(300, 1ULL << 40);
+  ASSERT_TRUE(parse_ostree_size(entry.data(), entry.size(), obj));
+  ASSERT_EQ("000102030405060708090a0b0c0d0e0f101112131415161718191a1b1c1d1e1f", obj.checksum);
+  ASSERT_EQ(300, obj.archived);
+  ASSERT_EQ(1ULL << 40, obj.unpacked);
+  ASSERT_EQ(OSTREE_OBJECT_TYPE_FILE, obj.type);
+
+  entry = size_entry(1, 2, OSTREE_OBJECT_TYPE_DIR_TREE);
+  ASSERT_TRUE(parse_ostree_size(entry.data(), entry.size(), obj));
+  ASSERT_EQ(OSTREE_OBJECT_TYPE_DIR_TREE, obj.type);
+
+  // Truncated, unterminated varint, trailing garbage and a bogus type
+  ASSERT_FALSE(parse_ostree_size(entry.data(), 31, obj));
+  entry = size_entry(1, 200);
+  ASSERT_FALSE(parse_ostree_size(entry.data(), entry.size() - 1, obj));
+  entry = size_entry(1, 2, OSTREE_OBJECT_TYPE_FILE);
+  entry.push_back(0);
+  ASSERT_FALSE(parse_ostree_size(entry.data(), entry.size(), obj));
+  entry = size_entry(1, 2, 99);
+  ASSERT_FALSE(parse_ostree_size(entry.data(), entry.size(), obj));
+}
+
+TEST(estimate, str) {
+  UpdateEstimate estimate;
+  ASSERT_EQ("unknown", estimate.str());
+  estimate.known = true;
+  estimate.ostree_bytes = 3 * 1024 * 1024;
+  estimate.ostree_objects = 12;
+  estimate.app_bytes = 512 * 1024;
+  estimate.apps = 1;
+  ASSERT_EQ("3.5 MiB (12 OSTree objects, 1 app bundles)", estimate.str());
+}
+
+TEST(estimate, metered_policy) {
+  MeteredPolicy none(std::map<std::string, std::string>{});
+  ASSERT_FALSE(none.enabled());
+  ASSERT_TRUE(none.allows(UpdateEstimate(), "wwan0"));
+
+  MeteredPolicy policy(std::map<std::string, std::string>{{"metered_interfaces", "wwan0, ppp0"},
+                                                          {"metered_update_limit", "10M"}});
+  ASSERT_TRUE(policy.enabled());
+  ASSERT_TRUE(policy.metered("ppp0"));
+  ASSERT_FALSE(policy.metered("eth0"));
+  ASSERT_FALSE(policy.metered(""));
+
+  UpdateEstimate estimate;
+  estimate.known = true;
+  estimate.ostree_bytes = 10 * 1024 * 1024;
+  ASSERT_TRUE(policy.allows(estimate, "wwan0"));
+  estimate.app_bytes = 1;
+  ASSERT_FALSE(policy.allows(estimate, "wwan0"));
+  ASSERT_TRUE(policy.allows(estimate, "eth0"));
+  // Unknown sizes are assumed to be too big
+  estimate = UpdateEstimate();
+  ASSERT_FALSE(policy.allows(estimate, "wwan0"));
+
+  ASSERT_THROW(MeteredPolicy(std::map<std::string, std::string>{{"metered_update_limit", "lots"}}),
+               std::invalid_argument);
+}
+
+TEST(estimate, default_interface) {
+  TemporaryDirectory dir;
+  auto routes = dir / "route";
+  ASSERT_EQ("", MeteredPolicy::defaultInterface(routes));
+
+  std::string header("Iface\tDestination\tGateway \tFlags\tRefCnt\tUse\tMetric\tMask\t\tMTU\tWindow\tIRTT\n");
+  Utils::writeFile(routes, header +
+                               "eth0\t0002A8C0\t00000000\t0001\t0\t0\t100\t00FFFFFF\t0\t0\t0\n"
+                               "wwan0\t00000000\t0101A8C0\t0003\t0\t0\t700\t00000000\t0\t0\t0\n");
+  ASSERT_EQ("wwan0", MeteredPolicy::defaultInterface(routes));
+
+  // The route with the lowest metric wins, routes that are down don't count
+  Utils::writeFile(routes, header +
+                               "wwan0\t00000000\t0101A8C0\t0003\t0\t0\t700\t00000000\t0\t0\t0\n"
+                               "eth0\t00000000\t0102A8C0\t0003\t0\t0\t100\t00000000\t0\t0\t0\n"
+                               "wlan0\t00000000\t0103A8C0\t0002\t0\t0\t50\t00000000\t0\t0\t0\n");
+  ASSERT_EQ("eth0", MeteredPolicy::defaultInterface(routes));
+}
+
+#ifndef __NO_MAIN__
+int main(int argc, char **argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
+#endif
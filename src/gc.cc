@@ -0,0 +1,262 @@
+#include <sys/stat.h>
+
+#include <cstdio>
+#include <stdexcept>
+
+#include "download.h"
+#include "gc.h"
+#include "logging/logging.h"
+#include "package_manager/ostreemanager.h"
+
+GcBudget::GcBudget(const std::map<std::string, std::string> &extra) {
+  auto it = extra.find("gc_time_budget_ms");
+  if (it != extra.end()) {
+    time = std::chrono::milliseconds(std::stoul(it->second));
+  }
+  it = extra.find("gc_io_budget");
+  if (it != extra.end()) {
+    bytes = parse_size(it->second);
+  }
+}
+
+RepoGc::RepoGc(boost::filesystem::path sysroot, std::vector<std::string> keep)
+    : sysroot_path_(std::move(sysroot)), keep_(std::move(keep)) {}
+
+// Commits that must be kept along with everything they reference
+std::set<std::string> RepoGc::rootCommits() {
+  std::set<std::string> roots(keep_.begin(), keep_.end());
+  roots.erase("");
+
+  GPtrArray *deployments = ostree_sysroot_get_deployments(sysroot_.get());
+  for (guint i = 0; i < deployments->len; i++) {
+    auto *deployment = static_cast<OstreeDeployment *>(deployments->pdata[i]);
+    roots.insert(ostree_deployment_get_csum(deployment));
+  }
+  g_ptr_array_unref(deployments);
+
+  GHashTable *refs = nullptr;
+  GError *error = nullptr;
+  if (!ostree_repo_list_refs(repo_.get(), nullptr, &refs, nullptr, &error)) {
+    std::string msg = error->message;
+    g_error_free(error);
+    throw std::runtime_error("Unable to list OSTree refs: " + msg);
+  }
+  GHashTableIter it;
+  gpointer key;
+  gpointer value;
+  g_hash_table_iter_init(&it, refs);
+  while (g_hash_table_iter_next(&it, &key, &value)) {
+    roots.insert(static_cast<const char *>(value));
+  }
+  g_hash_table_unref(refs);
+  return roots;
+}
+
+static std::string object_key(const std::string &checksum, OstreeObjectType type) {
+  return checksum + "." + ostree_object_type_to_string(type);
+}
+
+static std::string checksum_of(GVariant *bytes) {
+  char *checksum = ostree_checksum_from_bytes_v(bytes);
+  std::string res(checksum);
+  g_free(checksum);
+  g_variant_unref(bytes);
+  return res;
+}
+
+// Marks one commit or directory tree reachable along with what it directly
+// references. The subdirectories are traversed by later steps.
+void RepoGc::traverse(const std::string &checksum, OstreeObjectType type) {
+  if (!reachable_.insert(object_key(checksum, type)).second) {
+    return;  // shared by a tree already traversed
+  }
+  GVariant *obj = nullptr;
+  GError *error = nullptr;
+  if (!ostree_repo_load_variant_if_exists(repo_.get(), type, checksum.c_str(), &obj, &error)) {
+    std::string msg = error->message;
+    g_error_free(error);
+    throw std::runtime_error("Unable to traverse " + object_key(checksum, type) + ": " + msg);
+  }
+  if (obj == nullptr) {
+    // A kept commit that was never pulled, or a partial one
+    LOG_DEBUG << "Garbage collection skipping " << object_key(checksum, type) << ", it's not in the repo";
+    return;
+  }
+  if (type == OSTREE_OBJECT_TYPE_COMMIT) {
+    // Depth 0: history of a kept commit isn't needed on the device
+    to_traverse_.emplace_back(checksum_of(g_variant_get_child_value(obj, 6)), OSTREE_OBJECT_TYPE_DIR_TREE);
+    reachable_.insert(object_key(checksum_of(g_variant_get_child_value(obj, 7)), OSTREE_OBJECT_TYPE_DIR_META));
+  } else {
+    GVariant *files = g_variant_get_child_value(obj, 0);
+    for (gsize i = 0; i < g_variant_n_children(files); i++) {
+      const char *name;
+      GVariant *csum;
+      g_variant_get_child(files, i, "(&s@ay)", &name, &csum);
+      reachable_.insert(object_key(checksum_of(csum), OSTREE_OBJECT_TYPE_FILE));
+    }
+    g_variant_unref(files);
+    GVariant *dirs = g_variant_get_child_value(obj, 1);
+    for (gsize i = 0; i < g_variant_n_children(dirs); i++) {
+      const char *name;
+      GVariant *tree;
+      GVariant *meta;
+      g_variant_get_child(dirs, i, "(&s@ay@ay)", &name, &tree, &meta);
+      to_traverse_.emplace_back(checksum_of(tree), OSTREE_OBJECT_TYPE_DIR_TREE);
+      reachable_.insert(object_key(checksum_of(meta), OSTREE_OBJECT_TYPE_DIR_META));
+    }
+    g_variant_unref(dirs);
+  }
+  g_variant_unref(obj);
+}
+
+// Adds the unreachable loose objects of one objects/XX directory to the candidates
+void RepoGc::list(const std::string &prefix) {
+  static const std::map<std::string, OstreeObjectType> types = {
+      {"file", OSTREE_OBJECT_TYPE_FILE},       {"filez", OSTREE_OBJECT_TYPE_FILE},
+      {"dirtree", OSTREE_OBJECT_TYPE_DIR_TREE}, {"dirmeta", OSTREE_OBJECT_TYPE_DIR_META},
+      {"commit", OSTREE_OBJECT_TYPE_COMMIT},
+  };
+  boost::system::error_code ec;
+  for (boost::filesystem::directory_iterator it(objects_ / prefix, ec), end; !ec && it != end; it.increment(ec)) {
+    std::string name = it->path().filename().string();
+    auto dot = name.find('.');
+    // Detached commit metadata goes along with its commit
+    auto type = dot == std::string::npos ? types.end() : types.find(name.substr(dot + 1));
+    if (dot != 62 || type == types.end()) {
+      continue;
+    }
+    std::string checksum = prefix + name.substr(0, dot);
+    if (reachable_.count(object_key(checksum, type->second)) == 0) {
+      candidates_.push_back(Candidate{checksum, type->second, it->path()});
+    }
+  }
+}
+
+bool RepoGc::step(uint64_t &bytes) {
+  GError *error = nullptr;
+  switch (stage_) {
+    case Stage::kScan: {
+      sysroot_ = OstreeManager::LoadSysroot(sysroot_path_);
+      OstreeRepo *repo = nullptr;
+      if (!ostree_sysroot_get_repo(sysroot_.get(), &repo, nullptr, &error)) {
+        std::string msg = error->message;
+        g_error_free(error);
+        throw std::runtime_error("Unable to open OSTree repo: " + msg);
+      }
+      repo_.reset(repo);
+      char *path = g_file_get_path(ostree_repo_get_path(repo_.get()));
+      objects_ = boost::filesystem::path(path) / "objects";
+      g_free(path);
+      // Coarse, like the timestamps of the files written from now on
+      clock_gettime(CLOCK_REALTIME_COARSE, &started_);
+      roots_ = rootCommits();
+      to_traverse_.clear();
+      for (const auto &commit : roots_) {
+        to_traverse_.emplace_back(commit, OSTREE_OBJECT_TYPE_COMMIT);
+      }
+      reachable_.clear();
+      next_dir_ = 0;
+      stage_ = Stage::kTraverse;
+      break;
+    }
+    case Stage::kTraverse: {
+      if (to_traverse_.empty()) {
+        stage_ = Stage::kList;
+        break;
+      }
+      auto obj = to_traverse_.back();
+      to_traverse_.pop_back();
+      traverse(obj.first, obj.second);
+      break;
+    }
+    case Stage::kList: {
+      if (next_dir_ == 256) {
+        reachable_.clear();
+        LOG_INFO << "Garbage collection found " << candidates_.size() << " unused OSTree objects";
+        stage_ = Stage::kPrune;
+        break;
+      }
+      char prefix[3];
+      snprintf(prefix, sizeof(prefix), "%02x", next_dir_++);
+      list(prefix);
+      break;
+    }
+    case Stage::kPrune: {
+      if (next_ >= candidates_.size()) {
+        stage_ = Stage::kDone;
+        break;
+      }
+      const auto &obj = candidates_[next_++];
+      struct stat st {};
+      if (lstat(obj.path.c_str(), &st) != 0) {
+        break;  // removed by something else in the meantime
+      }
+      if (st.st_ctim.tv_sec > started_.tv_sec ||
+          (st.st_ctim.tv_sec == started_.tv_sec && st.st_ctim.tv_nsec >= started_.tv_nsec)) {
+        LOG_DEBUG << "Keeping " << obj.checksum << ", it was written since garbage collection started";
+        break;
+      }
+      guint64 size = 0;
+      if (!ostree_repo_query_object_storage_size(repo_.get(), obj.type, obj.checksum.c_str(), &size, nullptr,
+                                                 &error)) {
+        // Most likely removed by something else in the meantime
+        LOG_DEBUG << "Unable to query size of " << obj.checksum << ": " << error->message;
+        g_error_free(error);
+        break;
+      }
+      if (!ostree_repo_delete_object(repo_.get(), obj.type, obj.checksum.c_str(), nullptr, &error)) {
+        LOG_WARNING << "Unable to delete OSTree object " << obj.checksum << ": " << error->message;
+        g_error_free(error);
+        break;
+      }
+      bytes += size;
+      reclaimed_ += size;
+      removed_++;
+      break;
+    }
+    case Stage::kDone:
+      return true;
+  }
+  return stage_ == Stage::kDone;
+}
+
+bool RepoGc::reloadSysroot() {
+  gboolean changed = 0;
+  GError *error = nullptr;
+  if (!ostree_sysroot_load_if_changed(sysroot_.get(), &changed, nullptr, &error)) {
+    LOG_WARNING << "Unable to reload OSTree sysroot: " << error->message;
+    g_error_free(error);
+    return false;
+  }
+  return true;
+}
+
+bool RepoGc::run(const GcBudget &budget) {
+  if (stage_ == Stage::kDone) {
+    return true;
+  }
+  auto deadline = std::chrono::steady_clock::now() + budget.time;
+
+  uint64_t bytes = 0;
+  try {
+    if (stage_ != Stage::kScan && (!reloadSysroot() || rootCommits() != roots_)) {
+      // Something was deployed or pulled since the scan, objects we think are
+      // unused may not be any more.
+      LOG_INFO << "OSTree deployments or refs changed, restarting garbage collection";
+      candidates_.clear();
+      next_ = 0;
+      stage_ = Stage::kScan;
+    }
+
+    do {
+      if (step(bytes)) {
+        return true;
+      }
+    } while (std::chrono::steady_clock::now() < deadline && (budget.bytes == 0 || bytes < budget.bytes));
+  } catch (const std::exception &ex) {
+    LOG_ERROR << "Garbage collection failed: " << ex.what();
+    stage_ = Stage::kDone;
+    return true;
+  }
+  return false;
+}
@@ -0,0 +1,86 @@
+#ifndef AKTUALIZR_LITE_GC
+#define AKTUALIZR_LITE_GC
+
+#include <time.h>
+
+#include <chrono>
+#include <map>
+#include <set>
+#include <string>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+#include <ostree.h>
+#include <boost/filesystem.hpp>
+
+#include "utilities/utils.h"
+
+// How much work a garbage collector may do per daemon loop. Configured via
+// [pacman] gc_time_budget_ms (0 disables collection) and gc_io_budget (bytes
+// removed per loop, eg "64M", unlimited by default).
+struct GcBudget {
+  GcBudget() = default;
+  explicit GcBudget(const std::map<std::string, std::string> &extra);
+
+  bool enabled() const { return time.count() > 0; }
+
+  std::chrono::milliseconds time{0};
+  uint64_t bytes{0};
+};
+
+// Incrementally removes OSTree objects that are no longer reachable from any
+// deployment (so the booted, rollback and pending targets are kept), any ref
+// or the extra commits passed in. Each call to run() does a slice of work
+// bounded by the budget so that the I/O is spread across daemon loops: the
+// trees of the kept commits are walked a directory at a time and the loose
+// objects listed one objects/XX directory at a time. Kept commits that
+// aren't in the repo are skipped. An object written since the scan started
+// is never removed, so content pulled meanwhile without a ref is safe even
+// by something that doesn't take the download lock.
+class RepoGc {
+ public:
+  RepoGc(boost::filesystem::path sysroot, std::vector<std::string> keep);
+  RepoGc(const RepoGc &) = delete;
+  RepoGc &operator=(const RepoGc &) = delete;
+
+  // Returns true once collection has completed
+  bool run(const GcBudget &budget);
+
+  uint64_t reclaimed() const { return reclaimed_; }
+  uint64_t removed() const { return removed_; }
+
+ private:
+  enum class Stage { kScan, kTraverse, kList, kPrune, kDone };
+  struct Candidate {
+    std::string checksum;
+    OstreeObjectType type;
+    boost::filesystem::path path;
+  };
+
+  std::set<std::string> rootCommits();
+  bool reloadSysroot();
+  bool step(uint64_t &bytes);
+  void traverse(const std::string &checksum, OstreeObjectType type);
+  void list(const std::string &prefix);
+
+  boost::filesystem::path sysroot_path_;
+  std::vector<std::string> keep_;
+  Stage stage_{Stage::kScan};
+
+  GObjectUniquePtr<OstreeSysroot> sysroot_;
+  GObjectUniquePtr<OstreeRepo> repo_;
+  boost::filesystem::path objects_;
+  struct timespec started_ {};
+  std::set<std::string> roots_;
+  std::vector<std::pair<std::string, OstreeObjectType>> to_traverse_;
+  std::unordered_set<std::string> reachable_;
+  int next_dir_{0};
+  std::vector<Candidate> candidates_;
+  size_t next_{0};
+
+  uint64_t reclaimed_{0};
+  uint64_t removed_{0};
+};
+
+#endif  // AKTUALIZR_LITE_GC
@@ -2,6 +2,10 @@
 #include <sys/file.h>
 #include <unistd.h>
 
+#include <algorithm>
+#include <set>
+
+#include <boost/algorithm/string/join.hpp>
 #include <boost/uuid/uuid_generators.hpp>
 #include <boost/uuid/uuid_io.hpp>
 
@@ -153,10 +157,33 @@ static std::pair<Uptane::Target, data::ResultCode::Numeric> finalizeIfNeeded(Pac
 LiteClient::LiteClient(Config &config_in)
     : config(std::move(config_in)), primary_ecu(Uptane::EcuSerial::Unknown(), "") {
   std::string pkey;
-  storage = INvStorage::newStorage(config.storage);
+  const std::map<std::string, std::string> raw = config.pacman.extra;
+  meta_compression = MetaCompressionConfig(raw);
+  meta_stats = std::make_shared<MetaCompressionStats>();
+
+  // newStorage() migrates older storage, MetaStorage then reads and writes the
+  // same database. It's used even when not compressing so that metadata saved
+  // compressed before can still be read.
+  auto sql_storage = [this]() {
+    std::shared_ptr<INvStorage> sql = INvStorage::newStorage(config.storage);
+    if (config.storage.type == StorageType::kSqlite) {
+      sql = std::make_shared<MetaStorage>(config.storage, meta_compression.compress_storage, meta_stats);
+    }
+    return sql;
+  };
+  if (LiteStorageConfig(raw).enabled) {
+    // SQLite is only opened the once, to copy what it holds
+    auto lite = std::make_shared<LiteStorage>(config.storage);
+    if (!lite->imported()) {
+      bool existing = boost::filesystem::exists(config.storage.sqldb_path.get(config.storage.path));
+      lite->importFrom(existing ? sql_storage().get() : nullptr);
+    }
+    storage = lite;
+  } else {
+    storage = sql_storage();
+  }
   storage->importData(config.import);
 
-  const std::map<std::string, std::string> raw = config.pacman.extra;
   if (raw.count("tags") == 1) {
     std::string val = raw.at("tags");
     if (val.length() > 0) {
@@ -164,6 +191,19 @@ LiteClient::LiteClient(Config &config_in)
       boost::split(tags, val, boost::is_any_of(", "), boost::token_compress_on);
     }
   }
+  if (raw.count("download_rate_limit") == 1) {
+    download_rate = RateSchedule(raw.at("download_rate_limit"));
+  }
+  update_limits = ResourceLimits(raw);
+  metered = MeteredPolicy(raw);
+  verify = VerifyConfig(raw);
+  preempt = PreemptConfig(raw);
+  cancel = std::make_shared<UpdateCancel>();
+  state = std_::make_unique<LiteStore>(statePath(config));
+  meta_cache = std_::make_unique<MetaCache>();
+  if (BundleCacheConfig(raw).enabled && !configured_apps(config.pacman).empty()) {
+    bundle_cache = std_::make_unique<BundleCache>(config.storage.path / "app-bundles", storage);
+  }
 
   EcuSerials ecu_serials;
   if (!storage->loadEcuSerials(&ecu_serials)) {
@@ -181,6 +221,9 @@ LiteClient::LiteClient(Config &config_in)
     storage->storeEcuSerials(ecu_serials);
   }
   primary_ecu = ecu_serials[0];
+  if (raw.count("staged_rollout") == 0 || raw.at("staged_rollout") != "0") {
+    rollout = std_::make_unique<RolloutPolicy>(primary_ecu.first.ToString());
+  }
 
   std::vector<std::string> headers;
   GObjectUniquePtr<OstreeSysroot> sysroot_smart = OstreeManager::LoadSysroot(config.pacman.sysroot);
@@ -204,7 +247,12 @@ LiteClient::LiteClient(Config &config_in)
 
   headers.emplace_back("x-ats-tags: " + boost::algorithm::join(tags, ","));
 
-  http_client = std::make_shared<HttpClient>(&headers);
+  if (meta_compression.enabled()) {
+    headers.emplace_back("Accept-Encoding: identity");
+    http_client = std::make_shared<MetaHttpClient>(&headers, meta_compression, meta_stats);
+  } else {
+    http_client = std::make_shared<HttpClient>(&headers);
+  }
   report_queue = std_::make_unique<ReportQueue>(config, http_client, storage);
   package_manager = PackageManagerFactory::makePackageManager(config.pacman, config.bootloader, storage, http_client);
 
@@ -214,15 +262,162 @@ LiteClient::LiteClient(Config &config_in)
   KeyManager keys(storage, config.keymanagerConfig());
   keys.copyCertsToCurl(*http_client);
 
-  primary =
-      std::make_shared<SotaUptaneClient>(config, storage, http_client, nullptr, primary_ecu.first, primary_ecu.second);
+  events_channel = std::make_shared<event::Channel>();
+  primary = std::make_shared<SotaUptaneClient>(config, storage, http_client, events_channel, primary_ecu.first,
+                                               primary_ecu.second);
 
   writeCurrentTarget(pair.first);
+  if (pair.second != data::ResultCode::Numeric::kNeedCompletion) {
+    // Finalized, rolled back or never there: the recorded target can be trusted again
+    state->remove("install-pending");
+  }
   if (pair.second != data::ResultCode::Numeric::kAlreadyProcessed) {
     notifyInstallFinished(pair.first, pair.second);
   }
 }
 
+// Same limits libaktualizr applies when fetching them
+static const int64_t kMaxTimestampSize = 64 * 1024;
+static const int64_t kMaxRootSize = 64 * 1024;
+
+// Whether the repo has a root newer than the one in storage, which rotates
+// or revokes keys. Anything but a "not found" for the next version counts.
+static bool root_rotated(HttpInterface &http, const std::string &repo_server, INvStorage &storage) {
+  std::string raw;
+  if (!storage.loadLatestRoot(&raw, Uptane::RepositoryType::Image())) {
+    return true;
+  }
+  int version;
+  try {
+    version = Utils::parseJSON(raw)["signed"]["version"].asInt();
+  } catch (const std::exception &ex) {
+    return true;
+  }
+  HttpResponse res = http.get(repo_server + "/" + std::to_string(version + 1) + ".root.json", kMaxRootSize);
+  return res.http_status_code != 404;
+}
+
+bool LiteClient::updateImageMeta() {
+  // A new snapshot or targets always comes with a new timestamp. If the repo's
+  // timestamp is byte for byte the one verified last time, nothing has expired
+  // and no new root has been published, what libaktualizr verified then is
+  // still current. The probe carries the same x-ats-* headers, so the server
+  // still sees the device check in. Until something is verified there's
+  // nothing to compare with, so the first update goes straight to
+  // libaktualizr.
+  if (meta_cache->current()) {
+    HttpResponse res = http_client->get(config.uptane.repo_server + "/timestamp.json", kMaxTimestampSize);
+    if (res.isOk() && meta_cache->verified("timestamp", res.body) &&
+        !root_rotated(*http_client, config.uptane.repo_server, *storage)) {
+      LOG_DEBUG << "Targets metadata unchanged, skipping its verification";
+      return true;
+    }
+  }
+  meta_stats->reset();
+  // libaktualizr's copy may be left part updated by a failure
+  meta_cache->clear();
+  if (!primary->updateImageMeta()) {
+    return false;
+  }
+  recordVerifiedImageMeta();
+  if (meta_compression.enabled() || meta_compression.compress_storage) {
+    LOG_INFO << "Metadata " << meta_stats->str();
+  }
+  return true;
+}
+
+bool LiteClient::checkImageMetaOffline() {
+  if (storedImageMetaVerified()) {
+    LOG_DEBUG << "Stored targets metadata unchanged, skipping its verification";
+    return true;
+  }
+  meta_cache->clear();
+  if (!primary->checkImageMetaOffline()) {
+    return false;
+  }
+  recordVerifiedImageMeta();
+  return true;
+}
+
+static const char *const kImageRoles[] = {"root", "timestamp", "snapshot", "targets"};
+
+static bool load_image_role(INvStorage &storage, const std::string &role, std::string *raw) {
+  if (role == "root") {
+    return storage.loadLatestRoot(raw, Uptane::RepositoryType::Image());
+  } else if (role == "timestamp") {
+    return storage.loadNonRoot(raw, Uptane::RepositoryType::Image(), Uptane::Role::Timestamp());
+  } else if (role == "snapshot") {
+    return storage.loadNonRoot(raw, Uptane::RepositoryType::Image(), Uptane::Role::Snapshot());
+  }
+  return storage.loadNonRoot(raw, Uptane::RepositoryType::Image(), Uptane::Role::Targets());
+}
+
+// Identifies the targets metadata and the filter applied to it by deviceTargets()
+std::string LiteClient::targetsSnapshotKey(const std::string &raw_targets) const {
+  return Crypto::sha256digest(raw_targets) + "\n" + config.provision.primary_ecu_hardware_id + "\n" +
+         boost::algorithm::join(tags, ",");
+}
+
+// The targets this device can be updated to along with the app bundles they
+// refer to, which is all aktualizr-lite ever looks up
+std::vector<Uptane::Target> LiteClient::deviceTargets(const std::vector<Uptane::Target> &all) const {
+  Uptane::HardwareIdentifier hwid(config.provision.primary_ecu_hardware_id);
+  auto usable = [this, &hwid](const Uptane::Target &t) {
+    const auto &hwids = t.hardwareIds();
+    return target_has_tags(t, tags) && std::find(hwids.begin(), hwids.end(), hwid) != hwids.end();
+  };
+  std::set<std::string> apps;
+  for (const auto &t : all) {
+    if (usable(t)) {
+      auto docker_apps = t.custom_data()["docker_apps"];
+      for (Json::ValueIterator i = docker_apps.begin(); i != docker_apps.end(); ++i) {
+        apps.insert((*i)["filename"].asString());
+      }
+    }
+  }
+  std::vector<Uptane::Target> res;
+  for (const auto &t : all) {
+    if (usable(t) || apps.count(t.filename()) > 0) {
+      res.push_back(t);
+    }
+  }
+  return res;
+}
+
+// Whether every role in storage is the one libaktualizr verified in this
+// process and is unexpired
+bool LiteClient::storedImageMetaVerified() {
+  if (!meta_cache->current()) {
+    return false;
+  }
+  std::string raw;
+  for (const char *role : kImageRoles) {
+    if (!load_image_role(*storage, role, &raw) || !meta_cache->verified(role, raw)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// The device's targets come from the snapshot when there's one for this
+// metadata, rather than copying all of libaktualizr's
+void LiteClient::recordVerifiedImageMeta() {
+  std::map<std::string, std::string> roles;
+  std::string raw;
+  for (const char *role : kImageRoles) {
+    if (load_image_role(*storage, role, &raw)) {
+      roles[role] = raw;
+    }
+  }
+  meta_cache->record(roles);
+  // raw now holds the targets metadata
+  std::string key = targetsSnapshotKey(raw);
+  if (!load_targets_snapshot(targetsSnapshotPath(config), key, targets)) {
+    targets = primary->allTargets();
+    save_targets_snapshot(targetsSnapshotPath(config), key, deviceTargets(targets));
+  }
+}
+
 void LiteClient::notify(const Uptane::Target &t, std::unique_ptr<ReportEvent> event) {
   if (!config.tls.server.empty()) {
     event->custom["targetName"] = t.filename();
@@ -232,19 +427,41 @@ void LiteClient::notify(const Uptane::Target &t, std::unique_ptr<ReportEvent> ev
 }
 
 void LiteClient::notifyDownloadStarted(const Uptane::Target &t) {
+  if (progress_cb) {
+    progress_cb(t, "downloading", 0);
+  }
   notify(t, std_::make_unique<EcuDownloadStartedReport>(primary_ecu.first, t.correlation_id()));
 }
 
 void LiteClient::notifyDownloadFinished(const Uptane::Target &t, bool success) {
+  if (progress_cb) {
+    progress_cb(t, success ? "downloaded" : "download-failed", success ? 100 : 0);
+  }
   notify(t, std_::make_unique<EcuDownloadCompletedReport>(primary_ecu.first, t.correlation_id(), success));
 }
 
+// No event, the next attempt reports the download again under the same
+// correlation id
+void LiteClient::notifyDownloadCancelled(const Uptane::Target &t) {
+  if (progress_cb) {
+    progress_cb(t, "download-cancelled", 0);
+  }
+}
+
 void LiteClient::notifyInstallStarted(const Uptane::Target &t) {
+  if (progress_cb) {
+    progress_cb(t, "installing", 0);
+  }
   notify(t, std_::make_unique<EcuInstallationStartedReport>(primary_ecu.first, t.correlation_id()));
 }
 
 void LiteClient::notifyInstallFinished(const Uptane::Target &t, data::ResultCode::Numeric rc) {
+  if (progress_cb) {
+    bool ok = rc == data::ResultCode::Numeric::kNeedCompletion || rc == data::ResultCode::Numeric::kOk;
+    progress_cb(t, ok ? "installed" : "install-failed", 0);
+  }
   if (rc == data::ResultCode::Numeric::kNeedCompletion) {
+    state->put("install-pending", t.filename());
     notify(t, std_::make_unique<EcuInstallationAppliedReport>(primary_ecu.first, t.correlation_id()));
   } else if (rc == data::ResultCode::Numeric::kOk) {
     writeCurrentTarget(t);
@@ -272,9 +489,89 @@ void LiteClient::writeCurrentTarget(const Uptane::Target &t) {
     ss << "CONTAINERS_SHA=\"" << tmp << "\"\n";
   }
   Utils::writeFile(config.storage.path / "current-target", ss.str());
+
+  Json::Value cache;
+  cache["name"] = t.filename();
+  cache["target"] = t.toDebugJson();
+  state->put("current-target", Utils::jsonToStr(cache));
 }
 
-static std::unique_ptr<Lock> create_lock(boost::filesystem::path lockfile) {
+// Read-only commands like "status" only need the current target. Rather than
+// paying for storage, sysroot and network setup, they can use what the last
+// LiteClient recorded as long as the device is still booted on it and no
+// install awaits finalizing. Anything else (no record, a pending update that
+// was rebooted into or rolled back from) needs the full client to finalize
+// the installation. A rollback boots the recorded target again, so only the
+// marker tells it apart.
+boost::optional<Uptane::Target> LiteClient::cachedCurrentTarget(const Config &config) {
+  LiteStore store(statePath(config), true);
+  std::string raw;
+  if (store.get("install-pending", raw) || !store.get("current-target", raw)) {
+    return boost::none;
+  }
+  Json::Value cache = Utils::parseJSON(raw);
+  Uptane::Target target(cache["name"].asString(), cache["target"]);
+  if (!target.IsValid() || target.sha256Hash().empty()) {
+    return boost::none;
+  }
+
+  GObjectUniquePtr<OstreeSysroot> sysroot_smart = OstreeManager::LoadSysroot(config.pacman.sysroot);
+  OstreeDeployment *booted_deployment = ostree_sysroot_get_booted_deployment(sysroot_smart.get());
+  if (booted_deployment == nullptr || target.sha256Hash() != ostree_deployment_get_csum(booted_deployment)) {
+    return boost::none;
+  }
+  return target;
+}
+
+// A checkpoint records which target is being downloaded, its correlation id
+// and the number of attempts, so that an interrupted download is picked up
+// again as the same update attempt and its objects are spared by the repo's
+// garbage collection. It holds no download state of its own: what a retry
+// doesn't fetch again is the OSTree objects already in the repo. App bundles
+// and other target files get nothing from it beyond what libaktualizr does
+// with a file left in storage.
+bool LiteClient::resumeDownload(Uptane::Target &t) {
+  std::string raw;
+  if (!state->get("download-checkpoint", raw)) {
+    return false;
+  }
+  Json::Value data = Utils::parseJSON(raw);
+  if (data["name"].asString() != t.filename() || data["sha256"].asString() != t.sha256Hash()) {
+    LOG_INFO << "Discarding download checkpoint of " << data["name"].asString();
+    clearDownloadCheckpoint();
+    return false;
+  }
+  LOG_INFO << "Resuming download of " << t.filename() << " (attempt " << data["attempts"].asUInt() + 1 << ")";
+  t.setCorrelationId(data["correlation_id"].asString());
+  return true;
+}
+
+void LiteClient::checkpointDownload(const Uptane::Target &t) {
+  std::string raw;
+  Json::Value data;
+  if (state->get("download-checkpoint", raw)) {
+    data = Utils::parseJSON(raw);
+  }
+  data["name"] = t.filename();
+  data["sha256"] = t.sha256Hash();
+  data["correlation_id"] = t.correlation_id();
+  data["attempts"] = data["attempts"].asUInt() + 1;
+  state->put("download-checkpoint", Utils::jsonToStr(data));
+}
+
+// Returns the sha256 of the target an interrupted download was fetching
+std::string LiteClient::checkpointedDownload() {
+  std::string raw;
+  if (!state->get("download-checkpoint", raw)) {
+    return "";
+  }
+  return Utils::parseJSON(raw)["sha256"].asString();
+}
+
+void LiteClient::clearDownloadCheckpoint() { state->remove("download-checkpoint"); }
+
+static std::unique_ptr<Lock> create_lock(boost::filesystem::path lockfile,
+                                         const std::function<void(bool waiting)> &wait_cb) {
   if (lockfile.empty()) {
     // Just return a dummy one that will safely "close"
     return std_::make_unique<Lock>(-1);
@@ -286,7 +583,17 @@ static std::unique_ptr<Lock> create_lock(boost::filesystem::path lockfile) {
     return nullptr;
   }
   LOG_INFO << "Acquiring lock";
-  if (flock(fd, LOCK_EX) < 0) {
+  int rc = flock(fd, LOCK_EX | LOCK_NB);
+  if (rc < 0 && errno == EWOULDBLOCK) {
+    if (wait_cb) {
+      wait_cb(true);
+    }
+    rc = flock(fd, LOCK_EX);
+    if (wait_cb) {
+      wait_cb(false);
+    }
+  }
+  if (rc < 0) {
     LOG_ERROR << "Unable to acquire lock on " << lockfile;
     close(fd);
     return nullptr;
@@ -294,8 +601,8 @@ static std::unique_ptr<Lock> create_lock(boost::filesystem::path lockfile) {
   return std_::make_unique<Lock>(fd);
 }
 
-std::unique_ptr<Lock> LiteClient::getDownloadLock() { return create_lock(download_lockfile); }
-std::unique_ptr<Lock> LiteClient::getUpdateLock() { return create_lock(update_lockfile); }
+std::unique_ptr<Lock> LiteClient::getDownloadLock() { return create_lock(download_lockfile, lock_wait_cb); }
+std::unique_ptr<Lock> LiteClient::getUpdateLock() { return create_lock(update_lockfile, lock_wait_cb); }
 
 void generate_correlation_id(Uptane::Target &t) {
   std::string id = t.custom_version();
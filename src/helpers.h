@@ -5,8 +5,20 @@
 
 #include <string.h>
 
+#include "bundlecache.h"
+#include "download.h"
+#include "estimate.h"
+#include "litestorage.h"
+#include "litestore.h"
+#include "metacache.h"
+#include "metacompress.h"
+#include "preempt.h"
 #include "primary/sotauptaneclient.h"
+#include "resources.h"
+#include "rollout.h"
+#include "snapshot.h"
 #include "uptane/tuf.h"
+#include "verify.h"
 
 struct Version {
   std::string raw_ver;
@@ -40,14 +52,45 @@ struct LiteClient {
   std::pair<Uptane::EcuSerial, Uptane::HardwareIdentifier> primary_ecu;
   std::unique_ptr<ReportQueue> report_queue;
   std::shared_ptr<HttpClient> http_client;
+  std::shared_ptr<event::Channel> events_channel;
+  // Optional observer of update progress, eg the daemon's control socket
+  std::function<void(const Uptane::Target& t, const std::string& state, unsigned int progress)> progress_cb;
   boost::filesystem::path download_lockfile;
   boost::filesystem::path update_lockfile;
+  // Optional, called before and after blocking on one of the lock files
+  std::function<void(bool waiting)> lock_wait_cb;
+  RateSchedule download_rate;
+  ResourceLimits update_limits;
+  MeteredPolicy metered;
+  VerifyConfig verify;
+  PreemptConfig preempt;
+  // Calls off the download or verification of the update under way
+  std::shared_ptr<UpdateCancel> cancel;
+  MetaCompressionConfig meta_compression;
+  std::shared_ptr<MetaCompressionStats> meta_stats;
+  // aktualizr-lite's own records, libaktualizr's are in `storage`
+  std::unique_ptr<LiteStore> state;
+  std::unique_ptr<MetaCache> meta_cache;
+  // nullptr unless app_bundle_cache is set and docker apps are configured
+  std::unique_ptr<BundleCache> bundle_cache;
+  std::vector<Uptane::Target> targets;
+  // nullptr when staged rollouts are ignored
+  std::unique_ptr<RolloutPolicy> rollout;
 
   std::unique_ptr<Lock> getDownloadLock();
   std::unique_ptr<Lock> getUpdateLock();
 
+  // Wrappers of the SotaUptaneClient calls that skip verifying metadata
+  // identical to what libaktualizr verified earlier in this process.
+  // allTargets() is only valid after one of them has succeeded, and may then
+  // only hold deviceTargets().
+  bool updateImageMeta();
+  bool checkImageMetaOffline();
+  const std::vector<Uptane::Target>& allTargets() const { return targets; }
+
   void notifyDownloadStarted(const Uptane::Target& t);
   void notifyDownloadFinished(const Uptane::Target& t, bool success);
+  void notifyDownloadCancelled(const Uptane::Target& t);
   void notifyInstallStarted(const Uptane::Target& t);
   void notifyInstallFinished(const Uptane::Target& t, data::ResultCode::Numeric rc);
 
@@ -55,6 +98,20 @@ struct LiteClient {
   bool dockerAppsChanged();
   void storeDockerParamsDigest();
   void writeCurrentTarget(const Uptane::Target& t);
+  static boost::filesystem::path statePath(const Config& config) { return config.storage.path / "lite-state.log"; }
+  static boost::filesystem::path targetsSnapshotPath(const Config& config) {
+    return config.storage.path / "lite-targets.snap";
+  }
+  static boost::optional<Uptane::Target> cachedCurrentTarget(const Config& config);
+
+  bool resumeDownload(Uptane::Target& t);
+  void checkpointDownload(const Uptane::Target& t);
+  std::string checkpointedDownload();
+  void clearDownloadCheckpoint();
+  bool storedImageMetaVerified();
+  std::string targetsSnapshotKey(const std::string& raw_targets) const;
+  std::vector<Uptane::Target> deviceTargets(const std::vector<Uptane::Target>& all) const;
+  void recordVerifiedImageMeta();
 };
 
 bool should_compare_docker_apps(const Config& config);
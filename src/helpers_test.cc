@@ -1,6 +1,10 @@
 #include <gtest/gtest.h>
 
+#include <thread>
+
+#include "gc.h"
 #include "helpers.h"
+#include "package_manager/ostreemanager.h"
 
 static boost::filesystem::path test_sysroot;
 
@@ -51,6 +55,87 @@ TEST(helpers, lite_client_finalize) {
   ASSERT_FALSE(target.MatchHash(LiteClient(config).primary->getCurrent().hashes()[0]));
 }
 
+// With lite_storage the SQL storage is copied once and left alone after
+TEST(helpers, lite_storage) {
+  TemporaryDirectory cfg_dir;
+
+  Config config;
+  config.storage.path = cfg_dir.Path();
+  config.pacman.type = PACKAGE_MANAGER_OSTREEDOCKERAPP;
+  config.pacman.sysroot = test_sysroot;
+  config.pacman.extra["lite_storage"] = "1";
+  StorageConfig storage_config = config.storage;
+
+  Json::Value target_json;
+  target_json["hashes"]["sha256"] = "deadbeef";
+  target_json["custom"]["targetFormat"] = "OSTREE";
+  target_json["length"] = 0;
+  Uptane::Target target("test-lite-storage", target_json);
+  INvStorage::newStorage(storage_config)->savePrimaryInstalledVersion(target, InstalledVersionUpdateMode::kPending);
+
+  setenv("OSTREE_HASH", "deadbeef", 1);
+  {
+    LiteClient client(config);
+    ASSERT_NE(nullptr, std::dynamic_pointer_cast<LiteStorage>(client.storage));
+    ASSERT_TRUE(target.MatchHash(client.primary->getCurrent().hashes()[0]));
+  }
+
+  boost::optional<Uptane::Target> current;
+  boost::optional<Uptane::Target> pending;
+  INvStorage::newStorage(storage_config)->loadPrimaryInstalledVersions(&current, &pending);
+  ASSERT_TRUE(!!pending);
+  LiteStorage(storage_config).loadPrimaryInstalledVersions(&current, &pending);
+  ASSERT_TRUE(!!current);
+  ASSERT_EQ("test-lite-storage", current->filename());
+  ASSERT_FALSE(!!pending);
+}
+
+// Ensure read-only commands only trust the recorded target while it's booted
+TEST(helpers, cached_current_target) {
+  TemporaryDirectory cfg_dir;
+
+  Config config;
+  config.storage.path = cfg_dir.Path();
+  config.pacman.type = PACKAGE_MANAGER_OSTREEDOCKERAPP;
+  config.pacman.sysroot = test_sysroot;
+  ASSERT_FALSE(LiteClient::cachedCurrentTarget(config));
+
+  std::shared_ptr<INvStorage> storage = INvStorage::newStorage(config.storage);
+  Json::Value target_json;
+  target_json["hashes"]["sha256"] = "deadbeef";
+  target_json["custom"]["targetFormat"] = "OSTREE";
+  target_json["custom"]["version"] = "42";
+  target_json["length"] = 0;
+  Uptane::Target target("test-cached", target_json);
+  storage->savePrimaryInstalledVersion(target, InstalledVersionUpdateMode::kPending);
+
+  setenv("OSTREE_HASH", "deadbeef", 1);
+  Config client_config = config;
+  LiteClient client(client_config);
+
+  auto cached = LiteClient::cachedCurrentTarget(config);
+  ASSERT_TRUE(cached);
+  ASSERT_EQ("test-cached", cached->filename());
+  ASSERT_EQ("42", cached->custom_version());
+  ASSERT_TRUE(target.MatchTarget(*cached));
+
+  // Booted into something else - the full client has to sort it out
+  setenv("OSTREE_HASH", "abcd", 1);
+  ASSERT_FALSE(LiteClient::cachedCurrentTarget(config));
+
+  // An install awaiting a reboot, then rolled back to the recorded target
+  setenv("OSTREE_HASH", "deadbeef", 1);
+  target_json["hashes"]["sha256"] = "abcd";
+  Uptane::Target update("test-update", target_json);
+  client.notifyInstallFinished(update, data::ResultCode::Numeric::kNeedCompletion);
+  ASSERT_FALSE(LiteClient::cachedCurrentTarget(config));
+
+  // Until a full client has found it finalized
+  client_config = config;
+  LiteClient finalized(client_config);
+  ASSERT_TRUE(LiteClient::cachedCurrentTarget(config));
+}
+
 TEST(helpers, target_has_tags) {
   auto t = Uptane::Target::Unknown();
 
@@ -150,6 +235,85 @@ TEST(helpers, locking) {
   t.join();
 }
 
+TEST(helpers, download_checkpoint) {
+  TemporaryDirectory cfg_dir;
+  Config config;
+  config.storage.path = cfg_dir.Path();
+  config.pacman.sysroot = test_sysroot;
+  LiteClient client(config);
+
+  Json::Value target_json;
+  target_json["hashes"]["sha256"] = "deadbeef";
+  target_json["custom"]["targetFormat"] = "OSTREE";
+  target_json["length"] = 0;
+  Uptane::Target target("test-checkpoint", target_json);
+
+  // Nothing to resume
+  ASSERT_FALSE(client.resumeDownload(target));
+
+  // An interrupted download resumes as the same update attempt
+  generate_correlation_id(target);
+  client.checkpointDownload(target);
+  Uptane::Target resumed("test-checkpoint", target_json);
+  ASSERT_TRUE(client.resumeDownload(resumed));
+  ASSERT_EQ(target.correlation_id(), resumed.correlation_id());
+
+  // A different target discards the checkpoint
+  target_json["hashes"]["sha256"] = "abcd";
+  Uptane::Target other("test-checkpoint-2", target_json);
+  ASSERT_FALSE(client.resumeDownload(other));
+  ASSERT_FALSE(client.resumeDownload(resumed));
+
+  client.checkpointDownload(target);
+  client.clearDownloadCheckpoint();
+  ASSERT_FALSE(client.resumeDownload(resumed));
+}
+
+TEST(helpers, repo_gc) {
+  // On a copy of its own, the other tests share the fixture
+  TemporaryDirectory dir;
+  ASSERT_EQ(0, system(("cp -r " + test_sysroot.string() + " " + dir.PathString()).c_str()));
+  auto sysroot_path = dir / test_sysroot.filename();
+  auto repo = sysroot_path / "ostree/repo";
+  // A loose object nothing references
+  auto garbage = repo / "objects/00" / (std::string(62, '0') + ".dirmeta");
+  Utils::writeFile(garbage, std::string("garbage"));
+  // Anything written once collection has started is kept
+  std::this_thread::sleep_for(std::chrono::milliseconds(50));
+
+  // Along with a commit that isn't there, which doesn't stop it
+  RepoGc gc(sysroot_path, {std::string(64, 'f')});
+  GcBudget budget;  // a zero time budget does one step per run
+  int runs = 1;
+  while (!gc.run(budget)) {
+    runs++;
+    if (runs == 2) {
+      Utils::writeFile(repo / "objects/01" / (std::string(62, '0') + ".dirmeta"), std::string("pulled"));
+    }
+  }
+  ASSERT_GT(runs, 256);  // the work was spread over several runs
+  ASSERT_FALSE(boost::filesystem::exists(garbage));
+  ASSERT_TRUE(boost::filesystem::exists(repo / "objects/01" / (std::string(62, '0') + ".dirmeta")));
+  ASSERT_GE(gc.removed(), 1);
+  ASSERT_GE(gc.reclaimed(), 7);
+
+  // Deployed content is still intact
+  GObjectUniquePtr<OstreeSysroot> sysroot = OstreeManager::LoadSysroot(sysroot_path);
+  OstreeRepo *ostree_repo = nullptr;
+  ASSERT_TRUE(ostree_sysroot_get_repo(sysroot.get(), &ostree_repo, nullptr, nullptr));
+  GPtrArray *deployments = ostree_sysroot_get_deployments(sysroot.get());
+  ASSERT_GT(deployments->len, 0);
+  for (guint i = 0; i < deployments->len; i++) {
+    auto *deployment = static_cast<OstreeDeployment *>(deployments->pdata[i]);
+    GHashTable *reachable = ostree_repo_traverse_new_reachable();
+    ASSERT_TRUE(ostree_repo_traverse_commit_union(ostree_repo, ostree_deployment_get_csum(deployment), 0, reachable,
+                                                  nullptr, nullptr));
+    g_hash_table_unref(reachable);
+  }
+  g_ptr_array_unref(deployments);
+  g_object_unref(ostree_repo);
+}
+
 #ifdef BUILD_DOCKERAPP
 
 static LiteClient createClient(TemporaryDirectory &cfg_dir, std::map<std::string, std::string> extra) {
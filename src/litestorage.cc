@@ -0,0 +1,991 @@
+#include <sys/statvfs.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+
+#include <boost/algorithm/hex.hpp>
+#include <boost/algorithm/string.hpp>
+
+#include "crypto/crypto.h"
+#include "litestorage.h"
+#include "logging/logging.h"
+#include "utilities/utils.h"
+
+// Keys of the records, those of roots and non-root roles are built from these
+static const char kPrimaryKeys[] = "primary-keys";
+static const char kTlsCa[] = "tls-ca";
+static const char kTlsCert[] = "tls-cert";
+static const char kTlsPkey[] = "tls-pkey";
+static const char kDeviceId[] = "device-id";
+static const char kEcuSerials[] = "ecu-serials";
+static const char kMisconfigured[] = "misconfigured-ecus";
+static const char kEcuRegistered[] = "ecu-registered";
+static const char kNeedReboot[] = "need-reboot";
+static const char kSecondaries[] = "secondaries";
+static const char kDelegations[] = "delegations";
+static const char kInstalled[] = "installed-versions";
+static const char kEcuResults[] = "ecu-results";
+static const char kDeviceResult[] = "device-result";
+static const char kReportCounters[] = "report-counters";
+static const char kReportEvents[] = "report-events";
+static const char kImages[] = "images";
+static const char kImported[] = "imported";
+
+// What SQLStorage keeps free on top of a download
+static const uint64_t kDiskSpaceReserve = 1024 * 1024;
+
+const size_t LiteStorage::kMaxInstallationLog;
+
+LiteStorageConfig::LiteStorageConfig(const std::map<std::string, std::string> &extra) {
+  auto it = extra.find("lite_storage");
+  if (it != extra.end()) {
+    if (it->second != "0" && it->second != "1") {
+      throw std::invalid_argument("Invalid lite_storage: " + it->second);
+    }
+    enabled = it->second == "1";
+  }
+}
+
+static std::string root_key(Uptane::RepositoryType repo, const std::string &version) {
+  return "root/" + repo.toString() + "/" + version;
+}
+
+static std::string meta_key(Uptane::RepositoryType repo, const Uptane::Role &role) {
+  return "meta/" + repo.toString() + "/" + role.ToString();
+}
+
+static Json::Value result_json(const data::InstallationResult &result) {
+  Json::Value res;
+  res["success"] = result.success;
+  res["result_code"] = result.result_code.toRepr();
+  res["description"] = result.description;
+  return res;
+}
+
+static data::InstallationResult json_result(const Json::Value &json) {
+  data::InstallationResult res;
+  res.success = json["success"].asBool();
+  res.result_code = data::ResultCode::fromRepr(json["result_code"].asString());
+  res.description = json["description"].asString();
+  return res;
+}
+
+// The same fields SQLStorage keeps of an installed version
+static Json::Value installed_json(const Uptane::Target &target) {
+  Json::Value res;
+  res["name"] = target.filename();
+  res["sha256"] = target.sha256Hash();
+  res["hashes"] = Hash::encodeVector(target.hashes());
+  res["length"] = static_cast<Json::UInt64>(target.length());
+  res["custom"] = target.custom_data();
+  res["correlation_id"] = target.correlation_id();
+  return res;
+}
+
+static Uptane::Target json_installed(const Json::Value &json, const Uptane::EcuMap &ecus) {
+  Uptane::Target target(json["name"].asString(), ecus, Hash::decodeVector(json["hashes"].asString()),
+                        json["length"].asUInt64(), json["correlation_id"].asString());
+  Json::Value custom = json["custom"];
+  if (!custom.isNull()) {
+    target.updateCustom(custom);
+  }
+  return target;
+}
+
+static bool same_version(const Json::Value &entry, const Uptane::Target &target) {
+  return entry["name"].asString() == target.filename() && entry["sha256"].asString() == target.sha256Hash();
+}
+
+class LiteTargetWHandle : public StorageTargetWHandle {
+ public:
+  LiteTargetWHandle(boost::filesystem::path path, bool append) : path_(std::move(path)) {
+    stream_.open(path_.string(), std::ios::binary | (append ? std::ios::app : std::ios::trunc));
+    if (!stream_.good()) {
+      throw std::runtime_error("Unable to open " + path_.string() + " for writing");
+    }
+  }
+  ~LiteTargetWHandle() override {
+    if (stream_.is_open()) {
+      stream_.close();
+    }
+  }
+  LiteTargetWHandle(const LiteTargetWHandle &) = delete;
+  LiteTargetWHandle &operator=(const LiteTargetWHandle &) = delete;
+
+  size_t wfeed(const uint8_t *buf, size_t size) override {
+    stream_.write(reinterpret_cast<const char *>(buf), static_cast<std::streamsize>(size));
+    return stream_.good() ? size : 0;
+  }
+  void wcommit() override { stream_.close(); }
+  void wabort() override {
+    stream_.close();
+    boost::filesystem::remove(path_);
+  }
+
+ private:
+  boost::filesystem::path path_;
+  std::ofstream stream_;
+};
+
+class LiteTargetRHandle : public StorageTargetRHandle {
+ public:
+  LiteTargetRHandle(boost::filesystem::path path, uint64_t length)
+      : path_(std::move(path)), size_(boost::filesystem::file_size(path_)), length_(length) {
+    stream_.open(path_.string(), std::ios::binary);
+    if (!stream_.good()) {
+      throw std::runtime_error("Unable to open " + path_.string());
+    }
+  }
+
+  bool isPartial() const override { return size_ < length_; }
+  std::unique_ptr<StorageTargetWHandle> toWriteHandle() override {
+    return std::unique_ptr<StorageTargetWHandle>(new LiteTargetWHandle(path_, true));
+  }
+  uintmax_t rsize() const override { return size_; }
+  size_t rread(uint8_t *buf, size_t size) override {
+    stream_.read(reinterpret_cast<char *>(buf), static_cast<std::streamsize>(size));
+    return static_cast<size_t>(stream_.gcount());
+  }
+  void rclose() override { stream_.close(); }
+
+ private:
+  boost::filesystem::path path_;
+  uintmax_t size_;
+  uint64_t length_;
+  std::ifstream stream_;
+};
+
+LiteStorage::LiteStorage(const StorageConfig &config, bool readonly)
+    : INvStorage(config), images_path_(config.path / "images") {
+  if (!readonly) {
+    boost::filesystem::create_directories(config_.path);
+  }
+  store_ = std_::make_unique<LiteStore>(logPath(), readonly);
+}
+
+bool LiteStorage::loadValue(const std::string &key, std::string *value) const {
+  std::string raw;
+  if (!store_->get(key, raw)) {
+    return false;
+  }
+  if (value != nullptr) {
+    *value = std::move(raw);
+  }
+  return true;
+}
+
+Json::Value LiteStorage::loadJson(const std::string &key, const Json::Value &missing) const {
+  std::string raw;
+  if (!store_->get(key, raw)) {
+    return missing;
+  }
+  return Utils::parseJSON(raw);
+}
+
+void LiteStorage::storeJson(const std::string &key, const Json::Value &value) {
+  store_->put(key, Utils::jsonToCanonicalStr(value));
+}
+
+bool LiteStorage::imported() { return loadValue(kImported, nullptr); }
+
+void LiteStorage::importFrom(INvStorage *sql) {
+  if (imported()) {
+    return;
+  }
+  // One sync for the lot rather than one per record. The marker is the last
+  // record, so a copy cut short by a crash is made again.
+  LiteStore::Batch batch(*store_);
+  if (sql != nullptr) {
+    LOG_INFO << "Copying the SQL storage to " << logPath();
+    std::string a;
+    std::string b;
+    std::string c;
+    if (sql->loadPrimaryKeys(&a, &b)) {
+      storePrimaryKeys(a, b);
+    }
+    if (sql->loadTlsCreds(&a, &b, &c)) {
+      storeTlsCreds(a, b, c);
+    }
+    if (sql->loadDeviceId(&a)) {
+      storeDeviceId(a);
+    }
+    if (sql->loadEcuRegistered()) {
+      storeEcuRegistered();
+    }
+    bool need_reboot = false;
+    sql->loadNeedReboot(&need_reboot);
+    if (need_reboot) {
+      storeNeedReboot();
+    }
+    std::vector<MisconfiguredEcu> misconfigured;
+    if (sql->loadMisconfiguredEcus(&misconfigured)) {
+      storeMisconfiguredEcus(misconfigured);
+    }
+
+    for (Uptane::RepositoryType repo : {Uptane::RepositoryType::Director(), Uptane::RepositoryType::Image()}) {
+      if (sql->loadRoot(&a, repo, Uptane::Version())) {
+        int latest = Utils::parseJSON(a)["signed"]["version"].asInt();
+        for (int v = 1; v <= latest; v++) {
+          if (sql->loadRoot(&b, repo, Uptane::Version(v))) {
+            storeRoot(b, repo, Uptane::Version(v));
+          }
+        }
+      }
+      for (const auto &role : {Uptane::Role::Timestamp(), Uptane::Role::Snapshot(), Uptane::Role::Targets()}) {
+        if (sql->loadNonRoot(&a, repo, role)) {
+          storeNonRoot(a, repo, role);
+        }
+      }
+    }
+    std::vector<std::pair<Uptane::Role, std::string>> delegations;
+    if (sql->loadAllDelegations(delegations)) {
+      for (const auto &d : delegations) {
+        storeDelegation(d.second, d.first);
+      }
+    }
+
+    EcuSerials serials;
+    if (sql->loadEcuSerials(&serials)) {
+      storeEcuSerials(serials);
+    }
+    std::vector<SecondaryInfo> secondaries;
+    if (sql->loadSecondariesInfo(&secondaries)) {
+      for (const auto &s : secondaries) {
+        saveSecondaryInfo(s.serial, s.type, s.pub_key);
+        saveSecondaryData(s.serial, s.extra);
+      }
+    }
+
+    // The log doesn't tell which entries were installed, current or pending,
+    // so that's matched up from what SQLStorage returns for each
+    Json::Value installed(Json::objectValue);
+    for (const auto &ecu : serials) {
+      std::vector<Uptane::Target> log;
+      std::vector<Uptane::Target> installed_log;
+      boost::optional<Uptane::Target> current;
+      boost::optional<Uptane::Target> pending;
+      std::string serial = ecu.first.ToString();
+      if (!sql->loadInstallationLog(serial, &log, false) || log.empty()) {
+        continue;
+      }
+      sql->loadInstallationLog(serial, &installed_log, true);
+      sql->loadInstalledVersions(serial, &current, &pending);
+      Json::Value entries(Json::arrayValue);
+      size_t next_installed = 0;
+      int current_idx = -1;
+      int pending_idx = -1;
+      for (const auto &t : log) {
+        Json::Value entry = installed_json(t);
+        bool was_installed =
+            next_installed < installed_log.size() && same_version(entry, installed_log[next_installed]);
+        entry["installed"] = was_installed;
+        if (was_installed) {
+          next_installed++;
+        }
+        entry["current"] = false;
+        entry["pending"] = false;
+        if (!!current && same_version(entry, *current)) {
+          current_idx = static_cast<int>(entries.size());
+        }
+        if (!!pending && same_version(entry, *pending)) {
+          pending_idx = static_cast<int>(entries.size());
+        }
+        entries.append(entry);
+      }
+      if (current_idx >= 0) {
+        entries[current_idx]["current"] = true;
+      }
+      if (pending_idx >= 0) {
+        entries[pending_idx]["pending"] = true;
+      }
+      installed[serial] = entries;
+    }
+    storeJson(kInstalled, installed);
+
+    std::vector<std::pair<Uptane::EcuSerial, data::InstallationResult>> results;
+    if (sql->loadEcuInstallationResults(&results)) {
+      for (const auto &r : results) {
+        saveEcuInstallationResult(r.first, r.second);
+      }
+    }
+    data::InstallationResult device_result;
+    if (sql->loadDeviceInstallationResult(&device_result, &a, &b)) {
+      storeDeviceInstallationResult(device_result, a, b);
+    }
+    std::vector<std::pair<Uptane::EcuSerial, int64_t>> counters;
+    if (sql->loadEcuReportCounter(&counters)) {
+      for (const auto &c : counters) {
+        saveEcuReportCounter(c.first, c.second);
+      }
+    }
+    // Those not yet sent
+    Json::Value events(Json::arrayValue);
+    int64_t id_max = 0;
+    if (sql->loadReportEvents(&events, &id_max)) {
+      for (const auto &e : events) {
+        saveReportEvent(e);
+      }
+    }
+  }
+  store_->put(kImported, "1");
+  batch.commit();
+}
+
+void LiteStorage::storePrimaryKeys(const std::string &public_key, const std::string &private_key) {
+  Json::Value keys;
+  keys["public"] = public_key;
+  keys["private"] = private_key;
+  storeJson(kPrimaryKeys, keys);
+}
+
+bool LiteStorage::loadPrimaryKeys(std::string *public_key, std::string *private_key) {
+  return loadPrimaryPublic(public_key) && loadPrimaryPrivate(private_key);
+}
+
+bool LiteStorage::loadPrimaryPublic(std::string *public_key) {
+  Json::Value keys = loadJson(kPrimaryKeys, Json::Value());
+  if (keys["public"].asString().empty()) {
+    return false;
+  }
+  if (public_key != nullptr) {
+    *public_key = keys["public"].asString();
+  }
+  return true;
+}
+
+bool LiteStorage::loadPrimaryPrivate(std::string *private_key) {
+  Json::Value keys = loadJson(kPrimaryKeys, Json::Value());
+  if (keys["private"].asString().empty()) {
+    return false;
+  }
+  if (private_key != nullptr) {
+    *private_key = keys["private"].asString();
+  }
+  return true;
+}
+
+void LiteStorage::clearPrimaryKeys() { store_->remove(kPrimaryKeys); }
+
+void LiteStorage::saveSecondaryInfo(const Uptane::EcuSerial &ecu_serial, const std::string &sec_type,
+                                    const PublicKey &public_key) {
+  std::lock_guard<std::mutex> guard(lock_);
+  Json::Value secondaries = loadJson(kSecondaries, Json::objectValue);
+  Json::Value &info = secondaries[ecu_serial.ToString()];
+  info["type"] = sec_type;
+  info["public_key"] = public_key.ToUptane();
+  storeJson(kSecondaries, secondaries);
+}
+
+void LiteStorage::saveSecondaryData(const Uptane::EcuSerial &ecu_serial, const std::string &data) {
+  std::lock_guard<std::mutex> guard(lock_);
+  Json::Value secondaries = loadJson(kSecondaries, Json::objectValue);
+  secondaries[ecu_serial.ToString()]["extra"] = data;
+  storeJson(kSecondaries, secondaries);
+}
+
+bool LiteStorage::loadSecondaryInfo(const Uptane::EcuSerial &ecu_serial, SecondaryInfo *secondary) {
+  std::vector<SecondaryInfo> secondaries;
+  loadSecondariesInfo(&secondaries);
+  for (const auto &s : secondaries) {
+    if (s.serial == ecu_serial) {
+      if (secondary != nullptr) {
+        *secondary = s;
+      }
+      return true;
+    }
+  }
+  return false;
+}
+
+// Every ECU but the primary, with what was saved of those that have info
+bool LiteStorage::loadSecondariesInfo(std::vector<SecondaryInfo> *secondaries) {
+  EcuSerials serials;
+  loadEcuSerials(&serials);
+  Json::Value saved = loadJson(kSecondaries, Json::objectValue);
+  std::vector<SecondaryInfo> res;
+  for (size_t i = 1; i < serials.size(); i++) {
+    SecondaryInfo info;
+    info.serial = serials[i].first;
+    info.hw_id = serials[i].second;
+    const Json::Value &s = saved[serials[i].first.ToString()];
+    if (s.isObject()) {
+      info.type = s["type"].asString();
+      if (s.isMember("public_key")) {
+        info.pub_key = PublicKey(s["public_key"]);
+      }
+      info.extra = s["extra"].asString();
+    }
+    res.push_back(info);
+  }
+  if (secondaries != nullptr) {
+    *secondaries = std::move(res);
+  }
+  return true;
+}
+
+void LiteStorage::storeTlsCreds(const std::string &ca, const std::string &cert, const std::string &pkey) {
+  storeTlsCa(ca);
+  storeTlsCert(cert);
+  storeTlsPkey(pkey);
+}
+
+void LiteStorage::storeTlsCa(const std::string &ca) { store_->put(kTlsCa, ca); }
+
+void LiteStorage::storeTlsCert(const std::string &cert) { store_->put(kTlsCert, cert); }
+
+void LiteStorage::storeTlsPkey(const std::string &pkey) { store_->put(kTlsPkey, pkey); }
+
+// Like SQLStorage, true if any of them was stored and "" for those that weren't
+bool LiteStorage::loadTlsCreds(std::string *ca, std::string *cert, std::string *pkey) {
+  std::string values[3];
+  bool found = false;
+  int i = 0;
+  for (const char *key : {kTlsCa, kTlsCert, kTlsPkey}) {
+    found = loadValue(key, &values[i++]) || found;
+  }
+  if (!found) {
+    return false;
+  }
+  if (ca != nullptr) {
+    *ca = values[0];
+  }
+  if (cert != nullptr) {
+    *cert = values[1];
+  }
+  if (pkey != nullptr) {
+    *pkey = values[2];
+  }
+  return true;
+}
+
+bool LiteStorage::loadTlsCa(std::string *ca) { return loadValue(kTlsCa, ca); }
+
+bool LiteStorage::loadTlsCert(std::string *cert) { return loadValue(kTlsCert, cert); }
+
+bool LiteStorage::loadTlsPkey(std::string *pkey) { return loadValue(kTlsPkey, pkey); }
+
+void LiteStorage::clearTlsCreds() {
+  for (const char *key : {kTlsCa, kTlsCert, kTlsPkey}) {
+    store_->remove(key);
+  }
+}
+
+void LiteStorage::storeRoot(const std::string &data, Uptane::RepositoryType repo, Uptane::Version version) {
+  std::lock_guard<std::mutex> guard(lock_);
+  store_->put(root_key(repo, std::to_string(version.version())), data);
+  std::string latest;
+  if (!loadValue(root_key(repo, "latest"), &latest) || std::stoi(latest) < version.version()) {
+    store_->put(root_key(repo, "latest"), std::to_string(version.version()));
+  }
+}
+
+bool LiteStorage::loadRoot(std::string *data, Uptane::RepositoryType repo, Uptane::Version version) {
+  std::string v = std::to_string(version.version());
+  if (version.version() < 0 && !loadValue(root_key(repo, "latest"), &v)) {
+    return false;
+  }
+  return loadValue(root_key(repo, v), data);
+}
+
+void LiteStorage::storeNonRoot(const std::string &data, Uptane::RepositoryType repo, Uptane::Role role) {
+  store_->put(meta_key(repo, role), data);
+}
+
+bool LiteStorage::loadNonRoot(std::string *data, Uptane::RepositoryType repo, Uptane::Role role) {
+  return loadValue(meta_key(repo, role), data);
+}
+
+void LiteStorage::clearNonRootMeta(Uptane::RepositoryType repo) {
+  for (const auto &role : {Uptane::Role::Timestamp(), Uptane::Role::Snapshot(), Uptane::Role::Targets()}) {
+    store_->remove(meta_key(repo, role));
+  }
+}
+
+void LiteStorage::clearMetadata() {
+  std::lock_guard<std::mutex> guard(lock_);
+  for (Uptane::RepositoryType repo : {Uptane::RepositoryType::Director(), Uptane::RepositoryType::Image()}) {
+    std::string latest;
+    if (loadValue(root_key(repo, "latest"), &latest)) {
+      for (int v = std::stoi(latest); v >= 0; v--) {
+        store_->remove(root_key(repo, std::to_string(v)));
+      }
+      store_->remove(root_key(repo, "latest"));
+    }
+    for (const auto &role : {Uptane::Role::Timestamp(), Uptane::Role::Snapshot(), Uptane::Role::Targets()}) {
+      store_->remove(meta_key(repo, role));
+    }
+  }
+  store_->remove(kDelegations);
+}
+
+void LiteStorage::storeDelegation(const std::string &data, Uptane::Role role) {
+  std::lock_guard<std::mutex> guard(lock_);
+  Json::Value delegations = loadJson(kDelegations, Json::objectValue);
+  delegations[role.ToString()] = data;
+  storeJson(kDelegations, delegations);
+}
+
+bool LiteStorage::loadDelegation(std::string *data, Uptane::Role role) {
+  Json::Value delegations = loadJson(kDelegations, Json::objectValue);
+  if (!delegations.isMember(role.ToString())) {
+    return false;
+  }
+  if (data != nullptr) {
+    *data = delegations[role.ToString()].asString();
+  }
+  return true;
+}
+
+bool LiteStorage::loadAllDelegations(std::vector<std::pair<Uptane::Role, std::string>> &data) const {
+  Json::Value delegations = loadJson(kDelegations, Json::objectValue);
+  for (const auto &name : delegations.getMemberNames()) {
+    data.emplace_back(Uptane::Role(name, true), delegations[name].asString());
+  }
+  return true;
+}
+
+void LiteStorage::deleteDelegation(Uptane::Role role) {
+  std::lock_guard<std::mutex> guard(lock_);
+  Json::Value delegations = loadJson(kDelegations, Json::objectValue);
+  if (!delegations.isMember(role.ToString())) {
+    return;
+  }
+  delegations.removeMember(role.ToString());
+  storeJson(kDelegations, delegations);
+}
+
+void LiteStorage::clearDelegations() { store_->remove(kDelegations); }
+
+void LiteStorage::storeDeviceId(const std::string &device_id) { store_->put(kDeviceId, device_id); }
+
+bool LiteStorage::loadDeviceId(std::string *device_id) { return loadValue(kDeviceId, device_id); }
+
+void LiteStorage::clearDeviceId() { store_->remove(kDeviceId); }
+
+void LiteStorage::storeEcuSerials(const EcuSerials &serials) {
+  if (serials.empty()) {
+    return;
+  }
+  std::lock_guard<std::mutex> guard(lock_);
+  Json::Value json(Json::arrayValue);
+  for (const auto &s : serials) {
+    Json::Value ecu;
+    ecu["serial"] = s.first.ToString();
+    ecu["hardware_id"] = s.second.ToString();
+    json.append(ecu);
+  }
+  storeJson(kEcuSerials, json);
+
+  // Versions saved while the serials weren't known belong to the primary
+  Json::Value installed = loadJson(kInstalled, Json::objectValue);
+  if (installed.isMember("")) {
+    Json::Value &primary = installed[serials[0].first.ToString()];
+    for (const auto &entry : installed[""]) {
+      primary.append(entry);
+    }
+    installed.removeMember("");
+    storeJson(kInstalled, installed);
+  }
+}
+
+bool LiteStorage::loadEcuSerials(EcuSerials *serials) {
+  Json::Value json = loadJson(kEcuSerials, Json::arrayValue);
+  if (json.empty()) {
+    return false;
+  }
+  if (serials != nullptr) {
+    serials->clear();
+    for (const auto &ecu : json) {
+      serials->emplace_back(Uptane::EcuSerial(ecu["serial"].asString()),
+                            Uptane::HardwareIdentifier(ecu["hardware_id"].asString()));
+    }
+  }
+  return true;
+}
+
+void LiteStorage::clearEcuSerials() { store_->remove(kEcuSerials); }
+
+void LiteStorage::storeMisconfiguredEcus(const std::vector<MisconfiguredEcu> &ecus) {
+  std::lock_guard<std::mutex> guard(lock_);
+  Json::Value json(Json::arrayValue);
+  for (const auto &ecu : ecus) {
+    Json::Value e;
+    e["serial"] = ecu.serial.ToString();
+    e["hardware_id"] = ecu.hardware_id.ToString();
+    e["state"] = static_cast<int>(ecu.state);
+    json.append(e);
+  }
+  storeJson(kMisconfigured, json);
+}
+
+bool LiteStorage::loadMisconfiguredEcus(std::vector<MisconfiguredEcu> *ecus) {
+  Json::Value json = loadJson(kMisconfigured, Json::arrayValue);
+  if (json.empty()) {
+    return false;
+  }
+  if (ecus != nullptr) {
+    ecus->clear();
+    for (const auto &e : json) {
+      ecus->emplace_back(Uptane::EcuSerial(e["serial"].asString()),
+                         Uptane::HardwareIdentifier(e["hardware_id"].asString()),
+                         static_cast<EcuState>(e["state"].asInt()));
+    }
+  }
+  return true;
+}
+
+void LiteStorage::clearMisconfiguredEcus() { store_->remove(kMisconfigured); }
+
+void LiteStorage::storeEcuRegistered() { store_->put(kEcuRegistered, "1"); }
+
+bool LiteStorage::loadEcuRegistered() { return loadValue(kEcuRegistered, nullptr); }
+
+void LiteStorage::clearEcuRegistered() { store_->remove(kEcuRegistered); }
+
+void LiteStorage::storeNeedReboot() { store_->put(kNeedReboot, "1"); }
+
+bool LiteStorage::loadNeedReboot(bool *need_reboot) {
+  if (need_reboot != nullptr) {
+    *need_reboot = loadValue(kNeedReboot, nullptr);
+  }
+  return true;
+}
+
+void LiteStorage::clearNeedReboot() { store_->remove(kNeedReboot); }
+
+std::string LiteStorage::installedKey(const std::string &ecu_serial, Uptane::EcuMap *ecus) {
+  EcuSerials serials;
+  loadEcuSerials(&serials);
+  if (serials.empty()) {
+    if (ecu_serial.empty()) {
+      LOG_WARNING << "Could not find primary ecu serial, set to lazy init mode";
+    }
+    return ecu_serial;
+  }
+  std::string serial = ecu_serial.empty() ? serials[0].first.ToString() : ecu_serial;
+  if (ecus != nullptr) {
+    for (const auto &s : serials) {
+      if (s.first.ToString() == serial) {
+        ecus->insert(s);
+      }
+    }
+  }
+  return serial;
+}
+
+void LiteStorage::saveInstalledVersion(const std::string &ecu_serial, const Uptane::Target &target,
+                                       InstalledVersionUpdateMode update_mode) {
+  std::lock_guard<std::mutex> guard(lock_);
+  std::string serial = installedKey(ecu_serial, nullptr);
+  Json::Value installed = loadJson(kInstalled, Json::objectValue);
+  Json::Value &log = installed[serial];
+  if (!log.isArray()) {
+    log = Json::arrayValue;
+  }
+
+  bool current = update_mode == InstalledVersionUpdateMode::kCurrent;
+  bool pending = update_mode == InstalledVersionUpdateMode::kPending;
+  for (auto &entry : log) {
+    if (current) {
+      entry["current"] = false;
+    }
+    if (current || pending) {
+      entry["pending"] = false;
+    }
+  }
+
+  // Finalizing a pending install updates the entry made for it
+  if (!log.empty() && same_version(log[log.size() - 1], target)) {
+    Json::Value &last = log[log.size() - 1];
+    last["correlation_id"] = target.correlation_id();
+    last["current"] = current;
+    last["pending"] = pending;
+    last["installed"] = current || last["installed"].asBool();
+  } else {
+    Json::Value entry = installed_json(target);
+    entry["current"] = current;
+    entry["pending"] = pending;
+    entry["installed"] = current;
+    log.append(entry);
+  }
+
+  // Drops the oldest entries that are neither current nor pending
+  Json::Value::ArrayIndex excess = log.size() > kMaxInstallationLog ? log.size() - kMaxInstallationLog : 0;
+  if (excess > 0) {
+    Json::Value kept(Json::arrayValue);
+    for (const auto &entry : log) {
+      if (excess > 0 && !entry["current"].asBool() && !entry["pending"].asBool()) {
+        excess--;
+      } else {
+        kept.append(entry);
+      }
+    }
+    log = kept;
+  }
+  storeJson(kInstalled, installed);
+}
+
+bool LiteStorage::loadInstalledVersions(const std::string &ecu_serial,
+                                        boost::optional<Uptane::Target> *current_version,
+                                        boost::optional<Uptane::Target> *pending_version) {
+  std::lock_guard<std::mutex> guard(lock_);
+  Uptane::EcuMap ecus;
+  std::string serial = installedKey(ecu_serial, &ecus);
+  Json::Value installed = loadJson(kInstalled, Json::objectValue);
+  if (current_version != nullptr) {
+    *current_version = boost::none;
+  }
+  if (pending_version != nullptr) {
+    *pending_version = boost::none;
+  }
+  for (const auto &entry : installed[serial]) {
+    if (entry["current"].asBool() && current_version != nullptr) {
+      *current_version = json_installed(entry, ecus);
+    }
+    if (entry["pending"].asBool() && pending_version != nullptr) {
+      *pending_version = json_installed(entry, ecus);
+    }
+  }
+  return true;
+}
+
+bool LiteStorage::loadInstallationLog(const std::string &ecu_serial, std::vector<Uptane::Target> *log,
+                                      bool only_installed) {
+  std::lock_guard<std::mutex> guard(lock_);
+  Uptane::EcuMap ecus;
+  std::string serial = installedKey(ecu_serial, &ecus);
+  Json::Value installed = loadJson(kInstalled, Json::objectValue);
+  std::vector<Uptane::Target> res;
+  for (const auto &entry : installed[serial]) {
+    if (!only_installed || entry["installed"].asBool()) {
+      res.push_back(json_installed(entry, ecus));
+    }
+  }
+  if (log != nullptr) {
+    *log = std::move(res);
+  }
+  return true;
+}
+
+bool LiteStorage::hasPendingInstall() {
+  Json::Value installed = loadJson(kInstalled, Json::objectValue);
+  for (const auto &serial : installed.getMemberNames()) {
+    for (const auto &entry : installed[serial]) {
+      if (entry["pending"].asBool()) {
+        return true;
+      }
+    }
+  }
+  return false;
+}
+
+void LiteStorage::clearInstalledVersions() { store_->remove(kInstalled); }
+
+void LiteStorage::saveEcuInstallationResult(const Uptane::EcuSerial &ecu_serial,
+                                            const data::InstallationResult &result) {
+  std::lock_guard<std::mutex> guard(lock_);
+  Json::Value results = loadJson(kEcuResults, Json::arrayValue);
+  Json::Value kept(Json::arrayValue);
+  for (const auto &r : results) {
+    if (r["serial"].asString() != ecu_serial.ToString()) {
+      kept.append(r);
+    }
+  }
+  Json::Value r = result_json(result);
+  r["serial"] = ecu_serial.ToString();
+  kept.append(r);
+  storeJson(kEcuResults, kept);
+}
+
+// Like SQLStorage, only those of known ECUs and in the order of the ECUs
+bool LiteStorage::loadEcuInstallationResults(
+    std::vector<std::pair<Uptane::EcuSerial, data::InstallationResult>> *results) {
+  Json::Value json = loadJson(kEcuResults, Json::arrayValue);
+  EcuSerials serials;
+  loadEcuSerials(&serials);
+  if (results != nullptr) {
+    results->clear();
+    for (const auto &ecu : serials) {
+      for (const auto &r : json) {
+        if (r["serial"].asString() == ecu.first.ToString()) {
+          results->emplace_back(ecu.first, json_result(r));
+        }
+      }
+    }
+  }
+  return true;
+}
+
+void LiteStorage::storeDeviceInstallationResult(const data::InstallationResult &result, const std::string &raw_report,
+                                                const std::string &correlation_id) {
+  Json::Value json = result_json(result);
+  json["raw_report"] = raw_report;
+  json["correlation_id"] = correlation_id;
+  storeJson(kDeviceResult, json);
+}
+
+bool LiteStorage::loadDeviceInstallationResult(data::InstallationResult *result, std::string *raw_report,
+                                               std::string *correlation_id) {
+  Json::Value json = loadJson(kDeviceResult, Json::Value());
+  if (!json.isObject()) {
+    return false;
+  }
+  if (result != nullptr) {
+    *result = json_result(json);
+  }
+  if (raw_report != nullptr) {
+    *raw_report = json["raw_report"].asString();
+  }
+  if (correlation_id != nullptr) {
+    *correlation_id = json["correlation_id"].asString();
+  }
+  return true;
+}
+
+void LiteStorage::clearInstallationResults() {
+  store_->remove(kEcuResults);
+  store_->remove(kDeviceResult);
+}
+
+void LiteStorage::saveEcuReportCounter(const Uptane::EcuSerial &ecu_serial, int64_t counter) {
+  std::lock_guard<std::mutex> guard(lock_);
+  Json::Value counters = loadJson(kReportCounters, Json::objectValue);
+  counters[ecu_serial.ToString()] = static_cast<Json::Int64>(counter);
+  storeJson(kReportCounters, counters);
+}
+
+bool LiteStorage::loadEcuReportCounter(std::vector<std::pair<Uptane::EcuSerial, int64_t>> *results) {
+  Json::Value counters = loadJson(kReportCounters, Json::objectValue);
+  EcuSerials serials;
+  loadEcuSerials(&serials);
+  if (results != nullptr) {
+    results->clear();
+    for (const auto &ecu : serials) {
+      if (counters.isMember(ecu.first.ToString())) {
+        results->emplace_back(ecu.first, counters[ecu.first.ToString()].asInt64());
+      }
+    }
+  }
+  return true;
+}
+
+// Events wait here while the device is offline, each with an id that keeps
+// growing so those sent can be deleted
+void LiteStorage::saveReportEvent(const Json::Value &json_value) {
+  std::lock_guard<std::mutex> guard(lock_);
+  Json::Value events = loadJson(kReportEvents, Json::objectValue);
+  Json::Value::Int64 id = events["next"].asInt64() + 1;
+  Json::Value event;
+  event["id"] = id;
+  event["event"] = json_value;
+  events["next"] = id;
+  events["events"].append(event);
+  storeJson(kReportEvents, events);
+}
+
+bool LiteStorage::loadReportEvents(Json::Value *report_array, int64_t *id_max) {
+  Json::Value events = loadJson(kReportEvents, Json::objectValue);
+  *id_max = 0;
+  for (const auto &event : events["events"]) {
+    report_array->append(event["event"]);
+    *id_max = std::max<int64_t>(*id_max, event["id"].asInt64());
+  }
+  return true;
+}
+
+void LiteStorage::deleteReportEvents(int64_t id_max) {
+  std::lock_guard<std::mutex> guard(lock_);
+  Json::Value events = loadJson(kReportEvents, Json::objectValue);
+  Json::Value kept(Json::arrayValue);
+  for (const auto &event : events["events"]) {
+    if (event["id"].asInt64() > id_max) {
+      kept.append(event);
+    }
+  }
+  events["events"] = kept;
+  storeJson(kReportEvents, events);
+}
+
+bool LiteStorage::checkAvailableDiskSpace(uint64_t required_bytes) const {
+  struct statvfs stvfs_buf {};
+  if (statvfs(config_.path.c_str(), &stvfs_buf) < 0) {
+    LOG_ERROR << "Unable to get information on the storage file system: " << strerror(errno);
+    return false;
+  }
+  uint64_t available = static_cast<uint64_t>(stvfs_buf.f_bsize) * stvfs_buf.f_bavail;
+  return required_bytes + kDiskSpaceReserve < available;
+}
+
+boost::filesystem::path LiteStorage::imagePath(const std::string &target_name) const {
+  return images_path_ / boost::algorithm::to_lower_copy(boost::algorithm::hex(Crypto::sha256digest(target_name)));
+}
+
+// Like SQLStorage, a partial file is returned with its size so the download
+// can carry on from there
+boost::optional<std::pair<size_t, std::string>> LiteStorage::checkTargetFile(const Uptane::Target &target) const {
+  Json::Value image = loadJson(kImages, Json::objectValue)[target.filename()];
+  if (!image.isObject()) {
+    return boost::none;
+  }
+  boost::filesystem::path path = imagePath(target.filename());
+  if (!boost::filesystem::exists(path)) {
+    return boost::none;
+  }
+  for (const auto &hash : Hash::decodeVector(image["hashes"].asString())) {
+    if (target.MatchHash(hash)) {
+      return std::make_pair(static_cast<size_t>(boost::filesystem::file_size(path)), path.string());
+    }
+  }
+  return boost::none;
+}
+
+std::unique_ptr<StorageTargetWHandle> LiteStorage::allocateTargetFile(const Uptane::Target &target) {
+  {
+    std::lock_guard<std::mutex> guard(lock_);
+    Json::Value images = loadJson(kImages, Json::objectValue);
+    Json::Value &image = images[target.filename()];
+    image["hashes"] = Hash::encodeVector(target.hashes());
+    image["length"] = static_cast<Json::UInt64>(target.length());
+    storeJson(kImages, images);
+  }
+  boost::filesystem::create_directories(images_path_);
+  return std::unique_ptr<StorageTargetWHandle>(new LiteTargetWHandle(imagePath(target.filename()), false));
+}
+
+std::unique_ptr<StorageTargetRHandle> LiteStorage::openTargetFile(const Uptane::Target &target) {
+  auto stored = checkTargetFile(target);
+  if (!stored) {
+    throw std::runtime_error("Target file " + target.filename() + " not found");
+  }
+  return std::unique_ptr<StorageTargetRHandle>(new LiteTargetRHandle(stored->second, target.length()));
+}
+
+std::vector<Uptane::Target> LiteStorage::getTargetFiles() {
+  Json::Value images = loadJson(kImages, Json::objectValue);
+  std::vector<Uptane::Target> res;
+  for (const auto &name : images.getMemberNames()) {
+    res.emplace_back(name, Uptane::EcuMap{}, Hash::decodeVector(images[name]["hashes"].asString()),
+                     images[name]["length"].asUInt64());
+  }
+  return res;
+}
+
+void LiteStorage::removeTargetFile(const std::string &target_name) {
+  std::lock_guard<std::mutex> guard(lock_);
+  Json::Value images = loadJson(kImages, Json::objectValue);
+  if (!images.isMember(target_name)) {
+    throw std::runtime_error("Target file " + target_name + " not found");
+  }
+  images.removeMember(target_name);
+  storeJson(kImages, images);
+  boost::filesystem::remove(imagePath(target_name));
+}
+
+void LiteStorage::cleanUp() {
+  store_.reset();
+  boost::filesystem::remove(logPath());
+  boost::filesystem::remove(logPath().string() + ".lock");
+}
@@ -0,0 +1,156 @@
+#ifndef AKTUALIZR_LITE_LITESTORAGE
+#define AKTUALIZR_LITE_LITESTORAGE
+
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <json/json.h>
+
+#include "litestore.h"
+#include "storage/invstorage.h"
+
+// Whether libaktualizr's records are kept in a LiteStore rather than SQLite.
+// Configured via [pacman] lite_storage (0 or 1, default 0).
+struct LiteStorageConfig {
+  LiteStorageConfig() = default;
+  explicit LiteStorageConfig(const std::map<std::string, std::string> &extra);
+
+  bool enabled{false};
+};
+
+// INvStorage over a LiteStore log, "lite-storage.log" in the storage path,
+// so starting up means replaying one small log instead of opening SQLite and
+// checking its schema. Each record (keys, TLS credentials, ECU serials, the
+// installed versions of all ECUs, each root and non-root role) is a value of
+// its own, written with a single append. Target files live under "images" as
+// they do with SQLStorage.
+//
+// Installed versions follow SQLStorage: an empty serial is the primary, and
+// versions saved before the serials are known are moved to the primary once
+// they are. The installation log only keeps the last kMaxInstallationLog
+// entries of each ECU that aren't current or pending.
+class LiteStorage : public INvStorage {
+ public:
+  static const size_t kMaxInstallationLog = 100;
+
+  // A read-only storage throws std::logic_error on any change
+  explicit LiteStorage(const StorageConfig &config, bool readonly = false);
+  ~LiteStorage() override = default;
+  LiteStorage(const LiteStorage &) = delete;
+  LiteStorage &operator=(const LiteStorage &) = delete;
+
+  // Copies what the SQL storage used before lite_storage was enabled holds,
+  // nullptr if there's none. Only the first call on a new store does
+  // anything, later ones return straight away. The SQL storage is left as it
+  // was, so turning the option off again goes back to its older records.
+  void importFrom(INvStorage *sql);
+  bool imported();
+
+  StorageType type() override { return config_.type; }
+
+  void storePrimaryKeys(const std::string &public_key, const std::string &private_key) override;
+  bool loadPrimaryKeys(std::string *public_key, std::string *private_key) override;
+  bool loadPrimaryPublic(std::string *public_key) override;
+  bool loadPrimaryPrivate(std::string *private_key) override;
+  void clearPrimaryKeys() override;
+
+  void saveSecondaryInfo(const Uptane::EcuSerial &ecu_serial, const std::string &sec_type,
+                         const PublicKey &public_key) override;
+  void saveSecondaryData(const Uptane::EcuSerial &ecu_serial, const std::string &data) override;
+  bool loadSecondaryInfo(const Uptane::EcuSerial &ecu_serial, SecondaryInfo *secondary) override;
+  bool loadSecondariesInfo(std::vector<SecondaryInfo> *secondaries) override;
+
+  void storeTlsCreds(const std::string &ca, const std::string &cert, const std::string &pkey) override;
+  void storeTlsCa(const std::string &ca) override;
+  void storeTlsCert(const std::string &cert) override;
+  void storeTlsPkey(const std::string &pkey) override;
+  bool loadTlsCreds(std::string *ca, std::string *cert, std::string *pkey) override;
+  bool loadTlsCa(std::string *ca) override;
+  bool loadTlsCert(std::string *cert) override;
+  bool loadTlsPkey(std::string *pkey) override;
+  void clearTlsCreds() override;
+
+  void storeRoot(const std::string &data, Uptane::RepositoryType repo, Uptane::Version version) override;
+  bool loadRoot(std::string *data, Uptane::RepositoryType repo, Uptane::Version version) override;
+  void storeNonRoot(const std::string &data, Uptane::RepositoryType repo, Uptane::Role role) override;
+  bool loadNonRoot(std::string *data, Uptane::RepositoryType repo, Uptane::Role role) override;
+  void clearNonRootMeta(Uptane::RepositoryType repo) override;
+  void clearMetadata() override;
+  void storeDelegation(const std::string &data, Uptane::Role role) override;
+  bool loadDelegation(std::string *data, Uptane::Role role) override;
+  bool loadAllDelegations(std::vector<std::pair<Uptane::Role, std::string>> &data) const override;
+  void deleteDelegation(Uptane::Role role) override;
+  void clearDelegations() override;
+
+  void storeDeviceId(const std::string &device_id) override;
+  bool loadDeviceId(std::string *device_id) override;
+  void clearDeviceId() override;
+
+  void storeEcuSerials(const EcuSerials &serials) override;
+  bool loadEcuSerials(EcuSerials *serials) override;
+  void clearEcuSerials() override;
+  void storeMisconfiguredEcus(const std::vector<MisconfiguredEcu> &ecus) override;
+  bool loadMisconfiguredEcus(std::vector<MisconfiguredEcu> *ecus) override;
+  void clearMisconfiguredEcus() override;
+  void storeEcuRegistered() override;
+  bool loadEcuRegistered() override;
+  void clearEcuRegistered() override;
+  void storeNeedReboot() override;
+  bool loadNeedReboot(bool *need_reboot) override;
+  void clearNeedReboot() override;
+
+  void saveInstalledVersion(const std::string &ecu_serial, const Uptane::Target &target,
+                            InstalledVersionUpdateMode update_mode) override;
+  bool loadInstalledVersions(const std::string &ecu_serial, boost::optional<Uptane::Target> *current_version,
+                             boost::optional<Uptane::Target> *pending_version) override;
+  bool loadInstallationLog(const std::string &ecu_serial, std::vector<Uptane::Target> *log,
+                           bool only_installed) override;
+  bool hasPendingInstall() override;
+  void clearInstalledVersions() override;
+
+  void saveEcuInstallationResult(const Uptane::EcuSerial &ecu_serial, const data::InstallationResult &result) override;
+  bool loadEcuInstallationResults(
+      std::vector<std::pair<Uptane::EcuSerial, data::InstallationResult>> *results) override;
+  void storeDeviceInstallationResult(const data::InstallationResult &result, const std::string &raw_report,
+                                     const std::string &correlation_id) override;
+  bool loadDeviceInstallationResult(data::InstallationResult *result, std::string *raw_report,
+                                    std::string *correlation_id) override;
+  void clearInstallationResults() override;
+  void saveEcuReportCounter(const Uptane::EcuSerial &ecu_serial, int64_t counter) override;
+  bool loadEcuReportCounter(std::vector<std::pair<Uptane::EcuSerial, int64_t>> *results) override;
+  void saveReportEvent(const Json::Value &json_value) override;
+  bool loadReportEvents(Json::Value *report_array, int64_t *id_max) override;
+  void deleteReportEvents(int64_t id_max) override;
+
+  bool checkAvailableDiskSpace(uint64_t required_bytes) const override;
+
+  boost::optional<std::pair<size_t, std::string>> checkTargetFile(const Uptane::Target &target) const override;
+  std::unique_ptr<StorageTargetWHandle> allocateTargetFile(const Uptane::Target &target) override;
+  std::unique_ptr<StorageTargetRHandle> openTargetFile(const Uptane::Target &target) override;
+  std::vector<Uptane::Target> getTargetFiles() override;
+  void removeTargetFile(const std::string &target_name) override;
+  void cleanUp() override;
+
+  boost::filesystem::path logPath() const { return config_.path / "lite-storage.log"; }
+
+ private:
+  bool loadValue(const std::string &key, std::string *value) const;
+  Json::Value loadJson(const std::string &key, const Json::Value &missing) const;
+  void storeJson(const std::string &key, const Json::Value &value);
+  // The serial the versions of `ecu_serial` are recorded under and the ECU
+  // they are reported for. Must be called with lock_ held.
+  std::string installedKey(const std::string &ecu_serial, Uptane::EcuMap *ecus);
+  void saveInstalledLog(const std::string &ecu_serial, Json::Value log);
+  boost::filesystem::path imagePath(const std::string &target_name) const;
+
+  boost::filesystem::path images_path_;
+  std::unique_ptr<LiteStore> store_;
+  // Serializes the records that are read, changed and written back
+  mutable std::mutex lock_;
+};
+
+#endif  // AKTUALIZR_LITE_LITESTORAGE
@@ -0,0 +1,480 @@
+#include <gtest/gtest.h>
+
+#include <boost/algorithm/hex.hpp>
+#include <boost/algorithm/string.hpp>
+
+#include "crypto/crypto.h"
+#include "litestorage.h"
+#include "utilities/utils.h"
+
+static Uptane::Target version(const std::string &v, const std::string &content = "") {
+  Json::Value json;
+  json["hashes"]["sha256"] = boost::algorithm::to_lower_copy(boost::algorithm::hex(Crypto::sha256digest("lmp-" + v)));
+  json["custom"]["targetFormat"] = "OSTREE";
+  json["custom"]["version"] = v;
+  json["length"] = static_cast<Json::UInt64>(content.size());
+  if (!content.empty()) {
+    json["hashes"]["sha256"] = boost::algorithm::to_lower_copy(boost::algorithm::hex(Crypto::sha256digest(content)));
+  }
+  return Uptane::Target("lmp-" + v, json);
+}
+
+static StorageConfig storage_config(const TemporaryDirectory &dir) {
+  StorageConfig config;
+  config.path = dir.Path();
+  return config;
+}
+
+static const EcuSerials kSerials{{Uptane::EcuSerial("primary"), Uptane::HardwareIdentifier("hw")},
+                                 {Uptane::EcuSerial("secondary"), Uptane::HardwareIdentifier("hw-sec")}};
+
+TEST(litestorage, config) {
+  ASSERT_FALSE(LiteStorageConfig(std::map<std::string, std::string>{}).enabled);
+  ASSERT_TRUE(LiteStorageConfig(std::map<std::string, std::string>{{"lite_storage", "1"}}).enabled);
+  ASSERT_THROW(LiteStorageConfig(std::map<std::string, std::string>{{"lite_storage", "yes"}}), std::invalid_argument);
+}
+
+TEST(litestorage, installed_versions) {
+  TemporaryDirectory dir;
+  LiteStorage storage(storage_config(dir));
+  boost::optional<Uptane::Target> current;
+  boost::optional<Uptane::Target> pending;
+  std::vector<Uptane::Target> log;
+
+  // Saved before the serials are known, like SQLStorage it's the primary's
+  storage.savePrimaryInstalledVersion(version("1"), InstalledVersionUpdateMode::kCurrent);
+  storage.storeEcuSerials(kSerials);
+  ASSERT_TRUE(storage.loadPrimaryInstalledVersions(&current, &pending));
+  ASSERT_TRUE(!!current);
+  ASSERT_EQ("lmp-1", current->filename());
+  ASSERT_FALSE(!!pending);
+
+  storage.savePrimaryInstalledVersion(version("2"), InstalledVersionUpdateMode::kPending);
+  ASSERT_TRUE(storage.hasPendingInstall());
+  storage.loadPrimaryInstalledVersions(&current, &pending);
+  ASSERT_EQ("lmp-1", current->filename());
+  ASSERT_EQ("lmp-2", pending->filename());
+  ASSERT_EQ("2", pending->custom_version());
+  storage.loadPrimaryInstallationLog(&log, true);
+  ASSERT_EQ(1, log.size());
+
+  // Finalizing updates the pending entry rather than adding one
+  storage.savePrimaryInstalledVersion(version("2"), InstalledVersionUpdateMode::kCurrent);
+  ASSERT_FALSE(storage.hasPendingInstall());
+  storage.loadPrimaryInstalledVersions(&current, &pending);
+  ASSERT_EQ("lmp-2", current->filename());
+  ASSERT_FALSE(!!pending);
+  storage.loadPrimaryInstallationLog(&log, false);
+  ASSERT_EQ(2, log.size());
+  ASSERT_EQ(version("2").sha256Hash(), log[1].sha256Hash());
+
+  // A pending install that's rolled back stays out of the installed log
+  storage.savePrimaryInstalledVersion(version("3"), InstalledVersionUpdateMode::kPending);
+  storage.savePrimaryInstalledVersion(version("2"), InstalledVersionUpdateMode::kCurrent);
+  storage.loadPrimaryInstallationLog(&log, true);
+  ASSERT_EQ(3, log.size());
+  ASSERT_EQ("lmp-2", log[2].filename());
+  storage.loadPrimaryInstallationLog(&log, false);
+  ASSERT_EQ(4, log.size());
+
+  // Each ECU has its own
+  storage.saveInstalledVersion("secondary", version("s1"), InstalledVersionUpdateMode::kCurrent);
+  storage.loadInstalledVersions("secondary", &current, &pending);
+  ASSERT_EQ("lmp-s1", current->filename());
+  storage.loadPrimaryInstalledVersions(&current, &pending);
+  ASSERT_EQ("lmp-2", current->filename());
+
+  // And it all survives a restart
+  LiteStorage reopened(storage_config(dir));
+  reopened.loadPrimaryInstalledVersions(&current, &pending);
+  ASSERT_EQ("lmp-2", current->filename());
+  reopened.clearInstalledVersions();
+  reopened.loadPrimaryInstalledVersions(&current, &pending);
+  ASSERT_FALSE(!!current);
+}
+
+TEST(litestorage, installation_log_bound) {
+  TemporaryDirectory dir;
+  LiteStorage storage(storage_config(dir));
+  storage.storeEcuSerials(kSerials);
+  storage.savePrimaryInstalledVersion(version("0"), InstalledVersionUpdateMode::kCurrent);
+  for (size_t i = 1; i < LiteStorage::kMaxInstallationLog + 10; i++) {
+    storage.savePrimaryInstalledVersion(version(std::to_string(i)), InstalledVersionUpdateMode::kNone);
+  }
+  std::vector<Uptane::Target> log;
+  storage.loadPrimaryInstallationLog(&log, false);
+  ASSERT_EQ(LiteStorage::kMaxInstallationLog, log.size());
+  // The current version is kept however old it is
+  ASSERT_EQ("lmp-0", log[0].filename());
+  ASSERT_EQ("lmp-11", log[1].filename());
+  boost::optional<Uptane::Target> current;
+  storage.loadPrimaryInstalledVersions(&current, nullptr);
+  ASSERT_EQ("lmp-0", current->filename());
+}
+
+TEST(litestorage, metadata) {
+  TemporaryDirectory dir;
+  {
+    LiteStorage storage(storage_config(dir));
+    std::string data;
+    ASSERT_FALSE(storage.loadLatestRoot(&data, Uptane::RepositoryType::Image()));
+    storage.storeRoot("image-1", Uptane::RepositoryType::Image(), Uptane::Version(1));
+    storage.storeRoot("image-2", Uptane::RepositoryType::Image(), Uptane::Version(2));
+    storage.storeRoot("director-1", Uptane::RepositoryType::Director(), Uptane::Version(1));
+    storage.storeNonRoot("targets", Uptane::RepositoryType::Image(), Uptane::Role::Targets());
+    storage.storeNonRoot("timestamp", Uptane::RepositoryType::Image(), Uptane::Role::Timestamp());
+    storage.storeDelegation("delegated", Uptane::Role("apps", true));
+    storage.storeTlsCreds("ca", "cert", "pkey");
+    storage.storeDeviceId("device");
+  }
+
+  LiteStorage storage(storage_config(dir));
+  std::string data;
+  ASSERT_TRUE(storage.loadLatestRoot(&data, Uptane::RepositoryType::Image()));
+  ASSERT_EQ("image-2", data);
+  ASSERT_TRUE(storage.loadRoot(&data, Uptane::RepositoryType::Image(), Uptane::Version(1)));
+  ASSERT_EQ("image-1", data);
+  ASSERT_TRUE(storage.loadLatestRoot(&data, Uptane::RepositoryType::Director()));
+  ASSERT_EQ("director-1", data);
+  ASSERT_TRUE(storage.loadNonRoot(&data, Uptane::RepositoryType::Image(), Uptane::Role::Targets()));
+  ASSERT_EQ("targets", data);
+  ASSERT_FALSE(storage.loadNonRoot(&data, Uptane::RepositoryType::Director(), Uptane::Role::Targets()));
+  std::vector<std::pair<Uptane::Role, std::string>> delegations;
+  storage.loadAllDelegations(delegations);
+  ASSERT_EQ(1, delegations.size());
+  ASSERT_EQ("delegated", delegations[0].second);
+  std::string ca;
+  std::string cert;
+  std::string pkey;
+  ASSERT_TRUE(storage.loadTlsCreds(&ca, &cert, &pkey));
+  ASSERT_EQ("pkey", pkey);
+  ASSERT_TRUE(storage.loadDeviceId(&data));
+  ASSERT_EQ("device", data);
+
+  storage.clearNonRootMeta(Uptane::RepositoryType::Image());
+  ASSERT_FALSE(storage.loadNonRoot(&data, Uptane::RepositoryType::Image(), Uptane::Role::Timestamp()));
+  ASSERT_TRUE(storage.loadLatestRoot(&data, Uptane::RepositoryType::Image()));
+  storage.clearMetadata();
+  ASSERT_FALSE(storage.loadLatestRoot(&data, Uptane::RepositoryType::Image()));
+  ASSERT_FALSE(storage.loadRoot(&data, Uptane::RepositoryType::Image(), Uptane::Version(1)));
+}
+
+TEST(litestorage, target_files) {
+  TemporaryDirectory dir;
+  LiteStorage storage(storage_config(dir));
+  auto t = version("1", "content");
+  ASSERT_FALSE(!!storage.checkTargetFile(t));
+
+  // Cut short, the download carries on from what's there
+  auto out = storage.allocateTargetFile(t);
+  out->wfeed(reinterpret_cast<const uint8_t *>("cont"), 4);
+  out->wcommit();
+  auto stored = storage.checkTargetFile(t);
+  ASSERT_TRUE(!!stored);
+  ASSERT_EQ(4, stored->first);
+  ASSERT_TRUE(storage.openTargetFile(t)->isPartial());
+
+  out = storage.allocateTargetFile(t);
+  out->wfeed(reinterpret_cast<const uint8_t *>("content"), 7);
+  out->wcommit();
+  auto in = storage.openTargetFile(t);
+  ASSERT_FALSE(in->isPartial());
+  ASSERT_EQ("content", Utils::readFile(storage.checkTargetFile(t)->second));
+
+  // Another target by the same name isn't this one
+  ASSERT_FALSE(!!storage.checkTargetFile(version("1", "other")));
+
+  storage.removeTargetFile(t.filename());
+  ASSERT_FALSE(!!storage.checkTargetFile(t));
+  ASSERT_THROW(storage.removeTargetFile(t.filename()), std::runtime_error);
+}
+
+TEST(litestorage, import) {
+  TemporaryDirectory dir;
+  StorageConfig config = storage_config(dir);
+  {
+    auto sql = INvStorage::newStorage(config);
+    sql->storeEcuSerials(kSerials);
+    sql->storeTlsCreds("ca", "cert", "pkey");
+    sql->storePrimaryKeys("public", "private");
+    sql->storeDeviceId("device");
+    sql->storeEcuRegistered();
+    sql->storeRoot("image-1", Uptane::RepositoryType::Image(), Uptane::Version(1));
+    sql->storeRoot(R"({"signed": {"version": 2}})", Uptane::RepositoryType::Image(), Uptane::Version(2));
+    sql->storeNonRoot("targets", Uptane::RepositoryType::Image(), Uptane::Role::Targets());
+    sql->savePrimaryInstalledVersion(version("1"), InstalledVersionUpdateMode::kCurrent);
+    sql->savePrimaryInstalledVersion(version("2"), InstalledVersionUpdateMode::kPending);
+    sql->savePrimaryInstalledVersion(version("1"), InstalledVersionUpdateMode::kCurrent);
+    sql->savePrimaryInstalledVersion(version("3"), InstalledVersionUpdateMode::kPending);
+
+    LiteStorage storage(config);
+    ASSERT_FALSE(storage.imported());
+    storage.importFrom(sql.get());
+    ASSERT_TRUE(storage.imported());
+
+    // Only ever copied once
+    sql->storeDeviceId("changed");
+    storage.importFrom(sql.get());
+  }
+
+  LiteStorage storage(config);
+  std::string data;
+  ASSERT_TRUE(storage.loadDeviceId(&data));
+  ASSERT_EQ("device", data);
+  ASSERT_TRUE(storage.loadTlsCert(&data));
+  ASSERT_EQ("cert", data);
+  ASSERT_TRUE(storage.loadPrimaryPrivate(&data));
+  ASSERT_EQ("private", data);
+  ASSERT_TRUE(storage.loadEcuRegistered());
+  EcuSerials serials;
+  ASSERT_TRUE(storage.loadEcuSerials(&serials));
+  ASSERT_EQ(2, serials.size());
+  ASSERT_EQ("primary", serials[0].first.ToString());
+  ASSERT_TRUE(storage.loadRoot(&data, Uptane::RepositoryType::Image(), Uptane::Version(1)));
+  ASSERT_EQ("image-1", data);
+  ASSERT_TRUE(storage.loadLatestRoot(&data, Uptane::RepositoryType::Image()));
+  ASSERT_EQ(2, Utils::parseJSON(data)["signed"]["version"].asInt());
+  ASSERT_TRUE(storage.loadNonRoot(&data, Uptane::RepositoryType::Image(), Uptane::Role::Targets()));
+  ASSERT_EQ("targets", data);
+
+  boost::optional<Uptane::Target> current;
+  boost::optional<Uptane::Target> pending;
+  storage.loadPrimaryInstalledVersions(&current, &pending);
+  ASSERT_EQ("lmp-1", current->filename());
+  ASSERT_EQ("lmp-3", pending->filename());
+  std::vector<Uptane::Target> log;
+  storage.loadPrimaryInstallationLog(&log, false);
+  ASSERT_EQ(4, log.size());
+  storage.loadPrimaryInstallationLog(&log, true);
+  ASSERT_EQ(2, log.size());
+  ASSERT_EQ("lmp-1", log[1].filename());
+}
+
+// What the load methods return, to compare LiteStorage with SQLStorage
+static Json::Value target_json(const Uptane::Target &t) {
+  Json::Value res;
+  res["name"] = t.filename();
+  res["sha256"] = t.sha256Hash();
+  res["length"] = static_cast<Json::UInt64>(t.length());
+  res["version"] = t.custom_version();
+  res["correlation_id"] = t.correlation_id();
+  return res;
+}
+
+static Json::Value result_json(const data::InstallationResult &r) {
+  Json::Value res;
+  res["success"] = r.success;
+  res["result_code"] = r.result_code.toRepr();
+  res["description"] = r.description;
+  return res;
+}
+
+static Json::Value observe(INvStorage &storage) {
+  Json::Value res;
+  EcuSerials serials;
+  res["has_serials"] = storage.loadEcuSerials(&serials);
+  for (const auto &s : serials) {
+    res["serials"].append(s.first.ToString() + "/" + s.second.ToString());
+  }
+  std::vector<MisconfiguredEcu> misconfigured;
+  res["has_misconfigured"] = storage.loadMisconfiguredEcus(&misconfigured);
+  for (const auto &e : misconfigured) {
+    res["misconfigured"].append(e.serial.ToString() + "/" + e.hardware_id.ToString() + "/" +
+                                std::to_string(static_cast<int>(e.state)));
+  }
+  std::vector<SecondaryInfo> secondaries;
+  storage.loadSecondariesInfo(&secondaries);
+  for (const auto &s : secondaries) {
+    Json::Value info;
+    info["serial"] = s.serial.ToString();
+    info["hw_id"] = s.hw_id.ToString();
+    info["type"] = s.type;
+    info["public_key"] = s.pub_key.Value();
+    info["extra"] = s.extra;
+    res["secondaries"].append(info);
+  }
+
+  // An empty serial is the primary
+  for (const std::string serial : {"", "primary", "secondary"}) {
+    Json::Value &ecu = res["installed"][serial.empty() ? "-" : serial];
+    boost::optional<Uptane::Target> current;
+    boost::optional<Uptane::Target> pending;
+    storage.loadInstalledVersions(serial, &current, &pending);
+    ecu["current"] = !!current ? target_json(*current) : Json::Value();
+    ecu["pending"] = !!pending ? target_json(*pending) : Json::Value();
+    for (bool only_installed : {false, true}) {
+      std::vector<Uptane::Target> log;
+      storage.loadInstallationLog(serial, &log, only_installed);
+      Json::Value &entries = ecu[only_installed ? "installed" : "log"];
+      entries = Json::arrayValue;
+      for (const auto &t : log) {
+        entries.append(target_json(t));
+      }
+    }
+  }
+  res["has_pending"] = storage.hasPendingInstall();
+
+  std::vector<std::pair<Uptane::EcuSerial, data::InstallationResult>> results;
+  storage.loadEcuInstallationResults(&results);
+  for (const auto &r : results) {
+    Json::Value result = result_json(r.second);
+    result["serial"] = r.first.ToString();
+    res["ecu_results"].append(result);
+  }
+  data::InstallationResult device_result;
+  std::string raw_report;
+  std::string correlation_id;
+  res["has_device_result"] = storage.loadDeviceInstallationResult(&device_result, &raw_report, &correlation_id);
+  if (res["has_device_result"].asBool()) {
+    res["device_result"] = result_json(device_result);
+    res["device_result"]["raw_report"] = raw_report;
+    res["device_result"]["correlation_id"] = correlation_id;
+  }
+  std::vector<std::pair<Uptane::EcuSerial, int64_t>> counters;
+  storage.loadEcuReportCounter(&counters);
+  for (const auto &c : counters) {
+    res["report_counters"].append(c.first.ToString() + "=" + std::to_string(c.second));
+  }
+  Json::Value events(Json::arrayValue);
+  int64_t id_max = 0;
+  storage.loadReportEvents(&events, &id_max);
+  res["report_events"] = events;
+
+  bool need_reboot = false;
+  storage.loadNeedReboot(&need_reboot);
+  res["need_reboot"] = need_reboot;
+  res["registered"] = storage.loadEcuRegistered();
+  return res;
+}
+
+static Json::Value event(const std::string &id) {
+  Json::Value res;
+  res["id"] = id;
+  res["eventType"]["id"] = "EcuInstallationCompleted";
+  return res;
+}
+
+// The same changes as aktualizr-lite makes through an update, observed along
+// the way
+static Json::Value exercise(INvStorage &storage) {
+  Json::Value res(Json::arrayValue);
+  // Before the serials are known, then moved to the primary
+  storage.savePrimaryInstalledVersion(version("1"), InstalledVersionUpdateMode::kCurrent);
+  res.append(observe(storage));
+  storage.storeEcuSerials(kSerials);
+  storage.storeEcuRegistered();
+  res.append(observe(storage));
+
+  // Installed and finalized, then one that's rolled back
+  Uptane::Target v2 = version("2");
+  v2.setCorrelationId("update-2");
+  storage.savePrimaryInstalledVersion(v2, InstalledVersionUpdateMode::kPending);
+  storage.storeNeedReboot();
+  res.append(observe(storage));
+  storage.savePrimaryInstalledVersion(v2, InstalledVersionUpdateMode::kCurrent);
+  storage.clearNeedReboot();
+  storage.savePrimaryInstalledVersion(version("3"), InstalledVersionUpdateMode::kPending);
+  storage.savePrimaryInstalledVersion(v2, InstalledVersionUpdateMode::kCurrent);
+  // Only downloaded
+  storage.savePrimaryInstalledVersion(version("4"), InstalledVersionUpdateMode::kNone);
+  storage.saveInstalledVersion("secondary", version("s1"), InstalledVersionUpdateMode::kCurrent);
+  storage.saveInstalledVersion("secondary", version("s2"), InstalledVersionUpdateMode::kPending);
+  res.append(observe(storage));
+
+  storage.saveSecondaryInfo(Uptane::EcuSerial("secondary"), "virtual",
+                            PublicKey(Utils::parseJSON(R"({"keytype": "ED25519", "keyval": {"public": "abcd"}})")));
+  storage.saveSecondaryData(Uptane::EcuSerial("secondary"), "extra");
+  storage.storeMisconfiguredEcus({MisconfiguredEcu(Uptane::EcuSerial("old"), Uptane::HardwareIdentifier("hw-old"),
+                                                   static_cast<EcuState>(0))});
+  res.append(observe(storage));
+
+  // Reported in a different order to that of the ECUs
+  storage.saveEcuInstallationResult(Uptane::EcuSerial("secondary"),
+                                    data::InstallationResult(data::ResultCode::Numeric::kInstallFailed, "failed"));
+  storage.saveEcuInstallationResult(Uptane::EcuSerial("primary"),
+                                    data::InstallationResult(data::ResultCode::Numeric::kOk, "ok"));
+  storage.saveEcuInstallationResult(Uptane::EcuSerial("secondary"),
+                                    data::InstallationResult(data::ResultCode::Numeric::kOk, "retried"));
+  storage.storeDeviceInstallationResult(data::InstallationResult(data::ResultCode::Numeric::kOk, "device"), "raw",
+                                        "update-2");
+  storage.saveEcuReportCounter(Uptane::EcuSerial("secondary"), 5);
+  storage.saveEcuReportCounter(Uptane::EcuSerial("primary"), 3);
+  storage.saveEcuReportCounter(Uptane::EcuSerial("primary"), 4);
+  res.append(observe(storage));
+
+  // Events are deleted once sent, those saved meanwhile are kept
+  storage.saveReportEvent(event("1"));
+  storage.saveReportEvent(event("2"));
+  Json::Value sent(Json::arrayValue);
+  int64_t id_max = 0;
+  storage.loadReportEvents(&sent, &id_max);
+  storage.saveReportEvent(event("3"));
+  res.append(observe(storage));
+  storage.deleteReportEvents(id_max);
+  res.append(observe(storage));
+
+  storage.clearInstallationResults();
+  res.append(observe(storage));
+  return res;
+}
+
+static void expect_same(const Json::Value &sql, const Json::Value &lite) {
+  ASSERT_EQ(sql.size(), lite.size());
+  for (Json::Value::ArrayIndex i = 0; i < sql.size(); i++) {
+    EXPECT_EQ(sql[i].toStyledString(), lite[i].toStyledString()) << "Differs at step " << i;
+  }
+}
+
+TEST(litestorage, same_as_sql) {
+  TemporaryDirectory sql_dir;
+  TemporaryDirectory lite_dir;
+  auto sql = INvStorage::newStorage(storage_config(sql_dir));
+  Json::Value expected = exercise(*sql);
+  LiteStorage storage(storage_config(lite_dir));
+  expect_same(expected, exercise(storage));
+
+  // And read back after a restart
+  LiteStorage reopened(storage_config(lite_dir));
+  EXPECT_EQ(observe(*sql).toStyledString(), observe(reopened).toStyledString());
+}
+
+// An import reads back like the SQL storage, at every step of an update
+TEST(litestorage, import_same_as_sql) {
+  TemporaryDirectory sql_dir;
+  auto sql = INvStorage::newStorage(storage_config(sql_dir));
+  sql->savePrimaryInstalledVersion(version("1"), InstalledVersionUpdateMode::kCurrent);
+  sql->storeEcuSerials(kSerials);
+  Uptane::Target v2 = version("2");
+  v2.setCorrelationId("update-2");
+  sql->savePrimaryInstalledVersion(v2, InstalledVersionUpdateMode::kPending);
+  sql->savePrimaryInstalledVersion(v2, InstalledVersionUpdateMode::kCurrent);
+  sql->savePrimaryInstalledVersion(version("3"), InstalledVersionUpdateMode::kPending);
+  sql->saveInstalledVersion("secondary", version("s1"), InstalledVersionUpdateMode::kCurrent);
+  sql->saveEcuInstallationResult(Uptane::EcuSerial("primary"),
+                                 data::InstallationResult(data::ResultCode::Numeric::kOk, "ok"));
+  sql->storeDeviceInstallationResult(data::InstallationResult(data::ResultCode::Numeric::kOk, "device"), "raw",
+                                     "update-2");
+  sql->saveEcuReportCounter(Uptane::EcuSerial("primary"), 7);
+  sql->saveReportEvent(event("1"));
+  sql->saveReportEvent(event("2"));
+  sql->storeNeedReboot();
+
+  TemporaryDirectory lite_dir;
+  {
+    LiteStorage storage(storage_config(lite_dir));
+    uint64_t size = boost::filesystem::file_size(storage.logPath());
+    storage.importFrom(sql.get());
+    // Each record is written once, in a single append ending with the marker
+    LiteStore log(storage.logPath(), true);
+    ASSERT_EQ(log.liveSize(), log.logSize() - size);
+  }
+  LiteStorage storage(storage_config(lite_dir));
+  EXPECT_EQ(observe(*sql).toStyledString(), observe(storage).toStyledString());
+}
+
+#ifndef __NO_MAIN__
+int main(int argc, char **argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
+#endif
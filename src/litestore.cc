@@ -0,0 +1,399 @@
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include <unordered_set>
+
+#include <boost/crc.hpp>
+
+#include "litestore.h"
+#include "logging/logging.h"
+
+// Log layout: kMagic then records of
+//   crc32 (4) | op (1) | key length (4) | value length (4) | key | value
+// with the crc covering everything after itself. Integers are host order as
+// the log never leaves the device.
+static const char kMagic[] = "LITELOG1";
+static const size_t kMagicSize = sizeof(kMagic) - 1;
+static const size_t kHeaderSize = 13;
+static const uint8_t kOpPut = 1;
+static const uint8_t kOpRemove = 2;
+// Logs smaller than this are never worth compacting
+static const uint64_t kMinCompactSize = 64 * 1024;
+
+class LiteStore::FileLock {
+ public:
+  FileLock(int fd, int op) : fd_(fd) {
+    if (fd_ >= 0 && flock(fd_, op) != 0) {
+      throw std::runtime_error(std::string("Unable to lock state store: ") + strerror(errno));
+    }
+  }
+  ~FileLock() {
+    if (fd_ >= 0) {
+      flock(fd_, LOCK_UN);
+    }
+  }
+  FileLock(const FileLock &) = delete;
+  FileLock &operator=(const FileLock &) = delete;
+
+ private:
+  int fd_;
+};
+
+static void write_all(int fd, const std::string &data, uint64_t offset) {
+  size_t done = 0;
+  while (done < data.size()) {
+    ssize_t rc = pwrite(fd, data.data() + done, data.size() - done, static_cast<off_t>(offset + done));
+    if (rc < 0 && errno == EINTR) {
+      continue;
+    }
+    if (rc <= 0) {
+      throw std::runtime_error(std::string("Unable to write state store: ") + strerror(errno));
+    }
+    done += static_cast<size_t>(rc);
+  }
+}
+
+static bool read_all(int fd, std::string &data, uint64_t offset) {
+  size_t done = 0;
+  while (done < data.size()) {
+    ssize_t rc = pread(fd, &data[done], data.size() - done, static_cast<off_t>(offset + done));
+    if (rc < 0 && errno == EINTR) {
+      continue;
+    }
+    if (rc <= 0) {
+      return false;
+    }
+    done += static_cast<size_t>(rc);
+  }
+  return true;
+}
+
+static std::string encode(uint8_t op, const std::string &key, const std::string &value) {
+  std::string rec(kHeaderSize, '\0');
+  auto klen = static_cast<uint32_t>(key.size());
+  auto vlen = static_cast<uint32_t>(value.size());
+  rec[4] = static_cast<char>(op);
+  memcpy(&rec[5], &klen, 4);
+  memcpy(&rec[9], &vlen, 4);
+  rec += key;
+  rec += value;
+  boost::crc_32_type crc;
+  crc.process_bytes(rec.data() + 4, rec.size() - 4);
+  uint32_t sum = crc.checksum();
+  memcpy(&rec[0], &sum, 4);
+  return rec;
+}
+
+LiteStore::LiteStore(boost::filesystem::path path, bool readonly) : path_(std::move(path)), readonly_(readonly) {
+  std::string lock = path_.string() + ".lock";
+  lock_fd_ = open(lock.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+  if (lock_fd_ < 0 && !readonly_) {
+    throw std::runtime_error("Unable to open " + lock + ": " + strerror(errno));
+  }
+  FileLock guard(lock_fd_, readonly_ ? LOCK_SH : LOCK_EX);
+  refresh(!readonly_);
+}
+
+LiteStore::~LiteStore() {
+  if (fd_ >= 0) {
+    close(fd_);
+  }
+  if (lock_fd_ >= 0) {
+    close(lock_fd_);
+  }
+}
+
+// Brings the index up to date with the log on disk, which another process may
+// have appended to or compacted. Must be called with the file lock held.
+void LiteStore::refresh(bool writable) {
+  struct stat st {};
+  if (stat(path_.c_str(), &st) != 0) {
+    if (!writable) {
+      return;  // nothing has been stored yet
+    }
+    int fd = open(path_.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (fd < 0) {
+      throw std::runtime_error("Unable to create " + path_.string() + ": " + strerror(errno));
+    }
+    write_all(fd, std::string(kMagic, kMagicSize), 0);
+    fsync(fd);
+    close(fd);
+    if (stat(path_.c_str(), &st) != 0) {
+      throw std::runtime_error("Unable to stat " + path_.string() + ": " + strerror(errno));
+    }
+  }
+
+  if (fd_ < 0 || st.st_ino != inode_) {
+    if (fd_ >= 0) {
+      close(fd_);
+    }
+    fd_ = open(path_.c_str(), (readonly_ ? O_RDONLY : O_RDWR) | O_CLOEXEC);
+    if (fd_ < 0) {
+      throw std::runtime_error("Unable to open " + path_.string() + ": " + strerror(errno));
+    }
+    inode_ = st.st_ino;
+    index_.clear();
+    live_ = 0;
+    end_ = 0;
+
+    std::string magic(kMagicSize, '\0');
+    if (!read_all(fd_, magic, 0) || magic != std::string(kMagic, kMagicSize)) {
+      if (!writable) {
+        LOG_WARNING << "Ignoring invalid state store " << path_;
+        close(fd_);
+        fd_ = -1;
+        return;
+      }
+      LOG_WARNING << "Reinitializing invalid state store " << path_;
+      if (ftruncate(fd_, 0) != 0) {
+        throw std::runtime_error("Unable to truncate " + path_.string() + ": " + strerror(errno));
+      }
+      write_all(fd_, std::string(kMagic, kMagicSize), 0);
+      fdatasync(fd_);
+    }
+    end_ = kMagicSize;
+  }
+  replay(writable);
+}
+
+void LiteStore::replay(bool writable) {
+  struct stat st {};
+  if (fstat(fd_, &st) != 0) {
+    throw std::runtime_error("Unable to stat " + path_.string() + ": " + strerror(errno));
+  }
+  auto size = static_cast<uint64_t>(st.st_size);
+  if (size <= end_) {
+    return;
+  }
+
+  std::string tail(size - end_, '\0');
+  if (!read_all(fd_, tail, end_)) {
+    throw std::runtime_error("Unable to read " + path_.string() + ": " + strerror(errno));
+  }
+  size_t pos = 0;
+  while (pos < tail.size()) {
+    bool valid = false;
+    uint32_t klen = 0;
+    uint32_t vlen = 0;
+    uint8_t op = 0;
+    if (tail.size() - pos >= kHeaderSize) {
+      op = static_cast<uint8_t>(tail[pos + 4]);
+      memcpy(&klen, &tail[pos + 5], 4);
+      memcpy(&vlen, &tail[pos + 9], 4);
+      uint64_t len = kHeaderSize + static_cast<uint64_t>(klen) + vlen;
+      if (len <= tail.size() - pos && (op == kOpPut || op == kOpRemove)) {
+        uint32_t sum;
+        memcpy(&sum, &tail[pos], 4);
+        boost::crc_32_type crc;
+        crc.process_bytes(tail.data() + pos + 4, len - 4);
+        valid = crc.checksum() == sum;
+      }
+    }
+    if (!valid) {
+      // Only the tail can be torn, everything before it was synced
+      if (writable) {
+        LOG_WARNING << "Discarding " << tail.size() - pos << " bytes of incomplete records from " << path_;
+        if (ftruncate(fd_, static_cast<off_t>(end_)) != 0) {
+          throw std::runtime_error("Unable to truncate " + path_.string() + ": " + strerror(errno));
+        }
+      }
+      return;
+    }
+
+    uint32_t len = static_cast<uint32_t>(kHeaderSize) + klen + vlen;
+    std::string key = tail.substr(pos + kHeaderSize, klen);
+    auto it = index_.find(key);
+    if (it != index_.end()) {
+      live_ -= it->second.record;
+      index_.erase(it);
+    }
+    if (op == kOpPut) {
+      index_[key] = Entry{end_ + kHeaderSize + klen, vlen, len};
+      live_ += len;
+    }
+    pos += len;
+    end_ += len;
+  }
+}
+
+bool LiteStore::get(const std::string &key, std::string &value) {
+  std::lock_guard<std::mutex> guard(mutex_);
+  if (batching_) {
+    auto staged = staged_.find(key);
+    if (staged != staged_.end()) {
+      if (!staged->second) {
+        return false;
+      }
+      value = *staged->second;
+      return true;
+    }
+  }
+  FileLock lock(lock_fd_, LOCK_SH);
+  refresh(false);
+  auto it = index_.find(key);
+  if (it == index_.end()) {
+    return false;
+  }
+  value.resize(it->second.length);
+  if (!read_all(fd_, value, it->second.offset)) {
+    throw std::runtime_error("Unable to read " + path_.string() + ": " + strerror(errno));
+  }
+  return true;
+}
+
+void LiteStore::append(uint8_t op, const std::string &key, const std::string &value) {
+  if (readonly_) {
+    throw std::logic_error("State store " + path_.string() + " is read-only");
+  }
+  std::lock_guard<std::mutex> guard(mutex_);
+  if (batching_) {
+    staged_[key] = op == kOpPut ? boost::make_optional(value) : boost::none;
+    batch_.push_back(key);
+    return;
+  }
+  FileLock lock(lock_fd_, LOCK_EX);
+  refresh(true);
+  if (op == kOpRemove && index_.count(key) == 0) {
+    return;
+  }
+  writeLocked(encode(op, key, value));
+}
+
+// Appends and syncs records. Must be called with the file lock held.
+void LiteStore::writeLocked(const std::string &records) {
+  write_all(fd_, records, end_);
+  if (fdatasync(fd_) != 0) {
+    throw std::runtime_error("Unable to sync " + path_.string() + ": " + strerror(errno));
+  }
+  // Let replay() index what was just written, just as it would for records
+  // appended by another process
+  replay(true);
+
+  if (end_ > kMinCompactSize && end_ > 2 * live_) {
+    compactLocked();
+  }
+}
+
+void LiteStore::put(const std::string &key, const std::string &value) { append(kOpPut, key, value); }
+
+void LiteStore::remove(const std::string &key) { append(kOpRemove, key, ""); }
+
+void LiteStore::compact() {
+  if (readonly_) {
+    throw std::logic_error("State store " + path_.string() + " is read-only");
+  }
+  std::lock_guard<std::mutex> guard(mutex_);
+  FileLock lock(lock_fd_, LOCK_EX);
+  refresh(true);
+  compactLocked();
+}
+
+LiteStore::Batch::Batch(LiteStore &store) : store_(store) {
+  if (store_.readonly_) {
+    throw std::logic_error("State store " + store_.path_.string() + " is read-only");
+  }
+  std::lock_guard<std::mutex> guard(store_.mutex_);
+  if (store_.batching_) {
+    throw std::logic_error("State store " + store_.path_.string() + " already has a batch");
+  }
+  store_.batching_ = true;
+}
+
+LiteStore::Batch::~Batch() {
+  std::lock_guard<std::mutex> guard(store_.mutex_);
+  store_.batching_ = false;
+  store_.batch_.clear();
+  store_.staged_.clear();
+}
+
+void LiteStore::Batch::commit() { store_.commitBatch(); }
+
+void LiteStore::commitBatch() {
+  std::lock_guard<std::mutex> guard(mutex_);
+  std::vector<std::string> keys;
+  keys.swap(batch_);
+  std::unordered_map<std::string, boost::optional<std::string>> staged;
+  staged.swap(staged_);
+  batching_ = false;
+  if (keys.empty()) {
+    return;
+  }
+  FileLock lock(lock_fd_, LOCK_EX);
+  refresh(true);
+
+  // Each key where it was last changed
+  std::vector<std::string> last;
+  std::unordered_set<std::string> seen;
+  for (auto it = keys.rbegin(); it != keys.rend(); ++it) {
+    if (seen.insert(*it).second) {
+      last.push_back(*it);
+    }
+  }
+  std::string records;
+  for (auto it = last.rbegin(); it != last.rend(); ++it) {
+    const boost::optional<std::string> &value = staged[*it];
+    if (value) {
+      records += encode(kOpPut, *it, *value);
+    } else if (index_.count(*it) > 0) {
+      records += encode(kOpRemove, *it, "");
+    }
+  }
+  if (!records.empty()) {
+    writeLocked(records);
+  }
+}
+
+// Writes the live records to a new log and renames it over the old one, so a
+// crash at any point leaves one complete log or the other.
+void LiteStore::compactLocked() {
+  std::string tmp_path = path_.string() + ".tmp";
+  int fd = open(tmp_path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+  if (fd < 0) {
+    throw std::runtime_error("Unable to create " + tmp_path + ": " + strerror(errno));
+  }
+
+  std::unordered_map<std::string, Entry> index;
+  uint64_t end = kMagicSize;
+  try {
+    std::string out(kMagic, kMagicSize);
+    for (const auto &e : index_) {
+      std::string value(e.second.length, '\0');
+      if (!read_all(fd_, value, e.second.offset)) {
+        throw std::runtime_error("Unable to read " + path_.string() + ": " + strerror(errno));
+      }
+      std::string rec = encode(kOpPut, e.first, value);
+      index[e.first] = Entry{end + kHeaderSize + e.first.size(), e.second.length, static_cast<uint32_t>(rec.size())};
+      end += rec.size();
+      out += rec;
+    }
+    write_all(fd, out, 0);
+    if (fsync(fd) != 0 || rename(tmp_path.c_str(), path_.c_str()) != 0) {
+      throw std::runtime_error("Unable to replace " + path_.string() + ": " + strerror(errno));
+    }
+  } catch (...) {
+    close(fd);
+    unlink(tmp_path.c_str());
+    throw;
+  }
+
+  int dir = open(path_.parent_path().empty() ? "." : path_.parent_path().c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (dir >= 0) {
+    fsync(dir);
+    close(dir);
+  }
+
+  LOG_DEBUG << "Compacted " << path_ << " from " << end_ << " to " << end << " bytes";
+  struct stat st {};
+  fstat(fd, &st);
+  close(fd_);
+  fd_ = fd;
+  inode_ = st.st_ino;
+  index_ = std::move(index);
+  end_ = end;
+  live_ = end - kMagicSize;
+}
@@ -0,0 +1,88 @@
+#ifndef AKTUALIZR_LITE_LITESTORE
+#define AKTUALIZR_LITE_LITESTORE
+
+#include <sys/types.h>
+
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <boost/filesystem.hpp>
+#include <boost/optional.hpp>
+
+// A small key/value store for aktualizr-lite's own records, and for
+// libaktualizr's with LiteStorage, kept as an append-only log with an
+// in-memory index of where each live value is.
+//
+// Every change is appended and synced, or those of a Batch together. A record
+// torn by a crash fails its checksum and is dropped the next time the log is
+// opened for writing. Once more than half of the log is overwritten records
+// it's rewritten with only the live ones, so it stays within about twice the
+// size of its content.
+// Processes sharing a store serialize through an flock on "<path>.lock" and
+// pick up each other's changes before every operation.
+class LiteStore {
+ public:
+  explicit LiteStore(boost::filesystem::path path, bool readonly = false);
+  ~LiteStore();
+  LiteStore(const LiteStore &) = delete;
+  LiteStore &operator=(const LiteStore &) = delete;
+
+  bool get(const std::string &key, std::string &value);
+  void put(const std::string &key, const std::string &value);
+  void remove(const std::string &key);
+  void compact();
+
+  // Holds back the changes made to the store while it's alive, for commit()
+  // to append the last of each key's with a single sync, in the order made.
+  // get() sees them meanwhile, other processes only once committed, and
+  // they're dropped if they never are. A crash during the commit keeps a
+  // prefix of them at most.
+  class Batch {
+   public:
+    explicit Batch(LiteStore &store);
+    ~Batch();
+    Batch(const Batch &) = delete;
+    Batch &operator=(const Batch &) = delete;
+
+    void commit();
+
+   private:
+    LiteStore &store_;
+  };
+
+  uint64_t logSize() const { return end_; }
+  uint64_t liveSize() const { return live_; }
+
+ private:
+  struct Entry {
+    uint64_t offset;  // of the value
+    uint32_t length;  // of the value
+    uint32_t record;  // size of the whole record
+  };
+  class FileLock;
+
+  void refresh(bool writable);
+  void replay(bool writable);
+  void append(uint8_t op, const std::string &key, const std::string &value);
+  void writeLocked(const std::string &records);
+  void commitBatch();
+  void compactLocked();
+
+  boost::filesystem::path path_;
+  bool readonly_;
+  std::mutex mutex_;
+  int fd_{-1};
+  int lock_fd_{-1};
+  ino_t inode_{0};
+  uint64_t end_{0};   // how much of the log has been indexed
+  uint64_t live_{0};  // bytes of the records in the index
+  std::unordered_map<std::string, Entry> index_;
+  // The keys a Batch changed in order, and their values, none for a removal
+  bool batching_{false};
+  std::vector<std::string> batch_;
+  std::unordered_map<std::string, boost::optional<std::string>> staged_;
+};
+
+#endif  // AKTUALIZR_LITE_LITESTORE
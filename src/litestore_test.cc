@@ -0,0 +1,149 @@
+#include <gtest/gtest.h>
+
+#include <fstream>
+
+#include "litestore.h"
+#include "utilities/utils.h"
+
+TEST(litestore, put_get_remove) {
+  TemporaryDirectory dir;
+  boost::filesystem::remove(dir / "state.log");
+  std::string val;
+  {
+    LiteStore store(dir / "state.log");
+    ASSERT_FALSE(store.get("foo", val));
+    store.put("foo", "bar");
+    store.put("empty", "");
+    store.put("foo", "baz");
+    ASSERT_TRUE(store.get("foo", val));
+    ASSERT_EQ("baz", val);
+    ASSERT_TRUE(store.get("empty", val));
+    ASSERT_EQ("", val);
+    store.remove("empty");
+    store.remove("never-set");
+    ASSERT_FALSE(store.get("empty", val));
+  }
+
+  // The index is rebuilt from the log
+  LiteStore store(dir / "state.log", true);
+  ASSERT_TRUE(store.get("foo", val));
+  ASSERT_EQ("baz", val);
+  ASSERT_FALSE(store.get("empty", val));
+  ASSERT_THROW(store.put("foo", "bar"), std::logic_error);
+}
+
+TEST(litestore, shared) {
+  TemporaryDirectory dir;
+  boost::filesystem::remove(dir / "state.log");
+  LiteStore a(dir / "state.log");
+  LiteStore b(dir / "state.log");
+  std::string val;
+
+  a.put("foo", "1");
+  ASSERT_TRUE(b.get("foo", val));
+  ASSERT_EQ("1", val);
+  b.put("foo", "2");
+  b.compact();
+  ASSERT_TRUE(a.get("foo", val));
+  ASSERT_EQ("2", val);
+  a.put("bar", "3");
+  ASSERT_TRUE(b.get("bar", val));
+  ASSERT_EQ("3", val);
+}
+
+TEST(litestore, batch) {
+  TemporaryDirectory dir;
+  boost::filesystem::remove(dir / "state.log");
+  LiteStore a(dir / "state.log");
+  LiteStore b(dir / "state.log");
+  std::string val;
+  a.put("foo", "1");
+  uint64_t size = a.logSize();
+
+  {
+    LiteStore::Batch batch(a);
+    ASSERT_THROW({ LiteStore::Batch nested(a); }, std::logic_error);
+    a.put("foo", "2");
+    a.put("bar", "3");
+    a.remove("bar");
+    a.put("baz", "4");
+    // Seen here but not written yet
+    ASSERT_TRUE(a.get("foo", val));
+    ASSERT_EQ("2", val);
+    ASSERT_FALSE(a.get("bar", val));
+    ASSERT_EQ(size, a.logSize());
+    ASSERT_TRUE(b.get("foo", val));
+    ASSERT_EQ("1", val);
+    batch.commit();
+  }
+  ASSERT_TRUE(b.get("foo", val));
+  ASSERT_EQ("2", val);
+  ASSERT_FALSE(b.get("bar", val));
+  ASSERT_TRUE(b.get("baz", val));
+
+  // One that's never committed is dropped
+  {
+    LiteStore::Batch batch(a);
+    a.put("foo", "5");
+  }
+  ASSERT_TRUE(a.get("foo", val));
+  ASSERT_EQ("2", val);
+  a.put("foo", "6");
+  ASSERT_TRUE(b.get("foo", val));
+  ASSERT_EQ("6", val);
+}
+
+// A record torn by a crash is dropped, the ones before it are kept
+TEST(litestore, torn_write) {
+  TemporaryDirectory dir;
+  boost::filesystem::remove(dir / "state.log");
+  {
+    LiteStore store(dir / "state.log");
+    store.put("foo", "bar");
+  }
+  auto good = boost::filesystem::file_size(dir / "state.log");
+  {
+    std::ofstream f((dir / "state.log").string(), std::ios::app | std::ios::binary);
+    f << "\x01\x02\x03\x04\x01garbage";
+  }
+  std::string val;
+  LiteStore readonly(dir / "state.log", true);
+  ASSERT_TRUE(readonly.get("foo", val));
+  ASSERT_EQ(good + 12, boost::filesystem::file_size(dir / "state.log"));
+
+  LiteStore store(dir / "state.log");
+  ASSERT_EQ(good, boost::filesystem::file_size(dir / "state.log"));
+  ASSERT_TRUE(store.get("foo", val));
+  ASSERT_EQ("bar", val);
+  store.put("foo", "baz");
+  ASSERT_TRUE(LiteStore(dir / "state.log", true).get("foo", val));
+  ASSERT_EQ("baz", val);
+}
+
+// Overwriting a key forever keeps the log bounded
+TEST(litestore, compaction) {
+  TemporaryDirectory dir;
+  boost::filesystem::remove(dir / "state.log");
+  LiteStore store(dir / "state.log");
+  std::string big(1024, 'x');
+  store.put("constant", "value");
+  for (int i = 0; i < 1000; i++) {
+    store.put("counter", big + std::to_string(i));
+    ASSERT_LE(store.logSize(), 2 * store.liveSize() + 64 * 1024 + 2048);
+  }
+  ASSERT_LT(boost::filesystem::file_size(dir / "state.log"), 100 * 1024);
+
+  std::string val;
+  LiteStore reopened(dir / "state.log");
+  ASSERT_TRUE(reopened.get("counter", val));
+  ASSERT_EQ(big + "999", val);
+  ASSERT_TRUE(reopened.get("constant", val));
+  ASSERT_EQ("value", val);
+}
+
+#ifndef __NO_MAIN__
+int main(int argc, char **argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
+#endif
@@ -1,10 +1,21 @@
+#include <algorithm>
+#include <condition_variable>
 #include <iostream>
+#include <mutex>
+#include <set>
 
 #include <boost/filesystem.hpp>
 #include <boost/program_options.hpp>
 
+#include "alloctrack.h"
+#include "asynclog.h"
 #include "config/config.h"
+#include "control.h"
+#include "crypto/keymanager.h"
+#include "gc.h"
 #include "helpers.h"
+#include "snapshot.h"
+#include "workers.h"
 
 #include "utilities/aktualizr_version.h"
 
@@ -33,6 +44,19 @@ static void log_info_target(const std::string &prefix, const Config &config, con
   }
 }
 
+// Returned by a SubCommand's fast path when it needs a full LiteClient
+static const int kNeedClient = -1;
+
+static int status_fast(const Config &config, const bpo::variables_map &unused) {
+  (void)unused;
+  auto target = LiteClient::cachedCurrentTarget(config);
+  if (!target) {
+    return kNeedClient;
+  }
+  log_info_target("Active image is: ", config, *target);
+  return 0;
+}
+
 static int status_main(LiteClient &client, const bpo::variables_map &unused) {
   (void)unused;
   auto target = client.primary->getCurrent();
@@ -49,92 +73,263 @@ static int status_main(LiteClient &client, const bpo::variables_map &unused) {
   return 0;
 }
 
+static std::vector<Uptane::Target> available_targets(LiteClient &client, const Uptane::HardwareIdentifier &hwid) {
+  std::vector<Uptane::Target> targets;
+  for (auto &t : client.allTargets()) {
+    if (!target_has_tags(t, client.tags)) {
+      continue;
+    }
+    for (auto const &it : t.hardwareIds()) {
+      if (it == hwid) {
+        targets.push_back(t);
+        break;
+      }
+    }
+  }
+  return targets;
+}
+
 static int list_main(LiteClient &client, const bpo::variables_map &unused) {
   (void)unused;
   Uptane::HardwareIdentifier hwid(client.config.provision.primary_ecu_hardware_id);
 
   LOG_INFO << "Refreshing Targets metadata";
-  if (!client.primary->updateImageMeta()) {
+  if (!client.updateImageMeta()) {
     LOG_WARNING << "Unable to update latest metadata, using local copy";
-    if (!client.primary->checkImageMetaOffline()) {
+    if (!client.checkImageMetaOffline()) {
       LOG_ERROR << "Unable to use local copy of TUF data";
       return 1;
     }
   }
 
   LOG_INFO << "Updates available to " << hwid << ":";
-  for (auto &t : client.primary->allTargets()) {
-    if (!target_has_tags(t, client.tags)) {
-      continue;
-    }
-    for (auto const &it : t.hardwareIds()) {
-      if (it == hwid) {
-        log_info_target("", client.config, t);
-        break;
-      }
+  auto current = client.primary->getCurrent();
+  UpdateEstimator estimator(client.config, client.storage);
+  // Fetching commit objects writes to the repo, so keep out of a daemon's garbage collection
+  std::unique_ptr<Lock> lock = client.getDownloadLock();
+  if (lock == nullptr) {
+    LOG_WARNING << "Unable to take the download lock, update sizes aren't estimated";
+  }
+  for (auto &t : available_targets(client, hwid)) {
+    log_info_target("", client.config, t);
+    // Only for the targets it'd be an update to, as each can mean fetching its commit object
+    if (lock != nullptr && !t.MatchTarget(current) && Version(current.custom_version()) < Version(t.custom_version())) {
+      LOG_INFO << "\tUpdate size: " << estimator.estimate(t, client.allTargets()).str();
     }
   }
+  if (lock != nullptr) {
+    lock->release();
+  }
   return 0;
 }
 
-static std::unique_ptr<Uptane::Target> find_target(const std::shared_ptr<SotaUptaneClient> &client,
-                                                   Uptane::HardwareIdentifier &hwid,
-                                                   const std::vector<std::string> &tags, const std::string &version) {
-  std::unique_ptr<Uptane::Target> rv;
-  if (!client->updateImageMeta()) {
+// The target named `version`, or for "latest" the newest one the device can
+// adopt. nullptr when the rollout holds back everything newer than what the
+// device runs.
+static std::unique_ptr<Uptane::Target> find_target(LiteClient &client, Uptane::HardwareIdentifier &hwid,
+                                                   const std::vector<std::string> &tags, const std::string &version,
+                                                   const Uptane::Target &current) {
+  if (!client.updateImageMeta()) {
     LOG_WARNING << "Unable to update latest metadata, using local copy";
-    if (!client->checkImageMetaOffline()) {
+    if (!client.checkImageMetaOffline()) {
       LOG_ERROR << "Unable to use local copy of TUF data";
       throw std::runtime_error("Unable to find update");
     }
   }
 
   bool find_latest = (version == "latest");
-  std::unique_ptr<Uptane::Target> latest = nullptr;
-  for (auto &t : client->allTargets()) {
+  std::vector<Uptane::Target> matching;
+  for (auto &t : client.allTargets()) {
     if (!target_has_tags(t, tags)) {
       continue;
     }
     for (auto const &it : t.hardwareIds()) {
       if (it == hwid) {
         if (find_latest) {
-          if (latest == nullptr || Version(latest->custom_version()) < Version(t.custom_version())) {
-            latest = std_::make_unique<Uptane::Target>(t);
-          }
+          matching.push_back(t);
         } else if (version == t.filename() || version == t.custom_version()) {
           return std_::make_unique<Uptane::Target>(t);
         }
+        break;
       }
     }
   }
-  if (find_latest && latest != nullptr) {
-    return latest;
+  if (matching.empty()) {
+    throw std::runtime_error("Unable to find update");
   }
-  throw std::runtime_error("Unable to find update");
+
+  // Staged rollouts only hold back "latest", a target asked for by name is always used
+  std::unique_ptr<Uptane::Target> deferred;
+  auto latest = select_latest(matching, current, client.rollout.get(), RolloutPolicy::Clock::now(), &deferred);
+  if (deferred != nullptr) {
+    LOG_INFO << "Staged rollout of " << deferred->filename() << " reaches this device at "
+             << RolloutPolicy::timeStr(client.rollout->adoptionTime(*deferred));
+  }
+  return latest;
 }
 
-static data::ResultCode::Numeric do_update(LiteClient &client, Uptane::Target target) {
+// Checks every OSTree object and app bundle of the target against its hash
+static bool verify_content(LiteClient &client, const Uptane::Target &target) {
+  auto start = std::chrono::steady_clock::now();
+  ContentVerifier verifier(client.config.pacman.sysroot, client.verify, client.cancel->flag());
+  VerifyResult res;
+  try {
+    if (target.IsOstree()) {
+      verifier.addCommit(target.sha256Hash());
+    }
+    auto apps = target.custom_data()["docker_apps"];
+    for (const auto &app : configured_apps(client.config.pacman)) {
+      if (!apps.isMember(app)) {
+        continue;
+      }
+      std::string filename = apps[app]["filename"].asString();
+      for (const auto &t : client.allTargets()) {
+        if (t.filename() == filename) {
+          auto stored = client.storage->checkTargetFile(t);
+          if (stored) {
+            verifier.addFile(filename, stored->second, t.sha256Hash(), stored->first);
+          }
+          break;
+        }
+      }
+    }
+    res = verifier.run();
+  } catch (const std::exception &ex) {
+    LOG_ERROR << "Unable to verify content of " << target.filename() << ": " << ex.what();
+    return false;
+  }
+  auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+  LOG_INFO << "Verified " << res.checked << " objects and app bundles in " << ms << "ms with " << client.verify.threads
+           << " threads";
+  for (const auto &name : res.failed) {
+    LOG_ERROR << "Content of " << name << " doesn't match its hash";
+  }
+  return res.ok();
+}
+
+// Keeps the cached app bundles of `installed` and of the target installed
+// before it, which is what a rollback would go back to
+static void retain_bundles(LiteClient &client, const Uptane::Target &installed) {
+  if (!client.bundle_cache) {
+    return;
+  }
+  std::set<std::string> keep{installed.filename()};
+  std::vector<Uptane::Target> log;
+  client.storage->loadPrimaryInstallationLog(&log, true);
+  for (auto it = log.rbegin(); it != log.rend(); ++it) {
+    if (it->filename() != installed.filename()) {
+      keep.insert(it->filename());
+      break;
+    }
+  }
+  uint64_t freed = client.bundle_cache->retain(keep);
+  if (freed > 0) {
+    LOG_INFO << "Removed " << freed << " bytes of app bundles no longer in use from the cache";
+  }
+}
+
+// Meters a download for the bandwidth limit by how far through it is, which
+// needs the size of what's missing. See DownloadMeter for the precision that
+// gives the limit. Must be called holding the download lock,
+// as that can mean fetching the commit object.
+static std::unique_ptr<DownloadMeter> download_meter(LiteClient &client, const Uptane::Target &target) {
+  uint64_t expected = target.length();
+  if (target.IsOstree()) {
+    UpdateEstimate estimate = UpdateEstimator(client.config, client.storage, client.bundle_cache.get())
+                                  .estimate(target, client.allTargets());
+    if (!estimate.known) {
+      LOG_WARNING << "Unable to tell the size of " << target.filename() << ", its download isn't rate limited";
+      return nullptr;
+    }
+    expected = estimate.ostree_bytes;
+  }
+  return std_::make_unique<DownloadMeter>(expected);
+}
+
+static data::ResultCode::Numeric run_update(LiteClient &client, Uptane::Target target, PhaseTimer &timer) {
   target.InsertEcu({client.primary_ecu.first, client.primary_ecu.second});
-  generate_correlation_id(target);
+  if (!client.resumeDownload(target)) {
+    generate_correlation_id(target);
+  }
 
   std::unique_ptr<Lock> lock = client.getDownloadLock();
   if (lock == nullptr) {
     return data::ResultCode::Numeric::kInternalError;
   }
+  client.checkpointDownload(target);
+  std::vector<Uptane::Target> bundles;
+  if (client.bundle_cache) {
+    bundles = BundleCache::bundles(target, client.allTargets(), configured_apps(client.config.pacman));
+    uint64_t saved = client.bundle_cache->prime(target.filename(), bundles);
+    LOG_INFO << "App bundle cache saved " << saved << " bytes of this download, " << client.bundle_cache->stats().str();
+  }
+  std::unique_ptr<DownloadMeter> meter;
+  if (!client.download_rate.empty()) {
+    meter = download_meter(client, target);
+  }
   client.notifyDownloadStarted(target);
-  if (!client.primary->downloadImage(target).first) {
+  timer.start("download");
+  bool downloaded;
+  {
+    api::FlowControlToken token;
+    UpdateCancel::Scope cancel_scope(*client.cancel, &token);
+    std::unique_ptr<DownloadThrottle> throttle;
+    boost::signals2::scoped_connection progress;
+    if (meter != nullptr) {
+      DownloadMeter *m = meter.get();
+      throttle = std_::make_unique<DownloadThrottle>(client.download_rate, [m] { return m->received(); }, token);
+      progress = client.events_channel->connect([m, &target](const std::shared_ptr<event::BaseEvent> &event) {
+        if (event->isTypeOf<event::DownloadProgressReport>()) {
+          const auto *report = dynamic_cast<event::DownloadProgressReport *>(event.get());
+          if (report->target.filename() == target.filename()) {
+            m->progress(report->progress);
+          }
+        }
+      });
+    }
+    downloaded = client.primary->downloadImage(target, &token).first;
+  }
+  timer.stop();
+  if (!downloaded && client.cancel->cancelled()) {
+    lock->release();
+    // The checkpoint is kept, so the next attempt is the same one and reuses the objects fetched
+    LOG_INFO << "Download of " << target.filename() << " cancelled: " << client.cancel->reason();
+    client.notifyDownloadCancelled(target);
+    return data::ResultCode::Numeric::kOperationCancelled;
+  }
+  if (!downloaded) {
     lock->release();
     client.notifyDownloadFinished(target, false);
     return data::ResultCode::Numeric::kDownloadFailed;
   }
   lock->release();
+  if (client.bundle_cache) {
+    client.bundle_cache->add(target.filename(), bundles);
+  }
   client.notifyDownloadFinished(target, true);
 
-  if (client.primary->VerifyTarget(target) != TargetStatus::kGood) {
+  timer.start("verify");
+  TargetStatus status;
+  {
+    UpdateCancel::Scope cancel_scope(*client.cancel, nullptr);
+    status = client.primary->VerifyTarget(target);
+    if (status == TargetStatus::kGood && client.verify.enabled() && !verify_content(client, target)) {
+      status = TargetStatus::kHashMismatch;
+    }
+  }
+  timer.stop();
+  if (client.cancel->cancelled()) {
+    // Whatever was found corrupt so far has been dropped and is fetched again next time
+    LOG_INFO << "Verification of " << target.filename() << " cancelled: " << client.cancel->reason();
+    return data::ResultCode::Numeric::kOperationCancelled;
+  }
+  if (status != TargetStatus::kGood) {
+    client.clearDownloadCheckpoint();
     client.notifyInstallFinished(target, data::ResultCode::Numeric::kVerificationFailed);
     LOG_ERROR << "Downloaded target is invalid";
     return data::ResultCode::Numeric::kVerificationFailed;
   }
+  client.clearDownloadCheckpoint();
 
   lock = client.getUpdateLock();
   if (lock == nullptr) {
@@ -142,13 +337,17 @@ static data::ResultCode::Numeric do_update(LiteClient &client, Uptane::Target ta
   }
 
   client.notifyInstallStarted(target);
+  timer.start("install");
   auto iresult = client.primary->PackageInstall(target);
+  timer.stop();
   if (iresult.result_code.num_code == data::ResultCode::Numeric::kNeedCompletion) {
     LOG_INFO << "Update complete. Please reboot the device to activate";
     client.storage->savePrimaryInstalledVersion(target, InstalledVersionUpdateMode::kPending);
+    retain_bundles(client, target);
   } else if (iresult.result_code.num_code == data::ResultCode::Numeric::kOk) {
     LOG_INFO << "Update complete. No reboot needed";
     client.storage->savePrimaryInstalledVersion(target, InstalledVersionUpdateMode::kCurrent);
+    retain_bundles(client, target);
     lock->release();
   } else {
     LOG_ERROR << "Unable to install update: " << iresult.description;
@@ -159,6 +358,17 @@ static data::ResultCode::Numeric do_update(LiteClient &client, Uptane::Target ta
   return iresult.result_code.num_code;
 }
 
+static data::ResultCode::Numeric do_update(LiteClient &client, Uptane::Target target) {
+  PhaseTimer timer;
+  data::ResultCode::Numeric rc;
+  {
+    ScopedResourceLimits limits(client.update_limits);
+    rc = run_update(client, std::move(target), timer);
+  }
+  LOG_INFO << "Update phase durations: " << timer.str();
+  return rc;
+}
+
 static int update_main(LiteClient &client, const bpo::variables_map &variables_map) {
   Uptane::HardwareIdentifier hwid(client.config.provision.primary_ecu_hardware_id);
 
@@ -167,19 +377,518 @@ static int update_main(LiteClient &client, const bpo::variables_map &variables_m
     version = variables_map["update-name"].as<std::string>();
   }
   LOG_INFO << "Finding " << version << " to update to...";
-  auto target = find_target(client.primary, hwid, client.tags, version);
+  auto target = find_target(client, hwid, client.tags, version, client.primary->getCurrent());
   if (target == nullptr) {
     LOG_INFO << "Already up-to-date";
     return 0;
   }
   LOG_INFO << "Updating to: " << *target;
-  data::ResultCode::Numeric rc = do_update(client, *target);
+  data::ResultCode::Numeric rc;
+  {
+    ShutdownSignals signals([&client](int signal) {
+      LOG_INFO << "Received signal " << signal << ", cancelling the update unless it's installing, signal again "
+               << "to exit now";
+      client.cancel->cancel("signal " + std::to_string(signal));
+    });
+    rc = do_update(client, *target);
+  }
   if (rc == data::ResultCode::Numeric::kNeedCompletion || rc == data::ResultCode::Numeric::kOk) {
     return 0;
   }
   return 1;
 }
 
+// What the daemon is doing, shared by its workers and the control socket's thread
+struct DaemonState {
+  std::mutex lock;
+  std::condition_variable cv;
+  Uptane::Target current{Uptane::Target::Unknown()};
+  std::vector<Uptane::Target> available;
+  std::string state{"starting"};
+  std::string target;  // the target being updated to
+  unsigned int progress{0};
+  bool check_requested{false};
+  std::string update_requested;
+  bool installing{false};
+  bool polling{false};
+  uint64_t poll_wait{0};  // seconds until the next poll, set by the poll that just ran
+  bool stop{false};
+  int exit_code{0};
+  std::vector<const Worker *> workers;
+  const BundleCache *bundle_cache{nullptr};
+  UpdateCancel *cancel{nullptr};
+};
+
+static Json::Value target_json(const Uptane::Target &t) {
+  Json::Value res;
+  res["name"] = t.filename();
+  res["version"] = t.custom_version();
+  res["sha256"] = t.sha256Hash();
+  auto apps = t.custom_data()["docker_apps"];
+  for (Json::ValueIterator i = apps.begin(); i != apps.end(); ++i) {
+    res["docker_apps"][i.key().asString()] = (*i)["filename"];
+  }
+  return res;
+}
+
+// Must be called with state.lock held
+static Json::Value daemon_status(const DaemonState &state) {
+  Json::Value res;
+  res["current"] = target_json(state.current);
+  res["state"] = state.state;
+  if (!state.target.empty()) {
+    res["target"] = state.target;
+    res["progress"] = state.progress;
+  }
+  for (const auto *worker : state.workers) {
+    res["workers"][worker->name()] = worker->latency().json();
+  }
+  if (state.bundle_cache != nullptr) {
+    res["bundle_cache"] = state.bundle_cache->stats().json();
+  }
+  return res;
+}
+
+static void set_daemon_state(DaemonState &state, ControlServer *control, const std::string &new_state,
+                             const std::string &target = "", unsigned int progress = 0) {
+  Json::Value status;
+  {
+    std::lock_guard<std::mutex> guard(state.lock);
+    state.state = new_state;
+    state.target = target;
+    state.progress = progress;
+    status = daemon_status(state);
+  }
+  // Published outside of state.lock as the control thread takes it to serve requests
+  if (control != nullptr) {
+    control->publish(status);
+  }
+}
+
+// Polling keeps going during an update, but what the update is doing is the
+// more useful state to show
+static void set_poll_state(DaemonState &state, ControlServer *control, const std::string &new_state) {
+  Json::Value status;
+  {
+    std::lock_guard<std::mutex> guard(state.lock);
+    if (state.installing) {
+      return;
+    }
+    state.state = new_state;
+    state.target.clear();
+    state.progress = 0;
+    status = daemon_status(state);
+  }
+  if (control != nullptr) {
+    control->publish(status);
+  }
+}
+
+static Json::Value control_handler(DaemonState &state, const Json::Value &req) {
+  std::string cmd = req["cmd"].asString();
+  Json::Value res;
+  std::lock_guard<std::mutex> guard(state.lock);
+  if (cmd == "status") {
+    return daemon_status(state);
+  } else if (cmd == "list") {
+    res["targets"] = Json::arrayValue;
+    for (const auto &t : state.available) {
+      res["targets"].append(target_json(t));
+    }
+  } else if (cmd == "check") {
+    state.check_requested = true;
+    state.cv.notify_all();
+    res["ok"] = true;
+  } else if (cmd == "cancel") {
+    if (state.installing && state.cancel != nullptr && state.cancel->active()) {
+      state.cancel->cancel("cancelled over the control socket");
+      res["ok"] = true;
+    } else {
+      res["error"] = "No download or verification under way";
+    }
+  } else if (cmd == "update") {
+    std::string name = req["target"].asString();
+    auto match = [&name](const Uptane::Target &t) { return t.filename() == name || t.custom_version() == name; };
+    if (name.empty() || std::find_if(state.available.begin(), state.available.end(), match) == state.available.end()) {
+      res["error"] = "Unknown target: " + name;
+    } else {
+      state.update_requested = name;
+      state.cv.notify_all();
+      res["ok"] = true;
+    }
+  } else {
+    res["error"] = "Unknown command: " + cmd;
+  }
+  return res;
+}
+
+// Sleep for the polling interval unless a control client asks for something.
+// An update requested during an install waits for the install to finish, when
+// the install worker wakes this up.
+static void daemon_wait(DaemonState &state, uint64_t secs) {
+  std::unique_lock<std::mutex> guard(state.lock);
+  state.cv.wait_for(guard, std::chrono::seconds(secs), [&state] {
+    return state.check_requested || (!state.update_requested.empty() && !state.installing) || state.stop;
+  });
+  state.check_requested = false;
+}
+
+static void request_stop(DaemonState &state, int exit_code) {
+  std::lock_guard<std::mutex> guard(state.lock);
+  if (!state.stop) {
+    state.stop = true;
+    state.exit_code = exit_code;
+  }
+  state.cv.notify_all();
+}
+
+// Runs a slice of garbage collection. Returns true once it has completed.
+static bool run_gc(LiteClient &client, RepoGc &gc, const GcBudget &budget) {
+  // Hold the download lock so nothing is pulled into the repo while we prune it
+  std::unique_ptr<Lock> lock = client.getDownloadLock();
+  if (lock == nullptr) {
+    return false;
+  }
+  bool done = gc.run(budget);
+  lock->release();
+  if (done) {
+    LOG_INFO << "Garbage collection removed " << gc.removed() << " objects, reclaimed " << gc.reclaimed()
+             << " bytes";
+  }
+  return done;
+}
+
+// Whether the metered connection policy lets an update to `target` go ahead now
+static bool metered_allows(LiteClient &client, const Uptane::Target &target) {
+  if (!client.metered.enabled()) {
+    return true;
+  }
+  std::string iface = MeteredPolicy::defaultInterface();
+  if (!client.metered.metered(iface)) {
+    return true;
+  }
+  UpdateEstimate estimate;
+  {
+    // Fetching the commit object writes to the repo, so keep out of garbage collection's way
+    std::unique_ptr<Lock> lock = client.getDownloadLock();
+    if (lock == nullptr) {
+      return false;
+    }
+    estimate = UpdateEstimator(client.config, client.storage, client.bundle_cache.get())
+                   .estimate(target, client.allTargets());
+    lock->release();
+  }
+  if (!client.metered.allows(estimate, iface)) {
+    LOG_INFO << "Deferring update to " << target.filename() << " while on metered interface " << iface
+             << ", update size: " << estimate.str() << ", limit: " << client.metered.limit << " bytes";
+    return false;
+  }
+  return true;
+}
+
+// What the daemon's workers share. Polling, reporting and updating each run
+// on a worker of their own so that a slow report or a wait for a lock file
+// doesn't hold up the others. `uptane` serialises the use of the LiteClient,
+// as libaktualizr's SotaUptaneClient isn't thread safe, which means a poll
+// still waits for a download or install under way. It's let go of while
+// waiting for the lock files. Reporting has an HTTP client of its own, and so
+// does the watch for a newer target that polls run instead while an update
+// is under way, when preempt_check_sec is set.
+struct Daemon {
+  Daemon(LiteClient &client_in, const bpo::variables_map &vm)
+      : client(client_in),
+        hwid(client.config.provision.primary_ecu_hardware_id),
+        compare_docker_apps(should_compare_docker_apps(client.config)),
+        gc_budget(client.config.pacman.extra),
+        reports(client.config, client.storage) {
+    interval = client.config.uptane.polling_sec;
+    if (vm.count("interval") > 0) {
+      interval = vm["interval"].as<uint64_t>();
+    }
+    // Only set up by ALLOC_TRACKING builds, which the soak test runs
+    if (vm.count("max-polls") > 0) {
+      max_polls = vm["max-polls"].as<uint64_t>();
+      max_heap_growth = vm["max-heap-growth"].as<uint64_t>();
+    }
+    client.storage->loadPrimaryInstallationLog(&installed_versions, false);
+    if (client.preempt.enabled()) {
+      auto http = std::make_shared<HttpClient>();
+      KeyManager keys(client.storage, client.config.keymanagerConfig());
+      keys.copyCertsToCurl(*http);
+      watch = std_::make_unique<NewerTargetWatch>(http, client.config.uptane.repo_server);
+    }
+  }
+
+  Uptane::Target current() {
+    std::lock_guard<std::mutex> guard(state.lock);
+    return state.current;
+  }
+
+  LiteClient &client;
+  DaemonState state;
+  std::mutex uptane;
+  ControlServer *control{nullptr};
+  Worker *reporter{nullptr};
+  Worker *installer{nullptr};
+
+  Uptane::HardwareIdentifier hwid;
+  bool compare_docker_apps;
+  uint64_t interval{0};
+  std::vector<Uptane::Target> installed_versions;
+  bool first_poll{true};
+  GcBudget gc_budget;
+  std::unique_ptr<RepoGc> gc;
+  SystemInfoReporter reports;
+  std::unique_ptr<NewerTargetWatch> watch;
+  // Guarded by state.lock. The update a newer target may cancel, Unknown for
+  // one asked for by name or for a change of apps.
+  Uptane::Target updating{Uptane::Target::Unknown()};
+  bool preempted{false};
+
+  uint64_t max_polls{0};
+  uint64_t max_heap_growth{0};
+  uint64_t polls{0};
+  // Counts whatever allocates while the poll worker is in a phase, the other
+  // workers included
+  AllocPhases allocs;
+  HeapTrend heap;
+};
+
+// Runs on the install worker. `apps_changed` reinstalls the current target
+// for a change in the docker apps configured. A newer target only cancels a
+// `preemptible` update.
+static void daemon_install(Daemon &d, const Uptane::Target &target, bool apps_changed, bool preemptible) {
+  LiteClient &client = d.client;
+  std::unique_lock<std::mutex> uptane(d.uptane);
+  {
+    std::lock_guard<std::mutex> guard(d.state.lock);
+    // A shutdown asked for since this was posted cancels it straight away
+    if (!d.state.stop) {
+      client.cancel->reset();
+    }
+    d.updating = preemptible ? target : Uptane::Target::Unknown();
+    d.preempted = false;
+  }
+  LOG_INFO << "Updating base image to: " << target;
+  d.gc.reset();
+  data::ResultCode::Numeric rc = data::ResultCode::Numeric::kInternalError;
+  bool failed = false;
+  try {
+    rc = do_update(client, target);
+  } catch (const std::exception &ex) {
+    LOG_ERROR << "Update to " << target.filename() << " failed: " << ex.what();
+    failed = true;
+  }
+  {
+    std::lock_guard<std::mutex> guard(d.state.lock);
+    d.state.installing = false;
+    d.updating = Uptane::Target::Unknown();
+    if (d.preempted) {
+      // Poll again straight away to pick the newer target
+      d.state.check_requested = true;
+    }
+    // For an update requested while this one was under way
+    d.state.cv.notify_all();
+  }
+  set_daemon_state(d.state, d.control, "idle");
+  if (failed) {
+    // What's left of the update can't be trusted, so exit for the service
+    // manager to start the daemon afresh, as an uncaught error always did
+    request_stop(d.state, 1);
+    return;
+  }
+
+  if (apps_changed && rc != data::ResultCode::Numeric::kOperationCancelled) {
+    // A cancelled one is left to be found again on the next start
+    client.storeDockerParamsDigest();
+  } else if (rc == data::ResultCode::Numeric::kOk) {
+    client.http_client->updateHeader("x-ats-target", target.filename());
+    if (d.gc_budget.enabled()) {
+      d.gc = std_::make_unique<RepoGc>(client.config.pacman.sysroot, std::vector<std::string>{target.sha256Hash()});
+    }
+    // Poll again straight away to update this device's target name on the server
+    std::lock_guard<std::mutex> guard(d.state.lock);
+    d.state.current = target;
+    d.state.check_requested = true;
+    d.state.cv.notify_all();
+  } else if (rc == data::ResultCode::Numeric::kNeedCompletion) {
+    set_daemon_state(d.state, d.control, "rebooting", target.filename());
+    if (std::system(client.config.bootloader.reboot_command.c_str()) != 0) {
+      LOG_ERROR << "Unable to reboot system";
+      request_stop(d.state, 1);
+    }
+  }
+}
+
+static bool post_install(Daemon &d, const Uptane::Target &target, bool apps_changed, bool preemptible) {
+  {
+    std::lock_guard<std::mutex> guard(d.state.lock);
+    d.state.installing = true;
+  }
+  if (!d.installer->post([&d, target, apps_changed, preemptible] {
+        daemon_install(d, target, apps_changed, preemptible);
+      })) {
+    std::lock_guard<std::mutex> guard(d.state.lock);
+    d.state.installing = false;
+    return false;
+  }
+  return true;
+}
+
+// Runs on the poll worker in place of a poll while an update holds the
+// client. Cancels the download or verification under way for a newer target.
+static void preempt_check(Daemon &d) {
+  LiteClient &client = d.client;
+  Uptane::Target updating = Uptane::Target::Unknown();
+  {
+    std::lock_guard<std::mutex> guard(d.state.lock);
+    updating = d.updating;
+  }
+  if (updating.MatchTarget(Uptane::Target::Unknown()) || !client.cancel->active()) {
+    return;
+  }
+  auto newer = [&d, &client, &updating](const Uptane::Target &t) {
+    auto hwids = t.hardwareIds();
+    return target_has_tags(t, client.tags) && std::find(hwids.begin(), hwids.end(), d.hwid) != hwids.end() &&
+           Version(updating.custom_version()) < Version(t.custom_version()) &&
+           (client.rollout == nullptr || client.rollout->eligible(t));
+  };
+  std::string name = d.watch->check(newer);
+  if (name.empty()) {
+    return;
+  }
+  LOG_INFO << "Target " << name << " is newer than " << updating.filename() << ", cancelling the update to it";
+  {
+    // Before the cancel, so the install worker sees it once the update returns
+    std::lock_guard<std::mutex> guard(d.state.lock);
+    d.preempted = true;
+  }
+  client.cancel->cancel("newer target " + name);
+}
+
+// Runs on the poll worker. Returns the seconds to wait before the next poll.
+static uint64_t daemon_poll(Daemon &d) {
+  LiteClient &client = d.client;
+  if (AllocTracker::enabled() && d.polls > 0) {
+    d.allocs.stop();
+    LOG_INFO << "Poll allocations: " << d.allocs.str() << " heap=" << AllocTracker::heapInUse();
+    d.allocs.clear();
+    d.heap.add(AllocTracker::heapInUse());
+  }
+  if (d.max_polls > 0 && d.polls == d.max_polls) {
+    uint64_t growth = d.heap.growth();
+    if (growth > d.max_heap_growth) {
+      LOG_ERROR << "Heap grew by " << growth << " bytes over " << d.heap.samples() << " polls";
+      request_stop(d.state, 1);
+    } else {
+      LOG_INFO << "Heap grew by " << growth << " bytes over " << d.heap.samples() << " polls";
+      request_stop(d.state, 0);
+    }
+    return 0;
+  }
+  d.polls++;
+
+  d.allocs.start("check");
+  std::unique_lock<std::mutex> uptane(d.uptane, std::try_to_lock);
+  if (!uptane.owns_lock()) {
+    bool installing;
+    {
+      std::lock_guard<std::mutex> guard(d.state.lock);
+      installing = d.state.installing;
+    }
+    if (d.watch != nullptr && installing) {
+      preempt_check(d);
+      return client.preempt.check_sec;
+    }
+    uptane.lock();
+  }
+  set_poll_state(d.state, d.control, "checking");
+  LOG_INFO << "Refreshing Targets metadata";
+  if (!client.updateImageMeta()) {
+    LOG_WARNING << "Unable to update latest metadata";
+    set_poll_state(d.state, d.control, "offline");
+    return 10;  // There's no point trying to look for an update
+  }
+
+  Uptane::Target current = d.current();
+  if (d.first_poll) {
+    // On the first poll we need to see if we have a config change detected
+    // from the previous run. We need to make sure we have up-to-date metadata,
+    // so this really needs to be done here.
+    d.first_poll = false;
+    if (current.MatchTarget(Uptane::Target::Unknown()) || !client.dockerAppsChanged() ||
+        !post_install(d, current, true, false)) {
+      client.storeDockerParamsDigest();
+    }
+    if (d.gc_budget.enabled()) {
+      // Clean up after whatever was finalized during start up
+      d.gc = std_::make_unique<RepoGc>(client.config.pacman.sysroot,
+                                       std::vector<std::string>{current.sha256Hash(), client.checkpointedDownload()});
+    }
+  }
+
+  // Dropped if the last report is still waiting to go out
+  d.reporter->post([&d] { d.reports.report(); });
+
+  d.allocs.start("select");
+  bool installing;
+  std::string requested;
+  {
+    std::lock_guard<std::mutex> guard(d.state.lock);
+    installing = d.state.installing;
+    // A request made during an update waits for it to finish
+    if (!installing) {
+      std::swap(requested, d.state.update_requested);
+    }
+  }
+  std::unique_ptr<Uptane::Target> target;
+  if (installing) {
+    // Nothing to select until the update under way is done
+  } else if (requested.empty()) {
+    target = find_target(client, d.hwid, client.tags, "latest", current);
+  } else {
+    try {
+      target = find_target(client, d.hwid, client.tags, requested, current);
+    } catch (const std::exception &ex) {
+      LOG_ERROR << "Unable to update to requested target " << requested << ": " << ex.what();
+    }
+  }
+  {
+    std::vector<Uptane::Target> available = available_targets(client, d.hwid);
+    std::lock_guard<std::mutex> guard(d.state.lock);
+    d.state.available = std::move(available);
+  }
+  set_poll_state(d.state, d.control, "idle");
+
+  if (target != nullptr) {
+    // This is a workaround for finding and avoiding bad updates after a rollback.
+    // Rollback sets the installed version state to none instead of broken, so there is no
+    // easy way to find just the bad versions without api/storage changes. As a workaround we
+    // just check if the version is known (old hash) and not current/pending and abort if so.
+    // An update explicitly requested over the control socket is always honored.
+    bool known_target_sha = requested.empty() && known_local_target(client, *target, d.installed_versions);
+    bool update = !known_target_sha && (!requested.empty() || !targets_eq(*target, current, d.compare_docker_apps));
+    if (update && requested.empty()) {
+      update = metered_allows(client, *target);
+    }
+    if (update && post_install(d, *target, false, requested.empty())) {
+      installing = true;
+    }
+  }
+  if (d.gc != nullptr && !installing) {
+    d.allocs.start("gc");
+    if (run_gc(client, *d.gc, d.gc_budget)) {
+      d.gc.reset();
+    }
+  }
+  d.allocs.start("wait");
+  if (installing && d.watch != nullptr) {
+    // Look for a newer target as soon as the update just posted is under way, not a whole interval later
+    return std::min(d.interval, client.preempt.check_sec);
+  }
+  return d.interval;
+}
+
 static int daemon_main(LiteClient &client, const bpo::variables_map &variables_map) {
   if (client.config.uptane.repo_server.empty()) {
     LOG_ERROR << "[uptane]/repo_server is not configured";
@@ -189,93 +898,119 @@ static int daemon_main(LiteClient &client, const bpo::variables_map &variables_m
     LOG_ERROR << "reboot command: " << client.config.bootloader.reboot_command << " is not executable";
     return 1;
   }
-  bool firstLoop = true;
-  bool compareDockerApps = should_compare_docker_apps(client.config);
-  Uptane::HardwareIdentifier hwid(client.config.provision.primary_ecu_hardware_id);
-  if (variables_map.count("update-lockfile") > 0) {
-    client.update_lockfile = variables_map["update-lockfile"].as<boost::filesystem::path>();
-  }
-  if (variables_map.count("download-lockfile") > 0) {
-    client.download_lockfile = variables_map["download-lockfile"].as<boost::filesystem::path>();
+  // Keep slow consoles from holding up the update loop
+  std::unique_ptr<AsyncLog> async_log;
+  AsyncLogConfig log_config(client.config.pacman.extra);
+  if (log_config.enabled) {
+    async_log = std_::make_unique<AsyncLog>(std::cout, log_config);
   }
 
   auto current = client.primary->getCurrent();
   LOG_INFO << "Active image is: " << current;
 
-  uint64_t interval = client.config.uptane.polling_sec;
-  if (variables_map.count("interval") > 0) {
-    interval = variables_map["interval"].as<uint64_t>();
+  Daemon d(client, variables_map);
+  d.state.current = current;
+  d.state.bundle_cache = client.bundle_cache.get();
+  d.state.cancel = client.cancel.get();
+  // Every wait for a lock file is made holding `uptane`
+  client.lock_wait_cb = [&d](bool waiting) {
+    if (waiting) {
+      d.uptane.unlock();
+    } else {
+      d.uptane.lock();
+    }
+  };
+
+  // Before the workers start, as the socket is created under a umask of its own
+  std::unique_ptr<ControlServer> control;
+  if (variables_map.count("control-socket") > 0) {
+    auto handler = [&d](const Json::Value &req) { return control_handler(d.state, req); };
+    control = std_::make_unique<ControlServer>(variables_map["control-socket"].as<boost::filesystem::path>(), handler);
+    ControlServer *server = control.get();
+    d.control = server;
+    client.progress_cb = [&d, server](const Uptane::Target &t, const std::string &s, unsigned int progress) {
+      set_daemon_state(d.state, server, s, t.filename(), progress);
+    };
+    client.events_channel->connect([&client](const std::shared_ptr<event::BaseEvent> &event) {
+      if (event->isTypeOf<event::DownloadProgressReport>()) {
+        const auto *report = dynamic_cast<event::DownloadProgressReport *>(event.get());
+        client.progress_cb(report->target, "downloading", report->progress);
+      }
+    });
   }
 
-  std::vector<Uptane::Target> installed_versions;
-  client.storage->loadPrimaryInstallationLog(&installed_versions, false);
+  // One job at a time each, later ones are coalesced
+  Worker poller("poll", 1);
+  Worker reporter("report", 1);
+  Worker installer("install", 1);
+  d.reporter = &reporter;
+  d.installer = &installer;
+  {
+    std::lock_guard<std::mutex> guard(d.state.lock);
+    d.state.workers = {&poller, &reporter, &installer};
+  }
+
+  ShutdownSignals signals([&d](int signal) {
+    LOG_INFO << "Received signal " << signal << ", cancelling any download under way and stopping once the "
+             << "steps under way are done";
+    request_stop(d.state, 0);
+    d.client.cancel->cancel("signal " + std::to_string(signal));
+  });
 
   while (true) {
-    LOG_INFO << "Refreshing Targets metadata";
-    if (!client.primary->updateImageMeta()) {
-      LOG_WARNING << "Unable to update latest metadata";
-      std::this_thread::sleep_for(std::chrono::seconds(10));
-      continue;  // There's no point trying to look for an update
-    }
-
-    if (firstLoop) {
-      // On first loop we need to see if we have a config change detected from
-      // from the previous run. We need to make sure we have up-to-date
-      // metadata, so this really needs to be inside the loop.
-      if (!current.MatchTarget(Uptane::Target::Unknown()) && client.dockerAppsChanged()) {
-        do_update(client, current);
+    {
+      std::lock_guard<std::mutex> guard(d.state.lock);
+      if (d.state.stop) {
+        break;
       }
-      client.storeDockerParamsDigest();
-      firstLoop = false;
-    }
-
-    client.primary->reportNetworkInfo();
-    // reportNetworkInfo already checks `telemetry.report_network`. We need a
-    // way when not running in anonymous mode to decide if we should report
-    // hwinfo to the server. This flag is a good one to (ab)use.
-    if (client.config.telemetry.report_network) {
-      client.primary->reportHwInfo();
-    }
-
-    auto target = find_target(client.primary, hwid, client.tags, "latest");
-    if (target != nullptr) {
-      // This is a workaround for finding and avoiding bad updates after a rollback.
-      // Rollback sets the installed version state to none instead of broken, so there is no
-      // easy way to find just the bad versions without api/storage changes. As a workaround we
-      // just check if the version is known (old hash) and not current/pending and abort if so
-      bool known_target_sha = known_local_target(client, *target, installed_versions);
-      if (!known_target_sha && !targets_eq(*target, current, compareDockerApps)) {
-        LOG_INFO << "Updating base image to: " << *target;
-
-        data::ResultCode::Numeric rc = do_update(client, *target);
-        if (rc == data::ResultCode::Numeric::kOk) {
-          current = *target;
-          client.http_client->updateHeader("x-ats-target", current.filename());
-          // Start the loop over to call updateImagesMeta which will update this
-          // device's target name on the server.
-          continue;
-        } else if (rc == data::ResultCode::Numeric::kNeedCompletion) {
-          if (std::system(client.config.bootloader.reboot_command.c_str()) != 0) {
-            LOG_ERROR << "Unable to reboot system";
-            return 1;
-          }
-        }
+      d.state.polling = true;
+    }
+    auto done = [&d](uint64_t wait, bool failed) {
+      if (failed) {
+        set_poll_state(d.state, d.control, "idle");
       }
+      std::lock_guard<std::mutex> guard(d.state.lock);
+      d.state.poll_wait = wait;
+      d.state.polling = false;
+      d.state.cv.notify_all();
+    };
+    if (!poller.post(poll_job([&d] { return daemon_poll(d); }, d.interval, done))) {
+      done(d.interval, true);
     }
-    std::this_thread::sleep_for(std::chrono::seconds(interval));
+    uint64_t wait;
+    {
+      std::unique_lock<std::mutex> guard(d.state.lock);
+      d.state.cv.wait(guard, [&d] { return !d.state.polling || d.state.stop; });
+      wait = d.state.poll_wait;
+    }
+    daemon_wait(d.state, wait);
   }
-  return 0;
+
+  for (Worker *worker : {&poller, &reporter, &installer}) {
+    if (worker->busy()) {
+      LOG_INFO << "Waiting for the " << worker->name() << " worker to finish, signal again to exit now";
+    }
+    worker->stop();
+  }
+  for (const Worker *worker : {&poller, &reporter, &installer}) {
+    LOG_INFO << "Worker " << worker->name() << ": " << worker->latency().str();
+  }
+  client.lock_wait_cb = nullptr;
+  std::lock_guard<std::mutex> guard(d.state.lock);
+  return d.state.exit_code;
 }
 
 struct SubCommand {
   const char *name;
   int (*main)(LiteClient &, const bpo::variables_map &);
+  // Optional read-only fast path that runs without a LiteClient
+  int (*fast)(const Config &, const bpo::variables_map &);
 };
 static SubCommand commands[] = {
-    {"status", status_main},
-    {"list", list_main},
-    {"update", update_main},
-    {"daemon", daemon_main},
+    {"status", status_main, status_fast},
+    {"list", list_main, nullptr},
+    {"update", update_main, nullptr},
+    {"daemon", daemon_main, nullptr},
 };
 
 void check_info_options(const bpo::options_description &description, const bpo::variables_map &vm) {
@@ -311,9 +1046,16 @@ bpo::variables_map parse_options(int argc, char *argv[]) {
       ("primary-ecu-hardware-id", bpo::value<std::string>(), "hardware ID of primary ecu")
       ("update-name", bpo::value<std::string>(), "optional name of the update when running \"update\". default=latest")
       ("interval", bpo::value<uint64_t>(), "Override uptane.polling_secs interval to poll for update when in daemon mode.")
-      ("update-lockfile", bpo::value<boost::filesystem::path>(), "If provided, an flock(2) is applied to this file before performing an update in daemon mode")
-      ("download-lockfile", bpo::value<boost::filesystem::path>(), "If provided, an flock(2) is applied to this file before downloading an update in daemon mode")
+      ("update-lockfile", bpo::value<boost::filesystem::path>(), "If provided, an flock(2) is applied to this file before performing an update")
+      ("download-lockfile", bpo::value<boost::filesystem::path>(), "If provided, an flock(2) is applied to this file before downloading an update or fetching what estimates its size")
+      ("control-socket", bpo::value<boost::filesystem::path>(), "If provided, a JSON API is served on this unix socket in daemon mode")
+      ("config-snapshot", bpo::value<boost::filesystem::path>()->default_value("/var/cache/aktualizr-lite/config.snap"), "Snapshot of the configuration used by read-only commands to start faster. Empty to disable")
       ("command", bpo::value<std::string>(), subs.c_str());
+#ifdef ALLOC_TRACKING
+  description.add_options()
+      ("max-polls", bpo::value<uint64_t>(), "Exit the daemon after this many polls, failing if the heap kept growing")
+      ("max-heap-growth", bpo::value<uint64_t>()->default_value(64 * 1024), "Heap growth in bytes tolerated by --max-polls");
+#endif
   // clang-format on
 
   // consider the first positional argument as the aktualizr run mode
@@ -355,6 +1097,25 @@ bpo::variables_map parse_options(int argc, char *argv[]) {
   return vm;
 }
 
+// What the configuration would be built from: the state of its files plus
+// the command line options that override them.
+static std::string config_snapshot_key(const bpo::variables_map &vm) {
+  std::vector<boost::filesystem::path> sources{"/usr/lib/sota/conf.d", "/etc/sota/conf.d/"};
+  if (vm.count("config") > 0) {
+    sources = vm["config"].as<std::vector<boost::filesystem::path>>();
+  }
+  std::string key = source_stamp(sources);
+  if (vm.count("loglevel") > 0) {
+    key += "loglevel=" + std::to_string(vm["loglevel"].as<int>()) + "\n";
+  }
+  for (const char *opt : {"repo-server", "ostree-server", "primary-ecu-hardware-id"}) {
+    if (vm.count(opt) > 0) {
+      key += std::string(opt) + "=" + vm[opt].as<std::string>() + "\n";
+    }
+  }
+  return key;
+}
+
 int main(int argc, char *argv[]) {
   logger_init(isatty(1) == 1);
   logger_set_threshold(boost::log::trivial::info);
@@ -367,20 +1128,58 @@ int main(int argc, char *argv[]) {
       LOG_WARNING << "\033[31mRunning as non-root and may not work as expected!\033[0m\n";
     }
 
+    std::string cmd = commandline_map["command"].as<std::string>();
+    SubCommand *sub = nullptr;
+    for (auto &c : commands) {
+      if (cmd == c.name) {
+        sub = &c;
+      }
+    }
+    if (sub == nullptr) {
+      throw bpo::invalid_option_value(cmd);
+    }
+
+    auto snapshot_path = commandline_map["config-snapshot"].as<boost::filesystem::path>();
+    std::string snapshot_key;
+    boost::optional<Config> snap;
+    if (!snapshot_path.empty()) {
+      snapshot_key = config_snapshot_key(commandline_map);
+      snap = load_config_snapshot(snapshot_path, snapshot_key);
+    }
+    bool fast_tried = false;
+    if (sub->fast != nullptr && snap) {
+      // Parsing the configuration is most of what a fast path costs
+      fast_tried = true;
+      logger_set_threshold(static_cast<boost::log::trivial::severity_level>(snap->logger.loglevel));
+      int rc = sub->fast(*snap, commandline_map);
+      if (rc != kNeedClient) {
+        return rc;
+      }
+    }
+
     Config config(commandline_map);
     config.storage.uptane_metadata_path = BasedPath(config.storage.path / "metadata");
     config.telemetry.report_network = !config.tls.server.empty();
     LOG_DEBUG << "Current directory: " << boost::filesystem::current_path().string();
+    if (!snapshot_path.empty() && !snap) {
+      save_config_snapshot(snapshot_path, snapshot_key, config);
+    }
 
-    std::string cmd = commandline_map["command"].as<std::string>();
-    for (size_t i = 0; i < sizeof(commands) / sizeof(SubCommand); i++) {
-      if (cmd == commands[i].name) {
-        LiteClient client(config);
-        return commands[i].main(client, commandline_map);
+    if (sub->fast != nullptr && !fast_tried) {
+      int rc = sub->fast(config, commandline_map);
+      if (rc != kNeedClient) {
+        return rc;
       }
     }
-    throw bpo::invalid_option_value(cmd);
-    r = EXIT_SUCCESS;
+    LiteClient client(config);
+    // Any command that writes to the repo keeps out of the way of the daemon's
+    if (commandline_map.count("update-lockfile") > 0) {
+      client.update_lockfile = commandline_map["update-lockfile"].as<boost::filesystem::path>();
+    }
+    if (commandline_map.count("download-lockfile") > 0) {
+      client.download_lockfile = commandline_map["download-lockfile"].as<boost::filesystem::path>();
+    }
+    return sub->main(client, commandline_map);
   } catch (const std::exception &ex) {
     LOG_ERROR << ex.what();
   }
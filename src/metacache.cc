@@ -0,0 +1,54 @@
+#include <boost/algorithm/hex.hpp>
+#include <boost/algorithm/string.hpp>
+
+#include "crypto/crypto.h"
+#include "logging/logging.h"
+#include "metacache.h"
+#include "utilities/utils.h"
+
+static std::string sha256(const std::string &raw) {
+  return boost::algorithm::to_lower_copy(boost::algorithm::hex(Crypto::sha256digest(raw)));
+}
+
+bool MetaCache::unexpired(const std::string &role, const Entry &entry, const Uptane::TimeStamp &now) {
+  try {
+    Uptane::TimeStamp expires(entry.expires);
+    return expires.IsValid() && !expires.IsExpiredAt(now);
+  } catch (const std::exception &ex) {
+    LOG_WARNING << "Invalid expiry cached for " << role << ": " << ex.what();
+  }
+  return false;
+}
+
+bool MetaCache::verified(const std::string &role, const std::string &raw, const Uptane::TimeStamp &now) const {
+  auto it = roles_.find(role);
+  if (it == roles_.end() || it->second.sha256 != sha256(raw)) {
+    return false;
+  }
+  return unexpired(role, it->second, now);
+}
+
+bool MetaCache::current(const Uptane::TimeStamp &now) const {
+  if (roles_.empty()) {
+    return false;
+  }
+  for (const auto &role : roles_) {
+    if (!unexpired(role.first, role.second, now)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+void MetaCache::record(const std::map<std::string, std::string> &roles) {
+  roles_.clear();
+  for (const auto &role : roles) {
+    std::string expires;
+    try {
+      expires = Utils::parseJSON(role.second)["signed"]["expires"].asString();
+    } catch (const std::exception &ex) {
+      LOG_WARNING << "Unable to read the expiry of " << role.first << ": " << ex.what();
+    }
+    roles_[role.first] = Entry{sha256(role.second), expires};
+  }
+}
@@ -0,0 +1,36 @@
+#ifndef AKTUALIZR_LITE_METACACHE
+#define AKTUALIZR_LITE_METACACHE
+
+#include <map>
+#include <string>
+
+#include <json/json.h>
+
+#include "uptane/tuf.h"
+
+// Remembers the sha256 and expiry of each TUF role that libaktualizr verified
+// in this process. While the repo serves byte for byte the timestamp verified
+// and nothing has expired, libaktualizr's verified copy in memory is still
+// current, so the rest needn't be downloaded nor its signatures checked again.
+// Nothing is kept across restarts, as a new process has no verified copy.
+class MetaCache {
+ public:
+  bool verified(const std::string &role, const std::string &raw,
+                const Uptane::TimeStamp &now = Uptane::TimeStamp::Now()) const;
+  // Whether anything is recorded and none of it has expired
+  bool current(const Uptane::TimeStamp &now = Uptane::TimeStamp::Now()) const;
+  // Replaces what's cached with `roles`, the raw metadata by role name
+  void record(const std::map<std::string, std::string> &roles);
+  void clear() { roles_.clear(); }
+
+ private:
+  struct Entry {
+    std::string sha256;
+    std::string expires;
+  };
+  static bool unexpired(const std::string &role, const Entry &entry, const Uptane::TimeStamp &now);
+
+  std::map<std::string, Entry> roles_;
+};
+
+#endif  // AKTUALIZR_LITE_METACACHE
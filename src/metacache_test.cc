@@ -0,0 +1,65 @@
+#include <gtest/gtest.h>
+
+#include "metacache.h"
+#include "utilities/utils.h"
+
+static std::string meta(const std::string &expires, int version) {
+  Json::Value json;
+  json["signatures"] = Json::arrayValue;
+  json["signed"]["_type"] = "Targets";
+  json["signed"]["expires"] = expires;
+  json["signed"]["version"] = version;
+  return Utils::jsonToCanonicalStr(json);
+}
+
+TEST(metacache, verified) {
+  MetaCache cache;
+  Uptane::TimeStamp now("2020-06-01T00:00:00Z");
+
+  std::string targets = meta("2020-07-01T00:00:00Z", 1);
+  ASSERT_FALSE(cache.verified("targets", targets, now));
+  ASSERT_FALSE(cache.current(now));
+  std::string snapshot = meta("2020-07-01T00:00:00Z", 3);
+  cache.record({{"targets", targets}, {"snapshot", snapshot}});
+  ASSERT_TRUE(cache.verified("targets", targets, now));
+  ASSERT_TRUE(cache.verified("snapshot", snapshot, now));
+  ASSERT_TRUE(cache.current(now));
+
+  // Different bytes, roles and expired metadata all need a full verification
+  ASSERT_FALSE(cache.verified("targets", meta("2020-07-01T00:00:00Z", 2), now));
+  ASSERT_FALSE(cache.verified("snapshot", targets, now));
+  ASSERT_FALSE(cache.verified("timestamp", targets, now));
+  ASSERT_FALSE(cache.verified("targets", targets, Uptane::TimeStamp("2020-07-02T00:00:00Z")));
+  ASSERT_FALSE(cache.current(Uptane::TimeStamp("2020-07-02T00:00:00Z")));
+
+  // A new verification replaces all of it
+  cache.record({{"targets", targets}});
+  ASSERT_FALSE(cache.verified("snapshot", snapshot, now));
+
+  cache.clear();
+  ASSERT_FALSE(cache.verified("targets", targets, now));
+  ASSERT_FALSE(cache.current(now));
+}
+
+TEST(metacache, expiry) {
+  MetaCache cache;
+  Uptane::TimeStamp now("2020-06-01T00:00:00Z");
+
+  // One expired role is enough for the whole of it to be checked again
+  std::string timestamp = meta("2020-07-01T00:00:00Z", 1);
+  cache.record({{"timestamp", timestamp}, {"targets", meta("2020-05-01T00:00:00Z", 1)}});
+  ASSERT_TRUE(cache.verified("timestamp", timestamp, now));
+  ASSERT_FALSE(cache.current(now));
+
+  // Metadata without an expiry can never be trusted from the cache
+  cache.record({{"targets", "not json"}});
+  ASSERT_FALSE(cache.verified("targets", "not json", now));
+  ASSERT_FALSE(cache.current(now));
+}
+
+#ifndef __NO_MAIN__
+int main(int argc, char **argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
+#endif
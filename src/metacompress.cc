@@ -0,0 +1,252 @@
+#include <zlib.h>
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#include <cstring>
+#include <limits>
+#include <memory>
+#include <sstream>
+#include <stdexcept>
+
+#include <boost/algorithm/string.hpp>
+
+#include "logging/logging.h"
+#include "metacompress.h"
+#include "utilities/utils.h"
+
+// Marks a compressed row in the meta table. Metadata is JSON, which can't
+// start with it.
+static const char kStoragePrefix[] = "gzip:";
+// Not worth the CPU for the small roles
+static const size_t kMinStorageCompress = 4096;
+
+MetaCompressionConfig::MetaCompressionConfig(const std::map<std::string, std::string> &extra) {
+  auto it = extra.find("metadata_encoding");
+  if (it != extra.end() && !it->second.empty()) {
+    std::vector<std::string> names;
+    boost::split(names, it->second, boost::is_any_of(", "), boost::token_compress_on);
+    for (const auto &name : names) {
+      if (name == "zstd" && !zstd_supported()) {
+        LOG_WARNING << "Built without zstd, not asking for zstd compressed metadata";
+      } else if (name == "gzip" || name == "zstd") {
+        encodings.push_back(name);
+      } else if (!name.empty()) {
+        throw std::invalid_argument("Invalid metadata_encoding: " + name);
+      }
+    }
+  }
+  it = extra.find("metadata_compress_storage");
+  if (it != extra.end()) {
+    if (it->second != "0" && it->second != "1") {
+      throw std::invalid_argument("Invalid metadata_compress_storage: " + it->second);
+    }
+    compress_storage = it->second == "1";
+  }
+}
+
+std::string MetaCompressionConfig::acceptEncoding() const { return boost::algorithm::join(encodings, ", "); }
+
+void MetaCompressionStats::reset() {
+  wire = 0;
+  wire_decoded = 0;
+  disk = 0;
+  disk_decoded = 0;
+}
+
+static void add_saved(std::ostringstream &out, const char *what, uint64_t bytes, uint64_t decoded) {
+  out << what << " " << bytes << " of " << decoded << " bytes";
+  if (decoded > 0) {
+    out << " (" << (decoded - bytes) * 100 / decoded << "% saved)";
+  }
+}
+
+std::string MetaCompressionStats::str() const {
+  std::ostringstream out;
+  add_saved(out, "received", wire, wire_decoded);
+  out << ", ";
+  add_saved(out, "stored", disk, disk_decoded);
+  return out.str();
+}
+
+bool zstd_supported() {
+#ifdef HAVE_ZSTD
+  return true;
+#else
+  return false;
+#endif
+}
+
+std::string gzip_compress(const std::string &data) {
+  z_stream zs{};
+  // 16 + window bits for a gzip header rather than a zlib one
+  if (deflateInit2(&zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 16 + MAX_WBITS, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+    throw std::runtime_error("Unable to initialize gzip compression");
+  }
+  std::string out(deflateBound(&zs, data.size()), '\0');
+  zs.next_in = reinterpret_cast<Bytef *>(const_cast<char *>(data.data()));
+  zs.avail_in = static_cast<uInt>(data.size());
+  zs.next_out = reinterpret_cast<Bytef *>(&out[0]);
+  zs.avail_out = static_cast<uInt>(out.size());
+  int rc = deflate(&zs, Z_FINISH);
+  out.resize(zs.total_out);
+  deflateEnd(&zs);
+  if (rc != Z_STREAM_END) {
+    throw std::runtime_error("Unable to gzip compress");
+  }
+  return out;
+}
+
+static std::string gunzip(const std::string &data, int64_t maxsize) {
+  z_stream zs{};
+  if (inflateInit2(&zs, 16 + MAX_WBITS) != Z_OK) {
+    throw std::runtime_error("Unable to initialize gzip decompression");
+  }
+  std::unique_ptr<z_stream, int (*)(z_stream *)> guard(&zs, inflateEnd);
+  zs.next_in = reinterpret_cast<Bytef *>(const_cast<char *>(data.data()));
+  zs.avail_in = static_cast<uInt>(data.size());
+
+  std::string out;
+  char buf[16384];
+  int rc = Z_OK;
+  while (rc != Z_STREAM_END) {
+    zs.next_out = reinterpret_cast<Bytef *>(buf);
+    zs.avail_out = sizeof(buf);
+    rc = inflate(&zs, Z_NO_FLUSH);
+    if (rc != Z_OK && rc != Z_STREAM_END) {
+      throw std::runtime_error(std::string("Invalid gzip data: ") + (zs.msg != nullptr ? zs.msg : "truncated"));
+    }
+    out.append(buf, sizeof(buf) - zs.avail_out);
+    if (static_cast<int64_t>(out.size()) > maxsize) {
+      throw std::runtime_error("Decompressed data exceeds " + std::to_string(maxsize) + " bytes");
+    }
+  }
+  return out;
+}
+
+#ifdef HAVE_ZSTD
+static std::string unzstd(const std::string &data, int64_t maxsize) {
+  std::unique_ptr<ZSTD_DStream, size_t (*)(ZSTD_DStream *)> ds(ZSTD_createDStream(), ZSTD_freeDStream);
+  if (!ds || ZSTD_isError(ZSTD_initDStream(ds.get())) != 0) {
+    throw std::runtime_error("Unable to initialize zstd decompression");
+  }
+  ZSTD_inBuffer in{data.data(), data.size(), 0};
+  std::vector<char> buf(ZSTD_DStreamOutSize());
+  std::string out;
+  size_t rc = 1;
+  // rc is 0 once a frame is complete, a body may hold several
+  while (in.pos < in.size || rc != 0) {
+    ZSTD_outBuffer chunk{buf.data(), buf.size(), 0};
+    size_t in_pos = in.pos;
+    rc = ZSTD_decompressStream(ds.get(), &chunk, &in);
+    if (ZSTD_isError(rc) != 0) {
+      throw std::runtime_error(std::string("Invalid zstd data: ") + ZSTD_getErrorName(rc));
+    }
+    if (rc != 0 && chunk.pos == 0 && in.pos == in_pos) {
+      throw std::runtime_error("Invalid zstd data: truncated");
+    }
+    out.append(buf.data(), chunk.pos);
+    if (static_cast<int64_t>(out.size()) > maxsize) {
+      throw std::runtime_error("Decompressed data exceeds " + std::to_string(maxsize) + " bytes");
+    }
+  }
+  return out;
+}
+#endif
+
+std::string decode_content(const std::string &data, int64_t maxsize, std::string *encoding) {
+  std::string name = "identity";
+  std::string res;
+  if (data.size() >= 2 && static_cast<unsigned char>(data[0]) == 0x1f && static_cast<unsigned char>(data[1]) == 0x8b) {
+    name = "gzip";
+    res = gunzip(data, maxsize);
+  } else if (data.size() >= 4 && memcmp(data.data(), "\x28\xb5\x2f\xfd", 4) == 0) {
+#ifdef HAVE_ZSTD
+    name = "zstd";
+    res = unzstd(data, maxsize);
+#else
+    throw std::runtime_error("Unable to decode zstd data, built without zstd");
+#endif
+  } else {
+    res = data;
+  }
+  if (encoding != nullptr) {
+    *encoding = name;
+  }
+  return res;
+}
+
+MetaHttpClient::MetaHttpClient(const std::vector<std::string> *headers, const MetaCompressionConfig &config,
+                               std::shared_ptr<MetaCompressionStats> stats)
+    : HttpClient(headers), accept_(config.acceptEncoding()), stats_(std::move(stats)) {}
+
+HttpResponse MetaHttpClient::get(const std::string &url, int64_t maxsize) {
+  std::lock_guard<std::mutex> guard(lock_);
+  // Curl isn't asked to decode, so the body comes back as sent and the saving
+  // can be measured
+  updateHeader("Accept-Encoding", accept_);
+  HttpResponse res = HttpClient::get(url, maxsize);
+  updateHeader("Accept-Encoding", "identity");
+  if (!res.isOk()) {
+    return res;
+  }
+
+  uint64_t wire = res.body.size();
+  std::string encoding;
+  try {
+    res.body = decode_content(res.body, maxsize, &encoding);
+  } catch (const std::exception &ex) {
+    LOG_ERROR << "Unable to decode " << url << ": " << ex.what();
+    return HttpResponse("", 500, res.curl_code, ex.what());
+  }
+  stats_->wire += wire;
+  stats_->wire_decoded += res.body.size();
+  LOG_DEBUG << "Fetched " << url << " " << encoding << " encoded, " << wire << " of " << res.body.size() << " bytes";
+  return res;
+}
+
+HttpResponse MetaHttpClient::post(const std::string &url, const std::string &content_type, const std::string &data) {
+  std::lock_guard<std::mutex> guard(lock_);
+  return HttpClient::post(url, content_type, data);
+}
+
+HttpResponse MetaHttpClient::put(const std::string &url, const std::string &content_type, const std::string &data) {
+  std::lock_guard<std::mutex> guard(lock_);
+  return HttpClient::put(url, content_type, data);
+}
+
+// Like HttpClient's own, these go through the overloads above that take the lock
+HttpResponse MetaHttpClient::post(const std::string &url, const Json::Value &data) {
+  return post(url, "application/json", Utils::jsonToCanonicalStr(data));
+}
+
+HttpResponse MetaHttpClient::put(const std::string &url, const Json::Value &data) {
+  return put(url, "application/json", Utils::jsonToCanonicalStr(data));
+}
+
+MetaStorage::MetaStorage(const StorageConfig &config, bool compress, std::shared_ptr<MetaCompressionStats> stats)
+    : SQLStorage(config, false), compress_(compress), stats_(std::move(stats)) {}
+
+void MetaStorage::storeNonRoot(const std::string &data, Uptane::RepositoryType repo, Uptane::Role role) {
+  std::string stored = data;
+  if (compress_ && data.size() >= kMinStorageCompress) {
+    std::string packed = kStoragePrefix + Utils::toBase64(gzip_compress(data));
+    if (packed.size() < data.size()) {
+      stored = std::move(packed);
+    }
+  }
+  stats_->disk += stored.size();
+  stats_->disk_decoded += data.size();
+  SQLStorage::storeNonRoot(stored, repo, role);
+}
+
+bool MetaStorage::loadNonRoot(std::string *data, Uptane::RepositoryType repo, Uptane::Role role) {
+  if (!SQLStorage::loadNonRoot(data, repo, role)) {
+    return false;
+  }
+  if (data != nullptr && boost::starts_with(*data, kStoragePrefix)) {
+    *data = decode_content(Utils::fromBase64(data->substr(sizeof(kStoragePrefix) - 1)),
+                           std::numeric_limits<int64_t>::max());
+  }
+  return true;
+}
@@ -0,0 +1,91 @@
+#ifndef AKTUALIZR_LITE_METACOMPRESS
+#define AKTUALIZR_LITE_METACOMPRESS
+
+#include <atomic>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "http/httpclient.h"
+#include "storage/sqlstorage.h"
+
+// Compression of the TUF metadata on the wire and on disk. Configured via
+// [pacman] metadata_encoding, the encodings to ask the server for in order of
+// preference (eg "zstd,gzip", default none), and metadata_compress_storage
+// (0 or 1, default 0). zstd is only offered when built with libzstd.
+struct MetaCompressionConfig {
+  MetaCompressionConfig() = default;
+  explicit MetaCompressionConfig(const std::map<std::string, std::string> &extra);
+
+  bool enabled() const { return !encodings.empty(); }
+  // The Accept-Encoding header value, eg "zstd, gzip"
+  std::string acceptEncoding() const;
+
+  std::vector<std::string> encodings;
+  bool compress_storage{false};
+};
+
+// Bytes of metadata transferred and stored versus their decompressed size
+struct MetaCompressionStats {
+  std::atomic<uint64_t> wire{0};
+  std::atomic<uint64_t> wire_decoded{0};
+  std::atomic<uint64_t> disk{0};
+  std::atomic<uint64_t> disk_decoded{0};
+
+  void reset();
+  std::string str() const;
+};
+
+bool zstd_supported();
+std::string gzip_compress(const std::string &data);
+// Decodes a gzip or zstd body, telling them apart by their magic number, and
+// returns anything else as is. Throws if it's damaged or decodes to more than
+// `maxsize` bytes.
+std::string decode_content(const std::string &data, int64_t maxsize, std::string *encoding = nullptr);
+
+// Asks for compressed responses to get(), which is what fetches metadata,
+// and hands back the decoded body. libaktualizr then verifies the hashes and
+// signatures over the same bytes as an uncompressed response. Downloads of
+// target content keep the identity encoding as their hashes are over the
+// bytes as served.
+class MetaHttpClient : public HttpClient {
+ public:
+  // `headers` must hold an "Accept-Encoding: identity" line for get() to switch
+  MetaHttpClient(const std::vector<std::string> *headers, const MetaCompressionConfig &config,
+                 std::shared_ptr<MetaCompressionStats> stats);
+
+  HttpResponse get(const std::string &url, int64_t maxsize) override;
+  // libaktualizr's ReportQueue posts events from a thread of its own
+  HttpResponse post(const std::string &url, const std::string &content_type, const std::string &data) override;
+  HttpResponse post(const std::string &url, const Json::Value &data) override;
+  HttpResponse put(const std::string &url, const std::string &content_type, const std::string &data) override;
+  HttpResponse put(const std::string &url, const Json::Value &data) override;
+
+ private:
+  std::string accept_;
+  std::shared_ptr<MetaCompressionStats> stats_;
+  // The header list is shared by every request made with this client, so
+  // nothing may be sent while get() switches the encoding. Downloads are
+  // made by the thread doing the get()s.
+  std::mutex lock_;
+};
+
+// Stores the non-root metadata gzip compressed. Rows are told apart by a
+// prefix, so compressed and plain ones can be mixed and the option turned off
+// again. The compressed bytes are base64 encoded as SQLStorage reads the
+// metadata back as text.
+class MetaStorage : public SQLStorage {
+ public:
+  MetaStorage(const StorageConfig &config, bool compress, std::shared_ptr<MetaCompressionStats> stats);
+
+  void storeNonRoot(const std::string &data, Uptane::RepositoryType repo, Uptane::Role role) override;
+  bool loadNonRoot(std::string *data, Uptane::RepositoryType repo, Uptane::Role role) override;
+
+ private:
+  bool compress_;
+  std::shared_ptr<MetaCompressionStats> stats_;
+};
+
+#endif  // AKTUALIZR_LITE_METACOMPRESS
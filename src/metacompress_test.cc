@@ -0,0 +1,249 @@
+#include <gtest/gtest.h>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <thread>
+
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#include "metacompress.h"
+#include "utilities/utils.h"
+
+// A local stand-in for the metadata server. It answers every request with
+// `body`, encoded with the first of `encodings` the client accepts.
+class MetaServer {
+ public:
+  MetaServer(std::string body, std::vector<std::string> encodings)
+      : body_(std::move(body)), encodings_(std::move(encodings)) {
+    fd_ = socket(AF_INET, SOCK_STREAM, 0);
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t len = sizeof(addr);
+    if (bind(fd_, reinterpret_cast<sockaddr *>(&addr), len) != 0 || listen(fd_, 4) != 0 ||
+        getsockname(fd_, reinterpret_cast<sockaddr *>(&addr), &len) != 0) {
+      throw std::runtime_error("Unable to start test server");
+    }
+    port_ = ntohs(addr.sin_port);
+    thread_ = std::thread(&MetaServer::run, this);
+  }
+  ~MetaServer() {
+    stop_ = true;
+    thread_.join();
+    close(fd_);
+  }
+
+  std::string url() const { return "http://127.0.0.1:" + std::to_string(port_) + "/targets.json"; }
+  std::string accepted() {
+    std::lock_guard<std::mutex> guard(lock_);
+    return accepted_;
+  }
+
+ private:
+  void run() {
+    while (!stop_) {
+      pollfd pfd{fd_, POLLIN, 0};
+      if (poll(&pfd, 1, 50) <= 0) {
+        continue;
+      }
+      int conn = accept(fd_, nullptr, nullptr);
+      if (conn >= 0) {
+        serve(conn);
+        close(conn);
+      }
+    }
+  }
+
+  void serve(int conn) {
+    std::string req;
+    char buf[4096];
+    while (req.find("\r\n\r\n") == std::string::npos) {
+      ssize_t n = read(conn, buf, sizeof(buf));
+      if (n <= 0) {
+        return;
+      }
+      req.append(buf, static_cast<size_t>(n));
+    }
+    std::string accept;
+    auto pos = req.find("Accept-Encoding: ");
+    if (pos != std::string::npos) {
+      accept = req.substr(pos + 17, req.find("\r\n", pos) - pos - 17);
+    }
+    {
+      std::lock_guard<std::mutex> guard(lock_);
+      accepted_ = accept;
+    }
+
+    std::string body = body_;
+    std::string headers = "HTTP/1.1 200 OK\r\nConnection: close\r\n";
+    for (const auto &enc : encodings_) {
+      if (accept.find(enc) == std::string::npos) {
+        continue;
+      }
+      if (enc == "gzip") {
+        body = gzip_compress(body_);
+      }
+#ifdef HAVE_ZSTD
+      if (enc == "zstd") {
+        body.resize(ZSTD_compressBound(body_.size()));
+        body.resize(ZSTD_compress(&body[0], body.size(), body_.data(), body_.size(), 3));
+      }
+#endif
+      headers += "Content-Encoding: " + enc + "\r\n";
+      break;
+    }
+    std::string res = headers + "Content-Length: " + std::to_string(body.size()) + "\r\n\r\n" + body;
+    size_t done = 0;
+    while (done < res.size()) {
+      ssize_t n = write(conn, res.data() + done, res.size() - done);
+      if (n <= 0) {
+        return;
+      }
+      done += static_cast<size_t>(n);
+    }
+  }
+
+  std::string body_;
+  std::vector<std::string> encodings_;
+  int fd_{-1};
+  uint16_t port_{0};
+  std::atomic_bool stop_{false};
+  std::mutex lock_;
+  std::string accepted_;
+  std::thread thread_;
+};
+
+// Something like a targets.json, which is mostly repetitive JSON
+static std::string targets_json(int count) {
+  Json::Value targets;
+  for (int i = 0; i < count; i++) {
+    Json::Value t;
+    t["hashes"]["sha256"] = std::string(64, static_cast<char>('a' + i % 6));
+    t["length"] = 0;
+    t["custom"]["hardwareIds"][0] = "raspberrypi4-64";
+    t["custom"]["targetFormat"] = "OSTREE";
+    t["custom"]["version"] = std::to_string(i);
+    targets["signed"]["targets"]["raspberrypi4-64-lmp-" + std::to_string(i)] = t;
+  }
+  return Utils::jsonToCanonicalStr(targets);
+}
+
+TEST(metacompress, config) {
+  MetaCompressionConfig config(std::map<std::string, std::string>{});
+  ASSERT_FALSE(config.enabled());
+  ASSERT_FALSE(config.compress_storage);
+
+  config = MetaCompressionConfig(
+      std::map<std::string, std::string>{{"metadata_encoding", "gzip"}, {"metadata_compress_storage", "1"}});
+  ASSERT_TRUE(config.enabled());
+  ASSERT_EQ("gzip", config.acceptEncoding());
+  ASSERT_TRUE(config.compress_storage);
+
+  config = MetaCompressionConfig(std::map<std::string, std::string>{{"metadata_encoding", "zstd, gzip"}});
+  ASSERT_EQ(zstd_supported() ? "zstd, gzip" : "gzip", config.acceptEncoding());
+
+  ASSERT_THROW(MetaCompressionConfig(std::map<std::string, std::string>{{"metadata_encoding", "br"}}),
+               std::invalid_argument);
+  ASSERT_THROW(MetaCompressionConfig(std::map<std::string, std::string>{{"metadata_compress_storage", "yes"}}),
+               std::invalid_argument);
+}
+
+TEST(metacompress, decode) {
+  std::string data = targets_json(50);
+  std::string encoding;
+  ASSERT_EQ(data, decode_content(data, 1 << 20, &encoding));
+  ASSERT_EQ("identity", encoding);
+
+  std::string packed = gzip_compress(data);
+  ASSERT_LT(packed.size(), data.size() / 4);
+  ASSERT_EQ(data, decode_content(packed, 1 << 20, &encoding));
+  ASSERT_EQ("gzip", encoding);
+
+  // Truncated or corrupt data is an error rather than short metadata
+  ASSERT_THROW(decode_content(packed.substr(0, packed.size() / 2), 1 << 20), std::runtime_error);
+  packed[packed.size() / 2] ^= 0x55;
+  ASSERT_THROW(decode_content(packed, 1 << 20), std::runtime_error);
+
+  // The size limit applies to what it decodes to
+  ASSERT_THROW(decode_content(gzip_compress(std::string(1 << 20, '\0')), 4096), std::runtime_error);
+
+#ifdef HAVE_ZSTD
+  std::string zpacked(ZSTD_compressBound(data.size()), '\0');
+  zpacked.resize(ZSTD_compress(&zpacked[0], zpacked.size(), data.data(), data.size(), 3));
+  ASSERT_EQ(data, decode_content(zpacked, 1 << 20, &encoding));
+  ASSERT_EQ("zstd", encoding);
+  ASSERT_THROW(decode_content(zpacked.substr(0, zpacked.size() - 8), 1 << 20), std::runtime_error);
+#endif
+}
+
+TEST(metacompress, http) {
+  std::string data = targets_json(200);
+  MetaServer server(data, {"zstd", "gzip"});
+
+  MetaCompressionConfig config(std::map<std::string, std::string>{{"metadata_encoding", "gzip"}});
+  auto stats = std::make_shared<MetaCompressionStats>();
+  std::vector<std::string> headers{"Accept-Encoding: identity"};
+  MetaHttpClient client(&headers, config, stats);
+
+  HttpResponse res = client.get(server.url(), 1 << 20);
+  ASSERT_TRUE(res.isOk());
+  ASSERT_EQ("gzip", server.accepted());
+  // The exact bytes the server's hashes and signatures are over
+  ASSERT_EQ(data, res.body);
+  ASSERT_EQ(data.size(), stats->wire_decoded);
+  ASSERT_EQ(gzip_compress(data).size(), stats->wire);
+  ASSERT_NE(std::string::npos, stats->str().find("% saved"));
+
+  // Over the limit once decoded
+  res = client.get(server.url(), 1024);
+  ASSERT_FALSE(res.isOk());
+
+  // A server that ignores Accept-Encoding still works
+  MetaServer plain(data, {});
+  stats->reset();
+  res = client.get(plain.url(), 1 << 20);
+  ASSERT_TRUE(res.isOk());
+  ASSERT_EQ(data, res.body);
+  ASSERT_EQ(stats->wire_decoded, stats->wire);
+}
+
+TEST(metacompress, storage) {
+  TemporaryDirectory dir;
+  StorageConfig config;
+  config.path = dir.Path();
+  std::string data = targets_json(200);
+  std::string small = targets_json(1);
+  auto stats = std::make_shared<MetaCompressionStats>();
+
+  {
+    MetaStorage storage(config, true, stats);
+    storage.storeNonRoot(data, Uptane::RepositoryType::Image(), Uptane::Role::Targets());
+    storage.storeNonRoot(small, Uptane::RepositoryType::Image(), Uptane::Role::Timestamp());
+    std::string loaded;
+    ASSERT_TRUE(storage.loadNonRoot(&loaded, Uptane::RepositoryType::Image(), Uptane::Role::Targets()));
+    ASSERT_EQ(data, loaded);
+    ASSERT_TRUE(storage.loadNonRoot(&loaded, Uptane::RepositoryType::Image(), Uptane::Role::Timestamp()));
+    ASSERT_EQ(small, loaded);
+  }
+  ASSERT_EQ(data.size() + small.size(), stats->disk_decoded);
+  ASSERT_LT(stats->disk, data.size() / 2);
+
+  // Still readable with the option turned off
+  MetaStorage storage(config, false, stats);
+  std::string loaded;
+  ASSERT_TRUE(storage.loadNonRoot(&loaded, Uptane::RepositoryType::Image(), Uptane::Role::Targets()));
+  ASSERT_EQ(data, loaded);
+}
+
+#ifndef __NO_MAIN__
+int main(int argc, char **argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
+#endif
@@ -0,0 +1,106 @@
+#include <stdexcept>
+
+#include "logging/logging.h"
+#include "preempt.h"
+#include "utilities/utils.h"
+
+// Same limits libaktualizr applies when fetching them
+static const int64_t kMaxTimestampSize = 64 * 1024;
+static const int64_t kMaxTargetsSize = 8 * 1024 * 1024;
+
+PreemptConfig::PreemptConfig(const std::map<std::string, std::string> &extra) {
+  auto it = extra.find("preempt_check_sec");
+  if (it != extra.end()) {
+    try {
+      check_sec = std::stoull(it->second);
+    } catch (const std::exception &ex) {
+      throw std::invalid_argument("Invalid preempt_check_sec: " + it->second);
+    }
+  }
+}
+
+UpdateCancel::Scope::Scope(UpdateCancel &cancel, api::FlowControlToken *token) : cancel_(cancel) {
+  std::lock_guard<std::mutex> guard(cancel_.lock_);
+  cancel_.scopes_++;
+  if (token != nullptr) {
+    cancel_.token_ = token;
+    if (cancel_.cancelled_) {
+      token->setAbort();
+    }
+  }
+}
+
+UpdateCancel::Scope::~Scope() {
+  std::lock_guard<std::mutex> guard(cancel_.lock_);
+  cancel_.scopes_--;
+  cancel_.token_ = nullptr;
+}
+
+void UpdateCancel::cancel(const std::string &reason) {
+  std::lock_guard<std::mutex> guard(lock_);
+  if (cancelled_) {
+    return;
+  }
+  reason_ = reason;
+  cancelled_ = true;
+  if (token_ != nullptr) {
+    token_->setAbort();
+  }
+}
+
+std::string UpdateCancel::reason() const {
+  std::lock_guard<std::mutex> guard(lock_);
+  return reason_;
+}
+
+bool UpdateCancel::active() const {
+  std::lock_guard<std::mutex> guard(lock_);
+  return scopes_ > 0;
+}
+
+void UpdateCancel::reset() {
+  std::lock_guard<std::mutex> guard(lock_);
+  cancelled_ = false;
+  reason_.clear();
+}
+
+NewerTargetWatch::NewerTargetWatch(std::shared_ptr<HttpInterface> http, std::string repo_server)
+    : http_(std::move(http)), repo_server_(std::move(repo_server)) {}
+
+std::string NewerTargetWatch::check(const Filter &preempts) {
+  // A new targets.json always comes with a new timestamp.json
+  HttpResponse res = http_->get(repo_server_ + "/timestamp.json", kMaxTimestampSize);
+  if (!res.isOk()) {
+    LOG_DEBUG << "Unable to check for a newer target: " << res.getStatusStr();
+    return "";
+  }
+  if (res.body != last_timestamp_) {
+    HttpResponse targets = http_->get(repo_server_ + "/targets.json", kMaxTargetsSize);
+    if (!targets.isOk()) {
+      LOG_DEBUG << "Unable to check for a newer target: " << targets.getStatusStr();
+      return "";
+    }
+    try {
+      targets_ = Uptane::Targets(Utils::parseJSON(targets.body)).targets;
+    } catch (const std::exception &ex) {
+      LOG_WARNING << "Unable to parse targets.json while checking for a newer target: " << ex.what();
+      return "";
+    }
+    last_timestamp_ = res.body;
+  }
+  return check(targets_, preempts);
+}
+
+std::string NewerTargetWatch::check(const std::vector<Uptane::Target> &targets, const Filter &preempts) {
+  // All of them count as reported, the poll after the cancel picks between them
+  std::string res;
+  for (const auto &t : targets) {
+    if (reported_.count(t.filename()) == 0 && preempts(t)) {
+      reported_.insert(t.filename());
+      if (res.empty()) {
+        res = t.filename();
+      }
+    }
+  }
+  return res;
+}
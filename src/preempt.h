@@ -0,0 +1,94 @@
+#ifndef AKTUALIZR_LITE_PREEMPT
+#define AKTUALIZR_LITE_PREEMPT
+
+#include <atomic>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <vector>
+
+#include "http/httpinterface.h"
+#include "uptane/tuf.h"
+#include "utilities/apiqueue.h"
+
+// How often the daemon looks for a newer target while a download is under
+// way. Configured via [pacman] preempt_check_sec (default 0, don't look).
+struct PreemptConfig {
+  PreemptConfig() = default;
+  explicit PreemptConfig(const std::map<std::string, std::string> &extra);
+
+  bool enabled() const { return check_sec > 0; }
+
+  uint64_t check_sec{0};
+};
+
+// Calls off the download and verification of an update from another thread.
+// The download's flow control token is aborted, which libaktualizr turns into
+// a cancelled OSTree pull or app bundle fetch, and verification stops before
+// the next object. Neither throws away what was already fetched: OSTree keeps
+// the objects pulled and the download checkpoint is kept, so the next attempt
+// only fetches the rest. An update that got as far as installing isn't
+// interrupted.
+class UpdateCancel {
+ public:
+  // Ties the token of a download to the cancel for as long as it's in scope
+  class Scope {
+   public:
+    Scope(UpdateCancel &cancel, api::FlowControlToken *token);
+    ~Scope();
+    Scope(const Scope &) = delete;
+    Scope &operator=(const Scope &) = delete;
+
+   private:
+    UpdateCancel &cancel_;
+  };
+
+  // Takes effect at the next check even if nothing is under way yet
+  void cancel(const std::string &reason);
+  bool cancelled() const { return cancelled_; }
+  const std::atomic_bool *flag() const { return &cancelled_; }
+  std::string reason() const;
+  // Whether a download or verification could be cancelled right now
+  bool active() const;
+  // Forgets an earlier cancel before the next update
+  void reset();
+
+ private:
+  mutable std::mutex lock_;
+  std::atomic_bool cancelled_{false};
+  std::string reason_;
+  api::FlowControlToken *token_{nullptr};
+  int scopes_{0};
+};
+
+// Looks for a target that should replace the one being downloaded in the
+// repo's targets.json, fetched over an HTTP client of its own as
+// libaktualizr's is in use by the download. The metadata isn't verified here:
+// all a newer target does is cancel the download, after which the daemon polls
+// again and libaktualizr verifies the metadata before anything is installed.
+// Each target cancels one download at most, so one the verified poll doesn't
+// pick can't keep the download from ever finishing.
+class NewerTargetWatch {
+ public:
+  using Filter = std::function<bool(const Uptane::Target &)>;
+
+  NewerTargetWatch(std::shared_ptr<HttpInterface> http, std::string repo_server);
+
+  // The name of a target `preempts` accepts that hasn't been returned before,
+  // or "" if there's none or the metadata can't be fetched
+  std::string check(const Filter &preempts);
+  // The same over targets already parsed
+  std::string check(const std::vector<Uptane::Target> &targets, const Filter &preempts);
+
+ private:
+  std::shared_ptr<HttpInterface> http_;
+  std::string repo_server_;
+  std::string last_timestamp_;
+  std::vector<Uptane::Target> targets_;
+  std::set<std::string> reported_;
+};
+
+#endif  // AKTUALIZR_LITE_PREEMPT
@@ -0,0 +1,123 @@
+#include <gtest/gtest.h>
+
+#include <string.h>
+
+#include <thread>
+
+#include "preempt.h"
+#include "utilities/utils.h"
+
+// Serves the repo's timestamp.json and targets.json from memory
+class FakeRepo : public HttpClient {
+ public:
+  HttpResponse get(const std::string &url, int64_t maxsize) override {
+    (void)maxsize;
+    urls.push_back(url);
+    if (url == "https://repo.example/timestamp.json" && !timestamp.empty()) {
+      return HttpResponse(timestamp, 200, 0, "");
+    }
+    if (url == "https://repo.example/targets.json" && !targets.empty()) {
+      return HttpResponse(targets, 200, 0, "");
+    }
+    return HttpResponse("", 404, 0, "");
+  }
+
+  void publish(const std::vector<std::string> &versions) {
+    Json::Value json;
+    for (const auto &v : versions) {
+      json["signed"]["targets"]["lmp-" + v]["custom"]["version"] = v;
+    }
+    targets = Utils::jsonToCanonicalStr(json);
+    timestamp = "timestamp " + std::to_string(versions.size());
+  }
+
+  std::string timestamp;
+  std::string targets;
+  std::vector<std::string> urls;
+};
+
+TEST(preempt, config) {
+  ASSERT_FALSE(PreemptConfig(std::map<std::string, std::string>{}).enabled());
+  PreemptConfig config(std::map<std::string, std::string>{{"preempt_check_sec", "30"}});
+  ASSERT_TRUE(config.enabled());
+  ASSERT_EQ(30, config.check_sec);
+  ASSERT_THROW(PreemptConfig(std::map<std::string, std::string>{{"preempt_check_sec", "soon"}}),
+               std::invalid_argument);
+}
+
+TEST(preempt, cancel) {
+  UpdateCancel cancel;
+  ASSERT_FALSE(cancel.active());
+  {
+    api::FlowControlToken token;
+    UpdateCancel::Scope scope(cancel, &token);
+    ASSERT_TRUE(cancel.active());
+    ASSERT_TRUE(token.canContinue(false));
+
+    std::thread([&cancel] { cancel.cancel("shutdown"); }).join();
+    ASSERT_FALSE(token.canContinue(false));
+    ASSERT_TRUE(cancel.cancelled());
+    ASSERT_TRUE(*cancel.flag());
+    // The first reason sticks
+    cancel.cancel("newer target");
+    ASSERT_EQ("shutdown", cancel.reason());
+  }
+  ASSERT_FALSE(cancel.active());
+
+  // A cancel made before the download starts aborts it straight away
+  {
+    api::FlowControlToken token;
+    UpdateCancel::Scope scope(cancel, &token);
+    ASSERT_FALSE(token.canContinue(false));
+  }
+
+  cancel.reset();
+  ASSERT_FALSE(cancel.cancelled());
+  ASSERT_TRUE(cancel.reason().empty());
+  // Nothing under way to abort, it's kept for the next check
+  cancel.cancel("control");
+  ASSERT_TRUE(cancel.cancelled());
+  {
+    UpdateCancel::Scope scope(cancel, nullptr);
+    ASSERT_TRUE(cancel.active());
+    ASSERT_TRUE(*cancel.flag());
+  }
+}
+
+TEST(preempt, newer_target) {
+  auto repo = std::make_shared<FakeRepo>();
+  NewerTargetWatch watch(repo, "https://repo.example");
+  Json::Value custom;
+  custom["custom"]["version"] = "2";
+  Uptane::Target downloading("lmp-2", custom);
+  auto newer = [&downloading](const Uptane::Target &t) {
+    return strverscmp(downloading.custom_version().c_str(), t.custom_version().c_str()) < 0;
+  };
+
+  // Offline
+  ASSERT_EQ("", watch.check(newer));
+  ASSERT_EQ(1, repo->urls.size());
+
+  repo->publish({"1", "2"});
+  ASSERT_EQ("", watch.check(newer));
+  repo->urls.clear();
+  // The same timestamp, so the same targets
+  ASSERT_EQ("", watch.check(newer));
+  ASSERT_EQ(std::vector<std::string>{"https://repo.example/timestamp.json"}, repo->urls);
+
+  repo->publish({"1", "2", "3", "10"});
+  ASSERT_EQ("lmp-10", watch.check(newer));
+  // Each cancels once, both were there when it did
+  ASSERT_EQ("", watch.check(newer));
+
+  repo->targets = "not json";
+  repo->timestamp = "damaged";
+  ASSERT_EQ("", watch.check(newer));
+}
+
+#ifndef __NO_MAIN__
+int main(int argc, char **argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
+#endif
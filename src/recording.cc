@@ -0,0 +1,518 @@
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <sstream>
+#include <stdexcept>
+
+#include <boost/algorithm/string.hpp>
+
+#include "crypto/crypto.h"
+#include "logging/logging.h"
+#include "recording.h"
+#include "utilities/utils.h"
+
+using Clock = std::chrono::steady_clock;
+
+static int64_t ms_since(Clock::time_point start) {
+  return std::chrono::duration_cast<std::chrono::milliseconds>(Clock::now() - start).count();
+}
+
+Json::Value Exchange::json() const {
+  Json::Value res;
+  res["method"] = method;
+  res["path"] = path;
+  res["phase"] = phase;
+  res["status"] = status;
+  res["bytes"] = static_cast<Json::UInt64>(bytes);
+  res["body"] = body;
+  res["start_ms"] = static_cast<Json::Int64>(start_ms);
+  res["ms"] = static_cast<Json::Int64>(ms);
+  return res;
+}
+
+Exchange Exchange::fromJson(const Json::Value &json) {
+  Exchange res;
+  res.method = json["method"].asString();
+  res.path = json["path"].asString();
+  res.phase = json["phase"].asString();
+  res.status = json["status"].asInt();
+  res.bytes = json["bytes"].asUInt64();
+  res.body = json["body"].asString();
+  res.start_ms = json["start_ms"].asInt64();
+  res.ms = json["ms"].asInt64();
+  return res;
+}
+
+// The first component of a path, without its query
+static std::string path_root(const std::string &path) {
+  size_t start = path.find_first_not_of('/');
+  if (start == std::string::npos) {
+    return "";
+  }
+  return path.substr(start, path.find_first_of("/?", start) - start);
+}
+
+std::string exchange_phase(const std::string &path) {
+  static const std::map<std::string, std::string> phases{
+      {"repo", "metadata"},
+      {"ostree", "ostree"},
+      {"tls", "reports"},
+  };
+  auto it = phases.find(path_root(path));
+  return it != phases.end() ? it->second : "other";
+}
+
+Recording::Recording(boost::filesystem::path dir, bool create) : dir_(std::move(dir)) {
+  auto log_path = dir_ / "exchanges.jsonl";
+  if (create) {
+    boost::filesystem::create_directories(dir_ / "objects");
+  } else if (!boost::filesystem::exists(log_path)) {
+    throw std::runtime_error("No recording in " + dir_.string());
+  }
+
+  std::ifstream in(log_path.string());
+  std::string line;
+  while (std::getline(in, line)) {
+    if (line.empty()) {
+      continue;
+    }
+    Json::Value json = Utils::parseJSON(line);
+    if (!json.isObject()) {
+      throw std::runtime_error("Invalid exchange in " + log_path.string() + ": " + line);
+    }
+    exchanges_.push_back(Exchange::fromJson(json));
+  }
+
+  if (create) {
+    log_.reset(fopen(log_path.c_str(), "a"));
+    if (log_ == nullptr) {
+      throw std::runtime_error("Unable to open " + log_path.string() + ": " + strerror(errno));
+    }
+  }
+}
+
+boost::filesystem::path Recording::tmpPath() {
+  std::lock_guard<std::mutex> guard(lock_);
+  return dir_ / "objects" / (".tmp-" + std::to_string(tmp_count_++));
+}
+
+std::string Recording::addBodyFile(const boost::filesystem::path &tmp) {
+  MultiPartSHA256Hasher hasher;
+  {
+    std::ifstream in(tmp.string(), std::ios::binary);
+    char buf[65536];
+    while (in) {
+      in.read(buf, sizeof(buf));
+      hasher.update(reinterpret_cast<const unsigned char *>(buf), static_cast<uint64_t>(in.gcount()));
+    }
+  }
+  std::string name = boost::algorithm::to_lower_copy(hasher.getHexDigest());
+  // Same content, same name, so a body fetched twice is only kept once
+  if (boost::filesystem::exists(bodyPath(name))) {
+    boost::filesystem::remove(tmp);
+  } else {
+    boost::filesystem::rename(tmp, bodyPath(name));
+  }
+  return name;
+}
+
+std::string Recording::addBody(const std::string &data) {
+  auto tmp = tmpPath();
+  Utils::writeFile(tmp, data);
+  return addBodyFile(tmp);
+}
+
+void Recording::add(const Exchange &exchange) {
+  std::lock_guard<std::mutex> guard(lock_);
+  exchanges_.push_back(exchange);
+  if (log_ != nullptr) {
+    // Written as it goes so a session cut short still leaves a recording
+    std::string line = Utils::jsonToCanonicalStr(exchange.json()) + "\n";
+    if (fwrite(line.data(), 1, line.size(), log_.get()) != line.size() || fflush(log_.get()) != 0) {
+      LOG_ERROR << "Unable to record " << exchange.method << " " << exchange.path << ": " << strerror(errno);
+    }
+  }
+}
+
+std::vector<Exchange> Recording::exchanges() const {
+  std::lock_guard<std::mutex> guard(lock_);
+  return exchanges_;
+}
+
+HttpServer::HttpServer(uint16_t port, size_t threads, Handler handler) : handler_(std::move(handler)) {
+  // Non-blocking so the threads polling it don't get stuck in accept() when
+  // another one took the connection
+  fd_ = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (fd_ < 0) {
+    throw std::runtime_error(std::string("Unable to create socket: ") + strerror(errno));
+  }
+  int on = 1;
+  setsockopt(fd_, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+  sockaddr_in addr{};
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  addr.sin_port = htons(port);
+  socklen_t len = sizeof(addr);
+  if (bind(fd_, reinterpret_cast<sockaddr *>(&addr), len) != 0 || listen(fd_, 64) != 0 ||
+      getsockname(fd_, reinterpret_cast<sockaddr *>(&addr), &len) != 0) {
+    std::string err = strerror(errno);
+    close(fd_);
+    throw std::runtime_error("Unable to listen on port " + std::to_string(port) + ": " + err);
+  }
+  port_ = ntohs(addr.sin_port);
+  for (size_t i = 0; i < std::max<size_t>(threads, 1); i++) {
+    threads_.emplace_back(&HttpServer::run, this);
+  }
+}
+
+HttpServer::~HttpServer() {
+  stop();
+  close(fd_);
+}
+
+void HttpServer::stop() {
+  stop_ = true;
+  for (auto &t : threads_) {
+    if (t.joinable()) {
+      t.join();
+    }
+  }
+}
+
+void HttpServer::run() {
+  while (!stop_) {
+    pollfd pfd{fd_, POLLIN, 0};
+    if (poll(&pfd, 1, 100) <= 0) {
+      continue;
+    }
+    int conn = accept4(fd_, nullptr, nullptr, SOCK_CLOEXEC);
+    if (conn < 0) {
+      continue;
+    }
+    // Don't let a client that went quiet hold up stop()
+    timeval tv{30, 0};
+    setsockopt(conn, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(conn, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+    try {
+      serve(conn);
+    } catch (const std::exception &ex) {
+      LOG_ERROR << "Unable to serve request: " << ex.what();
+    }
+    close(conn);
+  }
+}
+
+static bool send_all(int conn, const char *data, size_t size) {
+  while (size > 0) {
+    ssize_t n = send(conn, data, size, MSG_NOSIGNAL);
+    if (n <= 0) {
+      return false;
+    }
+    data += n;
+    size -= static_cast<size_t>(n);
+  }
+  return true;
+}
+
+static const char *status_reason(int status) {
+  switch (status) {
+    case 200:
+      return "OK";
+    case 204:
+      return "No Content";
+    case 404:
+      return "Not Found";
+    case 405:
+      return "Method Not Allowed";
+    case 500:
+      return "Internal Server Error";
+    case 502:
+      return "Bad Gateway";
+    default:
+      return status < 400 ? "OK" : "Error";
+  }
+}
+
+void HttpServer::serve(int conn) {
+  static const size_t kMaxHeaders = 64 * 1024;
+  std::string data;
+  size_t end;
+  char buf[65536];
+  while ((end = data.find("\r\n\r\n")) == std::string::npos) {
+    ssize_t n = read(conn, buf, sizeof(buf));
+    if (n <= 0 || data.size() > kMaxHeaders) {
+      return;
+    }
+    data.append(buf, static_cast<size_t>(n));
+  }
+
+  std::vector<std::string> lines;
+  std::string head = data.substr(0, end);
+  boost::split(lines, head, boost::is_any_of("\r\n"), boost::token_compress_on);
+  std::vector<std::string> start;
+  boost::split(start, lines[0], boost::is_any_of(" "), boost::token_compress_on);
+  if (start.size() < 2) {
+    return;
+  }
+  Request req{start[0], start[1], "", data.substr(end + 4)};
+  size_t length = 0;
+  bool expect_continue = false;
+  for (size_t i = 1; i < lines.size(); i++) {
+    auto colon = lines[i].find(':');
+    if (colon == std::string::npos) {
+      continue;
+    }
+    std::string name = boost::algorithm::to_lower_copy(lines[i].substr(0, colon));
+    std::string value = boost::algorithm::trim_copy(lines[i].substr(colon + 1));
+    if (name == "content-length") {
+      length = std::stoul(value);
+    } else if (name == "content-type") {
+      req.content_type = value;
+    } else if (name == "expect" && boost::iequals(value, "100-continue")) {
+      expect_continue = true;
+    }
+  }
+  // curl holds back larger bodies until it's told to go ahead
+  if (expect_continue && req.body.size() < length) {
+    static const char kContinue[] = "HTTP/1.1 100 Continue\r\n\r\n";
+    send_all(conn, kContinue, sizeof(kContinue) - 1);
+  }
+  while (req.body.size() < length) {
+    ssize_t n = read(conn, buf, std::min(sizeof(buf), length - req.body.size()));
+    if (n <= 0) {
+      return;
+    }
+    req.body.append(buf, static_cast<size_t>(n));
+  }
+
+  Response res;
+  try {
+    res = handler_(req);
+  } catch (const std::exception &ex) {
+    LOG_ERROR << "Unable to handle " << req.method << " " << req.path << ": " << ex.what();
+    res = Response{500, ex.what(), {}};
+  }
+
+  std::ifstream file;
+  uint64_t size = res.body.size();
+  if (!res.file.empty()) {
+    file.open(res.file.string(), std::ios::binary);
+    size = boost::filesystem::file_size(res.file);
+  }
+  std::string headers = "HTTP/1.1 " + std::to_string(res.status) + " " + status_reason(res.status) +
+                        "\r\nContent-Length: " + std::to_string(size) + "\r\nConnection: close\r\n\r\n";
+  if (!send_all(conn, headers.data(), headers.size()) || req.method == "HEAD") {
+    return;
+  }
+  if (!res.file.empty()) {
+    while (file) {
+      file.read(buf, sizeof(buf));
+      if (!send_all(conn, buf, static_cast<size_t>(file.gcount()))) {
+        return;
+      }
+    }
+  } else {
+    send_all(conn, res.body.data(), res.body.size());
+  }
+}
+
+Recorder::Recorder(HttpFactory make_http, std::map<std::string, std::string> upstreams, Recording &recording)
+    : make_http_(std::move(make_http)),
+      upstreams_(std::move(upstreams)),
+      recording_(recording),
+      started_(Clock::now()) {}
+
+std::unique_ptr<HttpInterface> Recorder::takeHttp() {
+  {
+    std::lock_guard<std::mutex> guard(lock_);
+    if (!idle_.empty()) {
+      auto http = std::move(idle_.back());
+      idle_.pop_back();
+      return http;
+    }
+  }
+  return make_http_();
+}
+
+void Recorder::returnHttp(std::unique_ptr<HttpInterface> http) {
+  std::lock_guard<std::mutex> guard(lock_);
+  idle_.push_back(std::move(http));
+}
+
+static size_t write_body(char *data, size_t size, size_t nmemb, void *userp) {
+  return fwrite(data, size, nmemb, static_cast<FILE *>(userp)) * size;
+}
+
+HttpServer::Response Recorder::handle(const HttpServer::Request &req) {
+  std::string root = path_root(req.path);
+  auto upstream = upstreams_.find(root);
+  if (upstream == upstreams_.end() || upstream->second.empty()) {
+    LOG_WARNING << "No upstream for " << req.method << " " << req.path;
+    return HttpServer::Response{404, "", {}};
+  }
+  std::string url = upstream->second + req.path.substr(req.path.find(root) + root.size());
+
+  Exchange exchange;
+  exchange.method = req.method;
+  exchange.path = req.path;
+  exchange.phase = exchange_phase(req.path);
+  exchange.start_ms = ms_since(started_);
+  auto start = Clock::now();
+
+  HttpServer::Response res;
+  auto http = takeHttp();
+  if (req.method == "GET") {
+    auto tmp = recording_.tmpPath();
+    HttpResponse upstream_res;
+    {
+      std::unique_ptr<FILE, int (*)(FILE *)> out(fopen(tmp.c_str(), "wb"), fclose);
+      if (out == nullptr) {
+        throw std::runtime_error("Unable to create " + tmp.string() + ": " + strerror(errno));
+      }
+      upstream_res = http->download(url, write_body, nullptr, out.get(), 0);
+    }
+    exchange.bytes = boost::filesystem::file_size(tmp);
+    res.status = static_cast<int>(upstream_res.http_status_code);
+    if (exchange.bytes > 0) {
+      exchange.body = recording_.addBodyFile(tmp);
+      res.file = recording_.bodyPath(exchange.body);
+    } else {
+      boost::filesystem::remove(tmp);
+    }
+  } else if (req.method == "POST" || req.method == "PUT") {
+    HttpResponse upstream_res = req.method == "POST" ? http->post(url, req.content_type, req.body)
+                                                     : http->put(url, req.content_type, req.body);
+    res.status = static_cast<int>(upstream_res.http_status_code);
+    res.body = upstream_res.body;
+    exchange.bytes = res.body.size();
+    if (!res.body.empty()) {
+      exchange.body = recording_.addBody(res.body);
+    }
+  } else {
+    returnHttp(std::move(http));
+    return HttpServer::Response{405, "", {}};
+  }
+  returnHttp(std::move(http));
+
+  if (res.status == 0) {
+    // Never got a response, which is replayed as the proxy's own error
+    LOG_WARNING << "No response from " << url;
+    res.status = 502;
+  }
+  exchange.status = res.status;
+  exchange.ms = ms_since(start);
+  recording_.add(exchange);
+  LOG_DEBUG << "Recorded " << req.method << " " << req.path << " " << res.status << " " << exchange.bytes
+            << " bytes in " << exchange.ms << "ms";
+  return res;
+}
+
+Replayer::Replayer(const Recording &recording, double latency_scale, Recording *log)
+    : recording_(recording), latency_scale_(latency_scale), log_(log), started_(Clock::now()) {
+  auto exchanges = recording.exchanges();
+  // Recorded as they finished, replayed in the order they were asked for
+  std::stable_sort(exchanges.begin(), exchanges.end(),
+                   [](const Exchange &a, const Exchange &b) { return a.start_ms < b.start_ms; });
+  for (auto &e : exchanges) {
+    responses_[e.method + " " + e.path].exchanges.push_back(std::move(e));
+  }
+}
+
+HttpServer::Response Replayer::handle(const HttpServer::Request &req) {
+  Exchange exchange;
+  {
+    std::lock_guard<std::mutex> guard(lock_);
+    auto it = responses_.find(req.method + " " + req.path);
+    if (it == responses_.end()) {
+      exchange = Exchange{req.method, req.path, exchange_phase(req.path), 404, 0, "", 0, 0};
+      missing_++;
+      LOG_WARNING << "Not in the recording: " << req.method << " " << req.path;
+    } else {
+      auto &r = it->second;
+      exchange = r.exchanges[std::min(r.next, r.exchanges.size() - 1)];
+      r.next++;
+    }
+  }
+  exchange.start_ms = ms_since(started_);
+  auto start = Clock::now();
+  std::this_thread::sleep_for(
+      std::chrono::milliseconds(static_cast<int64_t>(static_cast<double>(exchange.ms) * latency_scale_)));
+
+  HttpServer::Response res{exchange.status, "", {}};
+  if (!exchange.body.empty()) {
+    res.file = recording_.bodyPath(exchange.body);
+  }
+  exchange.ms = ms_since(start);
+  if (log_ != nullptr) {
+    log_->add(exchange);
+  }
+  return res;
+}
+
+std::map<std::string, PhaseTiming> phase_timings(const std::vector<Exchange> &exchanges) {
+  std::map<std::string, PhaseTiming> res;
+  std::map<std::string, std::pair<int64_t, int64_t>> spans;
+  for (const auto &e : exchanges) {
+    for (const auto &phase : {e.phase, std::string("total")}) {
+      auto &t = res[phase];
+      t.requests++;
+      t.bytes += e.bytes;
+      t.busy_ms += e.ms;
+      auto span = spans.emplace(phase, std::make_pair(e.start_ms, e.start_ms + e.ms)).first;
+      span->second.first = std::min(span->second.first, e.start_ms);
+      span->second.second = std::max(span->second.second, e.start_ms + e.ms);
+    }
+  }
+  for (const auto &s : spans) {
+    res[s.first].span_ms = s.second.second - s.second.first;
+  }
+  return res;
+}
+
+static std::string change(int64_t a, int64_t b) {
+  if (a == 0) {
+    return "-";
+  }
+  std::ostringstream out;
+  out << std::showpos << std::fixed << std::setprecision(1)
+      << static_cast<double>(b - a) * 100.0 / static_cast<double>(a) << "%";
+  return out.str();
+}
+
+std::string compare_timings(const std::map<std::string, PhaseTiming> &a, const std::map<std::string, PhaseTiming> &b) {
+  std::vector<std::string> phases;
+  for (const auto *timings : {&a, &b}) {
+    for (const auto &t : *timings) {
+      if (t.first != "total" && std::find(phases.begin(), phases.end(), t.first) == phases.end()) {
+        phases.push_back(t.first);
+      }
+    }
+  }
+  phases.emplace_back("total");
+
+  std::ostringstream out;
+  out << std::left << std::setw(10) << "phase" << std::right << std::setw(16) << "requests" << std::setw(24)
+      << "bytes" << std::setw(20) << "busy ms" << std::setw(10) << "change" << std::setw(20) << "span ms"
+      << std::setw(10) << "change"
+      << "\n";
+  for (const auto &phase : phases) {
+    auto ta = a.count(phase) > 0 ? a.at(phase) : PhaseTiming{};
+    auto tb = b.count(phase) > 0 ? b.at(phase) : PhaseTiming{};
+    out << std::left << std::setw(10) << phase << std::right << std::setw(16)
+        << (std::to_string(ta.requests) + "/" + std::to_string(tb.requests)) << std::setw(24)
+        << (std::to_string(ta.bytes) + "/" + std::to_string(tb.bytes)) << std::setw(20)
+        << (std::to_string(ta.busy_ms) + "/" + std::to_string(tb.busy_ms)) << std::setw(10)
+        << change(ta.busy_ms, tb.busy_ms) << std::setw(20)
+        << (std::to_string(ta.span_ms) + "/" + std::to_string(tb.span_ms)) << std::setw(10)
+        << change(ta.span_ms, tb.span_ms) << "\n";
+  }
+  return out.str();
+}
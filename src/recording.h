@@ -0,0 +1,182 @@
+#ifndef AKTUALIZR_LITE_RECORDING
+#define AKTUALIZR_LITE_RECORDING
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include <json/json.h>
+#include <boost/filesystem.hpp>
+
+#include "http/httpclient.h"
+
+// Recording and replaying the HTTP exchanges of an update session, so client
+// changes can be benchmarked offline against a real catalog and real
+// latencies. A recording is a directory holding exchanges.jsonl, one exchange
+// per line in the order they finished, and the response bodies under objects/
+// named by their sha256.
+//
+// The server side of an exchange is identified by the first component of its
+// path, which is how the recorder tells its upstreams apart:
+//   /repo/...   metadata, from [uptane] repo_server
+//   /ostree/... OSTree objects, from [pacman] ostree_server
+//   /tls/...    events and system info reports, from [tls] server
+
+struct Exchange {
+  std::string method;
+  std::string path;
+  std::string phase;
+  int status{0};
+  uint64_t bytes{0};
+  // sha256 of the response body, empty when there was none
+  std::string body;
+  // Since the start of the session and how long the response took
+  int64_t start_ms{0};
+  int64_t ms{0};
+
+  Json::Value json() const;
+  static Exchange fromJson(const Json::Value &json);
+};
+
+// metadata, ostree, reports or "other" for a path the recorder doesn't forward
+std::string exchange_phase(const std::string &path);
+
+class Recording {
+ public:
+  // Opens `dir`, creating it when `create` is set and reading in the exchanges
+  // already in it otherwise
+  Recording(boost::filesystem::path dir, bool create);
+
+  const boost::filesystem::path &dir() const { return dir_; }
+  // Stores the body of a response and returns its name, moving it in from
+  // `tmp` for addBodyFile()
+  std::string addBody(const std::string &data);
+  std::string addBodyFile(const boost::filesystem::path &tmp);
+  boost::filesystem::path bodyPath(const std::string &name) const { return dir_ / "objects" / name; }
+  // For streaming a body in before it's added
+  boost::filesystem::path tmpPath();
+
+  void add(const Exchange &exchange);
+  std::vector<Exchange> exchanges() const;
+
+ private:
+  boost::filesystem::path dir_;
+  mutable std::mutex lock_;
+  std::vector<Exchange> exchanges_;
+  std::unique_ptr<FILE, int (*)(FILE *)> log_{nullptr, fclose};
+  uint64_t tmp_count_{0};
+};
+
+// A minimal HTTP/1.1 server on the loopback interface for the recorder and
+// the replay server. Each of `threads` threads accepts and serves one
+// connection at a time, closing it after the response.
+class HttpServer {
+ public:
+  struct Request {
+    std::string method;
+    std::string path;
+    std::string content_type;
+    std::string body;
+  };
+  struct Response {
+    int status{200};
+    std::string body;
+    // Sent instead of `body` when set
+    boost::filesystem::path file;
+  };
+  using Handler = std::function<Response(const Request &)>;
+
+  // Port 0 picks a free one
+  HttpServer(uint16_t port, size_t threads, Handler handler);
+  ~HttpServer();
+  HttpServer(const HttpServer &) = delete;
+  HttpServer &operator=(const HttpServer &) = delete;
+
+  uint16_t port() const { return port_; }
+  std::string url() const { return "http://127.0.0.1:" + std::to_string(port_); }
+  void stop();
+
+ private:
+  void run();
+  void serve(int conn);
+
+  Handler handler_;
+  int fd_{-1};
+  uint16_t port_{0};
+  std::atomic_bool stop_{false};
+  std::vector<std::thread> threads_;
+};
+
+// Forwards requests to the upstream for their first path component and
+// records the exchanges. GET bodies are streamed to the recording rather than
+// held in memory as OSTree objects can be large. A curl handle can only do one
+// transfer at a time, so each concurrent request gets an HTTP client of its own
+// from `make_http`, kept for reuse afterwards.
+class Recorder {
+ public:
+  using HttpFactory = std::function<std::unique_ptr<HttpInterface>()>;
+
+  Recorder(HttpFactory make_http, std::map<std::string, std::string> upstreams, Recording &recording);
+
+  HttpServer::Response handle(const HttpServer::Request &req);
+
+ private:
+  std::unique_ptr<HttpInterface> takeHttp();
+  void returnHttp(std::unique_ptr<HttpInterface> http);
+
+  HttpFactory make_http_;
+  std::mutex lock_;
+  std::vector<std::unique_ptr<HttpInterface>> idle_;
+  std::map<std::string, std::string> upstreams_;
+  Recording &recording_;
+  std::chrono::steady_clock::time_point started_;
+};
+
+// Answers each request with the next recorded response for its method and
+// path, repeating the last one once they run out, after the recorded latency
+// times `latency_scale`. What it served goes to `log`, a recording without
+// bodies, for comparing against the original or another replay.
+class Replayer {
+ public:
+  Replayer(const Recording &recording, double latency_scale, Recording *log);
+
+  HttpServer::Response handle(const HttpServer::Request &req);
+  uint64_t missing() const { return missing_; }
+
+ private:
+  struct Responses {
+    std::vector<Exchange> exchanges;
+    size_t next{0};
+  };
+
+  const Recording &recording_;
+  double latency_scale_;
+  Recording *log_;
+  std::mutex lock_;
+  std::map<std::string, Responses> responses_;
+  std::atomic<uint64_t> missing_{0};
+  std::chrono::steady_clock::time_point started_;
+};
+
+// Per phase numbers of a session: the time from its first request to its last
+// response, the time spent waiting on responses and the requests and bytes
+struct PhaseTiming {
+  uint64_t requests{0};
+  uint64_t bytes{0};
+  int64_t busy_ms{0};
+  int64_t span_ms{0};
+};
+// Keyed by phase, plus "total" for the whole session
+std::map<std::string, PhaseTiming> phase_timings(const std::vector<Exchange> &exchanges);
+// A table of `b`'s timings against `a`'s
+std::string compare_timings(const std::map<std::string, PhaseTiming> &a, const std::map<std::string, PhaseTiming> &b);
+
+#endif  // AKTUALIZR_LITE_RECORDING
@@ -0,0 +1,162 @@
+#include <gtest/gtest.h>
+
+#include <boost/algorithm/string.hpp>
+
+#include "recording.h"
+#include "utilities/utils.h"
+
+// Stands in for the device's servers behind the recorder
+class FakeUpstream : public HttpClient {
+ public:
+  HttpResponse download(const std::string &url, curl_write_callback write_cb, curl_xferinfo_callback progress_cb,
+                        void *userp, curl_off_t from) override {
+    (void)progress_cb;
+    (void)from;
+    urls.push_back(url);
+    std::string body = url.find("missing") != std::string::npos ? "" : "content of " + url.substr(url.rfind('/'));
+    write_cb(&body[0], 1, body.size(), userp);
+    return HttpResponse("", body.empty() ? 404 : 200, 0, "");
+  }
+  HttpResponse put(const std::string &url, const std::string &content_type, const std::string &data) override {
+    urls.push_back(url);
+    (void)content_type;
+    return HttpResponse(data.empty() ? "" : "ok", 200, 0, "");
+  }
+
+  static std::vector<std::string> urls;
+};
+std::vector<std::string> FakeUpstream::urls;
+
+TEST(recording, phase) {
+  ASSERT_EQ("metadata", exchange_phase("/repo/targets.json"));
+  ASSERT_EQ("ostree", exchange_phase("/ostree/objects/ab/cdef.filez"));
+  ASSERT_EQ("reports", exchange_phase("/tls/events"));
+  ASSERT_EQ("other", exchange_phase("/repository/targets.json"));
+  ASSERT_EQ("other", exchange_phase("/"));
+}
+
+TEST(recording, record) {
+  TemporaryDirectory dir;
+  FakeUpstream::urls.clear();
+  {
+    Recording recording(dir.Path(), true);
+    Recorder recorder([]() { return std_::make_unique<FakeUpstream>(); },
+                      {{"repo", "https://repo.example/repo"}, {"ostree", "https://ostree.example"}}, recording);
+    HttpServer server(0, 2, [&recorder](const HttpServer::Request &req) { return recorder.handle(req); });
+
+    HttpClient http;
+    HttpResponse res = http.get(server.url() + "/repo/1.root.json", 1 << 20);
+    ASSERT_TRUE(res.isOk());
+    ASSERT_EQ("content of /1.root.json", res.body);
+    res = http.get(server.url() + "/ostree/objects/00/1.root.json", 1 << 20);
+    ASSERT_EQ("content of /1.root.json", res.body);
+    ASSERT_EQ(404, http.get(server.url() + "/repo/missing.json", 1 << 20).http_status_code);
+    // Not one of the upstreams, so not forwarded or recorded
+    ASSERT_EQ(404, http.get(server.url() + "/tls/events", 1 << 20).http_status_code);
+
+    // Reports are recorded with what the server answered
+    auto put = recorder.handle(HttpServer::Request{"PUT", "/repo/manifest", "application/json", "{}"});
+    ASSERT_EQ(200, put.status);
+    ASSERT_EQ("ok", put.body);
+  }
+  ASSERT_EQ((std::vector<std::string>{
+                "https://repo.example/repo/1.root.json",
+                "https://ostree.example/objects/00/1.root.json",
+                "https://repo.example/repo/missing.json",
+                "https://repo.example/repo/manifest",
+            }),
+            FakeUpstream::urls);
+
+  Recording recording(dir.Path(), false);
+  auto exchanges = recording.exchanges();
+  ASSERT_EQ(4, exchanges.size());
+  ASSERT_EQ("metadata", exchanges[0].phase);
+  ASSERT_EQ("ostree", exchanges[1].phase);
+  ASSERT_EQ(200, exchanges[1].status);
+  ASSERT_EQ(23, exchanges[1].bytes);
+  // The same body is only stored once
+  ASSERT_EQ(exchanges[0].body, exchanges[1].body);
+  ASSERT_EQ("content of /1.root.json", Utils::readFile(recording.bodyPath(exchanges[0].body)));
+  ASSERT_EQ(404, exchanges[2].status);
+  ASSERT_TRUE(exchanges[2].body.empty());
+  ASSERT_EQ("PUT", exchanges[3].method);
+  size_t files = 0;
+  for (auto &entry : boost::make_iterator_range(boost::filesystem::directory_iterator(dir / "objects"), {})) {
+    ASSERT_NE('.', entry.path().filename().string()[0]);
+    files++;
+  }
+  ASSERT_EQ(2, files);
+}
+
+TEST(recording, replay) {
+  TemporaryDirectory dir;
+  TemporaryDirectory log_dir;
+  {
+    Recording recording(dir.Path(), true);
+    // Recorded as they finished: the second timestamp fetch finished first
+    recording.add(Exchange{"GET", "/repo/timestamp.json", "metadata", 200, 2, recording.addBody("v2"), 100, 10});
+    recording.add(Exchange{"GET", "/repo/timestamp.json", "metadata", 200, 2, recording.addBody("v1"), 0, 200});
+    recording.add(Exchange{"GET", "/ostree/config", "ostree", 200, 6, recording.addBody("config"), 300, 0});
+  }
+  Recording recording(dir.Path(), false);
+
+  {
+    Recording log(log_dir.Path(), true);
+    Replayer replayer(recording, 0.5, &log);
+    HttpServer server(0, 2, [&replayer](const HttpServer::Request &req) { return replayer.handle(req); });
+    HttpClient http;
+
+    auto start = std::chrono::steady_clock::now();
+    ASSERT_EQ("v1", http.get(server.url() + "/repo/timestamp.json", 1024).body);
+    // Half the recorded 200ms
+    ASSERT_GE(std::chrono::steady_clock::now() - start, std::chrono::milliseconds(100));
+    ASSERT_EQ("v2", http.get(server.url() + "/repo/timestamp.json", 1024).body);
+    // Once they run out it's the last one again
+    ASSERT_EQ("v2", http.get(server.url() + "/repo/timestamp.json", 1024).body);
+    ASSERT_EQ("config", http.get(server.url() + "/ostree/config", 1024).body);
+    ASSERT_EQ(404, http.get(server.url() + "/ostree/summary", 1024).http_status_code);
+    ASSERT_EQ(1, replayer.missing());
+  }
+
+  auto served = Recording(log_dir.Path(), false).exchanges();
+  ASSERT_EQ(5, served.size());
+  ASSERT_GE(served[0].ms, 100);
+  ASSERT_LE(served[0].start_ms, served[1].start_ms);
+  ASSERT_EQ("/ostree/summary", served[4].path);
+  ASSERT_EQ(404, served[4].status);
+}
+
+TEST(recording, timings) {
+  std::vector<Exchange> a{
+      {"GET", "/repo/targets.json", "metadata", 200, 1000, "", 0, 100},
+      {"GET", "/ostree/objects/1", "ostree", 200, 500, "", 100, 50},
+      {"GET", "/ostree/objects/2", "ostree", 200, 500, "", 120, 80},
+      {"PUT", "/tls/events", "reports", 200, 0, "", 300, 10},
+  };
+  auto ta = phase_timings(a);
+  ASSERT_EQ(1, ta["metadata"].requests);
+  ASSERT_EQ(2, ta["ostree"].requests);
+  ASSERT_EQ(1000, ta["ostree"].bytes);
+  ASSERT_EQ(130, ta["ostree"].busy_ms);
+  ASSERT_EQ(100, ta["ostree"].span_ms);
+  ASSERT_EQ(4, ta["total"].requests);
+  ASSERT_EQ(310, ta["total"].span_ms);
+
+  std::vector<Exchange> b = a;
+  b[2].ms = 180;
+  std::string table = compare_timings(ta, phase_timings(b));
+  std::vector<std::string> lines;
+  boost::split(lines, table, boost::is_any_of("\n"), boost::token_compress_on);
+  ASSERT_EQ(6, lines.size());
+  ASSERT_EQ(0, lines[1].find("metadata"));
+  ASSERT_NE(std::string::npos, lines[2].find("100/200"));
+  ASSERT_NE(std::string::npos, lines[2].find("+100.0%"));
+  ASSERT_EQ(0, lines[4].find("total"));
+}
+
+#ifndef __NO_MAIN__
+int main(int argc, char **argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
+#endif
@@ -0,0 +1,192 @@
+#include <unistd.h>
+
+#include <future>
+#include <iostream>
+
+#include <boost/program_options.hpp>
+
+#include "config/config.h"
+#include "crypto/keymanager.h"
+#include "litestorage.h"
+#include "logging/logging.h"
+#include "recording.h"
+#include "storage/invstorage.h"
+#include "utilities/utils.h"
+#include "workers.h"
+
+namespace bpo = boost::program_options;
+
+// Records the HTTP exchanges of a real update session and serves them back
+// locally, so client changes can be benchmarked against a realistic catalog
+// without the device's servers:
+//
+//  aktualizr-lite-replay record -c /var/sota -r /tmp/session
+//    then run aktualizr-lite with a config fragment pointing it at the
+//    recorder (see the output for the URLs), and Ctrl-C once it's done
+//  aktualizr-lite-replay serve -r /tmp/session --log /tmp/run1
+//    again with aktualizr-lite pointed at it, on the build being tested
+//  aktualizr-lite-replay compare /tmp/session /tmp/run1
+
+static void wait_for_signal() {
+  std::promise<void> stopped;
+  ShutdownSignals signals([&stopped](int signal) {
+    LOG_INFO << "Stopping on signal " << signal;
+    stopped.set_value();
+  });
+  stopped.get_future().wait();
+}
+
+static void print_config(const std::string &url) {
+  std::cout << "Serving on " << url << ", point aktualizr-lite at it with a config fragment like:\n"
+            << "  [uptane]\n  repo_server = \"" << url << "/repo\"\n"
+            << "  [pacman]\n  ostree_server = \"" << url << "/ostree\"\n"
+            << "  [tls]\n  server = \"" << url << "/tls\"\n"
+            << std::flush;
+}
+
+static int record_main(const bpo::variables_map &vm) {
+  if (vm.count("config") == 0) {
+    std::cerr << "record needs the device's configuration to reach its servers\n";
+    return EXIT_FAILURE;
+  }
+  Config config(vm);
+  std::shared_ptr<INvStorage> storage;
+  if (LiteStorageConfig(config.pacman.extra).enabled) {
+    storage = std::make_shared<LiteStorage>(config.storage, true);
+  } else {
+    storage = INvStorage::newStorage(config.storage, true);
+  }
+  std::map<std::string, std::string> upstreams{
+      {"repo", config.uptane.repo_server},
+      {"ostree", config.pacman.ostree_server},
+      {"tls", config.tls.server},
+  };
+  // The same client certificate as the device, so the servers treat the
+  // recorder as it
+  auto make_http = [&config, &storage]() {
+    std::unique_ptr<HttpInterface> http = std_::make_unique<HttpClient>();
+    KeyManager keys(storage, config.keymanagerConfig());
+    keys.copyCertsToCurl(*http);
+    return http;
+  };
+
+  Recording recording(vm["recording"].as<boost::filesystem::path>(), true);
+  Recorder recorder(make_http, upstreams, recording);
+  HttpServer server(vm["port"].as<uint16_t>(), vm["threads"].as<size_t>(),
+                    [&recorder](const HttpServer::Request &req) { return recorder.handle(req); });
+  print_config(server.url());
+  wait_for_signal();
+  server.stop();
+
+  std::cout << "Recorded " << recording.exchanges().size() << " exchanges in " << recording.dir() << "\n";
+  return EXIT_SUCCESS;
+}
+
+static int serve_main(const bpo::variables_map &vm) {
+  Recording recording(vm["recording"].as<boost::filesystem::path>(), false);
+  std::unique_ptr<Recording> log;
+  if (vm.count("log") != 0) {
+    log = std_::make_unique<Recording>(vm["log"].as<boost::filesystem::path>(), true);
+    if (!log->exchanges().empty()) {
+      std::cerr << "Already a run in " << log->dir() << "\n";
+      return EXIT_FAILURE;
+    }
+  }
+  Replayer replayer(recording, vm["latency-scale"].as<double>(), log.get());
+  HttpServer server(vm["port"].as<uint16_t>(), vm["threads"].as<size_t>(),
+                    [&replayer](const HttpServer::Request &req) { return replayer.handle(req); });
+  print_config(server.url());
+  wait_for_signal();
+  server.stop();
+
+  if (replayer.missing() > 0) {
+    std::cout << replayer.missing() << " requests weren't in the recording\n";
+  }
+  if (log) {
+    std::cout << "Recording vs this run:\n"
+              << compare_timings(phase_timings(recording.exchanges()), phase_timings(log->exchanges()));
+  }
+  return EXIT_SUCCESS;
+}
+
+static int compare_main(const bpo::variables_map &vm) {
+  std::vector<boost::filesystem::path> runs;
+  if (vm.count("runs") != 0) {
+    runs = vm["runs"].as<std::vector<boost::filesystem::path>>();
+  }
+  if (runs.size() != 2) {
+    std::cerr << "compare needs two recordings or runs\n";
+    return EXIT_FAILURE;
+  }
+  Recording a(runs[0], false);
+  Recording b(runs[1], false);
+  std::cout << runs[1].string() << " vs " << runs[0].string() << ":\n"
+            << compare_timings(phase_timings(a.exchanges()), phase_timings(b.exchanges()));
+  return EXIT_SUCCESS;
+}
+
+struct Command {
+  const char *name;
+  int (*main)(const bpo::variables_map &);
+};
+static Command commands[] = {
+    {"record", record_main},
+    {"serve", serve_main},
+    {"compare", compare_main},
+};
+
+int main(int argc, char *argv[]) {
+  logger_init(isatty(1) == 1);
+  logger_set_threshold(boost::log::trivial::info);
+
+  std::string names;
+  for (const auto &c : commands) {
+    names += names.empty() ? c.name : std::string(", ") + c.name;
+  }
+  bpo::options_description description("aktualizr-lite session record and replay");
+  // clang-format off
+  description.add_options()
+      ("help,h", "print usage")
+      ("config,c", bpo::value<std::vector<boost::filesystem::path> >()->composing(), "record: the device's configuration file or directory")
+      ("loglevel", bpo::value<int>(), "set log level 0-5 (trace, debug, info, warning, error, fatal)")
+      ("recording,r", bpo::value<boost::filesystem::path>()->default_value("aktualizr-lite-session"), "record, serve: directory of the recording")
+      ("log", bpo::value<boost::filesystem::path>(), "serve: directory to log what was served to, for compare")
+      ("port,p", bpo::value<uint16_t>()->default_value(8780), "record, serve: port to listen on, on the loopback interface")
+      ("threads", bpo::value<size_t>()->default_value(16), "record, serve: requests handled at once")
+      ("latency-scale", bpo::value<double>()->default_value(1.0), "serve: multiplies the recorded response times, 0 to answer at once")
+      ("command", bpo::value<std::string>(), ("Command to run: " + names).c_str())
+      ("runs", bpo::value<std::vector<boost::filesystem::path> >(), "compare: two recordings or serve logs");
+  // clang-format on
+  bpo::positional_options_description pos;
+  pos.add("command", 1);
+  pos.add("runs", 2);
+
+  bpo::variables_map vm;
+  try {
+    bpo::store(bpo::command_line_parser(argc, argv).options(description).positional(pos).run(), vm);
+    bpo::notify(vm);
+  } catch (const bpo::error &ex) {
+    std::cerr << ex.what() << "\n" << description;
+    return EXIT_FAILURE;
+  }
+  if (vm.count("help") != 0 || vm.count("command") == 0) {
+    std::cout << description;
+    return EXIT_SUCCESS;
+  }
+  if (vm.count("loglevel") != 0) {
+    logger_set_threshold(static_cast<boost::log::trivial::severity_level>(vm["loglevel"].as<int>()));
+  }
+
+  for (const auto &c : commands) {
+    if (vm["command"].as<std::string>() == c.name) {
+      try {
+        return c.main(vm);
+      } catch (const std::exception &ex) {
+        LOG_ERROR << ex.what();
+        return EXIT_FAILURE;
+      }
+    }
+  }
+  std::cerr << "Unknown command: " << vm["command"].as<std::string>() << "\n";
+  return EXIT_FAILURE;
+}
@@ -0,0 +1,226 @@
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+
+#include <boost/algorithm/string.hpp>
+
+#include "logging/logging.h"
+#include "resources.h"
+#include "utilities/utils.h"
+
+// glibc doesn't provide wrappers for ioprio_get/ioprio_set
+#define IOPRIO_CLASS_SHIFT 13
+#define IOPRIO_CLASS_BE 2
+#define IOPRIO_CLASS_IDLE 3
+#define IOPRIO_WHO_PROCESS 1
+
+static pid_t gettid_() { return static_cast<pid_t>(syscall(SYS_gettid)); }
+
+ResourceLimits::ResourceLimits(const std::map<std::string, std::string> &extra) {
+  auto it = extra.find("update_sched_policy");
+  if (it != extra.end()) {
+    if (it->second == "idle") {
+      sched_policy = SCHED_IDLE;
+    } else if (it->second == "batch") {
+      sched_policy = SCHED_BATCH;
+    } else if (it->second == "other") {
+      sched_policy = SCHED_OTHER;
+    } else {
+      throw std::invalid_argument("Invalid update_sched_policy: " + it->second);
+    }
+  }
+
+  it = extra.find("update_nice");
+  if (it != extra.end()) {
+    set_nice = true;
+    nice = std::stoi(it->second);
+    if (nice < -20 || nice > 19) {
+      throw std::invalid_argument("Invalid update_nice: " + it->second);
+    }
+  }
+
+  it = extra.find("update_ioprio");
+  if (it != extra.end()) {
+    if (it->second == "idle") {
+      ioprio = IOPRIO_CLASS_IDLE << IOPRIO_CLASS_SHIFT;
+    } else if (boost::starts_with(it->second, "be:")) {
+      int level = std::stoi(it->second.substr(3));
+      if (level < 0 || level > 7) {
+        throw std::invalid_argument("Invalid update_ioprio: " + it->second);
+      }
+      ioprio = (IOPRIO_CLASS_BE << IOPRIO_CLASS_SHIFT) | level;
+    } else {
+      throw std::invalid_argument("Invalid update_ioprio: " + it->second);
+    }
+  }
+
+  it = extra.find("update_cgroup");
+  if (it != extra.end()) {
+    cgroup = it->second;
+    if (cgroup.empty() || cgroup.find('/') != std::string::npos || cgroup == "." || cgroup == "..") {
+      throw std::invalid_argument("Invalid update_cgroup, it must name a child of aktualizr-lite's own: " + cgroup);
+    }
+  }
+  it = extra.find("update_cpu_weight");
+  if (it != extra.end()) {
+    if (cgroup.empty()) {
+      throw std::invalid_argument("update_cpu_weight requires update_cgroup to be set");
+    }
+    cpu_weight = std::stoull(it->second);
+    if (cpu_weight < 1 || cpu_weight > 10000) {
+      throw std::invalid_argument("Invalid update_cpu_weight: " + it->second);
+    }
+  }
+  if (extra.count("update_memory_limit") > 0) {
+    throw std::invalid_argument(
+        "update_memory_limit is not supported, memory can't be limited for the updating thread alone");
+  }
+}
+
+// Returns the cgroup v2 path of the calling thread as mounted under /sys/fs/cgroup
+static boost::filesystem::path current_cgroup() {
+  std::istringstream ss(Utils::readFile("/proc/thread-self/cgroup"));
+  std::string line;
+  while (std::getline(ss, line)) {
+    if (boost::starts_with(line, "0::")) {
+      return boost::filesystem::path("/sys/fs/cgroup") / line.substr(3);
+    }
+  }
+  return boost::filesystem::path();
+}
+
+// cgroupfs files can't be replaced atomically like Utils::writeFile does
+static void write_control(const boost::filesystem::path &path, const std::string &value) {
+  std::ofstream f(path.string());
+  f << value;
+  f.close();
+  if (f.fail()) {
+    throw std::runtime_error("Unable to write " + path.string() + ": " + strerror(errno));
+  }
+}
+
+// Threads can only move between the cgroups of a threaded subtree, rooted at
+// the process's domain cgroup. Creates `name` there as a threaded cgroup.
+static boost::filesystem::path threaded_cgroup(const boost::filesystem::path &cur, const std::string &name,
+                                               uint64_t cpu_weight) {
+  boost::filesystem::path domain = cur;
+  if (boost::trim_copy(Utils::readFile(cur / "cgroup.type")) == "threaded") {
+    domain = cur.parent_path();
+  }
+  boost::filesystem::path cgroup = domain / name;
+  boost::filesystem::create_directories(cgroup);
+  if (boost::trim_copy(Utils::readFile(cgroup / "cgroup.type")) != "threaded") {
+    write_control(cgroup / "cgroup.type", "threaded");
+  }
+  if (cpu_weight > 0) {
+    write_control(domain / "cgroup.subtree_control", "+cpu");
+    write_control(cgroup / "cpu.weight", std::to_string(cpu_weight));
+  }
+  return cgroup;
+}
+
+static bool join_cgroup(const boost::filesystem::path &cgroup) {
+  try {
+    write_control(cgroup / "cgroup.threads", std::to_string(gettid_()));
+    return true;
+  } catch (const std::exception &ex) {
+    LOG_WARNING << "Unable to move to cgroup " << cgroup << ": " << ex.what();
+  }
+  return false;
+}
+
+ScopedResourceLimits::ScopedResourceLimits(const ResourceLimits &limits) : limits_(limits) {
+  if (limits_.sched_policy >= 0) {
+    old_policy_ = sched_getscheduler(0);
+    sched_getparam(0, &old_param_);
+    struct sched_param param {};
+    if (sched_setscheduler(0, limits_.sched_policy, &param) != 0) {
+      LOG_WARNING << "Unable to set update scheduling policy: " << strerror(errno);
+      old_policy_ = -1;
+    }
+  }
+
+  if (limits_.set_nice) {
+    errno = 0;
+    old_nice_ = getpriority(PRIO_PROCESS, static_cast<id_t>(gettid_()));
+    if (errno != 0 || setpriority(PRIO_PROCESS, static_cast<id_t>(gettid_()), limits_.nice) != 0) {
+      LOG_WARNING << "Unable to set update nice level: " << strerror(errno);
+    }
+  }
+
+  if (limits_.ioprio >= 0) {
+    old_ioprio_ = static_cast<int>(syscall(SYS_ioprio_get, IOPRIO_WHO_PROCESS, 0));
+    if (old_ioprio_ < 0 || syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, limits_.ioprio) != 0) {
+      LOG_WARNING << "Unable to set update I/O priority: " << strerror(errno);
+      old_ioprio_ = -1;
+    }
+  }
+
+  if (!limits_.cgroup.empty()) {
+    try {
+      auto cur = current_cgroup();
+      if (join_cgroup(threaded_cgroup(cur, limits_.cgroup, limits_.cpu_weight))) {
+        old_cgroup_ = cur;
+      }
+    } catch (const std::exception &ex) {
+      LOG_WARNING << "Unable to set up update cgroup " << limits_.cgroup << ": " << ex.what();
+    }
+  }
+}
+
+ScopedResourceLimits::~ScopedResourceLimits() {
+  if (!old_cgroup_.empty()) {
+    join_cgroup(old_cgroup_);
+  }
+  if (old_ioprio_ >= 0) {
+    syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, old_ioprio_);
+  }
+  if (limits_.set_nice) {
+    setpriority(PRIO_PROCESS, static_cast<id_t>(gettid_()), old_nice_);
+  }
+  if (old_policy_ >= 0) {
+    sched_setscheduler(0, old_policy_, &old_param_);
+  }
+}
+
+void PhaseTimer::start(const std::string &phase) {
+  stop();
+  current_ = phase;
+  started_ = Clock::now();
+}
+
+void PhaseTimer::stop() {
+  if (current_.empty()) {
+    return;
+  }
+  auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(Clock::now() - started_);
+  phases_.emplace_back(current_, elapsed);
+  current_.clear();
+}
+
+std::chrono::milliseconds PhaseTimer::get(const std::string &phase) const {
+  std::chrono::milliseconds total{0};
+  for (const auto &p : phases_) {
+    if (p.first == phase) {
+      total += p.second;
+    }
+  }
+  return total;
+}
+
+std::string PhaseTimer::str() const {
+  std::string out;
+  for (const auto &p : phases_) {
+    if (!out.empty()) {
+      out += " ";
+    }
+    out += p.first + "=" + std::to_string(p.second.count()) + "ms";
+  }
+  return out;
+}
@@ -0,0 +1,79 @@
+#ifndef AKTUALIZR_LITE_RESOURCES
+#define AKTUALIZR_LITE_RESOURCES
+
+#include <sched.h>
+
+#include <chrono>
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <boost/filesystem.hpp>
+
+// CPU, I/O and memory settings the heavy phases of an update (download,
+// verification and deployment) run with so they don't disturb latency
+// sensitive workloads on the device. Configured via [pacman]:
+//   update_sched_policy = idle|batch|other
+//   update_nice = -20..19
+//   update_ioprio = idle|be:0-7
+//   update_cgroup = update
+//   update_cpu_weight = 1..10000  (requires update_cgroup)
+// update_cgroup names a cgroup v2 child of aktualizr-lite's own cgroup (so
+// its unit needs Delegate=yes under systemd). It's made a threaded cgroup,
+// which only the updating thread joins, and so only threaded controllers
+// like cpu apply to it. Memory can't be limited per thread, so an
+// update_memory_limit is refused rather than ignored.
+struct ResourceLimits {
+  ResourceLimits() = default;
+  explicit ResourceLimits(const std::map<std::string, std::string> &extra);
+
+  bool empty() const { return sched_policy < 0 && !set_nice && ioprio < 0 && cgroup.empty(); }
+
+  int sched_policy{-1};
+  bool set_nice{false};
+  int nice{0};
+  int ioprio{-1};  // encoded as for ioprio_set(2)
+  std::string cgroup;
+  uint64_t cpu_weight{0};
+};
+
+// Applies ResourceLimits to the calling thread (and so to the threads it
+// spawns) for the lifetime of the object, the rest of the process keeps its
+// own settings and cgroup. The previous settings are put
+// back on destruction. Failures are logged and otherwise ignored, an
+// update is never refused because it couldn't be de-prioritized.
+class ScopedResourceLimits {
+ public:
+  explicit ScopedResourceLimits(const ResourceLimits &limits);
+  ~ScopedResourceLimits();
+  ScopedResourceLimits(const ScopedResourceLimits &) = delete;
+  ScopedResourceLimits &operator=(const ScopedResourceLimits &) = delete;
+
+ private:
+  const ResourceLimits &limits_;
+  int old_policy_{-1};
+  struct sched_param old_param_ {};
+  int old_nice_{0};
+  int old_ioprio_{-1};
+  boost::filesystem::path old_cgroup_;
+};
+
+// Records how long each phase of an operation took.
+class PhaseTimer {
+ public:
+  using Clock = std::chrono::steady_clock;
+
+  void start(const std::string &phase);
+  void stop();
+  std::chrono::milliseconds get(const std::string &phase) const;
+  const std::vector<std::pair<std::string, std::chrono::milliseconds>> &phases() const { return phases_; }
+  std::string str() const;
+
+ private:
+  std::vector<std::pair<std::string, std::chrono::milliseconds>> phases_;
+  std::string current_;
+  Clock::time_point started_;
+};
+
+#endif  // AKTUALIZR_LITE_RESOURCES
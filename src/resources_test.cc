@@ -0,0 +1,79 @@
+#include <gtest/gtest.h>
+
+#include <thread>
+
+#include "resources.h"
+
+TEST(resources, parse) {
+  std::map<std::string, std::string> extra;
+  ASSERT_TRUE(ResourceLimits(extra).empty());
+
+  extra["update_sched_policy"] = "idle";
+  extra["update_ioprio"] = "be:7";
+  extra["update_nice"] = "10";
+  ResourceLimits limits(extra);
+  ASSERT_FALSE(limits.empty());
+  ASSERT_EQ(SCHED_IDLE, limits.sched_policy);
+  ASSERT_EQ((2 << 13) | 7, limits.ioprio);
+  ASSERT_TRUE(limits.set_nice);
+  ASSERT_EQ(10, limits.nice);
+
+  extra["update_ioprio"] = "be:8";
+  ASSERT_THROW(ResourceLimits{extra}, std::invalid_argument);
+  extra["update_ioprio"] = "idle";
+  extra["update_sched_policy"] = "fifo";
+  ASSERT_THROW(ResourceLimits{extra}, std::invalid_argument);
+  extra["update_sched_policy"] = "batch";
+
+  // A CPU weight needs a cgroup to apply it to
+  extra["update_cpu_weight"] = "10";
+  ASSERT_THROW(ResourceLimits{extra}, std::invalid_argument);
+  extra["update_cgroup"] = "update";
+  ASSERT_EQ(10, ResourceLimits(extra).cpu_weight);
+  extra["update_cpu_weight"] = "0";
+  ASSERT_THROW(ResourceLimits{extra}, std::invalid_argument);
+  extra.erase("update_cpu_weight");
+
+  // Only a child of the process's own cgroup can hold a single thread
+  extra["update_cgroup"] = "/sys/fs/cgroup/aklite";
+  ASSERT_THROW(ResourceLimits{extra}, std::invalid_argument);
+  extra.erase("update_cgroup");
+
+  // Not something that can be applied to the updating thread
+  extra["update_memory_limit"] = "256M";
+  ASSERT_THROW(ResourceLimits{extra}, std::invalid_argument);
+}
+
+TEST(resources, scoped_limits) {
+  std::map<std::string, std::string> extra;
+  extra["update_sched_policy"] = "batch";
+  ResourceLimits limits(extra);
+
+  int policy = sched_getscheduler(0);
+  {
+    ScopedResourceLimits scoped(limits);
+    ASSERT_EQ(SCHED_BATCH, sched_getscheduler(0));
+  }
+  ASSERT_EQ(policy, sched_getscheduler(0));
+}
+
+TEST(resources, phase_timer) {
+  PhaseTimer timer;
+  timer.start("download");
+  std::this_thread::sleep_for(std::chrono::milliseconds(20));
+  timer.start("verify");
+  timer.stop();
+  timer.stop();  // no-op
+
+  ASSERT_EQ(2, timer.phases().size());
+  ASSERT_GE(timer.get("download").count(), 20);
+  ASSERT_EQ(0, timer.get("install").count());
+  ASSERT_EQ(0, timer.str().find("download="));
+}
+
+#ifndef __NO_MAIN__
+int main(int argc, char **argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
+#endif
@@ -0,0 +1,105 @@
+#include <string.h>
+#include <time.h>
+
+#include "crypto/crypto.h"
+#include "logging/logging.h"
+#include "rollout.h"
+#include "utilities/utils.h"
+
+RolloutPolicy::RolloutPolicy(const std::string &serial) {
+  // The top 53 bits of the serial's hash, so every value is exact as a double
+  std::string digest = Crypto::sha256digest(serial);
+  uint64_t bits = 0;
+  for (size_t i = 0; i < 8; i++) {
+    bits = (bits << 8) | static_cast<uint8_t>(digest[i]);
+  }
+  slot_ = static_cast<double>(bits >> 11) / static_cast<double>(1ULL << 53);
+}
+
+static bool parse_time(const std::string &str, RolloutPolicy::Clock::time_point &t) {
+  struct tm tm {};
+  const char *end = strptime(str.c_str(), "%Y-%m-%dT%H:%M:%SZ", &tm);
+  if (end == nullptr || *end != '\0') {
+    return false;
+  }
+  t = RolloutPolicy::Clock::from_time_t(timegm(&tm));
+  return true;
+}
+
+RolloutPolicy::Clock::time_point RolloutPolicy::adoptionTime(const Uptane::Target &t) const {
+  const Json::Value rollout = t.custom_data()["rollout"];
+  Clock::time_point at = Clock::time_point::min();
+  if (!rollout.isObject()) {
+    return at;
+  }
+
+  if (rollout.isMember("percentage")) {
+    if (!rollout["percentage"].isNumeric()) {
+      LOG_WARNING << "Ignoring invalid rollout percentage of " << t.filename();
+    } else if (slot_ * 100 >= rollout["percentage"].asDouble()) {
+      return Clock::time_point::max();
+    }
+  }
+
+  if (rollout.isMember("start")) {
+    Clock::time_point start;
+    if (!rollout["start"].isString() || !parse_time(rollout["start"].asString(), start)) {
+      LOG_WARNING << "Ignoring invalid rollout start of " << t.filename();
+      return at;
+    }
+    at = start;
+    if (rollout.isMember("window")) {
+      if (!rollout["window"].isUInt64()) {
+        LOG_WARNING << "Ignoring invalid rollout window of " << t.filename();
+      } else {
+        auto offset = static_cast<double>(rollout["window"].asUInt64()) * slot_;
+        at += std::chrono::seconds(static_cast<int64_t>(offset));
+      }
+    }
+  }
+  return at;
+}
+
+std::string RolloutPolicy::timeStr(Clock::time_point t) {
+  if (t == Clock::time_point::max()) {
+    return "never";
+  }
+  time_t secs = Clock::to_time_t(t);
+  struct tm tm {};
+  char buf[32];
+  strftime(buf, sizeof(buf), "%Y-%m-%dT%H:%M:%SZ", gmtime_r(&secs, &tm));
+  return buf;
+}
+
+static bool older(const Uptane::Target &a, const Uptane::Target &b) {
+  return strverscmp(a.custom_version().c_str(), b.custom_version().c_str()) < 0;
+}
+
+std::unique_ptr<Uptane::Target> select_latest(const std::vector<Uptane::Target> &targets,
+                                              const Uptane::Target &current, const RolloutPolicy *rollout,
+                                              RolloutPolicy::Clock::time_point now,
+                                              std::unique_ptr<Uptane::Target> *deferred) {
+  std::unique_ptr<Uptane::Target> latest;
+  std::unique_ptr<Uptane::Target> held;
+  for (const auto &t : targets) {
+    if (rollout != nullptr && !rollout->eligible(t, now)) {
+      if (held == nullptr || older(*held, t)) {
+        held = std_::make_unique<Uptane::Target>(t);
+      }
+    } else if (latest == nullptr || older(*latest, t)) {
+      latest = std_::make_unique<Uptane::Target>(t);
+    }
+  }
+  // Only a rollout holding back something newer keeps the device where it is
+  if (latest != nullptr && held != nullptr && older(*latest, *held) && older(*latest, current)) {
+    latest.reset();
+  }
+  if (deferred != nullptr) {
+    if (held != nullptr && (latest == nullptr || older(*latest, *held)) && older(current, *held)) {
+      *deferred = std::move(held);
+    } else {
+      deferred->reset();
+    }
+  }
+  return latest;
+}
@@ -0,0 +1,51 @@
+#ifndef AKTUALIZR_LITE_ROLLOUT
+#define AKTUALIZR_LITE_ROLLOUT
+
+#include <chrono>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "uptane/tuf.h"
+
+// Spreads the adoption of a new target across a fleet. A target can carry
+//   "custom": {"rollout": {"start": "2020-06-01T00:00:00Z", "window": 86400, "percentage": 50}}
+// Each device gets a stable slot in [0, 1) from its ECU serial. It adopts the
+// target once `start + slot * window` (seconds) has passed, and only if its
+// slot is within the first `percentage` of the fleet. Either part can be left
+// out. Targets without valid rollout data are available to everyone at once.
+class RolloutPolicy {
+ public:
+  using Clock = std::chrono::system_clock;
+
+  explicit RolloutPolicy(const std::string &serial);
+
+  double slot() const { return slot_; }
+  // The earliest time this device may adopt the target. Clock::time_point::max()
+  // if it is outside of the target's percentage.
+  Clock::time_point adoptionTime(const Uptane::Target &t) const;
+  bool eligible(const Uptane::Target &t, Clock::time_point now = Clock::now()) const {
+    return now >= adoptionTime(t);
+  }
+
+  static std::string timeStr(Clock::time_point t);
+
+ private:
+  double slot_;
+};
+
+// What "latest" is for a device running `current`, among the targets for its
+// hardware and tags: the newest one `rollout` lets it adopt at `now` (all of
+// them when it's nullptr). nullptr when there's none, or when that one is
+// older than `current` while a newer one is held back: a device can be ahead
+// of its rollout after an update by name or a cut in the percentage, and it's
+// then up to date rather than due a downgrade. Without anything held back the
+// newest target is returned whatever `current` is, as without rollouts.
+// `deferred`, if given, is set to the newest target held back that's newer
+// than what's returned.
+std::unique_ptr<Uptane::Target> select_latest(const std::vector<Uptane::Target> &targets,
+                                              const Uptane::Target &current, const RolloutPolicy *rollout,
+                                              RolloutPolicy::Clock::time_point now,
+                                              std::unique_ptr<Uptane::Target> *deferred = nullptr);
+
+#endif  // AKTUALIZR_LITE_ROLLOUT
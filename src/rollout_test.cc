@@ -0,0 +1,162 @@
+#include <gtest/gtest.h>
+
+#include "rollout.h"
+
+using Clock = RolloutPolicy::Clock;
+
+static Uptane::Target staged(const Json::Value &rollout) {
+  Json::Value target_json;
+  target_json["hashes"]["sha256"] = "deadbeef";
+  target_json["custom"]["targetFormat"] = "OSTREE";
+  target_json["length"] = 0;
+  if (!rollout.isNull()) {
+    target_json["custom"]["rollout"] = rollout;
+  }
+  return Uptane::Target("test-rollout", target_json);
+}
+
+static Clock::time_point at(time_t secs) { return Clock::from_time_t(secs); }
+
+TEST(rollout, slot) {
+  RolloutPolicy policy("serial-1");
+  ASSERT_EQ(policy.slot(), RolloutPolicy("serial-1").slot());
+  ASSERT_NE(policy.slot(), RolloutPolicy("serial-2").slot());
+  ASSERT_GE(policy.slot(), 0);
+  ASSERT_LT(policy.slot(), 1);
+}
+
+TEST(rollout, no_rollout) {
+  RolloutPolicy policy("serial-1");
+  ASSERT_TRUE(policy.eligible(staged(Json::Value()), at(0)));
+  ASSERT_TRUE(policy.eligible(staged("garbage"), at(0)));
+
+  Json::Value rollout;
+  rollout["start"] = "not a time";
+  rollout["window"] = 86400;
+  ASSERT_TRUE(policy.eligible(staged(rollout), at(0)));
+}
+
+// A fleet polling with a simulated clock adopts evenly across the window
+TEST(rollout, window) {
+  const time_t start = 1590969600;  // 2020-06-01T00:00:00Z
+  const int kDevices = 10000;
+  const int kBuckets = 10;
+  Json::Value rollout;
+  rollout["start"] = "2020-06-01T00:00:00Z";
+  rollout["window"] = 10 * 3600;
+  Uptane::Target target = staged(rollout);
+
+  std::vector<RolloutPolicy> fleet;
+  for (int i = 0; i < kDevices; i++) {
+    fleet.emplace_back("serial-" + std::to_string(i));
+    ASSERT_FALSE(fleet.back().eligible(target, at(start - 1)));
+  }
+
+  int adopted = 0;
+  for (int hour = 1; hour <= kBuckets; hour++) {
+    int now = 0;
+    for (const auto &device : fleet) {
+      now += device.eligible(target, at(start + hour * 3600)) ? 1 : 0;
+    }
+    // Within 20% of an even share each hour
+    ASSERT_NEAR(kDevices / kBuckets, now - adopted, kDevices / kBuckets / 5) << "hour " << hour;
+    adopted = now;
+  }
+  ASSERT_EQ(kDevices, adopted);
+
+  RolloutPolicy device("serial-1");
+  ASSERT_EQ(at(start + static_cast<time_t>(device.slot() * 10 * 3600)), device.adoptionTime(target));
+  ASSERT_EQ("2020-06-01T00:00:00Z", RolloutPolicy::timeStr(at(start)));
+}
+
+TEST(rollout, percentage) {
+  Json::Value rollout;
+  rollout["percentage"] = 25;
+  Uptane::Target target = staged(rollout);
+  int eligible = 0;
+  for (int i = 0; i < 10000; i++) {
+    RolloutPolicy device("serial-" + std::to_string(i));
+    bool ok = device.eligible(target, at(0));
+    ASSERT_EQ(device.slot() < 0.25, ok);
+    eligible += ok ? 1 : 0;
+  }
+  ASSERT_NEAR(2500, eligible, 250);
+
+  // Raising the percentage only ever adds devices
+  rollout["percentage"] = 100;
+  ASSERT_TRUE(RolloutPolicy("serial-1").eligible(staged(rollout), at(0)));
+  rollout["percentage"] = 0;
+  ASSERT_FALSE(RolloutPolicy("serial-1").eligible(staged(rollout), Clock::now()));
+  ASSERT_EQ("never", RolloutPolicy::timeStr(RolloutPolicy("serial-1").adoptionTime(staged(rollout))));
+}
+
+static Uptane::Target version(const std::string &v, bool held_back) {
+  Json::Value target_json;
+  target_json["hashes"]["sha256"] = "deadbeef";
+  target_json["custom"]["targetFormat"] = "OSTREE";
+  target_json["custom"]["version"] = v;
+  target_json["length"] = 0;
+  if (held_back) {
+    target_json["custom"]["rollout"]["percentage"] = 0;
+  }
+  return Uptane::Target("lmp-" + v, target_json);
+}
+
+TEST(rollout, select_latest) {
+  RolloutPolicy policy("serial-1");
+  std::vector<Uptane::Target> targets{version("1", false), version("3", false), version("4", true)};
+  std::unique_ptr<Uptane::Target> deferred;
+  auto latest = select_latest(targets, version("1", false), &policy, at(0), &deferred);
+  ASSERT_EQ("lmp-3", latest->filename());
+  ASSERT_EQ("lmp-4", deferred->filename());
+
+  // Without a rollout policy everything is available
+  latest = select_latest(targets, version("1", false), nullptr, at(0), &deferred);
+  ASSERT_EQ("lmp-4", latest->filename());
+  ASSERT_EQ(nullptr, deferred);
+
+  // The running target is the latest
+  latest = select_latest(targets, version("3", false), &policy, at(0), &deferred);
+  ASSERT_EQ("lmp-3", latest->filename());
+}
+
+// A device running a target held back from it isn't taken back to an older one
+TEST(rollout, select_latest_ahead) {
+  RolloutPolicy policy("serial-1");
+  std::vector<Uptane::Target> targets{version("1", false), version("3", false), version("4", true)};
+  std::unique_ptr<Uptane::Target> deferred;
+  ASSERT_EQ(nullptr, select_latest(targets, version("4", true), &policy, at(0), &deferred));
+  ASSERT_EQ(nullptr, deferred);
+}
+
+// Nothing is held back, so a device running something newer than every
+// target still moves to the newest of them
+TEST(rollout, select_latest_no_rollout) {
+  RolloutPolicy policy("serial-1");
+  std::vector<Uptane::Target> targets{version("1", false), version("3", false)};
+  std::unique_ptr<Uptane::Target> deferred;
+  auto latest = select_latest(targets, version("4", false), &policy, at(0), &deferred);
+  ASSERT_EQ("lmp-3", latest->filename());
+  ASSERT_EQ(nullptr, deferred);
+
+  latest = select_latest(targets, version("4", false), nullptr, at(0), &deferred);
+  ASSERT_EQ("lmp-3", latest->filename());
+  ASSERT_EQ(nullptr, deferred);
+}
+
+// Every target is held back: up to date rather than an error
+TEST(rollout, select_latest_all_deferred) {
+  RolloutPolicy policy("serial-1");
+  std::vector<Uptane::Target> targets{version("2", true), version("3", true)};
+  std::unique_ptr<Uptane::Target> deferred;
+  ASSERT_EQ(nullptr, select_latest(targets, version("1", false), &policy, at(0), &deferred));
+  ASSERT_EQ("lmp-3", deferred->filename());
+  ASSERT_EQ(nullptr, select_latest(targets, Uptane::Target::Unknown(), &policy, at(0)));
+}
+
+#ifndef __NO_MAIN__
+int main(int argc, char **argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
+#endif
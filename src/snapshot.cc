@@ -0,0 +1,212 @@
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+
+#include <boost/crc.hpp>
+
+#include "logging/logging.h"
+#include "snapshot.h"
+#include "utilities/utils.h"
+
+// Layout: kMagic | crc32 (4) | count (4) | count * (length (4) | bytes), with
+// the crc covering everything after itself. Host byte order, like LiteStore.
+static const char kMagic[] = "LITESNP1";
+static const size_t kMagicSize = sizeof(kMagic) - 1;
+static const size_t kHeaderSize = kMagicSize + 8;
+
+static const char kConfigTag[] = "config-1";
+static const char kTargetsTag[] = "targets-1";
+
+Snapshot::Snapshot(const boost::filesystem::path &path) {
+  int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    return;
+  }
+  struct stat st {};
+  if (fstat(fd, &st) != 0 || static_cast<size_t>(st.st_size) < kHeaderSize) {
+    close(fd);
+    return;
+  }
+  length_ = static_cast<size_t>(st.st_size);
+  void *data = mmap(nullptr, length_, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED) {
+    return;
+  }
+  const char *p = static_cast<const char *>(data);
+
+  uint32_t sum;
+  uint32_t count;
+  memcpy(&sum, p + kMagicSize, 4);
+  memcpy(&count, p + kMagicSize + 4, 4);
+  boost::crc_32_type crc;
+  crc.process_bytes(p + kMagicSize + 4, length_ - kMagicSize - 4);
+  if (memcmp(p, kMagic, kMagicSize) != 0 || crc.checksum() != sum) {
+    LOG_DEBUG << "Ignoring damaged snapshot " << path;
+    munmap(data, length_);
+    return;
+  }
+
+  size_t pos = kHeaderSize;
+  for (uint32_t i = 0; i < count; i++) {
+    uint32_t len;
+    if (length_ - pos < 4) {
+      break;
+    }
+    memcpy(&len, p + pos, 4);
+    pos += 4;
+    if (length_ - pos < len) {
+      break;
+    }
+    records_.emplace_back(p + pos, len);
+    pos += len;
+  }
+  if (records_.size() != count) {
+    records_.clear();
+    munmap(data, length_);
+    return;
+  }
+  data_ = data;
+}
+
+Snapshot::~Snapshot() {
+  if (data_ != nullptr) {
+    munmap(data_, length_);
+  }
+}
+
+bool Snapshot::equals(size_t i, const std::string &value) const {
+  return records_[i].second == value.size() && memcmp(records_[i].first, value.data(), value.size()) == 0;
+}
+
+void Snapshot::write(const boost::filesystem::path &path, const std::vector<std::string> &records) {
+  std::string out(kHeaderSize, '\0');
+  memcpy(&out[0], kMagic, kMagicSize);
+  auto count = static_cast<uint32_t>(records.size());
+  memcpy(&out[kMagicSize + 4], &count, 4);
+  for (const auto &r : records) {
+    auto len = static_cast<uint32_t>(r.size());
+    out.append(reinterpret_cast<const char *>(&len), 4);
+    out += r;
+  }
+  boost::crc_32_type crc;
+  crc.process_bytes(out.data() + kMagicSize + 4, out.size() - kMagicSize - 4);
+  uint32_t sum = crc.checksum();
+  memcpy(&out[kMagicSize], &sum, 4);
+
+  // Unique per process as several may be refreshing the same snapshot
+  std::string tmp_path = path.string() + "." + std::to_string(getpid());
+  int fd = open(tmp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+  if (fd < 0) {
+    throw std::runtime_error("Unable to create " + tmp_path + ": " + strerror(errno));
+  }
+  size_t done = 0;
+  while (done < out.size()) {
+    ssize_t rc = ::write(fd, out.data() + done, out.size() - done);
+    if (rc < 0 && errno == EINTR) {
+      continue;
+    }
+    if (rc <= 0) {
+      break;
+    }
+    done += static_cast<size_t>(rc);
+  }
+  // Not synced: a snapshot lost to a crash is simply rebuilt
+  close(fd);
+  if (done != out.size() || rename(tmp_path.c_str(), path.c_str()) != 0) {
+    std::string err = strerror(errno);
+    unlink(tmp_path.c_str());
+    throw std::runtime_error("Unable to write " + path.string() + ": " + err);
+  }
+}
+
+static void add_stamp(std::string &stamp, const boost::filesystem::path &path) {
+  struct stat st {};
+  stamp += path.string();
+  if (stat(path.c_str(), &st) != 0) {
+    stamp += " -\n";
+    return;
+  }
+  stamp += " " + std::to_string(st.st_ino) + " " + std::to_string(st.st_size) + " " +
+           std::to_string(st.st_mtim.tv_sec) + "." + std::to_string(st.st_mtim.tv_nsec) + "\n";
+}
+
+std::string source_stamp(const std::vector<boost::filesystem::path> &paths) {
+  std::string stamp;
+  for (const auto &path : paths) {
+    add_stamp(stamp, path);
+    boost::system::error_code ec;
+    if (!boost::filesystem::is_directory(path, ec)) {
+      continue;
+    }
+    std::vector<boost::filesystem::path> files;
+    for (auto &entry : boost::make_iterator_range(boost::filesystem::directory_iterator(path, ec), {})) {
+      files.push_back(entry.path());
+    }
+    std::sort(files.begin(), files.end());
+    for (const auto &f : files) {
+      add_stamp(stamp, f);
+    }
+  }
+  return stamp;
+}
+
+static void save_snapshot(const boost::filesystem::path &path, const std::vector<std::string> &records) {
+  try {
+    boost::system::error_code ec;
+    boost::filesystem::create_directories(path.parent_path(), ec);
+    Snapshot::write(path, records);
+  } catch (const std::exception &ex) {
+    // Only costs start up time, not worth more than a debug message
+    LOG_DEBUG << "Unable to save snapshot: " << ex.what();
+  }
+}
+
+void save_config_snapshot(const boost::filesystem::path &path, const std::string &key, const Config &config) {
+  save_snapshot(path, {kConfigTag, key, config.storage.path.string(), config.pacman.sysroot.string(),
+                       config.pacman.type, std::to_string(config.logger.loglevel)});
+}
+
+boost::optional<Config> load_config_snapshot(const boost::filesystem::path &path, const std::string &key) {
+  Snapshot snap(path);
+  if (!snap.valid() || snap.size() != 6 || !snap.equals(0, kConfigTag) || !snap.equals(1, key)) {
+    return boost::none;
+  }
+  Config config;
+  config.storage.path = snap.get(2);
+  config.pacman.sysroot = snap.get(3);
+  config.pacman.type = snap.get(4);
+  config.logger.loglevel = std::stoi(snap.get(5));
+  return config;
+}
+
+void save_targets_snapshot(const boost::filesystem::path &path, const std::string &key,
+                           const std::vector<Uptane::Target> &targets) {
+  std::vector<std::string> records{kTargetsTag, key};
+  for (const auto &t : targets) {
+    records.push_back(t.filename());
+    records.push_back(Utils::jsonToCanonicalStr(t.toDebugJson()));
+  }
+  save_snapshot(path, records);
+}
+
+bool load_targets_snapshot(const boost::filesystem::path &path, const std::string &key,
+                           std::vector<Uptane::Target> &targets) {
+  Snapshot snap(path);
+  if (!snap.valid() || snap.size() < 2 || snap.size() % 2 != 0 || !snap.equals(0, kTargetsTag) ||
+      !snap.equals(1, key)) {
+    return false;
+  }
+  std::vector<Uptane::Target> loaded;
+  for (size_t i = 2; i < snap.size(); i += 2) {
+    loaded.emplace_back(snap.get(i), Utils::parseJSON(snap.get(i + 1)));
+  }
+  targets = std::move(loaded);
+  return true;
+}
@@ -0,0 +1,57 @@
+#ifndef AKTUALIZR_LITE_SNAPSHOT
+#define AKTUALIZR_LITE_SNAPSHOT
+
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <boost/filesystem.hpp>
+#include <boost/optional.hpp>
+
+#include "config/config.h"
+#include "uptane/tuf.h"
+
+// A list of strings saved in a file that's read through mmap, so loading it
+// costs little more than the page faults for what's looked at. The file is
+// written to a temporary one and renamed into place, and carries a checksum,
+// so readers only ever see a complete snapshot.
+class Snapshot {
+ public:
+  explicit Snapshot(const boost::filesystem::path &path);
+  ~Snapshot();
+  Snapshot(const Snapshot &) = delete;
+  Snapshot &operator=(const Snapshot &) = delete;
+
+  // False if the file is missing or damaged
+  bool valid() const { return data_ != nullptr; }
+  size_t size() const { return records_.size(); }
+  std::string get(size_t i) const { return std::string(records_[i].first, records_[i].second); }
+  bool equals(size_t i, const std::string &value) const;
+
+  static void write(const boost::filesystem::path &path, const std::vector<std::string> &records);
+
+ private:
+  void *data_{nullptr};
+  size_t length_{0};
+  std::vector<std::pair<const char *, size_t>> records_;
+};
+
+// Describes the current state of some files by their inode, size and mtime,
+// for telling whether something derived from them is stale. A directory
+// covers the files directly in it too.
+std::string source_stamp(const std::vector<boost::filesystem::path> &paths);
+
+// The settings used by the read-only fast paths, which can then start without
+// parsing the configuration. `key` identifies what the configuration was
+// built from, eg by way of source_stamp().
+void save_config_snapshot(const boost::filesystem::path &path, const std::string &key, const Config &config);
+boost::optional<Config> load_config_snapshot(const boost::filesystem::path &path, const std::string &key);
+
+// The targets a device can use, which is usually a small part of the targets
+// metadata. `key` identifies the metadata and the filter applied to it.
+void save_targets_snapshot(const boost::filesystem::path &path, const std::string &key,
+                           const std::vector<Uptane::Target> &targets);
+bool load_targets_snapshot(const boost::filesystem::path &path, const std::string &key,
+                           std::vector<Uptane::Target> &targets);
+
+#endif  // AKTUALIZR_LITE_SNAPSHOT
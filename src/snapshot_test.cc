@@ -0,0 +1,122 @@
+#include <gtest/gtest.h>
+
+#include <boost/filesystem.hpp>
+
+#include "snapshot.h"
+#include "utilities/utils.h"
+
+TEST(snapshot, round_trip) {
+  TemporaryDirectory dir;
+  auto path = dir / "test.snap";
+  ASSERT_FALSE(Snapshot(path).valid());
+
+  std::string binary("a\0b", 3);
+  Snapshot::write(path, {"first", "", binary});
+  Snapshot snap(path);
+  ASSERT_TRUE(snap.valid());
+  ASSERT_EQ(3, snap.size());
+  ASSERT_EQ("first", snap.get(0));
+  ASSERT_EQ("", snap.get(1));
+  ASSERT_EQ(binary, snap.get(2));
+  ASSERT_TRUE(snap.equals(0, "first"));
+  ASSERT_FALSE(snap.equals(0, "firs"));
+  ASSERT_FALSE(snap.equals(1, "x"));
+}
+
+TEST(snapshot, damaged) {
+  TemporaryDirectory dir;
+  auto path = dir / "test.snap";
+  Snapshot::write(path, {"first", "second"});
+  std::string data = Utils::readFile(path);
+
+  std::string flipped = data;
+  flipped[flipped.size() - 1] ^= 1;
+  Utils::writeFile(path, flipped);
+  ASSERT_FALSE(Snapshot(path).valid());
+
+  Utils::writeFile(path, data.substr(0, data.size() - 3));
+  ASSERT_FALSE(Snapshot(path).valid());
+
+  Utils::writeFile(path, std::string("LITESNP1"));
+  ASSERT_FALSE(Snapshot(path).valid());
+}
+
+TEST(snapshot, source_stamp) {
+  TemporaryDirectory dir;
+  auto conf_d = dir / "conf.d";
+  boost::filesystem::create_directories(conf_d);
+  Utils::writeFile(conf_d / "10-base.toml", std::string("[pacman]\n"));
+  std::vector<boost::filesystem::path> sources{conf_d, dir / "missing.toml"};
+
+  std::string stamp = source_stamp(sources);
+  ASSERT_EQ(stamp, source_stamp(sources));
+
+  Utils::writeFile(conf_d / "10-base.toml", std::string("[pacman]\ntype = \"ostree\"\n"));
+  std::string changed = source_stamp(sources);
+  ASSERT_NE(stamp, changed);
+
+  Utils::writeFile(conf_d / "20-extra.toml", std::string(""));
+  ASSERT_NE(changed, source_stamp(sources));
+  changed = source_stamp(sources);
+
+  Utils::writeFile(dir / "missing.toml", std::string(""));
+  ASSERT_NE(changed, source_stamp(sources));
+}
+
+TEST(snapshot, config) {
+  TemporaryDirectory dir;
+  auto path = dir / "cache" / "config.snap";
+  ASSERT_FALSE(load_config_snapshot(path, "key"));
+
+  Config config;
+  config.storage.path = "/var/sota-test";
+  config.pacman.sysroot = "/sysroot-test";
+  config.pacman.type = "ostree+docker-app";
+  config.logger.loglevel = 4;
+  save_config_snapshot(path, "key", config);
+
+  auto loaded = load_config_snapshot(path, "key");
+  ASSERT_TRUE(loaded);
+  ASSERT_EQ(config.storage.path, loaded->storage.path);
+  ASSERT_EQ(config.pacman.sysroot, loaded->pacman.sysroot);
+  ASSERT_EQ(config.pacman.type, loaded->pacman.type);
+  ASSERT_EQ(4, loaded->logger.loglevel);
+
+  ASSERT_FALSE(load_config_snapshot(path, "other key"));
+}
+
+TEST(snapshot, targets) {
+  TemporaryDirectory dir;
+  auto path = dir / "targets.snap";
+
+  Json::Value custom;
+  custom["hardwareIds"][0] = "hwid";
+  custom["targetFormat"] = "OSTREE";
+  custom["version"] = "42";
+  Json::Value json;
+  json["hashes"]["sha256"] = "abcd";
+  json["length"] = 0;
+  json["custom"] = custom;
+  std::vector<Uptane::Target> targets{Uptane::Target("hwid-42", json)};
+  save_targets_snapshot(path, "key", targets);
+
+  std::vector<Uptane::Target> loaded;
+  ASSERT_FALSE(load_targets_snapshot(path, "other key", loaded));
+  ASSERT_TRUE(loaded.empty());
+  ASSERT_TRUE(load_targets_snapshot(path, "key", loaded));
+  ASSERT_EQ(1, loaded.size());
+  ASSERT_EQ("hwid-42", loaded[0].filename());
+  ASSERT_EQ("abcd", loaded[0].sha256Hash());
+  ASSERT_EQ("42", loaded[0].custom_version());
+  ASSERT_TRUE(loaded[0].MatchTarget(targets[0]));
+
+  // A config snapshot isn't taken for a targets one
+  ASSERT_FALSE(load_config_snapshot(path, "key"));
+}
+
+#ifndef __NO_MAIN__
+int main(int argc, char **argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
+#endif
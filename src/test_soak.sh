@@ -0,0 +1,91 @@
+#!/usr/bin/env bash
+set -ex
+
+# Polls a local repo thousands of times with a daemon built with
+# ALLOC_TRACKING. The daemon fails if its heap keeps growing once warmed up.
+
+aklite=$1
+uptane_gen_bin=$2
+tests_dir=$3
+polls=${4-2000}
+mock_ostree=$(dirname $aklite)/libt_lite-mock.so
+
+dest_dir=$(mktemp -d)
+
+cleanup() {
+    echo "cleaning up temp dir"
+    rm -rf "$dest_dir"
+    if [ -n "$pid" ] ; then
+        echo "killing webserver"
+        kill $pid
+    fi
+}
+trap cleanup EXIT
+
+uptane_gen() {
+    $uptane_gen_bin --repotype image --path "$dest_dir" "$@"
+}
+
+add_target() {
+    custom_json="${dest_dir}/custom.json"
+    cat >$custom_json <<EOF
+{
+  "version": "$1",
+  "hardwareIds": ["hwid-for-test"],
+  "targetFormat": "OSTREE"
+}
+EOF
+    uptane_gen --command image \
+               --targetname $1 --targetsha256 $2 --targetlength 0 \
+               --hwid hwid-for-test --targetcustom $custom_json
+}
+
+uptane_gen --command generate --expires 2021-07-04T16:33:27Z
+# A catalog of old targets for every poll to wade through
+for i in $(seq 1 50) ; do
+    add_target foo$i $(echo foo$i | sha256sum | cut -f1 -d\  )
+done
+uptane_gen --command signtargets
+
+pushd $dest_dir
+python3 -m http.server 0&
+pid=$!
+port=$("$tests_dir/find_listening_port.sh" "$pid")
+echo "http server listening on $port"
+
+export OSTREE_SYSROOT=$dest_dir/sysroot
+mkdir $OSTREE_SYSROOT
+$tests_dir/ostree-scripts/makephysical.sh $OSTREE_SYSROOT
+
+sota_dir=$dest_dir/sota
+mkdir $sota_dir
+chmod 700 $sota_dir
+cat >$sota_dir/sota.toml <<EOF
+[uptane]
+repo_server = "http://localhost:$port/repo/repo"
+
+[provision]
+primary_ecu_hardware_id = "hwid-for-test"
+
+[storage]
+type = "sqlite"
+path = "$sota_dir"
+sqldb_path = "sql.db"
+uptane_metadata_path = "$sota_dir/metadata"
+
+[bootloader]
+reboot_command = "/bin/true"
+
+[pacman]
+type = "ostree"
+sysroot = "$OSTREE_SYSROOT"
+os = "dummy-os"
+EOF
+
+# Get on the latest target so that polls settle into finding nothing to do
+update=$(ostree admin status | head -n 1)
+sha=$(echo $update | cut -d\  -f2 | sed 's/\.0$//')
+add_target zlast $sha
+OSTREE_HASH=$sha LD_PRELOAD=$mock_ostree $aklite --loglevel 1 -c $sota_dir/sota.toml update --update-name zlast
+
+OSTREE_HASH=$sha LD_PRELOAD=$mock_ostree $aklite --loglevel 2 -c $sota_dir/sota.toml daemon --interval 0 --max-polls $polls
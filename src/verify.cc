@@ -0,0 +1,196 @@
+#include <algorithm>
+#include <fstream>
+#include <stdexcept>
+#include <thread>
+
+#include <boost/algorithm/string.hpp>
+
+#include "crypto/crypto.h"
+#include "logging/logging.h"
+#include "package_manager/ostreemanager.h"
+#include "verify.h"
+
+VerifyConfig::VerifyConfig(const std::map<std::string, std::string> &extra) {
+  auto it = extra.find("verify_threads");
+  if (it != extra.end()) {
+    threads = std::stoul(it->second);
+  }
+  it = extra.find("verify_fail_fast");
+  if (it != extra.end()) {
+    if (it->second != "0" && it->second != "1") {
+      throw std::invalid_argument("Invalid verify_fail_fast: " + it->second);
+    }
+    fail_fast = it->second == "1";
+  }
+}
+
+void VerifyPool::add(std::string name, uint64_t size, Check check) {
+  items_.push_back(Item{std::move(name), size, std::move(check)});
+}
+
+void VerifyPool::work(size_t worker, VerifyResult &res) {
+  uint64_t checked = 0;
+  uint64_t bytes = 0;
+  while (!stop_) {
+    if (cancel_ != nullptr && *cancel_) {
+      std::lock_guard<std::mutex> guard(lock_);
+      res.cancelled = true;
+      stop_ = true;
+      break;
+    }
+    size_t i = next_++;
+    if (i >= items_.size()) {
+      break;
+    }
+    const Item &item = items_[i];
+    bool ok;
+    try {
+      ok = item.check(worker);
+    } catch (const std::exception &ex) {
+      LOG_WARNING << "Unable to verify " << item.name << ": " << ex.what();
+      ok = false;
+    }
+    checked++;
+    bytes += item.size;
+    if (!ok) {
+      std::lock_guard<std::mutex> guard(lock_);
+      res.failed.push_back(item.name);
+      if (fail_fast_) {
+        stop_ = true;
+      }
+    }
+  }
+  std::lock_guard<std::mutex> guard(lock_);
+  res.checked += checked;
+  res.bytes += bytes;
+}
+
+VerifyResult VerifyPool::run() {
+  std::stable_sort(items_.begin(), items_.end(), [](const Item &a, const Item &b) { return a.size > b.size; });
+  next_ = 0;
+  stop_ = false;
+
+  VerifyResult res;
+  std::vector<std::thread> workers;
+  for (size_t w = 1; w < threads_; w++) {
+    workers.emplace_back(&VerifyPool::work, this, w, std::ref(res));
+  }
+  work(0, res);
+  for (auto &t : workers) {
+    t.join();
+  }
+  items_.clear();
+  return res;
+}
+
+bool verify_file_sha256(const boost::filesystem::path &path, const std::string &sha256, const std::atomic_bool *stop) {
+  std::ifstream in(path.string(), std::ios::binary);
+  if (!in) {
+    throw std::runtime_error("Unable to open " + path.string());
+  }
+  MultiPartSHA256Hasher hasher;
+  std::vector<char> buf(1024 * 1024);
+  while (in) {
+    if (stop != nullptr && *stop) {
+      return true;  // someone else already failed, the answer no longer matters
+    }
+    in.read(buf.data(), static_cast<std::streamsize>(buf.size()));
+    hasher.update(reinterpret_cast<const unsigned char *>(buf.data()), static_cast<uint64_t>(in.gcount()));
+  }
+  if (in.bad()) {
+    throw std::runtime_error("Unable to read " + path.string());
+  }
+  return boost::iequals(hasher.getHexDigest(), sha256);
+}
+
+ContentVerifier::ContentVerifier(boost::filesystem::path sysroot, const VerifyConfig &config,
+                                 const std::atomic_bool *cancel)
+    : sysroot_path_(std::move(sysroot)),
+      pool_(config.threads, config.fail_fast, cancel),
+      sysroots_(pool_.threads()),
+      repos_(pool_.threads()) {}
+
+// Only ever called by the worker itself, so no locking is needed
+OstreeRepo *ContentVerifier::repo(size_t worker) {
+  if (repos_[worker] == nullptr) {
+    sysroots_[worker] = OstreeManager::LoadSysroot(sysroot_path_);
+    OstreeRepo *repo = nullptr;
+    GError *error = nullptr;
+    if (!ostree_sysroot_get_repo(sysroots_[worker].get(), &repo, nullptr, &error)) {
+      std::string msg = error->message;
+      g_error_free(error);
+      throw std::runtime_error("Unable to open OSTree repo: " + msg);
+    }
+    repos_[worker].reset(repo);
+  }
+  return repos_[worker].get();
+}
+
+void ContentVerifier::addCommit(const std::string &commit) {
+  commit_ = commit;
+  OstreeRepo *main_repo = repo(0);
+  GHashTable *reachable = ostree_repo_traverse_new_reachable();
+  GError *error = nullptr;
+  if (!ostree_repo_traverse_commit_union(main_repo, commit.c_str(), 0, reachable, nullptr, &error)) {
+    std::string msg = error->message;
+    g_error_free(error);
+    g_hash_table_unref(reachable);
+    throw std::runtime_error("Unable to traverse commit " + commit + ": " + msg);
+  }
+  GHashTableIter it;
+  gpointer key;
+  gpointer value;
+  g_hash_table_iter_init(&it, reachable);
+  while (g_hash_table_iter_next(&it, &key, &value)) {
+    const char *checksum;
+    OstreeObjectType objtype;
+    ostree_object_name_deserialize(static_cast<GVariant *>(key), &checksum, &objtype);
+    std::string csum(checksum);
+    // Sizes are left out, looking each one up would take about as long as checking it
+    pool_.add(csum, 0, [this, csum, objtype](size_t worker) {
+      GError *err = nullptr;
+      if (!ostree_repo_fsck_object(repo(worker), objtype, csum.c_str(), nullptr, &err)) {
+        LOG_ERROR << "OSTree object " << csum << " is corrupt: " << err->message;
+        g_error_free(err);
+        std::lock_guard<std::mutex> guard(lock_);
+        corrupt_.emplace_back(csum, objtype);
+        return false;
+      }
+      return true;
+    });
+  }
+  g_hash_table_unref(reachable);
+}
+
+void ContentVerifier::addFile(const std::string &name, const boost::filesystem::path &path, const std::string &sha256,
+                              uint64_t size) {
+  pool_.add(name, size, [this, path, sha256](size_t worker) {
+    (void)worker;
+    return verify_file_sha256(path, sha256, pool_.stopFlag());
+  });
+}
+
+void ContentVerifier::repair() {
+  OstreeRepo *main_repo = repo(0);
+  GError *error = nullptr;
+  for (const auto &obj : corrupt_) {
+    if (!ostree_repo_delete_object(main_repo, obj.second, obj.first.c_str(), nullptr, &error)) {
+      LOG_WARNING << "Unable to delete corrupt OSTree object " << obj.first << ": " << error->message;
+      g_error_free(error);
+      error = nullptr;
+    }
+  }
+  // Otherwise the next pull takes the commit as complete and skips what's now missing
+  if (!ostree_repo_mark_commit_partial(main_repo, commit_.c_str(), 1, &error)) {
+    LOG_WARNING << "Unable to mark OSTree commit " << commit_ << " partial: " << error->message;
+    g_error_free(error);
+  }
+}
+
+VerifyResult ContentVerifier::run() {
+  VerifyResult res = pool_.run();
+  if (!corrupt_.empty()) {
+    repair();
+  }
+  return res;
+}
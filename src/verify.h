@@ -0,0 +1,106 @@
+#ifndef AKTUALIZR_LITE_VERIFY
+#define AKTUALIZR_LITE_VERIFY
+
+#include <atomic>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <ostree.h>
+#include <boost/filesystem.hpp>
+
+#include "utilities/utils.h"
+
+// Re-checks the content of a downloaded target after libaktualizr's
+// VerifyTarget(), which only looks for the OSTree commit. Configured via
+// [pacman] verify_threads (0, the default, skips the check) and
+// verify_fail_fast (0 or 1, default 1: stop at the first bad object).
+struct VerifyConfig {
+  VerifyConfig() = default;
+  explicit VerifyConfig(const std::map<std::string, std::string> &extra);
+
+  bool enabled() const { return threads > 0; }
+
+  size_t threads{0};
+  bool fail_fast{true};
+};
+
+struct VerifyResult {
+  uint64_t checked{0};
+  uint64_t bytes{0};
+  std::vector<std::string> failed;
+  // Stopped by the caller before every check was made
+  bool cancelled{false};
+
+  bool ok() const { return failed.empty() && !cancelled; }
+};
+
+// Runs independent checks on a pool of threads, largest first so that a big
+// one started last doesn't leave the other threads idle at the end. Setting
+// `cancel` stops the pool before the next check.
+class VerifyPool {
+ public:
+  // Returns false on a mismatch. `worker` is the index of the thread running it.
+  using Check = std::function<bool(size_t worker)>;
+
+  VerifyPool(size_t threads, bool fail_fast, const std::atomic_bool *cancel = nullptr)
+      : threads_(threads == 0 ? 1 : threads), fail_fast_(fail_fast), cancel_(cancel) {}
+
+  void add(std::string name, uint64_t size, Check check);
+  size_t threads() const { return threads_; }
+  // Set once a check failed with fail_fast, long running checks should give up
+  const std::atomic_bool *stopFlag() const { return &stop_; }
+  VerifyResult run();
+
+ private:
+  struct Item {
+    std::string name;
+    uint64_t size;
+    Check check;
+  };
+  void work(size_t worker, VerifyResult &res);
+
+  size_t threads_;
+  bool fail_fast_;
+  const std::atomic_bool *cancel_;
+  std::vector<Item> items_;
+  std::atomic<size_t> next_{0};
+  std::atomic_bool stop_{false};
+  std::mutex lock_;
+};
+
+// Checks a file against its sha256 (hex, any case)
+bool verify_file_sha256(const boost::filesystem::path &path, const std::string &sha256,
+                        const std::atomic_bool *stop = nullptr);
+
+// Verifies the objects of an OSTree commit and any app bundles in parallel.
+// Each worker opens its own handle on the repo. Corrupt objects are removed
+// and the commit marked partial so that the next pull fetches them again.
+class ContentVerifier {
+ public:
+  ContentVerifier(boost::filesystem::path sysroot, const VerifyConfig &config,
+                  const std::atomic_bool *cancel = nullptr);
+  ContentVerifier(const ContentVerifier &) = delete;
+  ContentVerifier &operator=(const ContentVerifier &) = delete;
+
+  void addCommit(const std::string &commit);
+  void addFile(const std::string &name, const boost::filesystem::path &path, const std::string &sha256, uint64_t size);
+  VerifyResult run();
+
+ private:
+  OstreeRepo *repo(size_t worker);
+  void repair();
+
+  boost::filesystem::path sysroot_path_;
+  VerifyPool pool_;
+  std::vector<GObjectUniquePtr<OstreeSysroot>> sysroots_;
+  std::vector<GObjectUniquePtr<OstreeRepo>> repos_;
+  std::string commit_;
+  std::mutex lock_;
+  std::vector<std::pair<std::string, OstreeObjectType>> corrupt_;
+};
+
+#endif  // AKTUALIZR_LITE_VERIFY
@@ -0,0 +1,116 @@
+#include <gtest/gtest.h>
+
+#include <algorithm>
+#include <set>
+#include <thread>
+
+#include <boost/algorithm/string.hpp>
+
+#include "verify.h"
+
+TEST(verify, config) {
+  VerifyConfig config(std::map<std::string, std::string>{});
+  ASSERT_FALSE(config.enabled());
+  ASSERT_TRUE(config.fail_fast);
+
+  config = VerifyConfig(std::map<std::string, std::string>{{"verify_threads", "4"}, {"verify_fail_fast", "0"}});
+  ASSERT_TRUE(config.enabled());
+  ASSERT_EQ(4, config.threads);
+  ASSERT_FALSE(config.fail_fast);
+
+  ASSERT_THROW(VerifyConfig(std::map<std::string, std::string>{{"verify_fail_fast", "yes"}}), std::invalid_argument);
+}
+
+TEST(verify, pool) {
+  VerifyPool pool(4, false);
+  std::mutex lock;
+  std::set<size_t> workers;
+  for (int i = 0; i < 100; i++) {
+    pool.add("item-" + std::to_string(i), static_cast<uint64_t>(i), [i, &lock, &workers](size_t worker) {
+      {
+        std::lock_guard<std::mutex> guard(lock);
+        workers.insert(worker);
+      }
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+      if (i == 50) {
+        throw std::runtime_error("unreadable");
+      }
+      return i != 7;
+    });
+  }
+  VerifyResult res = pool.run();
+  ASSERT_EQ(100, res.checked);
+  ASSERT_EQ(99 * 100 / 2, res.bytes);
+  ASSERT_FALSE(res.ok());
+  std::sort(res.failed.begin(), res.failed.end());
+  ASSERT_EQ((std::vector<std::string>{"item-50", "item-7"}), res.failed);
+  ASSERT_GT(workers.size(), 1);
+  ASSERT_LE(*workers.rbegin(), 3);
+}
+
+TEST(verify, fail_fast) {
+  VerifyPool pool(2, true);
+  // Largest first, so the bad one is checked first
+  pool.add("bad", 1000, [](size_t worker) {
+    (void)worker;
+    return false;
+  });
+  for (int i = 0; i < 1000; i++) {
+    pool.add("good", 1, [](size_t worker) {
+      (void)worker;
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+      return true;
+    });
+  }
+  VerifyResult res = pool.run();
+  ASSERT_EQ(std::vector<std::string>{"bad"}, res.failed);
+  ASSERT_LT(res.checked, 10);
+}
+
+TEST(verify, cancel) {
+  std::atomic_bool cancel{false};
+  VerifyPool pool(2, false, &cancel);
+  for (int i = 0; i < 1000; i++) {
+    pool.add("good", 1, [i, &cancel](size_t worker) {
+      (void)worker;
+      if (i == 5) {
+        cancel = true;
+      }
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+      return true;
+    });
+  }
+  VerifyResult res = pool.run();
+  ASSERT_TRUE(res.cancelled);
+  ASSERT_TRUE(res.failed.empty());
+  ASSERT_FALSE(res.ok());
+  ASSERT_LT(res.checked, 10);
+}
+
+TEST(verify, file_sha256) {
+  TemporaryDirectory dir;
+  auto path = dir / "bundle";
+  Utils::writeFile(path, std::string("hello"));
+  std::string sha256 = "2cf24dba5fb0a30e26e83b2ac5b9e29e1b161e5c1fa7425e73043362938b9824";
+  ASSERT_TRUE(verify_file_sha256(path, sha256));
+  ASSERT_TRUE(verify_file_sha256(path, boost::to_upper_copy(sha256)));
+  Utils::writeFile(path, std::string("hellO"));
+  ASSERT_FALSE(verify_file_sha256(path, sha256));
+  ASSERT_THROW(verify_file_sha256(dir / "missing", sha256), std::runtime_error);
+
+  // Files only, so no OSTree repo is needed
+  VerifyConfig config;
+  config.threads = 2;
+  ContentVerifier verifier(dir.Path(), config);
+  verifier.addFile("bundle", path, sha256, 5);
+  VerifyResult res = verifier.run();
+  ASSERT_EQ(1, res.checked);
+  ASSERT_EQ(std::vector<std::string>{"bundle"}, res.failed);
+}
+
+#ifndef __NO_MAIN__
+int main(int argc, char **argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
+#endif
@@ -0,0 +1,226 @@
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <csignal>
+#include <cstring>
+#include <sstream>
+#include <stdexcept>
+
+#include "crypto/keymanager.h"
+#include "logging/logging.h"
+#include "utilities/utils.h"
+#include "workers.h"
+
+static int64_t to_ms(LatencyStats::Duration d) {
+  return std::chrono::duration_cast<std::chrono::milliseconds>(d).count();
+}
+
+void LatencyStats::add(Sample &s, Duration d) {
+  s.last = d;
+  s.max = std::max(s.max, d);
+  s.total += d;
+}
+
+void LatencyStats::add(Duration queued, Duration ran) {
+  std::lock_guard<std::mutex> guard(lock_);
+  jobs_++;
+  add(queued_, queued);
+  add(ran_, ran);
+}
+
+Json::Value LatencyStats::json(const Sample &s, uint64_t jobs) {
+  Json::Value res;
+  res["last"] = static_cast<Json::Int64>(to_ms(s.last));
+  res["max"] = static_cast<Json::Int64>(to_ms(s.max));
+  res["mean"] = static_cast<Json::Int64>(jobs > 0 ? to_ms(s.total) / static_cast<int64_t>(jobs) : 0);
+  return res;
+}
+
+Json::Value LatencyStats::json() const {
+  std::lock_guard<std::mutex> guard(lock_);
+  Json::Value res;
+  res["jobs"] = static_cast<Json::UInt64>(jobs_);
+  res["queued_ms"] = json(queued_, jobs_);
+  res["run_ms"] = json(ran_, jobs_);
+  return res;
+}
+
+std::string LatencyStats::str() const {
+  Json::Value stats = json();
+  std::ostringstream out;
+  out << "jobs=" << stats["jobs"].asUInt64();
+  for (const char *what : {"queued_ms", "run_ms"}) {
+    out << " " << what << "(mean/max)=" << stats[what]["mean"].asInt64() << "/" << stats[what]["max"].asInt64();
+  }
+  return out.str();
+}
+
+Worker::Worker(std::string name, size_t capacity) : name_(std::move(name)), capacity_(capacity) {
+  thread_ = std::thread(&Worker::run, this);
+}
+
+Worker::~Worker() { stop(); }
+
+bool Worker::post(Job job) {
+  {
+    std::lock_guard<std::mutex> guard(lock_);
+    if (stopping_ || queue_.size() >= capacity_) {
+      return false;
+    }
+    queue_.push_back(Item{std::move(job), std::chrono::steady_clock::now()});
+  }
+  cv_.notify_one();
+  return true;
+}
+
+bool Worker::busy() const {
+  std::lock_guard<std::mutex> guard(lock_);
+  return running_ || !queue_.empty();
+}
+
+void Worker::stop() {
+  {
+    std::lock_guard<std::mutex> guard(lock_);
+    stopping_ = true;
+    queue_.clear();
+  }
+  cv_.notify_one();
+  if (thread_.joinable()) {
+    thread_.join();
+  }
+}
+
+void Worker::run() {
+  std::unique_lock<std::mutex> guard(lock_);
+  while (true) {
+    cv_.wait(guard, [this] { return stopping_ || !queue_.empty(); });
+    if (stopping_) {
+      return;
+    }
+    Item item = std::move(queue_.front());
+    queue_.pop_front();
+    running_ = true;
+    guard.unlock();
+
+    auto started = std::chrono::steady_clock::now();
+    try {
+      item.job();
+    } catch (const std::exception &ex) {
+      LOG_ERROR << "Unexpected error in " << name_ << " worker: " << ex.what();
+    }
+    latency_.add(started - item.queued, std::chrono::steady_clock::now() - started);
+
+    guard.lock();
+    running_ = false;
+  }
+}
+
+Worker::Job poll_job(std::function<uint64_t()> poll, uint64_t retry,
+                     std::function<void(uint64_t wait, bool failed)> done) {
+  return [poll, retry, done] {
+    uint64_t wait;
+    try {
+      wait = poll();
+    } catch (const std::exception &ex) {
+      LOG_ERROR << "Poll failed, retrying in " << retry << " seconds: " << ex.what();
+      done(retry, true);
+      return;
+    }
+    done(wait, false);
+  };
+}
+
+// The handler can only do async-signal-safe things, so it passes the signal
+// on to ShutdownSignals' thread through a pipe. 0 stops the thread.
+static int signal_pipe[2] = {-1, -1};
+static struct sigaction old_sigint;
+static struct sigaction old_sigterm;
+
+static void on_signal(int signal) {
+  int saved = errno;
+  auto c = static_cast<unsigned char>(signal);
+  if (write(signal_pipe[1], &c, 1) < 0) {
+    // Nothing to be done about it here
+  }
+  errno = saved;
+}
+
+ShutdownSignals::ShutdownSignals(std::function<void(int signal)> handler) : handler_(std::move(handler)) {
+  if (pipe2(signal_pipe, O_CLOEXEC) != 0) {
+    throw std::runtime_error(std::string("Unable to create signal pipe: ") + strerror(errno));
+  }
+  struct sigaction sa {};
+  sa.sa_handler = on_signal;
+  sigemptyset(&sa.sa_mask);
+  sigaction(SIGINT, &sa, &old_sigint);
+  sigaction(SIGTERM, &sa, &old_sigterm);
+  thread_ = std::thread(&ShutdownSignals::run, this);
+}
+
+ShutdownSignals::~ShutdownSignals() {
+  restore();
+  unsigned char c = 0;
+  if (write(signal_pipe[1], &c, 1) != 1) {
+    LOG_ERROR << "Unable to stop signal thread";
+  }
+  thread_.join();
+  close(signal_pipe[0]);
+  close(signal_pipe[1]);
+  signal_pipe[0] = signal_pipe[1] = -1;
+}
+
+void ShutdownSignals::restore() {
+  std::lock_guard<std::mutex> guard(restore_lock_);
+  if (!restored_) {
+    sigaction(SIGINT, &old_sigint, nullptr);
+    sigaction(SIGTERM, &old_sigterm, nullptr);
+    restored_ = true;
+  }
+}
+
+void ShutdownSignals::run() {
+  while (true) {
+    unsigned char c;
+    ssize_t rc = read(signal_pipe[0], &c, 1);
+    if (rc < 0 && errno == EINTR) {
+      continue;
+    }
+    if (rc <= 0 || c == 0) {
+      return;
+    }
+    restore();
+    handler_(c);
+  }
+}
+
+SystemInfoReporter::SystemInfoReporter(const Config &config, const std::shared_ptr<INvStorage> &storage)
+    : config_(config) {
+  KeyManager keys(storage, config.keymanagerConfig());
+  keys.copyCertsToCurl(http_);
+}
+
+void SystemInfoReporter::put(const std::string &path, const Json::Value &info, Json::Value &last) {
+  if (info == last) {
+    return;
+  }
+  HttpResponse res = http_.put(config_.tls.server + path, info);
+  if (res.isOk()) {
+    last = info;
+  } else {
+    LOG_WARNING << "Unable to report " << path << ": " << res.getStatusStr();
+  }
+}
+
+void SystemInfoReporter::report() {
+  if (config_.telemetry.report_network) {
+    put("/system_info/network", Utils::getNetworkInfo(), last_network_);
+    // Not running in anonymous mode, so hardware info is wanted too. The
+    // daemon has always used the flag this way.
+    Json::Value hw_info = Utils::getHardwareInfo();
+    if (hw_info.empty()) {
+      LOG_WARNING << "Unable to fetch hardware information from host system.";
+    } else {
+      put("/system_info", hw_info, last_hw_);
+    }
+  }
+}
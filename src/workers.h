@@ -0,0 +1,130 @@
+#ifndef AKTUALIZR_LITE_WORKERS
+#define AKTUALIZR_LITE_WORKERS
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#include <json/json.h>
+
+#include "config/config.h"
+#include "http/httpclient.h"
+#include "storage/invstorage.h"
+
+// How long a worker's jobs waited in its queue and then took to run
+class LatencyStats {
+ public:
+  using Duration = std::chrono::steady_clock::duration;
+
+  void add(Duration queued, Duration ran);
+  // {"jobs": N, "queued_ms": {"last", "max", "mean"}, "run_ms": {...}}
+  Json::Value json() const;
+  std::string str() const;
+
+ private:
+  struct Sample {
+    Duration last{0};
+    Duration max{0};
+    Duration total{0};
+  };
+  static void add(Sample &s, Duration d);
+  static Json::Value json(const Sample &s, uint64_t jobs);
+
+  mutable std::mutex lock_;
+  uint64_t jobs_{0};
+  Sample queued_;
+  Sample ran_;
+};
+
+// A thread running jobs one at a time from a queue of at most `capacity`.
+// post() never blocks: it refuses the job when the queue is full, which is
+// how the producers coalesce work a busy worker hasn't got to yet.
+class Worker {
+ public:
+  using Job = std::function<void()>;
+
+  Worker(std::string name, size_t capacity);
+  ~Worker();
+  Worker(const Worker &) = delete;
+  Worker &operator=(const Worker &) = delete;
+
+  bool post(Job job);
+  // Running a job or has some queued
+  bool busy() const;
+  // Waits for the job being run, if any, and drops the queued ones
+  void stop();
+
+  const std::string &name() const { return name_; }
+  const LatencyStats &latency() const { return latency_; }
+
+ private:
+  struct Item {
+    Job job;
+    std::chrono::steady_clock::time_point queued;
+  };
+  void run();
+
+  std::string name_;
+  size_t capacity_;
+  mutable std::mutex lock_;
+  std::condition_variable cv_;
+  std::deque<Item> queue_;
+  bool running_{false};
+  bool stopping_{false};
+  LatencyStats latency_;
+  std::thread thread_;
+};
+
+// A job for a Worker that runs `poll`, which returns the seconds to wait
+// until the next poll. `done` is always called, with what the poll returned
+// or, if it threw, with `retry` and `failed` set, so that whoever waits for
+// the poll isn't left waiting.
+Worker::Job poll_job(std::function<uint64_t()> poll, uint64_t retry,
+                     std::function<void(uint64_t wait, bool failed)> done);
+
+// Turns SIGINT and SIGTERM into a call of `handler` on a thread of its own,
+// where it's free to take locks. The previous dispositions are restored once
+// the first signal has been handled, so a second one ends the process the
+// usual way, and when this is destroyed.
+class ShutdownSignals {
+ public:
+  explicit ShutdownSignals(std::function<void(int signal)> handler);
+  ~ShutdownSignals();
+  ShutdownSignals(const ShutdownSignals &) = delete;
+  ShutdownSignals &operator=(const ShutdownSignals &) = delete;
+
+ private:
+  void run();
+  void restore();
+
+  std::function<void(int signal)> handler_;
+  std::mutex restore_lock_;
+  bool restored_{false};
+  std::thread thread_;
+};
+
+// Reports the network and hardware info the way SotaUptaneClient does, but
+// over an HTTP client of its own so it can run on the reporting worker while
+// the primary client is busy.
+class SystemInfoReporter {
+ public:
+  SystemInfoReporter(const Config &config, const std::shared_ptr<INvStorage> &storage);
+
+  void report();
+
+ private:
+  void put(const std::string &path, const Json::Value &info, Json::Value &last);
+
+  const Config &config_;
+  HttpClient http_;
+  Json::Value last_network_;
+  Json::Value last_hw_;
+};
+
+#endif  // AKTUALIZR_LITE_WORKERS
@@ -0,0 +1,133 @@
+#include <gtest/gtest.h>
+
+#include <csignal>
+#include <future>
+
+#include "workers.h"
+
+TEST(workers, runs_jobs) {
+  Worker worker("test", 4);
+  std::promise<void> done;
+  std::vector<int> ran;
+  for (int i = 0; i < 3; i++) {
+    ASSERT_TRUE(worker.post([i, &ran] { ran.push_back(i); }));
+  }
+  ASSERT_TRUE(worker.post([&done] { done.set_value(); }));
+  done.get_future().wait();
+  worker.stop();
+  ASSERT_EQ((std::vector<int>{0, 1, 2}), ran);
+  ASSERT_EQ(4, worker.latency().json()["jobs"].asUInt64());
+  ASSERT_FALSE(worker.post([] {}));
+}
+
+TEST(workers, coalesces) {
+  Worker worker("test", 1);
+  std::promise<void> release;
+  std::shared_future<void> released = release.get_future().share();
+  std::promise<void> started;
+  ASSERT_TRUE(worker.post([&started, released] {
+    started.set_value();
+    released.wait();
+  }));
+  started.get_future().wait();
+  ASSERT_TRUE(worker.busy());
+
+  // One job may wait while the first runs, the rest are refused
+  int ran = 0;
+  ASSERT_TRUE(worker.post([&ran] { ran++; }));
+  ASSERT_FALSE(worker.post([&ran] { ran++; }));
+  release.set_value();
+  while (worker.busy()) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+  ASSERT_EQ(1, ran);
+}
+
+TEST(workers, independent) {
+  // A job stuck on one worker doesn't hold up another's
+  Worker slow("slow", 1);
+  Worker fast("fast", 1);
+  std::promise<void> release;
+  std::shared_future<void> released = release.get_future().share();
+  ASSERT_TRUE(slow.post([released] { released.wait(); }));
+
+  std::promise<void> done;
+  ASSERT_TRUE(fast.post([&done] { done.set_value(); }));
+  ASSERT_EQ(std::future_status::ready, done.get_future().wait_for(std::chrono::seconds(5)));
+  ASSERT_TRUE(slow.busy());
+  release.set_value();
+}
+
+TEST(workers, stop) {
+  Worker worker("test", 2);
+  std::promise<void> started;
+  bool finished = false;
+  bool dropped_ran = false;
+  ASSERT_TRUE(worker.post([&started, &finished] {
+    started.set_value();
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    finished = true;
+  }));
+  ASSERT_TRUE(worker.post([&dropped_ran] { dropped_ran = true; }));
+  started.get_future().wait();
+  // Waits for the running job, drops the queued one
+  worker.stop();
+  ASSERT_TRUE(finished);
+  ASSERT_FALSE(dropped_ran);
+
+  Json::Value stats = worker.latency().json();
+  ASSERT_EQ(1, stats["jobs"].asUInt64());
+  ASSERT_GE(stats["run_ms"]["max"].asInt64(), 50);
+  ASSERT_EQ(stats["run_ms"]["max"], stats["run_ms"]["last"]);
+}
+
+TEST(workers, errors) {
+  Worker worker("test", 2);
+  std::promise<void> done;
+  ASSERT_TRUE(worker.post([] { throw std::runtime_error("broken"); }));
+  ASSERT_TRUE(worker.post([&done] { done.set_value(); }));
+  ASSERT_EQ(std::future_status::ready, done.get_future().wait_for(std::chrono::seconds(5)));
+}
+
+TEST(workers, poll_job) {
+  Worker worker("poll", 2);
+  std::promise<std::pair<uint64_t, bool>> failed;
+  std::promise<std::pair<uint64_t, bool>> polled;
+  auto throws = []() -> uint64_t { throw std::runtime_error("Unable to find update"); };
+  ASSERT_TRUE(worker.post(poll_job(throws, 30, [&failed](uint64_t wait, bool f) { failed.set_value({wait, f}); })));
+  ASSERT_TRUE(worker.post(
+      poll_job([] { return uint64_t{300}; }, 30, [&polled](uint64_t wait, bool f) { polled.set_value({wait, f}); })));
+
+  auto f = failed.get_future();
+  ASSERT_EQ(std::future_status::ready, f.wait_for(std::chrono::seconds(5)));
+  ASSERT_EQ(std::make_pair(uint64_t{30}, true), f.get());
+  f = polled.get_future();
+  ASSERT_EQ(std::future_status::ready, f.wait_for(std::chrono::seconds(5)));
+  ASSERT_EQ(std::make_pair(uint64_t{300}, false), f.get());
+}
+
+TEST(workers, signals) {
+  std::promise<int> got;
+  {
+    ShutdownSignals signals([&got](int signal) { got.set_value(signal); });
+    raise(SIGTERM);
+    auto f = got.get_future();
+    ASSERT_EQ(std::future_status::ready, f.wait_for(std::chrono::seconds(5)));
+    ASSERT_EQ(SIGTERM, f.get());
+
+    // A second signal gets the usual treatment
+    struct sigaction sa {};
+    sigaction(SIGTERM, nullptr, &sa);
+    ASSERT_EQ(SIG_DFL, sa.sa_handler);
+  }
+  struct sigaction sa {};
+  sigaction(SIGINT, nullptr, &sa);
+  ASSERT_EQ(SIG_DFL, sa.sa_handler);
+}
+
+#ifndef __NO_MAIN__
+int main(int argc, char **argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
+#endif